@@ -0,0 +1,680 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+// bench_mqtt: publish to subscribe throughput and latency of the MQTT client.
+//
+// Publishes through dx_mqttPublish to topics the same connection subscribed to with
+// dx_mqttSubscribe, so every message makes the full trip through the broker and back
+// into the message handler. Each message carries its sequence number and send time.
+// Sweeps every combination of payload size, QoS, producer threads and topic count and
+// writes one JSON document with messages/s, bytes/s and p50/p99/p999 latency per run.
+// Uses an in-process edge_mqtt_testbroker unless --host is given.
+
+#include "dx_mqtt.h"
+#include "dx_mqtt_testbroker.h"
+#include "parson.h"
+
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/utsname.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_MAX_VALUES 16
+#define BENCH_MAX_THREADS 256
+#define BENCH_MAX_TOPICS 100000
+#define BENCH_TOPIC_SIZE 64
+
+// Start of every payload, the rest is filler up to the payload size
+typedef struct
+{
+    uint64_t sequence;
+    uint64_t sent_ns;
+} BENCH_HEADER;
+
+// One value list from the command line
+typedef struct
+{
+    uint32_t values[BENCH_MAX_VALUES];
+    size_t count;
+} BENCH_LIST;
+
+// One point of the sweep
+typedef struct
+{
+    unsigned index;
+    size_t payload_size;
+    uint8_t qos;
+    size_t threads;
+    size_t topic_count;
+    size_t total;
+    uint32_t rate;
+    uint32_t timeout_ms;
+    char prefix[24]; // "bench/<index>/"
+    char (*topics)[BENCH_TOPIC_SIZE];
+
+    // Written by the message handler
+    uint64_t *latencies_ns;
+    atomic_uchar *seen;
+    atomic_size_t received;
+    atomic_size_t duplicates;
+    _Atomic uint64_t last_received_ns;
+
+    // Written by the producers
+    atomic_size_t sent;
+    atomic_size_t retries;
+    atomic_bool stalled;
+    uint64_t start_ns;
+} BENCH_RUN;
+
+// A producer thread and its share of the sequence numbers
+typedef struct
+{
+    BENCH_RUN *run;
+    size_t first;
+    pthread_t thread;
+} BENCH_PRODUCER;
+
+static _Atomic(BENCH_RUN *) current_run;
+static atomic_uint handlers_running;
+static atomic_bool probe_received;
+
+/// <summary>
+/// Monotonic clock in nanoseconds
+/// </summary>
+/// <returns>Nanoseconds</returns>
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+/// <summary>
+/// Sleep for a number of nanoseconds
+/// </summary>
+/// <param name="ns">Nanoseconds</param>
+static void sleep_ns(uint64_t ns)
+{
+    struct timespec delay = {.tv_sec = (time_t)(ns / 1000000000ull), .tv_nsec = (long)(ns % 1000000000ull)};
+    nanosleep(&delay, NULL);
+}
+
+/// <summary>
+/// Parse a comma separated list of numbers
+/// </summary>
+/// <param name="text">List such as "16,256,4096"</param>
+/// <param name="list">Receives the values</param>
+/// <returns>False if the list is empty, too long or not numeric</returns>
+static bool parse_list(const char *text, BENCH_LIST *list)
+{
+    list->count = 0;
+
+    while (*text != '\0')
+    {
+        char *end;
+        unsigned long value = strtoul(text, &end, 10);
+        if (end == text || list->count == BENCH_MAX_VALUES || (*end != ',' && *end != '\0'))
+        {
+            return false;
+        }
+
+        list->values[list->count++] = (uint32_t)value;
+        text                        = *end == ',' ? end + 1 : end;
+    }
+
+    return list->count > 0;
+}
+
+/// <summary>
+/// Record the latency of the first copy of a message
+/// </summary>
+/// <param name="run">Current run</param>
+/// <param name="payload">Payload starting with a BENCH_HEADER</param>
+/// <param name="received_ns">When the handler was called</param>
+static void record_message(BENCH_RUN *run, const void *payload, uint64_t received_ns)
+{
+    BENCH_HEADER header;
+    memcpy(&header, payload, sizeof(header));
+    if (header.sequence >= run->total)
+    {
+        return;
+    }
+
+    if (atomic_exchange(&run->seen[header.sequence], 1) != 0)
+    {
+        atomic_fetch_add(&run->duplicates, 1);
+        return;
+    }
+
+    run->latencies_ns[header.sequence] = received_ns - header.sent_ns;
+
+    uint64_t last = atomic_load(&run->last_received_ns);
+    while (received_ns > last && !atomic_compare_exchange_weak(&run->last_received_ns, &last, received_ns))
+    {
+    }
+
+    atomic_fetch_add(&run->received, 1);
+}
+
+/// <summary>
+/// Message handler. Records the latency of the first copy of each message of the current run.
+/// </summary>
+/// <param name="topic">Topic</param>
+/// <param name="payload">Payload starting with a BENCH_HEADER</param>
+/// <param name="payload_length">Payload length</param>
+/// <param name="context">Unused</param>
+static void message_received(const char *topic, const void *payload, size_t payload_length, void *context)
+{
+    (void)context;
+    uint64_t received_ns = now_ns();
+
+    if (strncmp(topic, "bench/probe", 11) == 0)
+    {
+        atomic_store(&probe_received, true);
+        return;
+    }
+
+    // Counted before the run is loaded, so run_once can wait for this call before freeing it
+    atomic_fetch_add(&handlers_running, 1);
+    BENCH_RUN *run = atomic_load(&current_run);
+
+    // Late messages of an earlier run land on that run's topics and are ignored
+    if (run != NULL && payload_length >= sizeof(BENCH_HEADER) && strncmp(topic, run->prefix, strlen(run->prefix)) == 0)
+    {
+        record_message(run, payload, received_ns);
+    }
+
+    atomic_fetch_sub(&handlers_running, 1);
+}
+
+/// <summary>
+/// Publish until the broker has answered on a probe topic, which shows the subscriptions
+/// made before it are in place
+/// </summary>
+/// <param name="timeout_ms">Longest wait</param>
+/// <returns>True once a probe came back</returns>
+static bool wait_for_probe(uint32_t timeout_ms)
+{
+    uint64_t deadline       = now_ns() + (uint64_t)timeout_ms * 1000000ull;
+    DX_MQTT_MESSAGE message = {.topic = "bench/probe", .payload = "", .payload_length = 0, .qos = 0};
+
+    atomic_store(&probe_received, false);
+
+    while (!atomic_load(&probe_received) && now_ns() < deadline)
+    {
+        dx_mqttPublish(&message);
+        sleep_ns(10000000ull);
+    }
+
+    return atomic_load(&probe_received);
+}
+
+/// <summary>
+/// Producer thread. Publishes every threads'th message of the run, retrying while the
+/// client's send buffer is full, paced when a rate is set.
+/// </summary>
+/// <param name="arg">BENCH_PRODUCER</param>
+/// <returns>NULL</returns>
+static void *producer_main(void *arg)
+{
+    BENCH_PRODUCER *producer = arg;
+    BENCH_RUN *run           = producer->run;
+    uint64_t interval_ns     = run->rate > 0 ? (uint64_t)run->threads * 1000000000ull / run->rate : 0;
+    uint64_t due_ns          = run->start_ns;
+
+    uint8_t *payload = malloc(run->payload_size);
+    if (payload == NULL)
+    {
+        atomic_store(&run->stalled, true);
+        return NULL;
+    }
+    memset(payload, 0xA5, run->payload_size);
+
+    DX_MQTT_MESSAGE message = {.payload = payload, .payload_length = run->payload_size, .qos = run->qos};
+
+    for (size_t sequence = producer->first; sequence < run->total && !atomic_load(&run->stalled); sequence += run->threads)
+    {
+        if (interval_ns > 0)
+        {
+            uint64_t now = now_ns();
+            if (due_ns > now)
+            {
+                sleep_ns(due_ns - now);
+            }
+            due_ns += interval_ns;
+        }
+
+        message.topic = run->topics[sequence % run->topic_count];
+
+        // A publish that stays refused past the timeout means the connection is gone
+        uint64_t give_up_ns = 0;
+        for (;;)
+        {
+            BENCH_HEADER header = {.sequence = sequence, .sent_ns = now_ns()};
+            memcpy(payload, &header, sizeof(header));
+
+            if (dx_mqttPublish(&message))
+            {
+                break;
+            }
+
+            if (give_up_ns == 0)
+            {
+                give_up_ns = header.sent_ns + (uint64_t)run->timeout_ms * 1000000ull;
+            }
+            else if (header.sent_ns > give_up_ns)
+            {
+                atomic_store(&run->stalled, true);
+                break;
+            }
+
+            atomic_fetch_add(&run->retries, 1);
+            sleep_ns(10000ull);
+        }
+
+        if (!atomic_load(&run->stalled))
+        {
+            atomic_fetch_add(&run->sent, 1);
+        }
+    }
+
+    free(payload);
+    return NULL;
+}
+
+/// <summary>
+/// qsort comparison for latencies
+/// </summary>
+/// <param name="a">First latency</param>
+/// <param name="b">Second latency</param>
+/// <returns>Ordering</returns>
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/// <summary>
+/// Value at a percentile of sorted samples, nearest rank
+/// </summary>
+/// <param name="sorted">Sorted samples</param>
+/// <param name="count">Number of samples, at least one</param>
+/// <param name="percentile">Percentile between 0 and 1</param>
+/// <returns>Sample</returns>
+static uint64_t percentile_of(const uint64_t *sorted, size_t count, double percentile)
+{
+    size_t rank = (size_t)(percentile * (double)count + 0.999999);
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+/// <summary>
+/// Run one point of the sweep and describe it as JSON
+/// </summary>
+/// <param name="run">Run with its parameters filled in</param>
+/// <returns>JSON object, or NULL when the run could not be set up</returns>
+static JSON_Value *run_once(BENCH_RUN *run)
+{
+    snprintf(run->prefix, sizeof(run->prefix), "bench/%u/", run->index);
+
+    BENCH_PRODUCER *producers = calloc(run->threads, sizeof(BENCH_PRODUCER));
+    run->topics               = calloc(run->topic_count, BENCH_TOPIC_SIZE);
+    run->latencies_ns         = calloc(run->total, sizeof(uint64_t));
+    run->seen                 = calloc(run->total, sizeof(atomic_uchar));
+
+    char filter[BENCH_TOPIC_SIZE];
+    snprintf(filter, sizeof(filter), "bench/%u/#", run->index);
+
+    if (run->topics == NULL || run->latencies_ns == NULL || run->seen == NULL || producers == NULL || !dx_mqttSubscribe(filter, run->qos) ||
+        !wait_for_probe(run->timeout_ms))
+    {
+        free(run->topics);
+        free(run->latencies_ns);
+        free(run->seen);
+        free(producers);
+        return NULL;
+    }
+
+    for (size_t t = 0; t < run->topic_count; t++)
+    {
+        snprintf(run->topics[t], BENCH_TOPIC_SIZE, "%s%zu", run->prefix, t);
+    }
+
+    atomic_store(&current_run, run);
+    run->start_ns = now_ns();
+
+    size_t started = 0;
+    for (; started < run->threads; started++)
+    {
+        producers[started].run   = run;
+        producers[started].first = started;
+        if (pthread_create(&producers[started].thread, NULL, producer_main, &producers[started]) != 0)
+        {
+            atomic_store(&run->stalled, true);
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < started; i++)
+    {
+        pthread_join(producers[i].thread, NULL);
+    }
+    uint64_t published_ns = now_ns();
+
+    // Wait for the stragglers, giving up once nothing has arrived for the timeout
+    size_t received      = atomic_load(&run->received);
+    uint64_t progress_ns = published_ns;
+    while (received < atomic_load(&run->sent) && now_ns() - progress_ns < (uint64_t)run->timeout_ms * 1000000ull)
+    {
+        sleep_ns(1000000ull);
+        size_t now_received = atomic_load(&run->received);
+        if (now_received != received)
+        {
+            received    = now_received;
+            progress_ns = now_ns();
+        }
+    }
+
+    // A handler that picked up the run before it was cleared may still be writing to it
+    atomic_store(&current_run, NULL);
+    while (atomic_load(&handlers_running) > 0)
+    {
+        sched_yield();
+    }
+    dx_mqttUnsubscribe(filter);
+
+    size_t sent      = atomic_load(&run->sent);
+    received         = atomic_load(&run->received);
+    uint64_t last_ns = atomic_load(&run->last_received_ns);
+    double seconds   = (double)((received > 0 ? last_ns : published_ns) - run->start_ns) / 1e9;
+
+    JSON_Value *value   = json_value_init_object();
+    JSON_Object *object = json_value_get_object(value);
+
+    json_object_set_number(object, "payload_bytes", (double)run->payload_size);
+    json_object_set_number(object, "qos", run->qos);
+    json_object_set_number(object, "threads", (double)run->threads);
+    json_object_set_number(object, "topics", (double)run->topic_count);
+    json_object_set_number(object, "rate", run->rate);
+    json_object_set_number(object, "sent", (double)sent);
+    json_object_set_number(object, "received", (double)received);
+    json_object_set_number(object, "lost", (double)(sent > received ? sent - received : 0));
+    json_object_set_number(object, "duplicates", (double)atomic_load(&run->duplicates));
+    json_object_set_number(object, "publish_retries", (double)atomic_load(&run->retries));
+    json_object_set_boolean(object, "stalled", atomic_load(&run->stalled));
+    json_object_set_number(object, "seconds", seconds);
+    json_object_set_number(object, "messages_per_second", seconds > 0 ? (double)received / seconds : 0);
+    json_object_set_number(object, "bytes_per_second", seconds > 0 ? (double)received * (double)run->payload_size / seconds : 0);
+
+    if (received > 0)
+    {
+        // Compact the latencies of the messages that arrived, in place
+        size_t count = 0;
+        for (size_t i = 0; i < run->total; i++)
+        {
+            if (atomic_load(&run->seen[i]) != 0)
+            {
+                run->latencies_ns[count++] = run->latencies_ns[i];
+            }
+        }
+        qsort(run->latencies_ns, count, sizeof(uint64_t), compare_u64);
+
+        json_object_dotset_number(object, "latency_us.p50", (double)percentile_of(run->latencies_ns, count, 0.50) / 1e3);
+        json_object_dotset_number(object, "latency_us.p99", (double)percentile_of(run->latencies_ns, count, 0.99) / 1e3);
+        json_object_dotset_number(object, "latency_us.p999", (double)percentile_of(run->latencies_ns, count, 0.999) / 1e3);
+        json_object_dotset_number(object, "latency_us.max", (double)run->latencies_ns[count - 1] / 1e3);
+    }
+
+    free(run->topics);
+    free(run->latencies_ns);
+    free(run->seen);
+    free(producers);
+
+    return value;
+}
+
+/// <summary>
+/// Print the command line help
+/// </summary>
+/// <param name="name">Program name</param>
+static void usage(const char *name)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  --payload LIST    payload sizes in bytes, at least 16 (default 16,256,4096)\n"
+        "  --qos LIST        QoS levels (default 0,1)\n"
+        "  --threads LIST    producer thread counts (default 1,4)\n"
+        "  --topics LIST     topic counts (default 1,64)\n"
+        "  --messages N      messages per run (default 50000)\n"
+        "  --rate N          total publishes per second, 0 for as fast as possible (default 0)\n"
+        "  --timeout MS      give up on a stalled run after this long (default 10000)\n"
+        "  --host HOST       external broker instead of the in-process one\n"
+        "  --port PORT       external broker port (default 1883)\n"
+        "  --output FILE     write the JSON here instead of stdout\n",
+        name);
+}
+
+int main(int argc, char *argv[])
+{
+    BENCH_LIST payloads = {{16, 256, 4096}, 3};
+    BENCH_LIST qos      = {{0, 1}, 2};
+    BENCH_LIST threads  = {{1, 4}, 2};
+    BENCH_LIST topics   = {{1, 64}, 2};
+    size_t messages     = 50000;
+    uint32_t rate       = 0;
+    uint32_t timeout_ms = 10000;
+    const char *host    = NULL;
+    const char *port    = "1883";
+    const char *output  = NULL;
+
+    static const struct option options[] = {
+        {"payload", required_argument, NULL, 'p'},
+        {"qos", required_argument, NULL, 'q'},
+        {"threads", required_argument, NULL, 't'},
+        {"topics", required_argument, NULL, 'n'},
+        {"messages", required_argument, NULL, 'm'},
+        {"rate", required_argument, NULL, 'r'},
+        {"timeout", required_argument, NULL, 'w'},
+        {"host", required_argument, NULL, 'H'},
+        {"port", required_argument, NULL, 'P'},
+        {"output", required_argument, NULL, 'o'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int option;
+    bool valid = true;
+    while (valid && (option = getopt_long(argc, argv, "h", options, NULL)) != -1)
+    {
+        switch (option)
+        {
+            case 'p':
+                valid = parse_list(optarg, &payloads);
+                break;
+            case 'q':
+                valid = parse_list(optarg, &qos);
+                break;
+            case 't':
+                valid = parse_list(optarg, &threads);
+                break;
+            case 'n':
+                valid = parse_list(optarg, &topics);
+                break;
+            case 'm':
+                messages = strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                rate = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+            case 'w':
+                timeout_ms = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+            case 'H':
+                host = optarg;
+                break;
+            case 'P':
+                port = optarg;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            default:
+                valid = false;
+                break;
+        }
+    }
+
+    for (size_t i = 0; valid && i < payloads.count; i++)
+    {
+        valid = payloads.values[i] >= sizeof(BENCH_HEADER);
+    }
+    for (size_t i = 0; valid && i < qos.count; i++)
+    {
+        valid = qos.values[i] <= 2;
+    }
+    for (size_t i = 0; valid && i < threads.count; i++)
+    {
+        valid = threads.values[i] > 0 && threads.values[i] <= BENCH_MAX_THREADS;
+    }
+    for (size_t i = 0; valid && i < topics.count; i++)
+    {
+        valid = topics.values[i] > 0 && topics.values[i] <= BENCH_MAX_TOPICS;
+    }
+
+    if (!valid || optind != argc || messages == 0)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // The library logs to stdout, keep it for the JSON and send the log to stderr
+    FILE *json_file = output != NULL ? fopen(output, "w") : fdopen(dup(STDOUT_FILENO), "w");
+    if (json_file == NULL)
+    {
+        perror("bench_mqtt: output");
+        return EXIT_FAILURE;
+    }
+    if (output == NULL)
+    {
+        fflush(stdout);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
+
+    DX_MQTT_TESTBROKER *broker = NULL;
+    char broker_port[8];
+
+    if (host == NULL)
+    {
+        broker = dx_mqttTestBrokerStart(0, NULL);
+        if (broker == NULL)
+        {
+            fprintf(stderr, "bench_mqtt: failed to start the test broker\n");
+            fclose(json_file);
+            return EXIT_FAILURE;
+        }
+        snprintf(broker_port, sizeof(broker_port), "%u", dx_mqttTestBrokerPort(broker));
+        host = "127.0.0.1";
+        port = broker_port;
+    }
+
+    size_t largest_payload = 0;
+    for (size_t i = 0; i < payloads.count; i++)
+    {
+        largest_payload = payloads.values[i] > largest_payload ? payloads.values[i] : largest_payload;
+    }
+
+    // Room for bursts from every producer, the buffers grow up to the limits on demand
+    DX_MQTT_CONFIG config = {
+        .hostname             = host,
+        .port                 = port,
+        .client_id            = "bench_mqtt",
+        .keep_alive_seconds   = 60,
+        .clean_session        = true,
+        .send_buffer_size     = 256 * 1024,
+        .recv_buffer_size     = 64 * 1024,
+        .max_send_buffer_size = 16 * 1024 * 1024,
+        .max_recv_buffer_size = largest_payload + 64 * 1024,
+    };
+
+    if (!dx_mqttConnect(&config, message_received, NULL))
+    {
+        fprintf(stderr, "bench_mqtt: connect to %s:%s failed: %s\n", host, port, dx_mqttGetLastError());
+        dx_mqttTestBrokerStop(broker);
+        fclose(json_file);
+        return EXIT_FAILURE;
+    }
+
+    dx_mqttSubscribe("bench/probe", 0);
+
+    struct utsname system;
+    JSON_Value *root_value = json_value_init_object();
+    JSON_Object *root      = json_value_get_object(root_value);
+    JSON_Value *runs_value = json_value_init_array();
+    JSON_Array *runs       = json_value_get_array(runs_value);
+
+    if (uname(&system) == 0)
+    {
+        json_object_set_string(root, "system", system.sysname);
+        json_object_set_string(root, "machine", system.machine);
+    }
+    json_object_set_string(root, "broker", broker != NULL ? "in-process" : host);
+    json_object_set_number(root, "messages_per_run", (double)messages);
+    json_object_set_value(root, "runs", runs_value);
+
+    unsigned index = 0;
+    int result     = EXIT_SUCCESS;
+
+    for (size_t p = 0; p < payloads.count; p++)
+    {
+        for (size_t q = 0; q < qos.count; q++)
+        {
+            for (size_t t = 0; t < threads.count; t++)
+            {
+                for (size_t n = 0; n < topics.count; n++)
+                {
+                    BENCH_RUN run    = {0};
+                    run.index        = index++;
+                    run.payload_size = payloads.values[p];
+                    run.qos          = (uint8_t)qos.values[q];
+                    run.threads      = threads.values[t];
+                    run.topic_count  = topics.values[n];
+                    run.total        = messages;
+                    run.rate         = rate;
+                    run.timeout_ms   = timeout_ms;
+
+                    JSON_Value *run_value = run_once(&run);
+                    if (run_value == NULL)
+                    {
+                        fprintf(stderr, "bench_mqtt: run %u could not start\n", run.index);
+                        result = EXIT_FAILURE;
+                        continue;
+                    }
+
+                    fprintf(stderr, "bench_mqtt: run %u payload %zu qos %u threads %zu topics %zu: %.0f msg/s\n", run.index, run.payload_size,
+                        run.qos, run.threads, run.topic_count, json_object_get_number(json_value_get_object(run_value), "messages_per_second"));
+                    json_array_append_value(runs, run_value);
+                }
+            }
+        }
+    }
+
+    dx_mqttDisconnect();
+    dx_mqttTestBrokerStop(broker);
+
+    char *json = json_serialize_to_string_pretty(root_value);
+    if (json != NULL)
+    {
+        fprintf(json_file, "%s\n", json);
+        json_free_serialized_string(json);
+    }
+    json_value_free(root_value);
+    fclose(json_file);
+
+    return result;
+}
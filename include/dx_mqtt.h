@@ -12,11 +12,46 @@
 #include "mqtt.h"
 #include "mqtt_pal.h"
 
+// Buckets of DX_MQTT_STATS.ping_rtt_histogram, upper bounds 1, 2, 5, 10, 20, 50, 100,
+// 200, 500, 1000, 2000 and 5000 ms with the last bucket catching everything slower
+#define DX_MQTT_STATS_RTT_BUCKETS 13
+
 #ifdef __cplusplus
 extern "C"
 {
 #endif
 
+    /// <summary>
+    /// TCP tuning for the broker connection, applied to every socket before it connects.
+    /// Zero fields keep the operating system default.
+    /// </summary>
+    typedef struct DX_MQTT_SOCKET_OPTIONS
+    {
+        // Send small packets straight away instead of holding them for Nagle's algorithm
+        bool tcp_nodelay;
+        // Kernel buffer sizes in bytes (SO_SNDBUF, SO_RCVBUF)
+        int send_buffer_size;
+        int recv_buffer_size;
+        // TCP keepalive, any non-zero field turns it on. Seconds idle before the first
+        // probe, seconds between probes, and unanswered probes before the link is dropped.
+        uint32_t keepalive_idle_s;
+        uint32_t keepalive_interval_s;
+        uint32_t keepalive_count;
+        // Drop the connection when sent data stays unacknowledged this long, Linux only
+        uint32_t user_timeout_ms;
+        // IP_TOS (IPv4) or IPV6_TCLASS (IPv6) byte, DSCP in the upper six bits
+        uint8_t tos;
+    } DX_MQTT_SOCKET_OPTIONS;
+
+    /// <summary>
+    /// What a received message does when its dispatch worker's queue, or the loop's, is full
+    /// </summary>
+    typedef enum
+    {
+        DX_MQTT_DISPATCH_BLOCK = 0, // Stop reading from the broker until the worker or loop catches up
+        DX_MQTT_DISPATCH_DROP       // Discard the message and count it in messages_dispatch_dropped
+    } DX_MQTT_DISPATCH_POLICY;
+
     /// <summary>
     /// MQTT connection configuration structure
     /// </summary>
@@ -29,8 +64,87 @@ extern "C"
         const char *password;
         uint16_t keep_alive_seconds;
         bool clean_session;
+        // Drive the connection from uv_default_loop() instead of a background thread.
+        // Connect, disconnect, destroy and the message handler then run on the loop thread.
+        // Publish and subscribe calls can also come from other threads, which wake the loop.
+        bool use_event_loop;
+        // Initial MQTT-C buffer sizes in bytes, 0 selects 2048 (send) and 1024 (receive)
+        size_t send_buffer_size;
+        size_t recv_buffer_size;
+        // Buffers double on demand up to these sizes when the send queue is full or an
+        // inbound packet does not fit. 0 keeps the buffers at their initial size.
+        // Publishes leave part of the send queue free for acknowledgements.
+        size_t max_send_buffer_size;
+        size_t max_recv_buffer_size;
+        // Number of slots in a lock-free queue that dx_mqttPublish encodes into from any
+        // thread, drained by the connection's thread or loop. 0 publishes directly into
+        // MQTT-C under its mutex. Messages larger than a slot always take the direct path.
+        size_t publish_queue_length;
+        // Bytes per queue slot for the encoded packet, 0 selects 512
+        size_t publish_queue_slot_size;
+        // Reconnect in the background when the connection drops, restoring subscriptions.
+        // Retries back off exponentially from the minimum to the maximum delay with jitter.
+        bool auto_reconnect;
+        // First retry delay in milliseconds, 0 selects 1000
+        uint32_t reconnect_min_delay_ms;
+        // Longest retry delay in milliseconds, 0 selects 60000
+        uint32_t reconnect_max_delay_ms;
+        // Memory-mapped file that keeps publishes made while disconnected, NULL disables it.
+        // The backlog survives process restarts and is replayed in order once connected.
+        const char *outbox_path;
+        // Bytes of message storage in the outbox file, 0 selects 1 MiB
+        size_t outbox_size;
+        // When the outbox is full reject the new message instead of evicting the oldest
+        bool outbox_drop_newest;
+        // Messages per second replayed from the outbox, 0 replays as fast as the send buffer allows
+        uint32_t outbox_replay_rate;
+        // Connect over TLS, the default port becomes 8883. Needs a build with DX_MQTT_TLS.
+        // Sessions are cached per client so reconnects resume instead of a full handshake.
+        // TLS builds write with MSG_NOSIGNAL, a plain TCP build on Linux writes through MQTT-C
+        // without it, so applications there should ignore SIGPIPE; the library leaves it alone.
+        bool use_tls;
+        // PEM file of trusted CAs, NULL uses the system store
+        const char *ca_file;
+        // PEM client certificate and key for mutual TLS, NULL when not used
+        const char *cert_file;
+        const char *key_file;
+        // Skip broker certificate and host name verification, for testing only
+        bool tls_insecure;
+        // Most QoS 1/2 publishes awaiting PUBACK/PUBCOMP, 0 for no limit. Publishes beyond
+        // the window fail like a full send buffer, queued and outbox messages wait for room.
+        // Zero-copy publishes count toward the window but are never held back by it.
+        uint16_t max_inflight;
+        // TCP options for the broker socket, the effective values are logged once connected
+        DX_MQTT_SOCKET_OPTIONS socket_options;
+        // Bytes of normal priority publishes let into the send queue until it has all been
+        // written to the socket, 0 for no limit. High priority publishes skip the budget,
+        // so no more than this much bulk is ever queued ahead of them. Bulk beyond it waits
+        // in the publish queue, or fails like a full send buffer on the direct path.
+        size_t bulk_flush_budget;
+        // Worker threads that run message handlers instead of the connection's thread,
+        // 0 runs them inline. A topic always goes to the same worker, so messages on one
+        // topic are handled in order while different topics run in parallel. Not combined
+        // with use_event_loop, which runs handlers on the loop thread.
+        size_t dispatch_workers;
+        // Run message handlers on uv_default_loop() instead of the connection's thread.
+        // Messages are queued lock-free and each loop wakeup runs every one pending, in
+        // order. Connect from the loop thread. Not combined with dispatch_workers, and
+        // not needed with use_event_loop, which already runs handlers on the loop.
+        bool dispatch_on_loop;
+        // Messages each worker, or the loop, can hold, 0 selects 256
+        size_t dispatch_queue_length;
+        DX_MQTT_DISPATCH_POLICY dispatch_policy;
     } DX_MQTT_CONFIG;
 
+    /// <summary>
+    /// Outbound priority of a publish
+    /// </summary>
+    typedef enum
+    {
+        DX_MQTT_PRIORITY_NORMAL = 0, // Bulk telemetry, metered by bulk_flush_budget
+        DX_MQTT_PRIORITY_HIGH   = 1  // Alarms and command acknowledgements, sent ahead of bulk
+    } DX_MQTT_PRIORITY;
+
     /// <summary>
     /// MQTT message structure for publishing
     /// </summary>
@@ -41,17 +155,385 @@ extern "C"
         size_t payload_length;
         uint8_t qos;
         bool retain;
+        DX_MQTT_PRIORITY priority;
     } DX_MQTT_MESSAGE;
 
     /// <summary>
-    /// Callback function prototype for handling received messages
+    /// Callback function prototype for handling received messages. Runs on the MQTT
+    /// background thread, or on the event loop thread when use_event_loop or
+    /// dispatch_on_loop is set, or on a dispatch worker thread when dispatch_workers is set.
     /// </summary>
-    /// <param name="topic">Topic on which the message was received</param>
+    /// <param name="topic">Topic on which the message was received, only valid during the callback</param>
     /// <param name="payload">Message payload</param>
     /// <param name="payload_length">Length of the payload</param>
     /// <param name="context">User-defined context passed during initialization</param>
     typedef void (*DX_MQTT_MESSAGE_RECEIVED_HANDLER)(const char *topic, const void *payload, size_t payload_length, void *context);
 
+    /// <summary>
+    /// Payload compression applied per topic filter, see dx_mqttClientSetCompression
+    /// </summary>
+    typedef enum
+    {
+        DX_MQTT_CODEC_NONE = 0,
+        DX_MQTT_CODEC_LZ4  = 1, // Fast, needs a build with DX_MQTT_LZ4
+        DX_MQTT_CODEC_ZSTD = 2  // Better ratio, needs a build with DX_MQTT_ZSTD
+    } DX_MQTT_CODEC;
+
+    /// <summary>
+    /// Why a publish was refused, indexes DX_MQTT_STATS.publish_failures
+    /// </summary>
+    typedef enum
+    {
+        DX_MQTT_PUBLISH_FAILED_NOT_CONNECTED = 0, // No connection and no outbox to keep the message
+        DX_MQTT_PUBLISH_FAILED_INVALID,           // Missing or oversized topic, or a bad zero-copy commit
+        DX_MQTT_PUBLISH_FAILED_BACK_PRESSURE,     // Send buffer, publish queue or in-flight window full
+        DX_MQTT_PUBLISH_FAILED_OUTBOX_FULL,       // Outbox set to drop newest and out of room
+        DX_MQTT_PUBLISH_FAILED_COMPRESSION,       // Payload could not be compressed
+        DX_MQTT_PUBLISH_FAILED_CONNECTION,        // MQTT-C reported a connection error
+        DX_MQTT_PUBLISH_FAILED_RATE_LIMITED,      // Over a rate limit set to reject, or its queue is full
+        DX_MQTT_PUBLISH_FAILURE_REASONS
+    } DX_MQTT_PUBLISH_FAILURE;
+
+    /// <summary>
+    /// What a publish over a rate limit does, see DX_MQTT_RATE_LIMIT
+    /// </summary>
+    typedef enum
+    {
+        DX_MQTT_LIMIT_REJECT = 0, // Fail the publish
+        DX_MQTT_LIMIT_DROP,       // Report success but discard the message
+        DX_MQTT_LIMIT_QUEUE       // Hold a copy and send it once the limit allows
+    } DX_MQTT_LIMIT_ACTION;
+
+    /// <summary>
+    /// Outbound rate limit for dx_mqttClientSetRateLimit and dx_mqttClientSetTopicRateLimit.
+    /// Bytes are whole PUBLISH packets as encoded on the wire, after compression.
+    /// </summary>
+    typedef struct DX_MQTT_RATE_LIMIT
+    {
+        // Sustained rates, 0 leaves that dimension unlimited
+        uint32_t messages_per_second;
+        uint32_t bytes_per_second;
+        // Amount that may go back to back after an idle spell, 0 selects one second's worth
+        uint32_t message_burst;
+        uint32_t byte_burst;
+        DX_MQTT_LIMIT_ACTION action;
+        // Most messages DX_MQTT_LIMIT_QUEUE holds before rejecting, 0 selects 256. Room for
+        // them is set aside with the limit, in slots of publish_queue_slot_size bytes.
+        uint32_t queue_length;
+    } DX_MQTT_RATE_LIMIT;
+
+    /// <summary>
+    /// Counters for one client since it was created. Each field is read atomically
+    /// but the snapshot as a whole is not, so related fields may be off by a message.
+    /// Indexes by QoS are 0, 1 and 2. Byte counts are whole PUBLISH packets as encoded
+    /// on the wire, after compression.
+    /// </summary>
+    typedef struct DX_MQTT_STATS
+    {
+        // Publishes handed to MQTT-C for sending, outbox messages count once replayed
+        uint64_t messages_out[3];
+        uint64_t bytes_out[3];
+        // Publishes received from the broker
+        uint64_t messages_in[3];
+        uint64_t bytes_in[3];
+        // Publishes refused, by DX_MQTT_PUBLISH_FAILURE
+        uint64_t publish_failures[DX_MQTT_PUBLISH_FAILURE_REASONS];
+        // Conflated values replaced by a newer one before they were sent
+        uint64_t messages_conflated;
+        // Publishes over a rate limit that were discarded, or held to be sent later
+        uint64_t messages_rate_dropped;
+        uint64_t messages_rate_queued;
+        // Received messages discarded because their dispatch worker's or the loop's queue was full
+        uint64_t messages_dispatch_dropped;
+        // Outbox replays put off because the oldest message could not be read into memory
+        uint64_t outbox_read_failures;
+        // Most bytes the MQTT-C send buffer has held at once
+        size_t send_buffer_high_water;
+        // Sessions re-established by auto_reconnect
+        uint64_t reconnects;
+        // Milliseconds the current session has been up, 0 while disconnected
+        uint64_t connected_ms;
+        // Milliseconds connected over all sessions including the current one
+        uint64_t total_connected_ms;
+        // Microseconds spent in message handlers, in total and for the slowest call
+        uint64_t handler_time_us;
+        uint64_t handler_time_max_us;
+        // Keep-alive round trips from PINGREQ sent to PINGRESP seen
+        uint64_t ping_rtt_histogram[DX_MQTT_STATS_RTT_BUCKETS];
+        uint64_t ping_rtt_last_us;
+        // Same as dx_mqttClientGetReceiveAllocations and dx_mqttClientGetInflight
+        size_t receive_allocations;
+        size_t inflight;
+    } DX_MQTT_STATS;
+
+    /// <summary>
+    /// Opaque handle for one broker connection. The dx_mqtt* functions without a
+    /// client argument operate on a built-in default instance.
+    /// </summary>
+    typedef struct DX_MQTT_CLIENT DX_MQTT_CLIENT;
+
+    /// <summary>
+    /// Callback raised when a client connects or loses its connection, including each
+    /// automatic reconnect. Runs on the thread that saw the change, normally the MQTT
+    /// background thread or, when use_event_loop is set, the event loop thread.
+    /// </summary>
+    /// <param name="client">MQTT client</param>
+    /// <param name="connected">True when connected, false when the connection was lost</param>
+    /// <param name="context">User context passed to dx_mqttClientSetConnectionHandler</param>
+    typedef void (*DX_MQTT_CONNECTION_HANDLER)(DX_MQTT_CLIENT *client, bool connected, void *context);
+
+    /// <summary>
+    /// Callback raised when the broker has acknowledged a QoS 1 (PUBACK) or QoS 2
+    /// (PUBCOMP) publish. Runs on the MQTT background thread, or on the event loop
+    /// thread when use_event_loop is set. Publishes still in flight when the connection
+    /// drops are abandoned without a callback.
+    /// </summary>
+    /// <param name="client">MQTT client</param>
+    /// <param name="packet_id">Packet id the publish was sent with</param>
+    /// <param name="latency_us">Microseconds from entering the MQTT-C send queue to the acknowledgement</param>
+    /// <param name="context">User context passed to dx_mqttClientSetPublishCompleteHandler</param>
+    typedef void (*DX_MQTT_PUBLISH_COMPLETE)(DX_MQTT_CLIENT *client, uint16_t packet_id, uint64_t latency_us, void *context);
+
+    /// <summary>
+    /// Create an MQTT client instance for a broker connection
+    /// </summary>
+    /// <param name="config">MQTT connection configuration, copied into the client</param>
+    /// <returns>New client, or NULL on failure</returns>
+    DX_MQTT_CLIENT *dx_mqttClientCreate(const DX_MQTT_CONFIG *config);
+
+    /// <summary>
+    /// Connect a client to its MQTT broker
+    /// </summary>
+    /// <param name="client">MQTT client</param>
+    /// <param name="message_handler">Callback function for received messages (can be NULL)</param>
+    /// <param name="context">User context to pass to the message handler</param>
+    /// <returns>True on success, false on failure</returns>
+    bool dx_mqttClientConnect(DX_MQTT_CLIENT *client, DX_MQTT_MESSAGE_RECEIVED_HANDLER message_handler, void *context);
+
+    /// <summary>
+    /// Connect a client to its MQTT broker without blocking. The host is resolved and
+    /// its IPv6 and IPv4 addresses raced on uv_default_loop(), which must be running.
+    /// With auto_reconnect set a failed attempt keeps retrying in the background.
+    /// </summary>
+    /// <param name="client">MQTT client</param>
+    /// <param name="message_handler">Callback function for received messages (can be NULL)</param>
+    /// <param name="context">User context to pass to the message handler</param>
+    /// <param name="complete">Called on the event loop thread with the outcome (can be NULL)</param>
+    /// <param name="complete_context">User context passed to the completion callback</param>
+    /// <returns>True if the connect was started</returns>
+    bool dx_mqttClientConnectAsync(DX_MQTT_CLIENT *client, DX_MQTT_MESSAGE_RECEIVED_HANDLER message_handler, void *context,
+        DX_MQTT_CONNECTION_HANDLER complete, void *complete_context);
+
+    /// <summary>
+    /// Register a callback for connection state changes
+    /// </summary>
+    /// <param name="client">MQTT client</param>
+    /// <param name="handler">Callback, NULL to remove</param>
+    /// <param name="context">User context passed to the handler</param>
+    void dx_mqttClientSetConnectionHandler(DX_MQTT_CLIENT *client, DX_MQTT_CONNECTION_HANDLER handler, void *context);
+
+    /// <summary>
+    /// Publish a message to an MQTT topic
+    /// </summary>
+    /// <param name="client">MQTT client</param>
+    /// <param name="message">Message to publish</param>
+    /// <returns>True on success, false on failure</returns>
+    bool dx_mqttClientPublish(DX_MQTT_CLIENT *client, const DX_MQTT_MESSAGE *message);
+
+    /// <summary>
+    /// Publish several messages under one lock of the client and write the resulting
+    /// packets to the socket with a single sendmsg when nothing older is still queued
+    /// </summary>
+    /// <param name="client">MQTT client</param>
+    /// <param name="messages">Messages to publish</param>
+    /// <param name="count">Number of messages</param>
+    /// <param name="results">Optional array of count entries set true for each message queued</param>
+    /// <returns>Number of messages queued</returns>
+    size_t dx_mqttClientPublishBatch(DX_MQTT_CLIENT *client, const DX_MQTT_MESSAGE *messages, size_t count, bool *results);
+
+    /// <summary>
+    /// Reserve space for a PUBLISH in the send buffer so the payload can be built in
+    /// place, avoiding an intermediate buffer and copy. Must be followed on the same
+    /// thread by dx_mqttClientPublishCommit or dx_mqttClientPublishAbort. The client is
+    /// not locked meanwhile: other threads keep publishing, while sends, subscribes and
+    /// reconnects wait for the reservation and a second Begin on another thread blocks
+    /// until it ends. Messages dx_mqttClientPublish would keep in the outbox, conflate,
+    /// compress or queue behind earlier publishes are staged in a client buffer and
+    /// committed through dx_mqttClientPublish, costing one copy. Commit applies the
+    /// rate limits, in-flight window and bulk budget like dx_mqttClientPublish.
+    /// </summary>
+    /// <param name="client">MQTT client</param>
+    /// <param name="topic">Topic to publish to, copied into the reservation</param>
+    /// <param name="max_length">Largest payload the caller may write</param>
+    /// <returns>Writable payload area of max_length bytes, or NULL on failure</returns>
+    void *dx_mqttClientPublishBegin(DX_MQTT_CLIENT *client, const char *topic, size_t max_length);
+
+    /// <summary>
+    /// Finish a PUBLISH started with dx_mqttClientPublishBegin
+    /// </summary>
+    /// <param name="client">MQTT client</param>
+    /// <param name="length">Number of payload bytes written, at most max_length</param>
+    /// <param name="qos">Quality of Service level (0, 1, or 2)</param>
+    /// <returns>True if the message was queued</returns>
+    bool dx_mqttClientPublishCommit(DX_MQTT_CLIENT *client, size_t length, uint8_t qos);
+
+    /// <summary>
+    /// Drop a reservation made with dx_mqttClientPublishBegin without sending anything
+    /// </summary>
+    /// <param name="client">MQTT client</param>
+    void dx_mqttClientPublishAbort(DX_MQTT_CLIENT *client);
+
+    /// <summary>
+    /// Register a callback for acknowledged QoS 1/2 publishes
+    /// </summary>
+    /// <param name="client">MQTT client</param>
+    /// <param name="handler">Callback, NULL to remove</param>
+    /// <param name="context">User context passed to the handler</param>
+    void dx_mqttClientSetPublishCompleteHandler(DX_MQTT_CLIENT *client, DX_MQTT_PUBLISH_COMPLETE handler, void *context);
+
+    /// <summary>
+    /// Number of QoS 1/2 publishes waiting for their acknowledgement. Only tracked while
+    /// max_inflight is set or a publish complete handler is registered.
+    /// </summary>
+    /// <param name="client">MQTT client</param>
+    /// <returns>In-flight count</returns>
+    size_t dx_mqttClientGetInflight(DX_MQTT_CLIENT *client);
+
+    /// <summary>
+    /// Block until the in-flight window has room for another QoS 1/2 publish. Must not be
+    /// called from a handler or, when use_event_loop is set, from the event loop thread.
+    /// </summary>
+    /// <param name="client">MQTT client</param>
+    /// <param name="timeout_ms">Longest wait in milliseconds</param>
+    /// <returns>True if there is room, false on timeout</returns>
+    bool dx_mqttClientWaitForWindow(DX_MQTT_CLIENT *client, uint32_t timeout_ms);
+
+    /// <summary>
+    /// Subscribe to an MQTT topic
+    /// </summary>
+    /// <param name="client">MQTT client</param>
+    /// <param name="topic">Topic to subscribe to</param>
+    /// <param name="qos">Quality of Service level (0, 1, or 2)</param>
+    /// <returns>True on success, false on failure</returns>
+    bool dx_mqttClientSubscribe(DX_MQTT_CLIENT *client, const char *topic, uint8_t qos);
+
+    /// <summary>
+    /// Subscribe to a topic filter and route matching messages to their own handler.
+    /// Filters may use the + and # wildcards. A message goes to every matching filter
+    /// handler, and to the connect handler only when no filter handler matches.
+    /// Subscribing to the same filter again replaces its handler.
+    /// </summary>
+    /// <param name="client">MQTT client</param>
+    /// <param name="topic_filter">Topic filter to subscribe to</param>
+    /// <param name="qos">Quality of Service level (0, 1, or 2)</param>
+    /// <param name="handler">Callback for messages matching the filter</param>
+    /// <param name="context">User context passed to the handler</param>
+    /// <returns>True on success, false on failure</returns>
+    bool dx_mqttClientSubscribeWithHandler(
+        DX_MQTT_CLIENT *client, const char *topic_filter, uint8_t qos, DX_MQTT_MESSAGE_RECEIVED_HANDLER handler, void *context);
+
+    /// <summary>
+    /// Compress payloads published to topics matching a filter, and decompress messages
+    /// received on them before any handler sees them. Every payload on a matching topic
+    /// starts with a small header, payloads that would not shrink are stored behind it
+    /// uncompressed, so both ends must configure the same filters. Payloads that arrive
+    /// without the header pass through. When several filters match, the one set most
+    /// recently wins. Payloads written in place with dx_mqttClientPublishBegin on these
+    /// topics are staged and compressed at commit.
+    /// </summary>
+    /// <param name="client">MQTT client</param>
+    /// <param name="topic_filter">Topic filter, may use + and #</param>
+    /// <param name="codec">Codec to use, DX_MQTT_CODEC_NONE removes the filter</param>
+    /// <param name="level">Codec specific level, 0 selects the default</param>
+    /// <returns>False if the filter is invalid or the codec was not built in</returns>
+    bool dx_mqttClientSetCompression(DX_MQTT_CLIENT *client, const char *topic_filter, DX_MQTT_CODEC codec, int level);
+
+    /// <summary>
+    /// Keep only the latest unsent value on topics matching a filter. A publish to such a
+    /// topic replaces any value still waiting, and at most one value per topic is sent
+    /// each interval. A value that does not fit the send buffer stays pending and goes
+    /// out once the link drains. Conflated topics bypass the outbox and the zero-copy API.
+    /// </summary>
+    /// <param name="client">MQTT client</param>
+    /// <param name="topic_filter">Topic filter, may use + and #</param>
+    /// <param name="conflate">True to conflate matching topics, false to remove the filter</param>
+    /// <param name="interval_ms">Minimum time between sends on each topic, 0 sends whenever the link has room</param>
+    /// <returns>False if the filter is invalid or could not be stored</returns>
+    bool dx_mqttClientSetConflation(DX_MQTT_CLIENT *client, const char *topic_filter, bool conflate, uint32_t interval_ms);
+
+    /// <summary>
+    /// Limit the rate of publishes on the whole connection. Every publish path checks
+    /// the limit, including the outbox replay and conflated values, which simply wait
+    /// for it. Messages held by DX_MQTT_LIMIT_QUEUE are released in order.
+    /// </summary>
+    /// <param name="client">MQTT client</param>
+    /// <param name="limit">Limit to apply, NULL removes it</param>
+    /// <returns>False if the limit could not be stored</returns>
+    bool dx_mqttClientSetRateLimit(DX_MQTT_CLIENT *client, const DX_MQTT_RATE_LIMIT *limit);
+
+    /// <summary>
+    /// Limit the rate of publishes on topics matching a filter. All matching topics share
+    /// one budget, and when several filters match the one set last applies. A message
+    /// must also pass the connection limit.
+    /// </summary>
+    /// <param name="client">MQTT client</param>
+    /// <param name="topic_filter">Topic filter, may use + and #</param>
+    /// <param name="limit">Limit to apply, NULL removes the filter</param>
+    /// <returns>False if the filter is invalid or could not be stored</returns>
+    bool dx_mqttClientSetTopicRateLimit(DX_MQTT_CLIENT *client, const char *topic_filter, const DX_MQTT_RATE_LIMIT *limit);
+
+    /// <summary>
+    /// Unsubscribe from an MQTT topic, dropping any handler registered for it
+    /// </summary>
+    /// <param name="client">MQTT client</param>
+    /// <param name="topic">Topic to unsubscribe from</param>
+    /// <returns>True on success, false on failure</returns>
+    bool dx_mqttClientUnsubscribe(DX_MQTT_CLIENT *client, const char *topic);
+
+    /// <summary>
+    /// Check if a client is connected to its broker
+    /// </summary>
+    /// <param name="client">MQTT client</param>
+    /// <returns>True if connected, false otherwise</returns>
+    bool dx_mqttClientIsConnected(DX_MQTT_CLIENT *client);
+
+    /// <summary>
+    /// Get the last error message recorded for a client
+    /// </summary>
+    /// <param name="client">MQTT client</param>
+    /// <returns>String description of the last error, or NULL if no error</returns>
+    const char *dx_mqttClientGetLastError(DX_MQTT_CLIENT *client);
+
+    /// <summary>
+    /// Number of heap allocations made on the receive path since the client was created.
+    /// Only growth of the receive and topic buffers allocates, so the count stops
+    /// rising once the largest message has been seen.
+    /// </summary>
+    /// <param name="client">MQTT client</param>
+    /// <returns>Allocation count</returns>
+    size_t dx_mqttClientGetReceiveAllocations(DX_MQTT_CLIENT *client);
+
+    /// <summary>
+    /// Copy the client's counters. Counting is lock-free, so this can be called from
+    /// any thread at any rate without slowing the connection.
+    /// </summary>
+    /// <param name="client">MQTT client</param>
+    /// <param name="stats">Receives the counters</param>
+    /// <returns>False if client or stats is NULL</returns>
+    bool dx_mqttClientGetStats(DX_MQTT_CLIENT *client, DX_MQTT_STATS *stats);
+
+    /// <summary>
+    /// Disconnect a client from its broker and cleanup connection resources
+    /// </summary>
+    /// <param name="client">MQTT client</param>
+    void dx_mqttClientDisconnect(DX_MQTT_CLIENT *client);
+
+    /// <summary>
+    /// Disconnect if needed and free a client created with dx_mqttClientCreate
+    /// </summary>
+    /// <param name="client">MQTT client</param>
+    void dx_mqttClientDestroy(DX_MQTT_CLIENT *client);
+
     /// <summary>
     /// Initialize and connect to an MQTT broker
     /// </summary>
@@ -61,6 +543,25 @@ extern "C"
     /// <returns>True on success, false on failure</returns>
     bool dx_mqttConnect(const DX_MQTT_CONFIG *config, DX_MQTT_MESSAGE_RECEIVED_HANDLER message_handler, void *context);
 
+    /// <summary>
+    /// Initialize and connect to an MQTT broker without blocking
+    /// </summary>
+    /// <param name="config">MQTT connection configuration</param>
+    /// <param name="message_handler">Callback function for received messages (can be NULL)</param>
+    /// <param name="context">User context to pass to the message handler</param>
+    /// <param name="complete">Called on the event loop thread with the outcome (can be NULL)</param>
+    /// <param name="complete_context">User context passed to the completion callback</param>
+    /// <returns>True if the connect was started</returns>
+    bool dx_mqttConnectAsync(const DX_MQTT_CONFIG *config, DX_MQTT_MESSAGE_RECEIVED_HANDLER message_handler, void *context,
+        DX_MQTT_CONNECTION_HANDLER complete, void *complete_context);
+
+    /// <summary>
+    /// Register a callback for connection state changes of the default client
+    /// </summary>
+    /// <param name="handler">Callback, NULL to remove</param>
+    /// <param name="context">User context passed to the handler</param>
+    void dx_mqttSetConnectionHandler(DX_MQTT_CONNECTION_HANDLER handler, void *context);
+
     /// <summary>
     /// Publish a message to an MQTT topic
     /// </summary>
@@ -68,6 +569,37 @@ extern "C"
     /// <returns>True on success, false on failure</returns>
     bool dx_mqttPublish(const DX_MQTT_MESSAGE *message);
 
+    /// <summary>
+    /// Publish several messages with one lock acquisition and one socket write
+    /// </summary>
+    /// <param name="messages">Messages to publish</param>
+    /// <param name="count">Number of messages</param>
+    /// <param name="results">Optional array of count entries set true for each message queued</param>
+    /// <returns>Number of messages queued</returns>
+    size_t dx_mqttPublishBatch(const DX_MQTT_MESSAGE *messages, size_t count, bool *results);
+
+    /// <summary>
+    /// Reserve space for a PUBLISH in the send buffer so the payload can be built in
+    /// place. See dx_mqttClientPublishBegin for the locking rules.
+    /// </summary>
+    /// <param name="topic">Topic to publish to</param>
+    /// <param name="max_length">Largest payload the caller may write</param>
+    /// <returns>Writable payload area of max_length bytes, or NULL on failure</returns>
+    void *dx_mqttPublishBegin(const char *topic, size_t max_length);
+
+    /// <summary>
+    /// Finish a PUBLISH started with dx_mqttPublishBegin
+    /// </summary>
+    /// <param name="length">Number of payload bytes written, at most max_length</param>
+    /// <param name="qos">Quality of Service level (0, 1, or 2)</param>
+    /// <returns>True if the message was queued</returns>
+    bool dx_mqttPublishCommit(size_t length, uint8_t qos);
+
+    /// <summary>
+    /// Drop a reservation made with dx_mqttPublishBegin without sending anything
+    /// </summary>
+    void dx_mqttPublishAbort(void);
+
     /// <summary>
     /// Subscribe to an MQTT topic
     /// </summary>
@@ -77,7 +609,70 @@ extern "C"
     bool dx_mqttSubscribe(const char *topic, uint8_t qos);
 
     /// <summary>
-    /// Unsubscribe from an MQTT topic
+    /// Subscribe to a topic filter and route matching messages to their own handler
+    /// </summary>
+    /// <param name="topic_filter">Topic filter to subscribe to, may use + and #</param>
+    /// <param name="qos">Quality of Service level (0, 1, or 2)</param>
+    /// <param name="handler">Callback for messages matching the filter</param>
+    /// <param name="context">User context passed to the handler</param>
+    /// <returns>True on success, false on failure</returns>
+    bool dx_mqttSubscribeWithHandler(const char *topic_filter, uint8_t qos, DX_MQTT_MESSAGE_RECEIVED_HANDLER handler, void *context);
+
+    /// <summary>
+    /// Compress payloads on topics matching a filter for the default client
+    /// </summary>
+    /// <param name="topic_filter">Topic filter, may use + and #</param>
+    /// <param name="codec">Codec to use, DX_MQTT_CODEC_NONE removes the filter</param>
+    /// <param name="level">Codec specific level, 0 selects the default</param>
+    /// <returns>False if the filter is invalid or the codec was not built in</returns>
+    bool dx_mqttSetCompression(const char *topic_filter, DX_MQTT_CODEC codec, int level);
+
+    /// <summary>
+    /// Keep only the latest unsent value on topics matching a filter, for the default client
+    /// </summary>
+    /// <param name="topic_filter">Topic filter, may use + and #</param>
+    /// <param name="conflate">True to conflate matching topics, false to remove the filter</param>
+    /// <param name="interval_ms">Minimum time between sends on each topic, 0 sends whenever the link has room</param>
+    /// <returns>False if the filter is invalid or could not be stored</returns>
+    bool dx_mqttSetConflation(const char *topic_filter, bool conflate, uint32_t interval_ms);
+
+    /// <summary>
+    /// Limit the rate of publishes on the default client's connection
+    /// </summary>
+    /// <param name="limit">Limit to apply, NULL removes it</param>
+    /// <returns>False if the limit could not be stored</returns>
+    bool dx_mqttSetRateLimit(const DX_MQTT_RATE_LIMIT *limit);
+
+    /// <summary>
+    /// Limit the rate of publishes on topics matching a filter, for the default client
+    /// </summary>
+    /// <param name="topic_filter">Topic filter, may use + and #</param>
+    /// <param name="limit">Limit to apply, NULL removes the filter</param>
+    /// <returns>False if the filter is invalid or could not be stored</returns>
+    bool dx_mqttSetTopicRateLimit(const char *topic_filter, const DX_MQTT_RATE_LIMIT *limit);
+
+    /// <summary>
+    /// Register a callback for acknowledged QoS 1/2 publishes on the default client
+    /// </summary>
+    /// <param name="handler">Callback, NULL to remove</param>
+    /// <param name="context">User context passed to the handler</param>
+    void dx_mqttSetPublishCompleteHandler(DX_MQTT_PUBLISH_COMPLETE handler, void *context);
+
+    /// <summary>
+    /// Number of QoS 1/2 publishes of the default client waiting for their acknowledgement
+    /// </summary>
+    /// <returns>In-flight count</returns>
+    size_t dx_mqttGetInflight(void);
+
+    /// <summary>
+    /// Block until the default client's in-flight window has room
+    /// </summary>
+    /// <param name="timeout_ms">Longest wait in milliseconds</param>
+    /// <returns>True if there is room, false on timeout</returns>
+    bool dx_mqttWaitForWindow(uint32_t timeout_ms);
+
+    /// <summary>
+    /// Unsubscribe from an MQTT topic, dropping any handler registered for it
     /// </summary>
     /// <param name="topic">Topic to unsubscribe from</param>
     /// <returns>True on success, false on failure</returns>
@@ -95,6 +690,19 @@ extern "C"
     /// <returns>String description of the last error, or NULL if no error</returns>
     const char *dx_mqttGetLastError(void);
 
+    /// <summary>
+    /// Number of heap allocations made on the receive path of the default client
+    /// </summary>
+    /// <returns>Allocation count</returns>
+    size_t dx_mqttGetReceiveAllocations(void);
+
+    /// <summary>
+    /// Copy the counters of the default client
+    /// </summary>
+    /// <param name="stats">Receives the counters</param>
+    /// <returns>False if stats is NULL</returns>
+    bool dx_mqttGetStats(DX_MQTT_STATS *stats);
+
     /// <summary>
     /// Disconnect from MQTT broker and cleanup resources
     /// </summary>
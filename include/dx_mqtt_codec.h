@@ -0,0 +1,78 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+#pragma once
+
+#include "dx_mqtt.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /// <summary>
+    /// Compression state and output buffer for one direction of one connection. The
+    /// codec contexts and buffer are kept between calls, so once the buffer has grown
+    /// to the largest payload no call allocates. Not thread safe.
+    /// </summary>
+    typedef struct DX_MQTT_CODEC_CONTEXT DX_MQTT_CODEC_CONTEXT;
+
+    /// <summary>
+    /// Create a codec context
+    /// </summary>
+    /// <returns>New context, or NULL on failure</returns>
+    DX_MQTT_CODEC_CONTEXT *dx_mqttCodecCreate(void);
+
+    /// <summary>
+    /// Free a codec context
+    /// </summary>
+    /// <param name="context">Codec context, can be NULL</param>
+    void dx_mqttCodecDestroy(DX_MQTT_CODEC_CONTEXT *context);
+
+    /// <summary>
+    /// Check whether a codec was compiled in
+    /// </summary>
+    /// <param name="codec">Codec</param>
+    /// <returns>True if payloads can be compressed and decompressed with it</returns>
+    bool dx_mqttCodecIsAvailable(DX_MQTT_CODEC codec);
+
+    /// <summary>
+    /// Compress a payload behind the codec header. Small payloads, and payloads that
+    /// would not shrink, are stored behind a header with DX_MQTT_CODEC_NONE. With
+    /// DX_MQTT_CODEC_NONE itself the payload is returned unchanged.
+    /// </summary>
+    /// <param name="context">Codec context</param>
+    /// <param name="codec">Codec to use</param>
+    /// <param name="level">Codec specific level, 0 selects the default</param>
+    /// <param name="payload">Payload to compress</param>
+    /// <param name="length">Payload length</param>
+    /// <param name="output">Receives the payload to send, valid until the next call</param>
+    /// <param name="output_length">Receives its length</param>
+    /// <returns>False if the codec failed or is not available</returns>
+    bool dx_mqttCodecCompress(DX_MQTT_CODEC_CONTEXT *context, DX_MQTT_CODEC codec, int level, const void *payload, size_t length,
+        const void **output, size_t *output_length);
+
+    /// <summary>
+    /// Decompress a payload that starts with the codec header. A stored payload is
+    /// returned in place after its header, payloads without the header unchanged.
+    /// </summary>
+    /// <param name="context">Codec context</param>
+    /// <param name="payload">Received payload</param>
+    /// <param name="length">Payload length</param>
+    /// <param name="output">Receives the original payload, valid until the next call</param>
+    /// <param name="output_length">Receives its length</param>
+    /// <returns>False if the payload is corrupt or uses a codec that is not available</returns>
+    bool dx_mqttCodecDecompress(DX_MQTT_CODEC_CONTEXT *context, const void *payload, size_t length, const void **output, size_t *output_length);
+
+    /// <summary>
+    /// Number of heap allocations the context has made, for the allocation counters
+    /// </summary>
+    /// <param name="context">Codec context, can be NULL</param>
+    /// <returns>Allocation count</returns>
+    size_t dx_mqttCodecAllocations(const DX_MQTT_CODEC_CONTEXT *context);
+
+#ifdef __cplusplus
+}
+#endif
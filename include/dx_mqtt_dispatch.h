@@ -0,0 +1,92 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /// <summary>
+    /// Fixed pool of worker threads that run received messages off the connection's
+    /// thread. A topic always hashes to the same worker, so messages on one topic are
+    /// handled in the order they arrived. Each worker has a bounded queue whose slots
+    /// keep their buffers, so once warmed up posting a message does not allocate.
+    /// </summary>
+    typedef struct DX_MQTT_DISPATCH DX_MQTT_DISPATCH;
+
+    /// <summary>
+    /// Called on a worker thread for each posted message
+    /// </summary>
+    /// <param name="topic">NUL terminated topic, valid during the call</param>
+    /// <param name="header">Copy of the header given with the message, valid during the call and not aligned</param>
+    /// <param name="header_length">Header length</param>
+    /// <param name="payload">Payload, valid during the call</param>
+    /// <param name="payload_length">Payload length</param>
+    /// <param name="context">Context given to dx_mqttDispatchCreate</param>
+    typedef void (*DX_MQTT_DISPATCH_HANDLER)(
+        const char *topic, const void *header, size_t header_length, const void *payload, size_t payload_length, void *context);
+
+    /// <summary>
+    /// Outcome of dx_mqttDispatchPost
+    /// </summary>
+    typedef enum
+    {
+        DX_MQTT_DISPATCH_QUEUED = 0,
+        DX_MQTT_DISPATCH_FULL,     // The topic's worker has no free slot
+        DX_MQTT_DISPATCH_NO_MEMORY // The slot buffer could not grow to fit the message
+    } DX_MQTT_DISPATCH_RESULT;
+
+    /// <summary>
+    /// Create a worker pool and start its threads
+    /// </summary>
+    /// <param name="workers">Number of worker threads</param>
+    /// <param name="queue_length">Messages each worker can hold</param>
+    /// <param name="handler">Called for each message</param>
+    /// <param name="context">Passed to the handler</param>
+    /// <returns>New pool, or NULL on failure</returns>
+    DX_MQTT_DISPATCH *dx_mqttDispatchCreate(size_t workers, size_t queue_length, DX_MQTT_DISPATCH_HANDLER handler, void *context);
+
+    /// <summary>
+    /// Run every message still queued, then stop and free the pool. Must not be called
+    /// from a worker thread.
+    /// </summary>
+    /// <param name="dispatch">Worker pool, can be NULL</param>
+    void dx_mqttDispatchDestroy(DX_MQTT_DISPATCH *dispatch);
+
+    /// <summary>
+    /// Copy a message into the queue of its topic's worker
+    /// </summary>
+    /// <param name="dispatch">Worker pool</param>
+    /// <param name="topic">Topic, not NUL terminated</param>
+    /// <param name="topic_length">Topic length</param>
+    /// <param name="header">Bytes the poster wants back with the message, such as what it already looked up</param>
+    /// <param name="header_length">Header length, can be 0</param>
+    /// <param name="payload">Payload</param>
+    /// <param name="payload_length">Payload length</param>
+    /// <returns>DX_MQTT_DISPATCH_QUEUED, or why the message was not queued</returns>
+    DX_MQTT_DISPATCH_RESULT dx_mqttDispatchPost(DX_MQTT_DISPATCH *dispatch, const char *topic, size_t topic_length, const void *header,
+        size_t header_length, const void *payload, size_t payload_length);
+
+    /// <summary>
+    /// Block until the worker a topic hashes to has a free slot
+    /// </summary>
+    /// <param name="dispatch">Worker pool</param>
+    /// <param name="topic">Topic, not NUL terminated</param>
+    /// <param name="topic_length">Topic length</param>
+    void dx_mqttDispatchWaitForRoom(DX_MQTT_DISPATCH *dispatch, const char *topic, size_t topic_length);
+
+    /// <summary>
+    /// Number of heap allocations the pool has made for slot buffers, for the allocation counters
+    /// </summary>
+    /// <param name="dispatch">Worker pool, can be NULL</param>
+    /// <returns>Allocation count</returns>
+    size_t dx_mqttDispatchAllocations(const DX_MQTT_DISPATCH *dispatch);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,74 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+#pragma once
+
+#include "dx_mqtt_dispatch.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <uv.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /// <summary>
+    /// Hands received messages from the connection's thread to a libuv loop. Messages
+    /// go into a lock-free ring and one uv_async_t wakeup runs every message pending at
+    /// that point, in order, however many sends libuv coalesced into it. Messages that
+    /// fit a slot are copied into it, larger ones are copied to the heap.
+    /// </summary>
+    typedef struct DX_MQTT_HANDOFF DX_MQTT_HANDOFF;
+
+    /// <summary>
+    /// Create a handoff onto a loop. Must be called on the loop's thread.
+    /// </summary>
+    /// <param name="loop">Loop whose thread runs the handler</param>
+    /// <param name="slot_count">Messages that can be waiting for the loop</param>
+    /// <param name="inline_size">Topic and payload bytes a slot holds without allocating</param>
+    /// <param name="handler">Called on the loop thread for each message</param>
+    /// <param name="context">Passed to the handler</param>
+    /// <returns>New handoff, or NULL on failure</returns>
+    DX_MQTT_HANDOFF *dx_mqttHandoffCreate(uv_loop_t *loop, size_t slot_count, size_t inline_size, DX_MQTT_DISPATCH_HANDLER handler, void *context);
+
+    /// <summary>
+    /// Run the messages still waiting and close the handoff. Must be called on the
+    /// loop's thread with no producer left, the memory is freed on a later loop iteration.
+    /// </summary>
+    /// <param name="handoff">Handoff, can be NULL</param>
+    void dx_mqttHandoffDestroy(DX_MQTT_HANDOFF *handoff);
+
+    /// <summary>
+    /// Copy a message into the ring and wake the loop
+    /// </summary>
+    /// <param name="handoff">Handoff</param>
+    /// <param name="topic">Topic, not NUL terminated</param>
+    /// <param name="topic_length">Topic length</param>
+    /// <param name="header">Bytes handed back to the handler with the message</param>
+    /// <param name="header_length">Header length, can be 0</param>
+    /// <param name="payload">Payload</param>
+    /// <param name="payload_length">Payload length</param>
+    /// <returns>DX_MQTT_DISPATCH_QUEUED, or why the message was not queued</returns>
+    DX_MQTT_DISPATCH_RESULT dx_mqttHandoffPost(DX_MQTT_HANDOFF *handoff, const char *topic, size_t topic_length, const void *header,
+        size_t header_length, const void *payload, size_t payload_length);
+
+    /// <summary>
+    /// Block until the loop has taken messages off a full ring, or the timeout passes
+    /// </summary>
+    /// <param name="handoff">Handoff</param>
+    /// <param name="timeout_ms">Longest wait</param>
+    /// <returns>True if there is room</returns>
+    bool dx_mqttHandoffWaitForRoom(DX_MQTT_HANDOFF *handoff, uint32_t timeout_ms);
+
+    /// <summary>
+    /// Number of heap allocations made for messages too large for a slot, for the allocation counters
+    /// </summary>
+    /// <param name="handoff">Handoff, can be NULL</param>
+    /// <returns>Allocation count</returns>
+    size_t dx_mqttHandoffAllocations(const DX_MQTT_HANDOFF *handoff);
+
+#ifdef __cplusplus
+}
+#endif
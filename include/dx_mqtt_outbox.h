@@ -0,0 +1,99 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+#pragma once
+
+#include "dx_mqtt.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /// <summary>
+    /// Fixed size store-and-forward queue of publishes in a memory-mapped ring file.
+    /// Records are written through the shared mapping and synced before they count,
+    /// so the backlog survives a process restart or power loss. Thread safe, though
+    /// only one thread should peek and pop.
+    /// </summary>
+    typedef struct DX_MQTT_OUTBOX DX_MQTT_OUTBOX;
+
+    /// <summary>
+    /// What to do when a new message does not fit in the outbox
+    /// </summary>
+    typedef enum
+    {
+        DX_MQTT_OUTBOX_DROP_OLDEST, // Evict the oldest records until the new one fits
+        DX_MQTT_OUTBOX_DROP_NEWEST  // Keep the backlog and reject the new message
+    } DX_MQTT_OUTBOX_EVICTION;
+
+    /// <summary>
+    /// Outcome of dx_mqttOutboxPeek
+    /// </summary>
+    typedef enum
+    {
+        DX_MQTT_OUTBOX_PEEKED = 0,
+        DX_MQTT_OUTBOX_EMPTY,     // Nothing is waiting
+        DX_MQTT_OUTBOX_NO_MEMORY  // The oldest message could not be copied out, it stays queued
+    } DX_MQTT_OUTBOX_PEEK_RESULT;
+
+    /// <summary>
+    /// Open or create an outbox file. An existing file with the same capacity keeps its
+    /// backlog less any damaged records, a missing, damaged or differently sized file
+    /// starts empty.
+    /// </summary>
+    /// <param name="path">File path</param>
+    /// <param name="capacity">Bytes of record storage</param>
+    /// <param name="eviction">Policy when the outbox is full</param>
+    /// <returns>Outbox, or NULL on failure</returns>
+    DX_MQTT_OUTBOX *dx_mqttOutboxOpen(const char *path, size_t capacity, DX_MQTT_OUTBOX_EVICTION eviction);
+
+    /// <summary>
+    /// Flush and unmap an outbox
+    /// </summary>
+    /// <param name="outbox">Outbox to close</param>
+    void dx_mqttOutboxClose(DX_MQTT_OUTBOX *outbox);
+
+    /// <summary>
+    /// Append a message to the end of the outbox
+    /// </summary>
+    /// <param name="outbox">Outbox</param>
+    /// <param name="message">Message to store</param>
+    /// <returns>True if stored, false if it was larger than the outbox or rejected by the eviction policy</returns>
+    bool dx_mqttOutboxAppend(DX_MQTT_OUTBOX *outbox, const DX_MQTT_MESSAGE *message);
+
+    /// <summary>
+    /// Read the oldest message without removing it
+    /// </summary>
+    /// <param name="outbox">Outbox</param>
+    /// <param name="message">Receives the message, valid until the next peek</param>
+    /// <returns>DX_MQTT_OUTBOX_PEEKED, or why there is no message</returns>
+    DX_MQTT_OUTBOX_PEEK_RESULT dx_mqttOutboxPeek(DX_MQTT_OUTBOX *outbox, DX_MQTT_MESSAGE *message);
+
+    /// <summary>
+    /// Remove the message returned by the last peek. Does nothing if it has already
+    /// been evicted to make room. The removal is synced by the next append, a crash
+    /// before then replays the message again.
+    /// </summary>
+    /// <param name="outbox">Outbox</param>
+    void dx_mqttOutboxPop(DX_MQTT_OUTBOX *outbox);
+
+    /// <summary>
+    /// Number of messages waiting in the outbox
+    /// </summary>
+    /// <param name="outbox">Outbox</param>
+    /// <returns>Message count</returns>
+    size_t dx_mqttOutboxCount(DX_MQTT_OUTBOX *outbox);
+
+    /// <summary>
+    /// Number of messages lost to the eviction policy since the file was created
+    /// </summary>
+    /// <param name="outbox">Outbox</param>
+    /// <returns>Dropped message count</returns>
+    size_t dx_mqttOutboxDropped(DX_MQTT_OUTBOX *outbox);
+
+#ifdef __cplusplus
+}
+#endif
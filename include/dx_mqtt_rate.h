@@ -0,0 +1,58 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /// <summary>
+    /// Message and byte rate limit using the generic cell rate algorithm, a token bucket
+    /// that keeps one timestamp per bucket instead of a token count and refill timer.
+    /// A decision is one compare and swap per bucket, so any number of threads can
+    /// check the same limit without a lock.
+    /// </summary>
+    typedef struct DX_MQTT_RATE DX_MQTT_RATE;
+
+    /// <summary>
+    /// Create a rate limit
+    /// </summary>
+    /// <param name="messages_per_second">Sustained message rate, 0 for no message limit</param>
+    /// <param name="message_burst">Messages that may go back to back, 0 selects one second's worth</param>
+    /// <param name="bytes_per_second">Sustained byte rate, 0 for no byte limit</param>
+    /// <param name="byte_burst">Bytes that may go back to back, 0 selects one second's worth</param>
+    /// <returns>New rate limit, or NULL on failure</returns>
+    DX_MQTT_RATE *dx_mqttRateCreate(uint32_t messages_per_second, uint32_t message_burst, uint32_t bytes_per_second, uint32_t byte_burst);
+
+    /// <summary>
+    /// Free a rate limit
+    /// </summary>
+    /// <param name="rate">Rate limit, can be NULL</param>
+    void dx_mqttRateDestroy(DX_MQTT_RATE *rate);
+
+    /// <summary>
+    /// Take one message of the given size from the buckets if both allow it. A message
+    /// larger than the byte burst goes through once the byte bucket is full, so it is
+    /// delayed rather than refused forever.
+    /// </summary>
+    /// <param name="rate">Rate limit, NULL always allows</param>
+    /// <param name="bytes">Message size</param>
+    /// <param name="now_ns">Current monotonic time in nanoseconds</param>
+    /// <returns>0 if the message was taken, otherwise nanoseconds until it would be allowed</returns>
+    int64_t dx_mqttRateTake(DX_MQTT_RATE *rate, size_t bytes, int64_t now_ns);
+
+    /// <summary>
+    /// Give back a message taken with dx_mqttRateTake that was not sent after all
+    /// </summary>
+    /// <param name="rate">Rate limit, can be NULL</param>
+    /// <param name="bytes">Size passed to dx_mqttRateTake</param>
+    void dx_mqttRateRefund(DX_MQTT_RATE *rate, size_t bytes);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,80 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /// <summary>
+    /// Bounded lock-free ring of fixed size slots. Any number of threads may produce,
+    /// a single thread consumes. Producers never block: a full ring is reported to
+    /// the caller instead.
+    /// </summary>
+    typedef struct DX_MQTT_RING DX_MQTT_RING;
+
+    /// <summary>
+    /// Create a ring
+    /// </summary>
+    /// <param name="slot_count">Number of slots, rounded up to a power of two</param>
+    /// <param name="slot_size">Bytes of storage in each slot</param>
+    /// <returns>New ring, or NULL on failure</returns>
+    DX_MQTT_RING *dx_mqttRingCreate(size_t slot_count, size_t slot_size);
+
+    /// <summary>
+    /// Free a ring. No producer or consumer may be using it.
+    /// </summary>
+    /// <param name="ring">Ring to free</param>
+    void dx_mqttRingDestroy(DX_MQTT_RING *ring);
+
+    /// <summary>
+    /// Size of the storage in each slot
+    /// </summary>
+    /// <param name="ring">Ring</param>
+    /// <returns>Slot size in bytes</returns>
+    size_t dx_mqttRingSlotSize(const DX_MQTT_RING *ring);
+
+    /// <summary>
+    /// Producer: claim the next free slot for writing
+    /// </summary>
+    /// <param name="ring">Ring</param>
+    /// <returns>Slot storage of dx_mqttRingSlotSize bytes, or NULL if the ring is full</returns>
+    void *dx_mqttRingClaim(DX_MQTT_RING *ring);
+
+    /// <summary>
+    /// Producer: make a claimed slot visible to the consumer
+    /// </summary>
+    /// <param name="ring">Ring</param>
+    /// <param name="slot">Slot returned by dx_mqttRingClaim</param>
+    /// <param name="length">Number of bytes written to the slot</param>
+    void dx_mqttRingPublish(DX_MQTT_RING *ring, void *slot, size_t length);
+
+    /// <summary>
+    /// Consumer: look at the oldest published slot without removing it
+    /// </summary>
+    /// <param name="ring">Ring</param>
+    /// <param name="length">Receives the number of bytes in the slot</param>
+    /// <returns>Slot storage, or NULL if nothing is ready</returns>
+    const void *dx_mqttRingPeek(DX_MQTT_RING *ring, size_t *length);
+
+    /// <summary>
+    /// Consumer: release the slot returned by dx_mqttRingPeek back to producers
+    /// </summary>
+    /// <param name="ring">Ring</param>
+    void dx_mqttRingRelease(DX_MQTT_RING *ring);
+
+    /// <summary>
+    /// Check if no slot is claimed or published
+    /// </summary>
+    /// <param name="ring">Ring</param>
+    /// <returns>True if the ring is empty</returns>
+    bool dx_mqttRingIsEmpty(DX_MQTT_RING *ring);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,72 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+#pragma once
+
+#include "dx_mqtt.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <uv.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /// <summary>
+    /// Non-blocking TCP connect in progress on a libuv loop. The host is resolved with
+    /// uv_getaddrinfo and its addresses are raced Happy Eyeballs style (RFC 8305):
+    /// address families alternate and each attempt gets a short head start before the
+    /// next one begins, the first socket to connect wins.
+    /// </summary>
+    typedef struct DX_MQTT_SOCKET_CONNECT DX_MQTT_SOCKET_CONNECT;
+
+    /// <summary>
+    /// Called once on the loop thread when the connect completes
+    /// </summary>
+    /// <param name="sockfd">Connected non-blocking socket owned by the callee, or -1 on failure</param>
+    /// <param name="status">0 on success, otherwise a libuv error code</param>
+    /// <param name="context">Context passed to dx_mqttSocketConnectAsync</param>
+    typedef void (*DX_MQTT_SOCKET_CONNECTED)(int sockfd, int status, void *context);
+
+    /// <summary>
+    /// Start connecting to a host
+    /// </summary>
+    /// <param name="loop">Loop that runs the resolver, attempts and callback</param>
+    /// <param name="host">Host name or address</param>
+    /// <param name="port">Port number or service name</param>
+    /// <param name="timeout_ms">Deadline for the whole connect including name resolution</param>
+    /// <param name="options">TCP options applied to each attempt's socket, NULL for OS defaults</param>
+    /// <param name="callback">Completion callback</param>
+    /// <param name="context">Passed to the callback</param>
+    /// <returns>Handle for cancelling, or NULL if the connect could not be started</returns>
+    DX_MQTT_SOCKET_CONNECT *dx_mqttSocketConnectAsync(uv_loop_t *loop, const char *host, const char *port, uint32_t timeout_ms,
+        const DX_MQTT_SOCKET_OPTIONS *options, DX_MQTT_SOCKET_CONNECTED callback, void *context);
+
+    /// <summary>
+    /// Abandon a connect that has not completed. The callback is not called and any
+    /// socket still opening is closed. Must run on the loop thread.
+    /// </summary>
+    /// <param name="pending">Connect in progress</param>
+    void dx_mqttSocketConnectCancel(DX_MQTT_SOCKET_CONNECT *pending);
+
+    /// <summary>
+    /// Apply TCP options to a socket that has not connected yet. Buffer sizes must be set
+    /// before the handshake to affect window scaling. Every option is attempted, one the
+    /// platform rejects is logged and skipped.
+    /// </summary>
+    /// <param name="sockfd">Socket</param>
+    /// <param name="family">Address family the socket was created with</param>
+    /// <param name="options">Options, NULL leaves the socket unchanged</param>
+    /// <returns>False if any option could not be applied</returns>
+    bool dx_mqttSocketApplyOptions(int sockfd, int family, const DX_MQTT_SOCKET_OPTIONS *options);
+
+    /// <summary>
+    /// Log the TCP options in effect on a connected socket, as the kernel reports them
+    /// </summary>
+    /// <param name="sockfd">Connected socket</param>
+    void dx_mqttSocketLogOptions(int sockfd);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,97 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /// <summary>
+    /// Small MQTT 3.1.1 broker for tests and benchmarks. Listens on 127.0.0.1 and runs
+    /// its own libuv loop on its own thread, so it never shares uv_default_loop() with
+    /// the client under test. Supports CONNECT, SUBSCRIBE, UNSUBSCRIBE, PUBLISH at QoS
+    /// 0 to 2 and retained messages. A QoS 2 publish resent before its PUBREL is routed
+    /// only once. Sessions are always clean and nothing is persisted.
+    /// Built with the DX_MQTT_TESTBROKER CMake option as edge_mqtt_testbroker.
+    /// </summary>
+    typedef struct DX_MQTT_TESTBROKER DX_MQTT_TESTBROKER;
+
+    /// <summary>
+    /// Faults the broker injects, all off when zero. Can be changed while running.
+    /// </summary>
+    typedef struct DX_MQTT_TESTBROKER_FAULTS
+    {
+        // Hold every packet the broker sends for this long before writing it, order is kept
+        uint32_t delay_ms;
+        // Silently drop one in this many packets the broker sends, CONNACK is never dropped
+        uint32_t drop_one_in;
+        // Read at most this many bytes per second from each connection
+        uint32_t read_bytes_per_second;
+        // Close a connection once it has sent this many packets
+        uint32_t disconnect_after_packets;
+    } DX_MQTT_TESTBROKER_FAULTS;
+
+    /// <summary>
+    /// Counters since the broker started
+    /// </summary>
+    typedef struct DX_MQTT_TESTBROKER_STATS
+    {
+        uint64_t connections;        // Accepted connections
+        uint64_t packets_in;         // Packets read from clients
+        uint64_t packets_out;        // Packets written to clients
+        uint64_t packets_dropped;    // Packets thrown away by drop_one_in
+        uint64_t publishes_in;       // PUBLISH packets read from clients
+        uint64_t publishes_out;      // PUBLISH packets written to subscribers
+        uint64_t forced_disconnects; // Connections closed by a fault or dx_mqttTestBrokerDisconnectAll
+    } DX_MQTT_TESTBROKER_STATS;
+
+    /// <summary>
+    /// Start a broker on 127.0.0.1
+    /// </summary>
+    /// <param name="port">TCP port, 0 picks a free one</param>
+    /// <param name="faults">Faults to inject from the start, can be NULL</param>
+    /// <returns>Running broker, or NULL on failure</returns>
+    DX_MQTT_TESTBROKER *dx_mqttTestBrokerStart(uint16_t port, const DX_MQTT_TESTBROKER_FAULTS *faults);
+
+    /// <summary>
+    /// Close every connection, stop the loop thread and free the broker
+    /// </summary>
+    /// <param name="broker">Broker, can be NULL</param>
+    void dx_mqttTestBrokerStop(DX_MQTT_TESTBROKER *broker);
+
+    /// <summary>
+    /// Port the broker listens on
+    /// </summary>
+    /// <param name="broker">Broker</param>
+    /// <returns>TCP port</returns>
+    uint16_t dx_mqttTestBrokerPort(const DX_MQTT_TESTBROKER *broker);
+
+    /// <summary>
+    /// Replace the injected faults, applies to packets handled from now on
+    /// </summary>
+    /// <param name="broker">Broker</param>
+    /// <param name="faults">New faults, NULL turns them all off</param>
+    void dx_mqttTestBrokerSetFaults(DX_MQTT_TESTBROKER *broker, const DX_MQTT_TESTBROKER_FAULTS *faults);
+
+    /// <summary>
+    /// Drop every open connection without a DISCONNECT, as if the network failed
+    /// </summary>
+    /// <param name="broker">Broker</param>
+    void dx_mqttTestBrokerDisconnectAll(DX_MQTT_TESTBROKER *broker);
+
+    /// <summary>
+    /// Copy the broker's counters
+    /// </summary>
+    /// <param name="broker">Broker</param>
+    /// <param name="stats">Receives the counters</param>
+    void dx_mqttTestBrokerGetStats(const DX_MQTT_TESTBROKER *broker, DX_MQTT_TESTBROKER_STATS *stats);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,73 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+#pragma once
+
+#include <openssl/bio.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /// <summary>
+    /// OpenSSL client context for one broker connection. Keeps the most recent session
+    /// ticket or id so a reconnect can resume instead of running a full handshake.
+    /// </summary>
+    typedef struct DX_MQTT_TLS DX_MQTT_TLS;
+
+    /// <summary>
+    /// Create a TLS client context
+    /// </summary>
+    /// <param name="ca_file">PEM file of trusted CAs, NULL uses the system store</param>
+    /// <param name="cert_file">PEM client certificate for mutual TLS, can be NULL</param>
+    /// <param name="key_file">PEM private key for cert_file, can be NULL</param>
+    /// <param name="verify_peer">Check the broker certificate and host name</param>
+    /// <param name="error">Receives a description on failure</param>
+    /// <param name="error_size">Size of the error buffer</param>
+    /// <returns>New context, or NULL on failure</returns>
+    DX_MQTT_TLS *dx_mqttTlsCreate(
+        const char *ca_file, const char *cert_file, const char *key_file, bool verify_peer, char *error, size_t error_size);
+
+    /// <summary>
+    /// Destroy a TLS context. Transports opened from it stay usable until closed.
+    /// </summary>
+    /// <param name="tls">TLS context, can be NULL</param>
+    void dx_mqttTlsDestroy(DX_MQTT_TLS *tls);
+
+    /// <summary>
+    /// Wrap a connected non-blocking socket in a BIO for MQTT-C. The handshake runs on
+    /// the first read or write, resuming the cached session when there is one.
+    /// </summary>
+    /// <param name="tls">TLS context, NULL for a plain socket BIO</param>
+    /// <param name="sockfd">Connected socket, stays owned by the caller</param>
+    /// <param name="hostname">Broker host name for SNI and certificate checks</param>
+    /// <returns>BIO chain, or NULL on failure</returns>
+    BIO *dx_mqttTlsOpen(DX_MQTT_TLS *tls, int sockfd, const char *hostname);
+
+    /// <summary>
+    /// Send close_notify if the handshake completed and free the BIO chain
+    /// </summary>
+    /// <param name="bio">BIO from dx_mqttTlsOpen, can be NULL</param>
+    void dx_mqttTlsClose(BIO *bio);
+
+    /// <summary>
+    /// Decrypted bytes buffered inside OpenSSL. The socket does not poll readable for
+    /// these, so the caller must service the connection again while this is non-zero.
+    /// </summary>
+    /// <param name="bio">BIO from dx_mqttTlsOpen</param>
+    /// <returns>Number of bytes ready to read</returns>
+    size_t dx_mqttTlsPending(BIO *bio);
+
+    /// <summary>
+    /// Check whether the handshake resumed a cached session
+    /// </summary>
+    /// <param name="bio">BIO from dx_mqttTlsOpen</param>
+    /// <returns>True if the session was resumed</returns>
+    bool dx_mqttTlsSessionReused(BIO *bio);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,94 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /// <summary>
+    /// Map from MQTT topic filters to values, organised by topic level so a topic is
+    /// matched against every filter, including + and # wildcards, in O(topic depth).
+    /// Not thread safe, callers serialise access.
+    /// </summary>
+    typedef struct DX_MQTT_TOPIC_TRIE DX_MQTT_TOPIC_TRIE;
+
+    /// <summary>
+    /// Called for each filter value that matches a topic
+    /// </summary>
+    /// <param name="value">Value stored with the matching filter</param>
+    /// <param name="context">Context passed to dx_mqttTopicTrieMatch</param>
+    typedef void (*DX_MQTT_TOPIC_TRIE_VISITOR)(void *value, void *context);
+
+    /// <summary>
+    /// Create an empty trie
+    /// </summary>
+    /// <returns>New trie, or NULL on failure</returns>
+    DX_MQTT_TOPIC_TRIE *dx_mqttTopicTrieCreate(void);
+
+    /// <summary>
+    /// Free a trie
+    /// </summary>
+    /// <param name="trie">Trie to free</param>
+    /// <param name="free_value">Called for each stored value (can be NULL)</param>
+    void dx_mqttTopicTrieDestroy(DX_MQTT_TOPIC_TRIE *trie, void (*free_value)(void *value));
+
+    /// <summary>
+    /// Check a topic filter is well formed: + and # occupy a whole level and # is last
+    /// </summary>
+    /// <param name="filter">Topic filter</param>
+    /// <returns>True if valid</returns>
+    bool dx_mqttTopicFilterIsValid(const char *filter);
+
+    /// <summary>
+    /// Store a value for a topic filter, replacing any existing value
+    /// </summary>
+    /// <param name="trie">Trie</param>
+    /// <param name="filter">Topic filter</param>
+    /// <param name="value">Value to store</param>
+    /// <param name="previous">Receives the replaced value, or NULL (can be NULL)</param>
+    /// <returns>True on success, false on an invalid filter or allocation failure</returns>
+    bool dx_mqttTopicTrieInsert(DX_MQTT_TOPIC_TRIE *trie, const char *filter, void *value, void **previous);
+
+    /// <summary>
+    /// Remove the value stored for a topic filter
+    /// </summary>
+    /// <param name="trie">Trie</param>
+    /// <param name="filter">Topic filter</param>
+    /// <returns>The removed value, or NULL if the filter was not present</returns>
+    void *dx_mqttTopicTrieRemove(DX_MQTT_TOPIC_TRIE *trie, const char *filter);
+
+    /// <summary>
+    /// Look up the value stored for exactly this filter, wildcards are not expanded
+    /// </summary>
+    /// <param name="trie">Trie</param>
+    /// <param name="filter">Topic filter</param>
+    /// <returns>The stored value, or NULL if not present</returns>
+    void *dx_mqttTopicTrieFind(DX_MQTT_TOPIC_TRIE *trie, const char *filter);
+
+    /// <summary>
+    /// Visit the value of every filter matching a topic name
+    /// </summary>
+    /// <param name="trie">Trie</param>
+    /// <param name="topic">Topic name, need not be NUL terminated</param>
+    /// <param name="topic_length">Topic length in bytes</param>
+    /// <param name="visitor">Called for each match</param>
+    /// <param name="context">Passed to the visitor</param>
+    /// <returns>Number of matching filters</returns>
+    size_t dx_mqttTopicTrieMatch(DX_MQTT_TOPIC_TRIE *trie, const char *topic, size_t topic_length, DX_MQTT_TOPIC_TRIE_VISITOR visitor, void *context);
+
+    /// <summary>
+    /// Number of filters stored in the trie
+    /// </summary>
+    /// <param name="trie">Trie</param>
+    /// <returns>Filter count</returns>
+    size_t dx_mqttTopicTrieCount(const DX_MQTT_TOPIC_TRIE *trie);
+
+#ifdef __cplusplus
+}
+#endif
@@ -6,14 +6,28 @@
 
 #include "dx_mqtt.h"
 
+#include "dx_mqtt_codec.h"
+#include "dx_mqtt_dispatch.h"
+#include "dx_mqtt_handoff.h"
+#include "dx_mqtt_outbox.h"
+#include "dx_mqtt_rate.h"
+#include "dx_mqtt_ring.h"
+#include "dx_mqtt_socket.h"
+#include "dx_mqtt_topic_trie.h"
 #include "dx_utilities.h"
+#ifdef MQTT_USE_BIO
+#include "dx_mqtt_tls.h"
+#endif
 #include <errno.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <uv.h>
 
 // MQTT-C includes
 #include "mqtt.h"
@@ -24,141 +38,6394 @@
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 
-// Internal state management
-static struct mqtt_client _client;
-static int _sockfd              = -1;
-static pthread_t _client_daemon = 0;
-static bool _is_initialized     = false;
-static bool _is_connected       = false;
-static bool _daemon_running     = false;
-static bool _daemon_created     = false; // Track if daemon thread has been created
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
-// Buffers for MQTT client
-static uint8_t _send_buffer[2048];
-static uint8_t _recv_buffer[1024];
+// Largest number of packets dx_mqttClientPublishBatch hands to a single sendmsg
+#define DX_MQTT_BATCH_MAX_IOV 64
 
-// Message handling
-static DX_MQTT_MESSAGE_RECEIVED_HANDLER _message_handler = NULL;
-static void *_user_context                               = NULL;
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
 
-// Error tracking
-static char _last_error[256] = {0};
+// Broker ports used when DX_MQTT_CONFIG leaves the port unset
+#define DX_MQTT_DEFAULT_PORT "1883"
+#define DX_MQTT_DEFAULT_TLS_PORT "8883"
+
+// Default MQTT-C buffer sizes used when DX_MQTT_CONFIG leaves them at zero
+#define DX_MQTT_DEFAULT_SEND_BUFFER_SIZE 2048
+#define DX_MQTT_DEFAULT_RECV_BUFFER_SIZE 1024
+
+// Acknowledgements the send queue always keeps room for. MQTT-C queues PUBACK, PUBREC,
+// PUBREL and PUBCOMP while reading and drops the connection when they do not fit, so
+// publishes and subscribes stop short of filling the buffer. Capped to a quarter of it.
+#define DX_MQTT_ACK_HEADROOM_PACKETS 8
+
+// Reconnect backoff bounds used when DX_MQTT_CONFIG leaves them at zero
+#define DX_MQTT_DEFAULT_RECONNECT_MIN_DELAY_MS 1000
+#define DX_MQTT_DEFAULT_RECONNECT_MAX_DELAY_MS 60000
+
+// Deadline for an event loop connect, name resolution included
+#define DX_MQTT_CONNECT_TIMEOUT_MS 30000
+
+// Outbox file size used when DX_MQTT_CONFIG leaves it at zero
+#define DX_MQTT_DEFAULT_OUTBOX_SIZE (1024 * 1024)
+
+// Most outbox messages moved into MQTT-C per service pass, so replay cannot starve receive
+#define DX_MQTT_OUTBOX_REPLAY_BURST 64
+
+// Most filter handlers a single received message is dispatched to
+#define DX_MQTT_MAX_DISPATCH 32
+
+// Messages each dispatch worker holds when DX_MQTT_CONFIG leaves dispatch_queue_length at zero
+#define DX_MQTT_DEFAULT_DISPATCH_QUEUE_LENGTH 256
+
+// Longest a blocked receive waits on the loop before checking the client is not stopping
+#define DX_MQTT_HANDOFF_WAIT_MS 100
+
+// Publishes a DX_MQTT_LIMIT_QUEUE rate limit holds when DX_MQTT_RATE_LIMIT leaves it at zero
+#define DX_MQTT_DEFAULT_RATE_QUEUE_LENGTH 256
+
+// Topics each rate snapshot remembers the limiter of, a power of two
+#define DX_MQTT_RATE_CACHE_SLOTS 64
+
+// Reader counters a rate snapshot is guarded by
+#define DX_MQTT_RATE_READER_STRIPES 8
+
+// Event loop driver used instead of the daemon thread when use_event_loop is set.
+// Heap allocated because libuv only releases the handles on a later loop iteration.
+typedef struct
+{
+    uv_poll_t poll;
+    uv_timer_t timer;
+    uv_async_t async; // Publish queue wakeups from other threads
+    int open_handles;
+    DX_MQTT_CLIENT *client;
+} MQTT_LOOP_DRIVER;
+
+// Header of a record in the publish queue, followed by the encoded PUBLISH packet.
+// The packet id is patched in when the record is moved into the MQTT-C queue.
+typedef struct
+{
+    uint32_t packet_length;
+    uint32_t packet_id_offset; // 0 for QoS 0, which carries no packet id
+} MQTT_QUEUED_PUBLISH;
+
+// Value stored in the topic trie for dx_mqttClientSubscribeWithHandler
+typedef struct
+{
+    DX_MQTT_MESSAGE_RECEIVED_HANDLER handler;
+    void *context;
+} MQTT_TOPIC_HANDLER;
+
+// Handlers collected while the trie lock is held, called after it is released
+typedef struct
+{
+    MQTT_TOPIC_HANDLER handlers[DX_MQTT_MAX_DISPATCH];
+    size_t count;
+} MQTT_DISPATCH_LIST;
+
+// Value stored in the compression trie for dx_mqttClientSetCompression
+typedef struct
+{
+    DX_MQTT_CODEC codec;
+    int level;
+    uint32_t sequence; // Later settings win when several filters match
+} MQTT_COMPRESSION;
+
+// Value stored in the conflation filter trie for dx_mqttClientSetConflation
+typedef struct
+{
+    uint32_t interval_ms;
+    uint32_t sequence; // Later settings win when several filters match, 0 means none
+} MQTT_CONFLATION;
+
+// Latest unsent value of a conflated topic, its buffers are reused for every sample
+typedef struct
+{
+    char *topic;
+    uint8_t *payload;
+    size_t payload_length;
+    size_t payload_capacity;
+    uint8_t qos;
+    bool retain;
+    DX_MQTT_PRIORITY priority;
+    bool pending;         // Holds a value not yet handed to MQTT-C
+    uint32_t interval_ms;
+    int64_t next_send_us; // Earliest time the next value may go out
+} MQTT_CONFLATED;
+
+// Header of a publish held back by a DX_MQTT_LIMIT_QUEUE rate limit. The NUL terminated
+// topic and then the payload follow it in the ring slot, or in a separate allocation
+// pointed to by spill when they do not fit.
+typedef struct
+{
+    size_t topic_length;
+    size_t payload_length;
+    uint8_t qos;
+    bool retain;
+    DX_MQTT_PRIORITY priority;
+    char *spill;
+} MQTT_RATE_HELD;
+
+// Connection or topic filter rate limit
+typedef struct
+{
+    DX_MQTT_RATE *rate;
+    DX_MQTT_LIMIT_ACTION action;
+    bool topic;               // Set by dx_mqttClientSetTopicRateLimit
+    uint32_t sequence;        // Later settings win when several filters match
+    size_t queue_length;
+    atomic_size_t held_count; // Claimed before the slot, so it never undercounts the ring
+    bool retired;             // Replaced, freed once its held publishes are sent. Guarded by rate_lock
+    DX_MQTT_RING *held;       // Held publishes in publish order, NULL unless DX_MQTT_LIMIT_QUEUE
+} MQTT_RATE_LIMITER;
+
+// Topic filter and the limiter set for it, the rate_lock side copy a snapshot is built from
+typedef struct
+{
+    char *filter;
+    MQTT_RATE_LIMITER *limiter;
+} MQTT_RATE_FILTER;
+
+// A topic name and the limiter it resolved to, NULL when no filter matched
+typedef struct
+{
+    uint64_t hash;
+    size_t topic_length;
+    MQTT_RATE_LIMITER *limiter;
+    char topic[];
+} MQTT_RATE_CACHED;
+
+// Rate limits as publishers see them. Never changed once published through rate_snapshot,
+// a new setting publishes a new snapshot and frees the old one after a grace period.
+typedef struct
+{
+    MQTT_RATE_LIMITER *connection; // NULL when the connection is unlimited
+    DX_MQTT_TOPIC_TRIE *filters;   // Filter to MQTT_RATE_LIMITER, NULL without topic limits
+    _Atomic(MQTT_RATE_CACHED *) cache[DX_MQTT_RATE_CACHE_SLOTS]; // Direct mapped, filled once
+} MQTT_RATE_SNAPSHOT;
+
+// Publishers inside a rate snapshot, counted per parity of rate_epoch. Threads are spread
+// over the stripes so they do not all bounce one cache line.
+typedef struct
+{
+    atomic_size_t active[2];
+    char padding[64 - 2 * sizeof(atomic_size_t)];
+} MQTT_RATE_READERS;
+
+// Outcome of checking a publish against the rate limits
+typedef enum
+{
+    MQTT_RATE_ALLOW = 0, // Within the limits, send it now
+    MQTT_RATE_QUEUED,    // Copied to a limiter queue, released by release_rate_held
+    MQTT_RATE_DROPPED,
+    MQTT_RATE_REJECTED
+} MQTT_RATE_DECISION;
+
+// QoS 1/2 publish waiting for PUBACK or PUBCOMP
+typedef struct
+{
+    uint16_t packet_id;
+    int64_t queued_us;
+} MQTT_INFLIGHT;
+
+// Counters behind dx_mqttClientGetStats, updated with relaxed atomics from any thread
+typedef struct
+{
+    _Atomic uint64_t messages_out[3];
+    _Atomic uint64_t bytes_out[3];
+    _Atomic uint64_t messages_in[3];
+    _Atomic uint64_t bytes_in[3];
+    _Atomic uint64_t publish_failures[DX_MQTT_PUBLISH_FAILURE_REASONS];
+    _Atomic uint64_t messages_conflated;
+    _Atomic uint64_t messages_rate_dropped;
+    _Atomic uint64_t messages_rate_queued;
+    _Atomic uint64_t messages_dispatch_dropped;
+    _Atomic uint64_t outbox_read_failures;
+    atomic_size_t send_buffer_high_water;
+    _Atomic uint64_t reconnects;
+    _Atomic int64_t connected_since_ms;  // Monotonic start of the current session, 0 while down
+    _Atomic uint64_t total_connected_ms; // Finished sessions only
+    _Atomic uint64_t handler_time_us;
+    _Atomic uint64_t handler_time_max_us;
+    _Atomic uint64_t ping_rtt_histogram[DX_MQTT_STATS_RTT_BUCKETS];
+    _Atomic uint64_t ping_rtt_last_us;
+} MQTT_STATS;
+
+// Subscription remembered so it can be restored after a reconnect
+typedef struct
+{
+    char *topic;
+    uint8_t qos;
+} MQTT_SUBSCRIPTION;
+
+/// <summary>
+/// Per connection state. Everything that used to be file level lives here so a
+/// process can hold several broker connections at once.
+/// </summary>
+struct DX_MQTT_CLIENT
+{
+    struct mqtt_client client;
+    int sockfd;
+    mqtt_pal_socket_handle transport; // What MQTT-C reads and writes, a BIO over sockfd when built with TLS
+    pthread_t daemon;
+    atomic_bool is_initialized;
+    atomic_bool is_connected;
+    bool daemon_running;
+    bool daemon_created; // Track if daemon thread has been created
+
+    // Wakeup channel for the daemon thread, an eventfd on Linux and a self-pipe elsewhere
+    int wakeup_fd[2];
+
+    // Event loop driver, replaced only on the loop thread. Other threads reach its async
+    // handle under driver_lock, so it is never signalled once loop_driver_stop has run.
+    MQTT_LOOP_DRIVER *loop_driver;
+    pthread_mutex_t driver_lock;
+
+    // Optional lock-free queues of pre-encoded publishes from application threads, one
+    // per priority. The high priority queue is always drained first.
+    DX_MQTT_RING *publish_queue;
+    DX_MQTT_RING *priority_queue;
+    atomic_bool publish_queue_signalled;
+
+    // Normal priority bytes still allowed into the MQTT-C queue before it is next written
+    // out in full, guarded by the MQTT-C mutex. Deferred is set when bulk had to wait.
+    size_t bulk_budget;
+    bool bulk_deferred;
+
+    // Connection configuration, strings are owned copies
+    DX_MQTT_CONFIG config;
+
+    // Optional store-and-forward backlog for publishes made while disconnected
+    DX_MQTT_OUTBOX *outbox;
+    int64_t outbox_next_replay_us;
+
+    // Buffers for MQTT client, grown up to the configured maximum on demand
+    uint8_t *send_buffer;
+    size_t send_buffer_size;
+    uint8_t *recv_buffer;
+    size_t recv_buffer_size;
+
+    // Open dx_mqttClientPublishBegin reservation, guarded by the MQTT-C mutex. A pinned
+    // reservation owns a COMPLETE placeholder entry in the MQTT-C queue that nothing may
+    // compact or move until commit or abort. Otherwise the topic and payload are staged
+    // and committed through dx_mqttClientPublish.
+    struct
+    {
+        bool active;
+        bool pinned;
+        pthread_t owner;
+        struct mqtt_queued_message *entry;
+        uint8_t *payload;
+        size_t max_length;
+        size_t topic_length;
+        uint8_t *staging;
+        size_t staging_size;
+    } reservation;
+    pthread_cond_t reservation_cond;
+
+    // MQTT-C calls under way that may compact the send queue, a reservation is staged
+    // rather than pinned while any run. Guarded by the MQTT-C mutex.
+    int send_queue_users;
+
+    // Message handling
+    DX_MQTT_MESSAGE_RECEIVED_HANDLER message_handler;
+    void *user_context;
+
+    // NUL terminated copy of the received topic, reused for every inbound message.
+    // Only touched from publish_callback, which MQTT-C runs with its mutex held.
+    char *topic_scratch;
+    size_t topic_scratch_size;
+
+    // Heap allocations made while receiving, stays flat once buffers have warmed up
+    atomic_size_t receive_allocations;
+
+    // Optional workers, or handoff onto uv_default_loop, that run message handlers off
+    // the connection's thread. Created by the first connect that asks for them and kept
+    // until the client is destroyed.
+    DX_MQTT_DISPATCH *dispatch_pool;
+    DX_MQTT_HANDOFF *loop_handoff;
+
+    // Per topic filter handlers, survive reconnects like message_handler
+    DX_MQTT_TOPIC_TRIE *topic_handlers;
+
+    // Active subscriptions, sent again in one SUBSCRIBE after a reconnect
+    MQTT_SUBSCRIPTION *subscriptions;
+    size_t subscription_count;
+    size_t subscription_capacity;
+
+    // Per topic filter payload compression, the count lets topics skip the lookup when unused
+    DX_MQTT_TOPIC_TRIE *compression_filters;
+    atomic_size_t compression_filter_count;
+    uint32_t compression_sequence;
+
+    // Per topic filter conflation, the count lets topics skip the lookup when unused
+    DX_MQTT_TOPIC_TRIE *conflation_filters;
+    atomic_size_t conflation_filter_count;
+    uint32_t conflation_sequence;
+
+    // Guards topic_handlers, subscriptions, compression_filters and conflation_filters
+    pthread_mutex_t subscriptions_lock;
+
+    // Latest value of each conflated topic, found by exact topic in conflated_topics and
+    // walked in first publish order by flush_conflated. Guarded by conflation_lock, which
+    // is taken after the MQTT-C mutex.
+    DX_MQTT_TOPIC_TRIE *conflated_topics;
+    MQTT_CONFLATED **conflated;
+    size_t conflated_count;
+    size_t conflated_capacity;
+    _Atomic int64_t conflation_next_us; // Earliest pending value's send time, 0 when none
+    bool conflation_blocked;            // Last flush stopped on a full buffer or window
+    pthread_mutex_t conflation_lock;
+
+    // Outbound rate limits. Publishers read rate_snapshot without locking, inside a reader
+    // section on rate_readers. Setters, serialized by rate_lock, build a new snapshot from
+    // rate_connection and rate_filters, publish it, flip rate_epoch and wait for the
+    // readers of the old one before freeing it. Limiters in use or still holding publishes
+    // are kept in rate_limiters, which the driver walks under rate_lock, taken after the
+    // MQTT-C mutex.
+    _Atomic(MQTT_RATE_SNAPSHOT *) rate_snapshot; // NULL when nothing is limited
+    atomic_uint rate_epoch;
+    MQTT_RATE_READERS rate_readers[DX_MQTT_RATE_READER_STRIPES];
+    MQTT_RATE_LIMITER *rate_connection;
+    MQTT_RATE_FILTER *rate_filters;
+    size_t rate_filter_count;
+    size_t rate_filter_capacity;
+    uint32_t rate_sequence;
+    MQTT_RATE_LIMITER **rate_limiters;
+    size_t rate_limiter_count;
+    size_t rate_limiter_capacity;
+    atomic_size_t rate_held_count; // Over all limiters, lets the driver skip the lock
+    _Atomic int64_t rate_next_us;  // When the first held publish may go
+    bool rate_blocked;             // Last release stopped on a full buffer or window
+    pthread_mutex_t rate_lock;
+
+    // Codec state for each direction. The receive side is only used from publish_callback
+    // under the MQTT-C mutex. Publishing threads each take a context of their own from
+    // the idle ones, so codec_lock only covers the hand out and never a compression.
+    // The array has room for every context created, so returning one never allocates.
+    DX_MQTT_CODEC_CONTEXT **publish_codecs;
+    size_t publish_codec_count;
+    size_t publish_codec_capacity;
+    DX_MQTT_CODEC_CONTEXT *receive_codec;
+    pthread_mutex_t codec_lock;
+
+    // Automatic reconnect
+    DX_MQTT_CONNECTION_HANDLER connection_handler;
+    void *connection_context;
+    atomic_bool reconnect_enabled;
+    atomic_bool reconnect_pending;
+    _Atomic int64_t reconnect_at_ms;
+    atomic_uint reconnect_attempt;
+    unsigned int reconnect_seed;
+    uv_timer_t *reconnect_timer; // Event loop mode backoff timer
+    bool mqtt_initialized;       // mqtt_init has run, later sessions use mqtt_reinit
+
+    // Event loop connect in flight and the dx_mqttClientConnectAsync completion
+    DX_MQTT_SOCKET_CONNECT *pending_connect;
+    DX_MQTT_CONNECTION_HANDLER connect_complete;
+    void *connect_complete_context;
+
+#ifdef MQTT_USE_BIO
+    // TLS context, built on the first connect and kept so reconnects can resume sessions
+    DX_MQTT_TLS *tls;
+    bool tls_stale; // TLS settings changed since the context was built
+#endif
+
+    // QoS 1/2 publishes awaiting acknowledgement, guarded by the MQTT-C mutex. Tracked
+    // only while a window or completion handler is configured.
+    MQTT_INFLIGHT *inflight;
+    atomic_size_t inflight_count;
+    size_t inflight_capacity;
+    uint64_t *inflight_outstanding; // One bit per packet id, rebuilt by inflight_collect
+    MQTT_INFLIGHT *inflight_completed; // Acknowledged entries handed to the callback
+    size_t inflight_completed_capacity;
+    pthread_cond_t inflight_cond;      // Signalled with the MQTT-C mutex when the window opens
+    DX_MQTT_PUBLISH_COMPLETE publish_complete;
+    void *publish_complete_context;
+
+    // Counters for dx_mqttClientGetStats
+    MQTT_STATS stats;
+
+    // Keep-alive round trip in progress, guarded by the MQTT-C mutex
+    int64_t ping_sent_us;            // When the outstanding PINGREQ was seen sent, 0 if none
+    bool ping_queued;                // A PINGREQ is waiting in the queue to be sent
+    mqtt_pal_time_t ping_last_send;  // time_of_last_send at the last check
+
+    // Error tracking
+    char last_error[256];
+};
+
+// Instance behind the original single connection API
+static DX_MQTT_CLIENT _default_client;
+static bool _default_client_initialized = false;
 
 // Function prototypes
-static void publish_callback(void **unused, struct mqtt_response_publish *published);
-static void *client_refresher(void *client);
-static bool cleanup_connection(void);
-static void set_last_error(const char *format, ...);
-static int open_nb_socket(const char *addr, const char *port);
+static void publish_callback(void **state, struct mqtt_response_publish *published);
+static void *client_refresher(void *arg);
+static bool cleanup_connection(DX_MQTT_CLIENT *client);
+static void set_last_error(DX_MQTT_CLIENT *client, const char *format, ...);
+static int open_nb_socket(const char *addr, const char *port, const DX_MQTT_SOCKET_OPTIONS *options, char *error, size_t error_size);
+static bool wakeup_open(DX_MQTT_CLIENT *client);
+static void wakeup_close(DX_MQTT_CLIENT *client);
+static void wakeup_daemon(DX_MQTT_CLIENT *client);
+static void wakeup_drain(DX_MQTT_CLIENT *client);
+static void request_service(DX_MQTT_CLIENT *client);
+static void service_connection(DX_MQTT_CLIENT *client);
+static bool loop_driver_start(DX_MQTT_CLIENT *client);
+static void loop_driver_stop(DX_MQTT_CLIENT *client);
+static void loop_driver_rearm(DX_MQTT_CLIENT *client);
+static bool loop_driver_signal(DX_MQTT_CLIENT *client);
+static void stop_daemon(DX_MQTT_CLIENT *client);
+static int next_poll_timeout_ms(struct mqtt_client *client);
+static bool has_pending_send(struct mqtt_client *client);
+static bool has_pending_send_locked(struct mqtt_client *client);
+static bool send_queue_wait_locked(DX_MQTT_CLIENT *client);
+static bool send_queue_enter(DX_MQTT_CLIENT *client, bool wait);
+static void send_queue_leave(DX_MQTT_CLIENT *client);
+static bool send_queue_pinned(DX_MQTT_CLIENT *client);
+static void reservation_end_locked(DX_MQTT_CLIENT *client);
+static bool reservation_stage_locked(DX_MQTT_CLIENT *client, size_t size);
+static bool reservation_publish_staged(DX_MQTT_CLIENT *client, size_t length, uint8_t qos);
+static bool allocate_buffers(DX_MQTT_CLIENT *client);
+static void free_buffers(DX_MQTT_CLIENT *client);
+static bool grow_send_buffer_locked(DX_MQTT_CLIENT *client, size_t required);
+static bool grow_recv_buffer_locked(DX_MQTT_CLIENT *client);
+static bool reserve_send_space_locked(DX_MQTT_CLIENT *client, size_t required);
+static size_t remaining_length_size(size_t remaining_length);
+static size_t publish_packet_size(size_t topic_length, size_t payload_length, uint8_t publish_flags);
+static enum MQTTErrors enqueue_publish(
+    DX_MQTT_CLIENT *client, const char *topic, const void *payload, size_t payload_length, uint8_t publish_flags, DX_MQTT_PRIORITY priority);
+static enum MQTTErrors enqueue_publish_locked(
+    DX_MQTT_CLIENT *client, const char *topic, const void *payload, size_t payload_length, uint8_t publish_flags, DX_MQTT_PRIORITY priority);
+static bool bulk_budget_open_locked(DX_MQTT_CLIENT *client, size_t packet_length);
+static void bulk_budget_spend_locked(DX_MQTT_CLIENT *client, size_t packet_length);
+static void refill_bulk_budget(DX_MQTT_CLIENT *client);
+static uint8_t publish_flags_for(const DX_MQTT_MESSAGE *message);
+static void flush_tail_locked(DX_MQTT_CLIENT *client, size_t count);
+static bool queue_publish(DX_MQTT_CLIENT *client, const DX_MQTT_MESSAGE *message);
+static bool drain_publish_queue(DX_MQTT_CLIENT *client);
+static bool drain_ring_locked(DX_MQTT_CLIENT *client, DX_MQTT_RING *ring, bool bulk);
+static bool publish_queue_pending(DX_MQTT_CLIENT *client);
+static void signal_publish_queue(DX_MQTT_CLIENT *client);
+static const char *topic_scratch_copy(DX_MQTT_CLIENT *client, const char *topic, size_t topic_length);
+static void deliver_message(
+    DX_MQTT_CLIENT *client, const MQTT_DISPATCH_LIST *dispatch, const char *topic, const void *payload, size_t payload_length);
+static void post_received(
+    DX_MQTT_CLIENT *client, const MQTT_DISPATCH_LIST *dispatch, const char *topic, size_t topic_length, const void *payload,
+    size_t payload_length);
+static void dispatch_received(
+    const char *topic, const void *header, size_t header_length, const void *payload, size_t payload_length, void *context);
+static size_t receive_allocations(DX_MQTT_CLIENT *client);
+static size_t collect_topic_handlers(DX_MQTT_CLIENT *client, const char *topic, size_t topic_length, MQTT_DISPATCH_LIST *list);
+static DX_MQTT_CODEC topic_codec(DX_MQTT_CLIENT *client, const char *topic, size_t topic_length, int *level);
+static bool decompress_payload(DX_MQTT_CLIENT *client, const char *topic, size_t topic_length, const void **payload, size_t *payload_length);
+static DX_MQTT_CODEC_CONTEXT *codec_acquire(DX_MQTT_CLIENT *client);
+static void codec_release(DX_MQTT_CLIENT *client, DX_MQTT_CODEC_CONTEXT *context);
+static bool compress_message(DX_MQTT_CLIENT *client, DX_MQTT_CODEC_CONTEXT *context, const DX_MQTT_MESSAGE *message, DX_MQTT_MESSAGE *compressed);
+static bool publish_message(DX_MQTT_CLIENT *client, const DX_MQTT_MESSAGE *message);
+static size_t publish_batch_run(DX_MQTT_CLIENT *client, const DX_MQTT_MESSAGE *messages, size_t count, bool *results);
+static size_t publish_batch(
+    DX_MQTT_CLIENT *client, const DX_MQTT_MESSAGE *messages, size_t count, bool *results, DX_MQTT_CODEC_CONTEXT *codec);
+static bool subscription_add(DX_MQTT_CLIENT *client, const char *topic, uint8_t qos);
+static void subscription_remove(DX_MQTT_CLIENT *client, const char *topic);
+static bool restore_subscriptions(DX_MQTT_CLIENT *client);
+static bool start_session(DX_MQTT_CLIENT *client, int sockfd);
+static bool transport_open(DX_MQTT_CLIENT *client);
+static void transport_close(DX_MQTT_CLIENT *client);
+static const char *client_port(DX_MQTT_CLIENT *client);
+static void close_socket(DX_MQTT_CLIENT *client);
+static void notify_connection(DX_MQTT_CLIENT *client, bool connected);
+static void connection_lost(DX_MQTT_CLIENT *client);
+static void schedule_reconnect(DX_MQTT_CLIENT *client);
+static void reconnect_timer_arm(DX_MQTT_CLIENT *client);
+static void reconnect_now(DX_MQTT_CLIENT *client);
+static void reconnect_stop(DX_MQTT_CLIENT *client);
+static void finish_reconnect(DX_MQTT_CLIENT *client, int sockfd);
+static bool start_daemon(DX_MQTT_CLIENT *client);
+static bool outbox_should_store(DX_MQTT_CLIENT *client, DX_MQTT_PRIORITY priority);
+static bool outbox_store(DX_MQTT_CLIENT *client, const DX_MQTT_MESSAGE *message);
+static bool replay_outbox(DX_MQTT_CLIENT *client);
+static int outbox_poll_timeout_ms(DX_MQTT_CLIENT *client, int timeout_ms);
+static bool inflight_window_open_locked(DX_MQTT_CLIENT *client);
+static void inflight_track_locked(DX_MQTT_CLIENT *client, uint16_t packet_id);
+static void inflight_reset(DX_MQTT_CLIENT *client);
+static void inflight_collect(DX_MQTT_CLIENT *client);
+static int64_t monotonic_us(void);
+static void stats_add(_Atomic uint64_t *counter, uint64_t value);
+static void stats_max(_Atomic uint64_t *counter, uint64_t value);
+static void stats_publish_failed(DX_MQTT_CLIENT *client, DX_MQTT_PUBLISH_FAILURE reason, uint64_t count);
+static DX_MQTT_PUBLISH_FAILURE publish_failure_for(enum MQTTErrors error);
+static void stats_publish_sent_locked(DX_MQTT_CLIENT *client, uint8_t qos, size_t packet_length);
+static void stats_session_started(DX_MQTT_CLIENT *client);
+static void stats_session_ended(DX_MQTT_CLIENT *client);
+static void stats_ping(DX_MQTT_CLIENT *client);
+static bool topic_conflation(DX_MQTT_CLIENT *client, const char *topic, uint32_t *interval_ms);
+static bool conflate_message(DX_MQTT_CLIENT *client, const DX_MQTT_MESSAGE *message, uint32_t interval_ms);
+static void flush_conflated(DX_MQTT_CLIENT *client);
+static int conflation_poll_timeout_ms(DX_MQTT_CLIENT *client, int timeout_ms);
+static void prune_conflated(DX_MQTT_CLIENT *client);
+static void free_conflated(void *value);
+static int64_t rate_acquire(DX_MQTT_CLIENT *client, const char *topic, size_t topic_length, size_t bytes, int64_t now_us);
+static void rate_release(DX_MQTT_CLIENT *client, const char *topic, size_t topic_length, size_t bytes);
+static MQTT_RATE_DECISION rate_admit(DX_MQTT_CLIENT *client, const DX_MQTT_MESSAGE *message, size_t topic_length);
+static void rate_unadmit(DX_MQTT_CLIENT *client, const DX_MQTT_MESSAGE *message, size_t topic_length);
+static void release_rate_held(DX_MQTT_CLIENT *client);
+static int rate_poll_timeout_ms(DX_MQTT_CLIENT *client, int timeout_ms);
+static void free_rate_limiter(MQTT_RATE_LIMITER *limiter);
+static void remove_rate_limiter_locked(DX_MQTT_CLIENT *client, size_t index);
 
 /// <summary>
 /// MQTT publish callback - called when a message is received
 /// </summary>
-/// <param name="unused">Unused parameter</param>
+/// <param name="state">Points at the owning DX_MQTT_CLIENT</param>
 /// <param name="published">Published message details</param>
-static void publish_callback(void **unused, struct mqtt_response_publish *published)
+static void publish_callback(void **state, struct mqtt_response_publish *published)
+{
+    DX_MQTT_CLIENT *client = *state;
+
+    if (client == NULL || published == NULL)
+    {
+        return;
+    }
+
+    uint8_t qos = published->qos_level > 2 ? 2 : published->qos_level;
+    stats_add(&client->stats.messages_in[qos], 1);
+    stats_add(&client->stats.bytes_in[qos],
+        publish_packet_size(published->topic_name_size, published->application_message_size, (uint8_t)(qos << 1)));
+
+    MQTT_DISPATCH_LIST dispatch;
+    collect_topic_handlers(client, published->topic_name, published->topic_name_size, &dispatch);
+
+    if (dispatch.count == 0 && client->message_handler == NULL)
+    {
+        return;
+    }
+
+    // Handlers always see the original payload on topics with compression configured
+    const void *payload   = published->application_message;
+    size_t payload_length = published->application_message_size;
+    if (!decompress_payload(client, published->topic_name, published->topic_name_size, &payload, &payload_length))
+    {
+        set_last_error(client, "Dropped undecodable compressed message on '%.*s'", (int)published->topic_name_size, published->topic_name);
+        return;
+    }
+
+    // Workers and the loop get the handlers found here along with the message
+    if (client->dispatch_pool != NULL || client->loop_handoff != NULL)
+    {
+        post_received(client, &dispatch, published->topic_name, published->topic_name_size, payload, payload_length);
+        return;
+    }
+
+    // Null-terminated topic string in the per client scratch buffer
+    const char *topic = topic_scratch_copy(client, published->topic_name, published->topic_name_size);
+    if (topic == NULL)
+    {
+        set_last_error(client, "Failed to allocate memory for topic");
+        return;
+    }
+
+    deliver_message(client, &dispatch, topic, payload, payload_length);
+}
+
+/// <summary>
+/// Call the handlers for a received message and time them
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="dispatch">Filter handlers matching the topic</param>
+/// <param name="topic">NUL terminated topic</param>
+/// <param name="payload">Original payload</param>
+/// <param name="payload_length">Payload length</param>
+static void deliver_message(
+    DX_MQTT_CLIENT *client, const MQTT_DISPATCH_LIST *dispatch, const char *topic, const void *payload, size_t payload_length)
+{
+    DX_MQTT_MESSAGE_RECEIVED_HANDLER message_handler = client->message_handler;
+
+    if (dispatch->count == 0 && message_handler == NULL)
+    {
+        return;
+    }
+
+    int64_t started_us = monotonic_us();
+
+    // Filter handlers take the message, the connect handler sees only unclaimed topics
+    for (size_t i = 0; i < dispatch->count; i++)
+    {
+        dispatch->handlers[i].handler(topic, payload, payload_length, dispatch->handlers[i].context);
+    }
+
+    if (dispatch->count == 0)
+    {
+        message_handler(topic, payload, payload_length, client->user_context);
+    }
+
+    uint64_t elapsed_us = (uint64_t)(monotonic_us() - started_us);
+    stats_add(&client->stats.handler_time_us, elapsed_us);
+    stats_max(&client->stats.handler_time_max_us, elapsed_us);
+}
+
+/// <summary>
+/// Hand a received message to its topic's dispatch worker or to the loop. Called from
+/// publish_callback with the MQTT-C mutex held. A blocking wait for room lets go of the
+/// mutex, so a handler can still publish, and holds up the rest of the receive pass.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="dispatch">Filter handlers matching the topic, copied with the message</param>
+/// <param name="topic">Topic name, not NUL terminated</param>
+/// <param name="topic_length">Topic length</param>
+/// <param name="payload">Original payload</param>
+/// <param name="payload_length">Payload length</param>
+static void post_received(
+    DX_MQTT_CLIENT *client, const MQTT_DISPATCH_LIST *dispatch, const char *topic, size_t topic_length, const void *payload,
+    size_t payload_length)
+{
+    const void *handlers   = dispatch->handlers;
+    size_t handlers_length = dispatch->count * sizeof(MQTT_TOPIC_HANDLER);
+    DX_MQTT_DISPATCH_RESULT result;
+
+    for (;;)
+    {
+        result = client->loop_handoff != NULL
+                     ? dx_mqttHandoffPost(client->loop_handoff, topic, topic_length, handlers, handlers_length, payload, payload_length)
+                     : dx_mqttDispatchPost(client->dispatch_pool, topic, topic_length, handlers, handlers_length, payload, payload_length);
+
+        // A loop stuck disconnecting this client will not drain, give up once the daemon is told to stop
+        bool stopping = client->loop_handoff != NULL && !client->daemon_running;
+        if (result != DX_MQTT_DISPATCH_FULL || client->config.dispatch_policy != DX_MQTT_DISPATCH_BLOCK || stopping)
+        {
+            break;
+        }
+
+        // The receive buffer and codec are only touched by this thread, so the message stays put
+        MQTT_PAL_MUTEX_UNLOCK(&client->client.mutex);
+        if (client->loop_handoff != NULL)
+        {
+            dx_mqttHandoffWaitForRoom(client->loop_handoff, DX_MQTT_HANDOFF_WAIT_MS);
+        }
+        else
+        {
+            dx_mqttDispatchWaitForRoom(client->dispatch_pool, topic, topic_length);
+        }
+        MQTT_PAL_MUTEX_LOCK(&client->client.mutex);
+    }
+
+    if (result == DX_MQTT_DISPATCH_FULL)
+    {
+        stats_add(&client->stats.messages_dispatch_dropped, 1);
+    }
+    else if (result == DX_MQTT_DISPATCH_NO_MEMORY)
+    {
+        set_last_error(client, "Dropped message on '%.*s', no memory to queue it", (int)topic_length, topic);
+    }
+}
+
+/// <summary>
+/// Dispatch worker and loop handoff handler, runs the handlers of a received message
+/// </summary>
+/// <param name="topic">NUL terminated topic</param>
+/// <param name="header">Filter handlers post_received found for the topic, unaligned</param>
+/// <param name="header_length">Bytes of handlers</param>
+/// <param name="payload">Original payload</param>
+/// <param name="payload_length">Payload length</param>
+/// <param name="context">MQTT client</param>
+static void dispatch_received(
+    const char *topic, const void *header, size_t header_length, const void *payload, size_t payload_length, void *context)
+{
+    DX_MQTT_CLIENT *client = context;
+
+    MQTT_DISPATCH_LIST dispatch;
+    dispatch.count = header_length / sizeof(MQTT_TOPIC_HANDLER);
+    memcpy(dispatch.handlers, header, dispatch.count * sizeof(MQTT_TOPIC_HANDLER));
+
+    deliver_message(client, &dispatch, topic, payload, payload_length);
+}
+
+/// <summary>
+/// Heap allocations made while receiving, dispatch and handoff buffers included
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <returns>Allocation count</returns>
+static size_t receive_allocations(DX_MQTT_CLIENT *client)
+{
+    return atomic_load(&client->receive_allocations) + dx_mqttDispatchAllocations(client->dispatch_pool) +
+           dx_mqttHandoffAllocations(client->loop_handoff);
+}
+
+/// <summary>
+/// Copy a received topic into the scratch buffer, growing it only when a longer
+/// topic than any seen before arrives so steady state receives do not allocate
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="topic">Topic name, not NUL terminated</param>
+/// <param name="topic_length">Topic length</param>
+/// <returns>NUL terminated topic, valid until the next received message</returns>
+static const char *topic_scratch_copy(DX_MQTT_CLIENT *client, const char *topic, size_t topic_length)
+{
+    if (topic_length + 1 > client->topic_scratch_size)
+    {
+        size_t size = client->topic_scratch_size == 0 ? 128 : client->topic_scratch_size;
+        while (size < topic_length + 1)
+        {
+            size *= 2;
+        }
+
+        char *scratch = realloc(client->topic_scratch, size);
+        if (scratch == NULL)
+        {
+            return NULL;
+        }
+
+        client->topic_scratch      = scratch;
+        client->topic_scratch_size = size;
+        atomic_fetch_add(&client->receive_allocations, 1);
+    }
+
+    memcpy(client->topic_scratch, topic, topic_length);
+    client->topic_scratch[topic_length] = '\0';
+
+    return client->topic_scratch;
+}
+
+/// <summary>
+/// Trie visitor that copies a matching handler into the dispatch list
+/// </summary>
+/// <param name="value">MQTT_TOPIC_HANDLER stored for the filter</param>
+/// <param name="context">MQTT_DISPATCH_LIST being filled</param>
+static void add_topic_handler(void *value, void *context)
+{
+    MQTT_DISPATCH_LIST *list = context;
+
+    if (list->count < DX_MQTT_MAX_DISPATCH)
+    {
+        list->handlers[list->count++] = *(MQTT_TOPIC_HANDLER *)value;
+    }
+}
+
+/// <summary>
+/// Find the filter handlers for a topic. Copies are returned so handlers can
+/// subscribe or unsubscribe without deadlocking on the trie lock.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="topic">Topic name, not NUL terminated</param>
+/// <param name="topic_length">Topic length</param>
+/// <param name="list">Receives the handlers</param>
+/// <returns>Number of handlers found</returns>
+static size_t collect_topic_handlers(DX_MQTT_CLIENT *client, const char *topic, size_t topic_length, MQTT_DISPATCH_LIST *list)
+{
+    list->count = 0;
+
+    pthread_mutex_lock(&client->subscriptions_lock);
+
+    size_t matches = dx_mqttTopicTrieMatch(client->topic_handlers, topic, topic_length, add_topic_handler, list);
+
+    pthread_mutex_unlock(&client->subscriptions_lock);
+
+    if (matches > DX_MQTT_MAX_DISPATCH)
+    {
+        dx_Log_Debug("DX MQTT: %zu handlers match topic '%.*s', only %d called\n", matches, (int)topic_length, topic, DX_MQTT_MAX_DISPATCH);
+    }
+
+    return list->count;
+}
+
+/// <summary>
+/// Trie visitor that keeps the most recently set of the matching compression filters
+/// </summary>
+/// <param name="value">MQTT_COMPRESSION stored for the filter</param>
+/// <param name="context">MQTT_COMPRESSION receiving the winner</param>
+static void pick_compression(void *value, void *context)
+{
+    const MQTT_COMPRESSION *candidate = value;
+    MQTT_COMPRESSION *best            = context;
+
+    if (best->codec == DX_MQTT_CODEC_NONE || candidate->sequence > best->sequence)
+    {
+        *best = *candidate;
+    }
+}
+
+/// <summary>
+/// Find the codec configured for a topic
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="topic">Topic name, not NUL terminated</param>
+/// <param name="topic_length">Topic length</param>
+/// <param name="level">Receives the codec level</param>
+/// <returns>Codec, DX_MQTT_CODEC_NONE when no compression filter matches</returns>
+static DX_MQTT_CODEC topic_codec(DX_MQTT_CLIENT *client, const char *topic, size_t topic_length, int *level)
+{
+    MQTT_COMPRESSION best = {.codec = DX_MQTT_CODEC_NONE};
+
+    if (atomic_load(&client->compression_filter_count) > 0)
+    {
+        pthread_mutex_lock(&client->subscriptions_lock);
+        dx_mqttTopicTrieMatch(client->compression_filters, topic, topic_length, pick_compression, &best);
+        pthread_mutex_unlock(&client->subscriptions_lock);
+    }
+
+    *level = best.level;
+    return best.codec;
+}
+
+/// <summary>
+/// Decompress a received payload when its topic has compression configured. Called
+/// from publish_callback, so the receive codec is only ever used under the MQTT-C mutex.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="topic">Topic name, not NUL terminated</param>
+/// <param name="topic_length">Topic length</param>
+/// <param name="payload">Received payload, replaced by the original one</param>
+/// <param name="payload_length">Received length, replaced by the original one</param>
+/// <returns>False if the payload could not be decompressed</returns>
+static bool decompress_payload(DX_MQTT_CLIENT *client, const char *topic, size_t topic_length, const void **payload, size_t *payload_length)
+{
+    int level;
+    if (topic_codec(client, topic, topic_length, &level) == DX_MQTT_CODEC_NONE)
+    {
+        return true;
+    }
+
+    if (client->receive_codec == NULL)
+    {
+        client->receive_codec = dx_mqttCodecCreate();
+        if (client->receive_codec == NULL)
+        {
+            return false;
+        }
+        atomic_fetch_add(&client->receive_allocations, 1);
+    }
+
+    size_t allocations = dx_mqttCodecAllocations(client->receive_codec);
+    bool decoded       = dx_mqttCodecDecompress(client->receive_codec, *payload, *payload_length, payload, payload_length);
+    atomic_fetch_add(&client->receive_allocations, dx_mqttCodecAllocations(client->receive_codec) - allocations);
+
+    return decoded;
+}
+
+/// <summary>
+/// Take an idle publish codec context, creating one when every context is in use
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <returns>Context for the caller alone until codec_release, NULL if none could be created</returns>
+static DX_MQTT_CODEC_CONTEXT *codec_acquire(DX_MQTT_CLIENT *client)
+{
+    DX_MQTT_CODEC_CONTEXT *context = NULL;
+
+    pthread_mutex_lock(&client->codec_lock);
+
+    if (client->publish_codec_count > 0)
+    {
+        context = client->publish_codecs[--client->publish_codec_count];
+    }
+    else
+    {
+        DX_MQTT_CODEC_CONTEXT **contexts = realloc(client->publish_codecs, (client->publish_codec_capacity + 1) * sizeof(*contexts));
+        if (contexts != NULL)
+        {
+            client->publish_codecs = contexts;
+            context                = dx_mqttCodecCreate();
+            if (context != NULL)
+            {
+                client->publish_codec_capacity++;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&client->codec_lock);
+
+    return context;
+}
+
+/// <summary>
+/// Return a context taken with codec_acquire
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="context">Context, can be NULL</param>
+static void codec_release(DX_MQTT_CLIENT *client, DX_MQTT_CODEC_CONTEXT *context)
+{
+    if (context == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&client->codec_lock);
+    client->publish_codecs[client->publish_codec_count++] = context;
+    pthread_mutex_unlock(&client->codec_lock);
+}
+
+/// <summary>
+/// Compress a message's payload when a compression filter matches its topic. The
+/// compressed payload lives in the context, valid until its next use.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="context">Context from codec_acquire, NULL if none could be had</param>
+/// <param name="message">Message to publish</param>
+/// <param name="compressed">Receives the message to send</param>
+/// <returns>False if the payload could not be compressed</returns>
+static bool compress_message(DX_MQTT_CLIENT *client, DX_MQTT_CODEC_CONTEXT *context, const DX_MQTT_MESSAGE *message, DX_MQTT_MESSAGE *compressed)
 {
-    if (_message_handler == NULL || published == NULL)
+    *compressed = *message;
+
+    int level;
+    DX_MQTT_CODEC codec = topic_codec(client, message->topic, strlen(message->topic), &level);
+    if (codec == DX_MQTT_CODEC_NONE)
+    {
+        return true;
+    }
+
+    if (context == NULL)
+    {
+        set_last_error(client, "Failed to allocate memory for compression");
+        stats_publish_failed(client, DX_MQTT_PUBLISH_FAILED_COMPRESSION, 1);
+        return false;
+    }
+
+    if (!dx_mqttCodecCompress(context, codec, level, message->payload, message->payload_length, &compressed->payload, &compressed->payload_length))
+    {
+        set_last_error(client, "Failed to compress payload for '%s'", message->topic);
+        stats_publish_failed(client, DX_MQTT_PUBLISH_FAILED_COMPRESSION, 1);
+        return false;
+    }
+
+    return true;
+}
+
+/// <summary>
+/// Open the daemon wakeup channel
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <returns>True on success</returns>
+static bool wakeup_open(DX_MQTT_CLIENT *client)
+{
+    if (client->wakeup_fd[0] != -1)
+    {
+        return true;
+    }
+
+#ifdef __linux__
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd == -1)
+    {
+        return false;
+    }
+    client->wakeup_fd[0] = fd;
+    client->wakeup_fd[1] = fd;
+#else
+    if (pipe(client->wakeup_fd) == -1)
+    {
+        client->wakeup_fd[0] = client->wakeup_fd[1] = -1;
+        return false;
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        int flags = fcntl(client->wakeup_fd[i], F_GETFL, 0);
+        fcntl(client->wakeup_fd[i], F_SETFL, flags | O_NONBLOCK);
+        fcntl(client->wakeup_fd[i], F_SETFD, FD_CLOEXEC);
+    }
+#endif
+
+    return true;
+}
+
+/// <summary>
+/// Close the daemon wakeup channel
+/// </summary>
+/// <param name="client">MQTT client</param>
+static void wakeup_close(DX_MQTT_CLIENT *client)
+{
+    if (client->wakeup_fd[0] != -1)
+    {
+        close(client->wakeup_fd[0]);
+    }
+    if (client->wakeup_fd[1] != -1 && client->wakeup_fd[1] != client->wakeup_fd[0])
+    {
+        close(client->wakeup_fd[1]);
+    }
+    client->wakeup_fd[0] = client->wakeup_fd[1] = -1;
+}
+
+/// <summary>
+/// Wake the daemon thread so it services the socket immediately
+/// </summary>
+/// <param name="client">MQTT client</param>
+static void wakeup_daemon(DX_MQTT_CLIENT *client)
+{
+    if (client->wakeup_fd[1] == -1)
+    {
+        return;
+    }
+
+#ifdef __linux__
+    uint64_t one = 1;
+    ssize_t rv   = write(client->wakeup_fd[1], &one, sizeof(one));
+#else
+    uint8_t one = 1;
+    ssize_t rv  = write(client->wakeup_fd[1], &one, sizeof(one));
+#endif
+    // EAGAIN means a wakeup is already pending, which is all we need
+    (void)rv;
+}
+
+/// <summary>
+/// Consume pending wakeups so the channel becomes quiet again
+/// </summary>
+/// <param name="client">MQTT client</param>
+static void wakeup_drain(DX_MQTT_CLIENT *client)
+{
+    uint8_t buffer[64];
+    while (read(client->wakeup_fd[0], buffer, sizeof(buffer)) > 0)
+    {
+    }
+}
+
+/// <summary>
+/// Check if MQTT-C has queued data that it will send on the next mqtt_sync
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <returns>True if a send is pending</returns>
+static bool has_pending_send(struct mqtt_client *client)
+{
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    bool pending = has_pending_send_locked(client);
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+
+    return pending;
+}
+
+/// <summary>
+/// Check if MQTT-C has queued data that it will send on the next mqtt_sync. Caller
+/// holds the MQTT-C mutex.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <returns>True if a send is pending</returns>
+static bool has_pending_send_locked(struct mqtt_client *client)
+{
+    bool pending       = false;
+    bool inflight_qos2 = false;
+
+    ssize_t length = mqtt_mq_length(&client->mq);
+    for (ssize_t i = 0; i < length && !pending; i++)
+    {
+        struct mqtt_queued_message *msg = mqtt_mq_get(&client->mq, i);
+        bool unsent                     = msg->state == MQTT_QUEUED_UNSENT;
+
+        // Mirror MQTT-C which holds back a QoS 2 publish while another one is in flight
+        if (msg->control_type == MQTT_CONTROL_PUBLISH && msg->state != MQTT_QUEUED_COMPLETE && ((msg->start[0] >> 1) & 0x03) == 2)
+        {
+            if (inflight_qos2)
+            {
+                unsent = false;
+            }
+            inflight_qos2 = true;
+        }
+
+        pending = unsent;
+    }
+
+    return pending;
+}
+
+/// <summary>
+/// Wait until no publish reservation pins the send queue. Caller holds the MQTT-C mutex.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <returns>False if the calling thread holds the pinned reservation itself</returns>
+static bool send_queue_wait_locked(DX_MQTT_CLIENT *client)
+{
+    while (client->reservation.pinned)
+    {
+        if (pthread_equal(client->reservation.owner, pthread_self()))
+        {
+            return false;
+        }
+        pthread_cond_wait(&client->reservation_cond, &client->client.mutex);
+    }
+
+    return true;
+}
+
+/// <summary>
+/// Announce an MQTT-C call that may compact the send queue, so no reservation pins it
+/// until send_queue_leave
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="wait">Wait for a pinned reservation on another thread instead of failing</param>
+/// <returns>True if the call may go ahead</returns>
+static bool send_queue_enter(DX_MQTT_CLIENT *client, bool wait)
+{
+    MQTT_PAL_MUTEX_LOCK(&client->client.mutex);
+    bool entered = wait ? send_queue_wait_locked(client) : !client->reservation.pinned;
+    if (entered)
+    {
+        client->send_queue_users++;
+    }
+    MQTT_PAL_MUTEX_UNLOCK(&client->client.mutex);
+
+    return entered;
+}
+
+/// <summary>
+/// End a call started with send_queue_enter
+/// </summary>
+/// <param name="client">MQTT client</param>
+static void send_queue_leave(DX_MQTT_CLIENT *client)
+{
+    MQTT_PAL_MUTEX_LOCK(&client->client.mutex);
+    client->send_queue_users--;
+    MQTT_PAL_MUTEX_UNLOCK(&client->client.mutex);
+}
+
+/// <summary>
+/// Check if a publish reservation pins the send queue, the driver stands aside until it ends
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <returns>True while pinned</returns>
+static bool send_queue_pinned(DX_MQTT_CLIENT *client)
+{
+    MQTT_PAL_MUTEX_LOCK(&client->client.mutex);
+    bool pinned = client->reservation.pinned;
+    MQTT_PAL_MUTEX_UNLOCK(&client->client.mutex);
+
+    return pinned;
+}
+
+/// <summary>
+/// Work out how long the daemon may block before MQTT-C has timed work to do,
+/// which is the earlier of the keepalive ping and the next ack resend
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <returns>Poll timeout in milliseconds</returns>
+static int next_poll_timeout_ms(struct mqtt_client *client)
+{
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+
+    // MQTT-C acts once MQTT_PAL_TIME() is strictly greater than these times
+    mqtt_pal_time_t deadline = client->time_of_last_send + (mqtt_pal_time_t)client->keep_alive + 1;
+
+    ssize_t length = mqtt_mq_length(&client->mq);
+    for (ssize_t i = 0; i < length; i++)
+    {
+        struct mqtt_queued_message *msg = mqtt_mq_get(&client->mq, i);
+        if (msg->state == MQTT_QUEUED_AWAITING_ACK)
+        {
+            mqtt_pal_time_t resend = msg->time_sent + (mqtt_pal_time_t)client->response_timeout + 1;
+            if (resend < deadline)
+            {
+                deadline = resend;
+            }
+        }
+    }
+
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    int64_t remaining_ms = (int64_t)deadline * 1000 - ((int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000);
+    if (remaining_ms < 0)
+    {
+        return 0;
+    }
+
+    // Round up so the wakeup lands after the second boundary MQTT-C waits for
+    return remaining_ms + 1 > INT32_MAX ? INT32_MAX : (int)(remaining_ms + 1);
+}
+
+/// <summary>
+/// MQTT client refresher thread - blocks until the socket is ready, a publish kicks
+/// the wakeup channel, or a keepalive/resend deadline is due, then runs mqtt_sync
+/// </summary>
+/// <param name="arg">DX_MQTT_CLIENT pointer</param>
+/// <returns>NULL</returns>
+static void *client_refresher(void *arg)
+{
+    DX_MQTT_CLIENT *client = arg;
+
+    dx_Log_Debug("DX MQTT: Background processing thread started\n");
+
+    while (client->daemon_running)
+    {
+        struct pollfd fds[2] = {{.fd = client->wakeup_fd[0], .events = POLLIN}};
+        nfds_t nfds          = 1;
+        int timeout_ms       = -1;
+
+        // A pinned reservation keeps mqtt_sync off the queue, commit or abort wakes the thread
+        if (client->is_connected && client->sockfd != -1 && !send_queue_pinned(client))
+        {
+            fds[1].fd     = client->sockfd;
+            fds[1].events = POLLIN;
+            if (has_pending_send(&client->client))
+            {
+                fds[1].events |= POLLOUT;
+            }
+            nfds       = 2;
+            timeout_ms = rate_poll_timeout_ms(client, conflation_poll_timeout_ms(client, outbox_poll_timeout_ms(client, next_poll_timeout_ms(&client->client))));
+        }
+        else if (client->reconnect_pending)
+        {
+            int64_t remaining_ms = client->reconnect_at_ms - dx_getNowMilliseconds();
+            timeout_ms           = remaining_ms < 0 ? 0 : (int)remaining_ms;
+        }
+
+        if (poll(fds, nfds, timeout_ms) == -1 && errno != EINTR)
+        {
+            set_last_error(client, "MQTT poll failed: %s", strerror(errno));
+            usleep(100000U);
+            continue;
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            wakeup_drain(client);
+        }
+
+        if (client->daemon_running)
+        {
+            if (client->reconnect_pending && dx_getNowMilliseconds() >= client->reconnect_at_ms)
+            {
+                reconnect_now(client);
+            }
+            service_connection(client);
+        }
+    }
+
+    dx_Log_Debug("DX MQTT: Background processing thread stopped\n");
+    return NULL;
+}
+
+/// <summary>
+/// Run one mqtt_sync pass and record any connection failure. Called from the
+/// daemon thread or, in event loop mode, from the loop thread.
+/// </summary>
+/// <param name="client">MQTT client</param>
+static void service_connection(DX_MQTT_CLIENT *client)
+{
+    if (!client->is_connected)
+    {
+        return;
+    }
+
+    // Move publishes queued by other threads into MQTT-C ahead of the send
+    bool drained = drain_publish_queue(client);
+
+    // Publishes held by a rate limit that may go now, ahead of anything published later
+    release_rate_held(client);
+
+    // Then any backlog kept while the connection was down
+    bool replayed = replay_outbox(client);
+
+    // And the latest value of conflated topics that are due
+    flush_conflated(client);
+
+    // mqtt_sync may compact the send queue, which waits for a pinned reservation to end
+    if (!send_queue_enter(client, false))
+    {
+        return;
+    }
+
+    // Process MQTT operations (send/receive messages, handle keepalive, etc.)
+    int result = mqtt_sync(&client->client);
+
+    // An inbound packet larger than the receive buffer is recoverable if the buffer may grow
+    while (result == MQTT_ERROR_RECV_BUFFER_TOO_SMALL)
+    {
+        MQTT_PAL_MUTEX_LOCK(&client->client.mutex);
+        bool grown = grow_recv_buffer_locked(client);
+        if (grown)
+        {
+            client->client.error = MQTT_OK;
+        }
+        MQTT_PAL_MUTEX_UNLOCK(&client->client.mutex);
+
+        if (!grown)
+        {
+            break;
+        }
+        result = mqtt_sync(&client->client);
+    }
+
+    send_queue_leave(client);
+
+    if (result != MQTT_OK)
+    {
+        set_last_error(client, "MQTT sync failed: %s", mqtt_error_str(client->client.error));
+        connection_lost(client);
+    }
+
+    // Check for any client errors that might have occurred
+    if (client->client.error != MQTT_OK)
+    {
+        set_last_error(client, "MQTT client error: %s", mqtt_error_str(client->client.error));
+        dx_Log_Debug("DX MQTT: Client error detected\n");
+        connection_lost(client);
+    }
+
+    // Report acknowledged publishes and let anything held back by the window move
+    inflight_collect(client);
+
+    if (client->is_connected)
+    {
+        // Once the send queue has been written out, bulk may have its next budget's worth
+        refill_bulk_budget(client);
+        stats_ping(client);
+    }
+
+#ifdef MQTT_USE_BIO
+    // Records OpenSSL already decrypted will not make the socket poll readable
+    if (client->is_connected && dx_mqttTlsPending(client->transport) > 0)
+    {
+        request_service(client);
+    }
+#endif
+
+    // Records that did not fit before the send may fit now, come straight back for them
+    if (drained && client->is_connected && publish_queue_pending(client))
+    {
+        signal_publish_queue(client);
+    }
+
+    // Same for an outbox replay that stopped at its burst limit
+    if (replayed && client->is_connected)
+    {
+        signal_publish_queue(client);
+    }
+}
+
+/// <summary>
+/// Microseconds on the monotonic clock, used to pace outbox replay
+/// </summary>
+/// <returns>Current time</returns>
+static int64_t monotonic_us(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/// <summary>
+/// True if a publish must go to the outbox: the connection is down, or older
+/// messages are still waiting there and sending directly would reorder them.
+/// High priority publishes go ahead of a backlog while connected.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="priority">Priority of the publish</param>
+/// <returns>True to store in the outbox</returns>
+static bool outbox_should_store(DX_MQTT_CLIENT *client, DX_MQTT_PRIORITY priority)
+{
+    if (client->outbox == NULL)
+    {
+        return false;
+    }
+
+    if (!dx_mqttClientIsConnected(client))
+    {
+        return true;
+    }
+
+    return priority != DX_MQTT_PRIORITY_HIGH && dx_mqttOutboxCount(client->outbox) > 0;
+}
+
+/// <summary>
+/// Append a publish to the outbox
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="message">Message to store</param>
+/// <returns>True if stored</returns>
+static bool outbox_store(DX_MQTT_CLIENT *client, const DX_MQTT_MESSAGE *message)
+{
+    if (!dx_mqttOutboxAppend(client->outbox, message))
+    {
+        set_last_error(client, "MQTT outbox full - message to '%s' dropped", message->topic);
+        stats_publish_failed(client, DX_MQTT_PUBLISH_FAILED_OUTBOX_FULL, 1);
+        return false;
+    }
+
+    // Connected with a backlog, make sure the replay picks this up without waiting for a deadline
+    if (client->is_connected)
+    {
+        request_service(client);
+    }
+
+    return true;
+}
+
+/// <summary>
+/// Move backlog from the outbox into MQTT-C, oldest first, paced by outbox_replay_rate.
+/// Runs on the connection's thread or loop.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <returns>True if the burst limit stopped the replay with messages still ready to go</returns>
+static bool replay_outbox(DX_MQTT_CLIENT *client)
+{
+    if (client->outbox == NULL || !client->is_connected)
+    {
+        return false;
+    }
+
+    uint32_t rate       = client->config.outbox_replay_rate;
+    int64_t interval_us = rate > 0 ? 1000000 / rate : 0;
+    int64_t now_us      = monotonic_us();
+    size_t replayed     = 0;
+    DX_MQTT_MESSAGE message;
+
+    // Pace from now after an idle spell instead of bursting to catch up
+    if (client->outbox_next_replay_us < now_us - interval_us)
+    {
+        client->outbox_next_replay_us = now_us;
+    }
+
+    while (replayed < DX_MQTT_OUTBOX_REPLAY_BURST && client->outbox_next_replay_us <= now_us)
+    {
+        DX_MQTT_OUTBOX_PEEK_RESULT peeked = dx_mqttOutboxPeek(client->outbox, &message);
+        if (peeked == DX_MQTT_OUTBOX_EMPTY)
+        {
+            break;
+        }
+
+        // The message stays at the head of the outbox, try again on a later pass
+        if (peeked == DX_MQTT_OUTBOX_NO_MEMORY)
+        {
+            set_last_error(client, "MQTT outbox replay failed: out of memory");
+            stats_add(&client->stats.outbox_read_failures, 1);
+            client->outbox_next_replay_us = now_us + (interval_us > 0 ? interval_us : 10000);
+            return false;
+        }
+
+        // Replay is paced by the rate limits like any other publish
+        uint8_t flags       = publish_flags_for(&message);
+        size_t topic_length = strlen(message.topic);
+        size_t bytes        = publish_packet_size(topic_length, message.payload_length, flags);
+        int64_t wait_us     = rate_acquire(client, message.topic, topic_length, bytes, now_us);
+
+        if (wait_us > 0)
+        {
+            client->outbox_next_replay_us = now_us + wait_us;
+            return false;
+        }
+
+        // A full send buffer leaves the message where it is for a later pass
+        if (enqueue_publish(client, message.topic, message.payload, message.payload_length, flags, DX_MQTT_PRIORITY_NORMAL) != MQTT_OK)
+        {
+            rate_release(client, message.topic, topic_length, bytes);
+            client->outbox_next_replay_us = now_us + (interval_us > 0 ? interval_us : 10000);
+            return false;
+        }
+
+        dx_mqttOutboxPop(client->outbox);
+        client->outbox_next_replay_us += interval_us;
+        replayed++;
+    }
+
+    return replayed == DX_MQTT_OUTBOX_REPLAY_BURST && rate == 0;
+}
+
+/// <summary>
+/// Shorten a poll timeout so the driver wakes when the next outbox message is due
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="timeout_ms">Timeout from the MQTT-C deadlines</param>
+/// <returns>Timeout in milliseconds</returns>
+static int outbox_poll_timeout_ms(DX_MQTT_CLIENT *client, int timeout_ms)
+{
+    if (client->outbox == NULL || dx_mqttOutboxCount(client->outbox) == 0)
+    {
+        return timeout_ms;
+    }
+
+    int64_t remaining_us = client->outbox_next_replay_us - monotonic_us();
+    int replay_ms        = remaining_us <= 0 ? 0 : (int)((remaining_us + 999) / 1000);
+
+    return timeout_ms < 0 || replay_ms < timeout_ms ? replay_ms : timeout_ms;
+}
+
+/// <summary>
+/// Trie visitor keeping the most recently set conflation filter among the matches
+/// </summary>
+/// <param name="value">MQTT_CONFLATION of a matching filter</param>
+/// <param name="context">MQTT_CONFLATION receiving the winner</param>
+static void pick_conflation(void *value, void *context)
+{
+    const MQTT_CONFLATION *candidate = value;
+    MQTT_CONFLATION *best            = context;
+
+    if (candidate->sequence > best->sequence)
+    {
+        *best = *candidate;
+    }
+}
+
+/// <summary>
+/// Find the conflation interval configured for a topic
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="topic">Topic name</param>
+/// <param name="interval_ms">Receives the minimum time between sends</param>
+/// <returns>True if a conflation filter matches the topic</returns>
+static bool topic_conflation(DX_MQTT_CLIENT *client, const char *topic, uint32_t *interval_ms)
+{
+    MQTT_CONFLATION best = {0};
+
+    if (atomic_load(&client->conflation_filter_count) > 0)
+    {
+        pthread_mutex_lock(&client->subscriptions_lock);
+        dx_mqttTopicTrieMatch(client->conflation_filters, topic, strlen(topic), pick_conflation, &best);
+        pthread_mutex_unlock(&client->subscriptions_lock);
+    }
+
+    *interval_ms = best.interval_ms;
+    return best.sequence != 0;
+}
+
+/// <summary>
+/// Find the latest value slot of a conflated topic, creating it on first use. Caller
+/// holds conflation_lock.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="topic">Topic name</param>
+/// <returns>Slot, or NULL if it could not be allocated</returns>
+static MQTT_CONFLATED *conflated_slot_locked(DX_MQTT_CLIENT *client, const char *topic)
+{
+    MQTT_CONFLATED *slot = client->conflated_topics != NULL ? dx_mqttTopicTrieFind(client->conflated_topics, topic) : NULL;
+    if (slot != NULL)
+    {
+        return slot;
+    }
+
+    if (client->conflated_topics == NULL && (client->conflated_topics = dx_mqttTopicTrieCreate()) == NULL)
+    {
+        return NULL;
+    }
+
+    if (client->conflated_count == client->conflated_capacity)
+    {
+        size_t capacity        = client->conflated_capacity > 0 ? client->conflated_capacity * 2 : 8;
+        MQTT_CONFLATED **slots = realloc(client->conflated, capacity * sizeof(MQTT_CONFLATED *));
+        if (slots == NULL)
+        {
+            return NULL;
+        }
+        client->conflated          = slots;
+        client->conflated_capacity = capacity;
+    }
+
+    slot = calloc(1, sizeof(MQTT_CONFLATED));
+    if (slot == NULL || (slot->topic = strdup(topic)) == NULL || !dx_mqttTopicTrieInsert(client->conflated_topics, topic, slot, NULL))
+    {
+        if (slot != NULL)
+        {
+            free(slot->topic);
+        }
+        free(slot);
+        return NULL;
+    }
+
+    client->conflated[client->conflated_count++] = slot;
+    return slot;
+}
+
+/// <summary>
+/// Keep a publish as the latest value of its conflated topic, replacing any value
+/// still waiting to be sent. Safe to call from any thread.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="message">Message to publish</param>
+/// <param name="interval_ms">Minimum time between sends on the topic</param>
+/// <returns>True if the value was stored</returns>
+static bool conflate_message(DX_MQTT_CLIENT *client, const DX_MQTT_MESSAGE *message, uint32_t interval_ms)
+{
+    pthread_mutex_lock(&client->conflation_lock);
+
+    MQTT_CONFLATED *slot = conflated_slot_locked(client, message->topic);
+    if (slot != NULL && slot->payload_capacity < message->payload_length)
+    {
+        uint8_t *payload = realloc(slot->payload, message->payload_length);
+        if (payload != NULL)
+        {
+            slot->payload          = payload;
+            slot->payload_capacity = message->payload_length;
+        }
+    }
+
+    if (slot == NULL || slot->payload_capacity < message->payload_length)
+    {
+        pthread_mutex_unlock(&client->conflation_lock);
+        set_last_error(client, "Failed to allocate memory for conflated topic '%s'", message->topic);
+        return false;
+    }
+
+    if (slot->pending)
+    {
+        stats_add(&client->stats.messages_conflated, 1);
+    }
+
+    if (message->payload_length > 0)
+    {
+        memcpy(slot->payload, message->payload, message->payload_length);
+    }
+    slot->payload_length = message->payload_length;
+    slot->qos            = message->qos;
+    slot->retain         = message->retain;
+    slot->priority       = message->priority;
+    slot->interval_ms    = interval_ms;
+
+    // The driver may be sleeping on a later deadline, wake it when this value is due sooner
+    bool wake = false;
+    if (!slot->pending)
+    {
+        int64_t due_us  = slot->next_send_us > 0 ? slot->next_send_us : 1;
+        int64_t next_us = atomic_load(&client->conflation_next_us);
+        if (next_us == 0 || due_us < next_us)
+        {
+            atomic_store(&client->conflation_next_us, due_us);
+            wake = true;
+        }
+        slot->pending = true;
+    }
+
+    pthread_mutex_unlock(&client->conflation_lock);
+
+    if (wake)
+    {
+        signal_publish_queue(client);
+    }
+
+    return true;
+}
+
+/// <summary>
+/// Move the latest value of every conflated topic whose interval has passed into
+/// MQTT-C. A value that does not fit stays pending, still replaced by newer samples,
+/// and is retried on the next pass once the link drains. Runs on the thread that
+/// drives the connection, ahead of mqtt_sync.
+/// </summary>
+/// <param name="client">MQTT client</param>
+static void flush_conflated(DX_MQTT_CLIENT *client)
+{
+    if (atomic_load(&client->conflation_next_us) == 0)
+    {
+        return;
+    }
+
+    struct mqtt_client *mqtt     = &client->client;
+    bool compress                = atomic_load(&client->compression_filter_count) > 0;
+    DX_MQTT_CODEC_CONTEXT *codec = compress ? codec_acquire(client) : NULL;
+
+    // Lock order matches the publish paths: MQTT-C, then the conflated values
+    MQTT_PAL_MUTEX_LOCK(&mqtt->mutex);
+    pthread_mutex_lock(&client->conflation_lock);
+
+    int64_t now_us  = monotonic_us();
+    int64_t next_us = 0;
+    bool blocked    = false;
+
+    for (size_t i = 0; i < client->conflated_count; i++)
+    {
+        MQTT_CONFLATED *slot = client->conflated[i];
+        if (!slot->pending)
+        {
+            continue;
+        }
+
+        if (!blocked && slot->next_send_us <= now_us)
+        {
+            DX_MQTT_MESSAGE message = {
+                .topic          = slot->topic,
+                .payload        = slot->payload,
+                .payload_length = slot->payload_length,
+                .qos            = slot->qos,
+                .retain         = slot->retain,
+                .priority       = slot->priority,
+            };
+            DX_MQTT_MESSAGE compressed = message;
+
+            if (compress && !compress_message(client, codec, &message, &compressed))
+            {
+                slot->pending = false;
+                continue;
+            }
+
+            // A value over its rate limit stays pending until the limit allows it
+            uint8_t flags   = publish_flags_for(&compressed);
+            size_t bytes    = publish_packet_size(strlen(compressed.topic), compressed.payload_length, flags);
+            int64_t wait_us = rate_acquire(client, slot->topic, strlen(slot->topic), bytes, now_us);
+
+            if (wait_us == 0 &&
+                enqueue_publish_locked(client, compressed.topic, compressed.payload, compressed.payload_length, flags, slot->priority) == MQTT_OK)
+            {
+                slot->pending      = false;
+                slot->next_send_us = now_us + (int64_t)slot->interval_ms * 1000;
+                continue;
+            }
+
+            if (wait_us > 0)
+            {
+                slot->next_send_us = now_us + wait_us;
+            }
+            else
+            {
+                // The rest wait for the send buffer or in-flight window to drain
+                rate_release(client, slot->topic, strlen(slot->topic), bytes);
+                blocked = true;
+            }
+        }
+
+        int64_t due_us = slot->next_send_us > 0 ? slot->next_send_us : 1;
+        if (next_us == 0 || due_us < next_us)
+        {
+            next_us = due_us;
+        }
+    }
+
+    atomic_store(&client->conflation_next_us, next_us);
+    client->conflation_blocked = blocked;
+
+    pthread_mutex_unlock(&client->conflation_lock);
+    MQTT_PAL_MUTEX_UNLOCK(&mqtt->mutex);
+    codec_release(client, codec);
+}
+
+/// <summary>
+/// Shorten a poll timeout so the driver wakes when the next conflated value is due.
+/// Values held back by a full buffer are left to the writable and ack wakeups.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="timeout_ms">Timeout from the other deadlines</param>
+/// <returns>Timeout in milliseconds</returns>
+static int conflation_poll_timeout_ms(DX_MQTT_CLIENT *client, int timeout_ms)
+{
+    int64_t next_us = atomic_load(&client->conflation_next_us);
+    if (next_us == 0 || client->conflation_blocked)
+    {
+        return timeout_ms;
+    }
+
+    int64_t remaining_us = next_us - monotonic_us();
+    int due_ms           = remaining_us <= 0 ? 0 : (int)((remaining_us + 999) / 1000);
+
+    return timeout_ms < 0 || due_ms < timeout_ms ? due_ms : timeout_ms;
+}
+
+/// <summary>
+/// Free the value slots of topics no conflation filter matches any more, keeping those
+/// with a value still to send
+/// </summary>
+/// <param name="client">MQTT client</param>
+static void prune_conflated(DX_MQTT_CLIENT *client)
+{
+    pthread_mutex_lock(&client->conflation_lock);
+
+    size_t kept = 0;
+    for (size_t i = 0; i < client->conflated_count; i++)
+    {
+        MQTT_CONFLATED *slot = client->conflated[i];
+        uint32_t interval_ms;
+
+        if (slot->pending || topic_conflation(client, slot->topic, &interval_ms))
+        {
+            client->conflated[kept++] = slot;
+            continue;
+        }
+
+        dx_mqttTopicTrieRemove(client->conflated_topics, slot->topic);
+        free_conflated(slot);
+    }
+    client->conflated_count = kept;
+
+    pthread_mutex_unlock(&client->conflation_lock);
+}
+
+/// <summary>
+/// Free a conflated value slot
+/// </summary>
+/// <param name="value">MQTT_CONFLATED</param>
+static void free_conflated(void *value)
+{
+    MQTT_CONFLATED *slot = value;
+    if (slot != NULL)
+    {
+        free(slot->topic);
+        free(slot->payload);
+        free(slot);
+    }
+}
+
+/// <summary>
+/// Trie visitor keeping the most recently set rate limit among the matches
+/// </summary>
+/// <param name="value">MQTT_RATE_LIMITER of a matching filter</param>
+/// <param name="context">MQTT_RATE_LIMITER pointer receiving the winner</param>
+static void pick_rate_limiter(void *value, void *context)
+{
+    MQTT_RATE_LIMITER *candidate = value;
+    MQTT_RATE_LIMITER **best     = context;
+
+    if (*best == NULL || candidate->sequence > (*best)->sequence)
+    {
+        *best = candidate;
+    }
+}
+
+// Stripe of rate_readers the calling thread counts itself in, 0 until its first read
+static _Thread_local unsigned rate_reader_stripe;
+static atomic_uint rate_reader_threads;
+
+/// <summary>
+/// Enter a reader section on the current rate snapshot. The snapshot and the limiters it
+/// points at stay valid until rate_read_unlock. Never blocks.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="snapshot">Receives the snapshot, NULL when nothing is limited</param>
+/// <returns>Reader count to pass to rate_read_unlock</returns>
+static atomic_size_t *rate_read_lock(DX_MQTT_CLIENT *client, MQTT_RATE_SNAPSHOT **snapshot)
+{
+    if (rate_reader_stripe == 0)
+    {
+        rate_reader_stripe = atomic_fetch_add(&rate_reader_threads, 1) % DX_MQTT_RATE_READER_STRIPES + 1;
+    }
+
+    MQTT_RATE_READERS *readers = &client->rate_readers[rate_reader_stripe - 1];
+
+    // A setter that flipped the epoch in between may already be waiting on the other count
+    for (;;)
+    {
+        unsigned epoch        = atomic_load(&client->rate_epoch);
+        atomic_size_t *active = &readers->active[epoch & 1];
+
+        atomic_fetch_add(active, 1);
+        if (atomic_load(&client->rate_epoch) == epoch)
+        {
+            *snapshot = atomic_load(&client->rate_snapshot);
+            return active;
+        }
+        atomic_fetch_sub(active, 1);
+    }
+}
+
+/// <summary>
+/// Leave a reader section entered with rate_read_lock
+/// </summary>
+/// <param name="active">Reader count returned by rate_read_lock</param>
+static void rate_read_unlock(atomic_size_t *active)
+{
+    atomic_fetch_sub(active, 1);
+}
+
+/// <summary>
+/// Wait until no publisher can still be reading a snapshot replaced before the call.
+/// Caller holds rate_lock.
+/// </summary>
+/// <param name="client">MQTT client</param>
+static void rate_synchronize(DX_MQTT_CLIENT *client)
+{
+    unsigned parity = atomic_fetch_add(&client->rate_epoch, 1) & 1;
+
+    for (;;)
+    {
+        size_t active = 0;
+        for (size_t i = 0; i < DX_MQTT_RATE_READER_STRIPES; i++)
+        {
+            active += atomic_load(&client->rate_readers[i].active[parity]);
+        }
+
+        if (active == 0)
+        {
+            return;
+        }
+
+        // Reader sections are a few atomic operations long, never waiting on anything
+        sched_yield();
+    }
+}
+
+/// <summary>
+/// Hash a topic name for the rate snapshot cache, FNV-1a
+/// </summary>
+/// <param name="topic">Topic name, need not be NUL terminated</param>
+/// <param name="topic_length">Topic length</param>
+/// <returns>Hash</returns>
+static uint64_t rate_topic_hash(const char *topic, size_t topic_length)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < topic_length; i++)
+    {
+        hash = (hash ^ (uint8_t)topic[i]) * 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+/// <summary>
+/// Find the rate limit configured for a topic. A topic seen before is answered from the
+/// snapshot's cache, a new one is matched against the filters and remembered when its
+/// cache slot is still free. Lock-free, caller is inside a reader section.
+/// </summary>
+/// <param name="snapshot">Current rate snapshot</param>
+/// <param name="topic">Topic name, need not be NUL terminated</param>
+/// <param name="topic_length">Topic length</param>
+/// <returns>Limiter of the matching filter set last, or NULL</returns>
+static MQTT_RATE_LIMITER *topic_rate_limiter(MQTT_RATE_SNAPSHOT *snapshot, const char *topic, size_t topic_length)
+{
+    if (snapshot->filters == NULL)
+    {
+        return NULL;
+    }
+
+    uint64_t hash                      = rate_topic_hash(topic, topic_length);
+    _Atomic(MQTT_RATE_CACHED *) *entry = &snapshot->cache[hash & (DX_MQTT_RATE_CACHE_SLOTS - 1)];
+    MQTT_RATE_CACHED *cached           = atomic_load_explicit(entry, memory_order_acquire);
+
+    if (cached != NULL && cached->hash == hash && cached->topic_length == topic_length && memcmp(cached->topic, topic, topic_length) == 0)
+    {
+        return cached->limiter;
+    }
+
+    MQTT_RATE_LIMITER *limiter = NULL;
+    dx_mqttTopicTrieMatch(snapshot->filters, topic, topic_length, pick_rate_limiter, &limiter);
+
+    // Slots are filled once and never replaced, so a reader never sees an entry freed
+    if (cached == NULL && (cached = malloc(sizeof(MQTT_RATE_CACHED) + topic_length)) != NULL)
+    {
+        cached->hash         = hash;
+        cached->topic_length = topic_length;
+        cached->limiter      = limiter;
+        memcpy(cached->topic, topic, topic_length);
+
+        MQTT_RATE_CACHED *empty = NULL;
+        if (!atomic_compare_exchange_strong_explicit(entry, &empty, cached, memory_order_release, memory_order_relaxed))
+        {
+            free(cached);
+        }
+    }
+
+    return limiter;
+}
+
+/// <summary>
+/// Take a publish from the topic limit and then the connection limit, giving the topic
+/// tokens back when the connection refuses. Lock-free.
+/// </summary>
+/// <param name="connection">Connection limiter, NULL if the connection has none</param>
+/// <param name="topic">Topic limiter, NULL if the topic has none</param>
+/// <param name="bytes">Encoded packet size</param>
+/// <param name="now_us">Current monotonic time</param>
+/// <param name="limited">Receives the limiter that refused</param>
+/// <returns>0 if taken, otherwise microseconds until the publish would be allowed</returns>
+static int64_t rate_take(MQTT_RATE_LIMITER *connection, MQTT_RATE_LIMITER *topic, size_t bytes, int64_t now_us, MQTT_RATE_LIMITER **limited)
+{
+    int64_t now_ns  = now_us * 1000;
+    int64_t wait_ns = 0;
+
+    if (topic != NULL && (wait_ns = dx_mqttRateTake(topic->rate, bytes, now_ns)) > 0)
+    {
+        *limited = topic;
+    }
+    else if (connection != NULL && (wait_ns = dx_mqttRateTake(connection->rate, bytes, now_ns)) > 0)
+    {
+        if (topic != NULL)
+        {
+            dx_mqttRateRefund(topic->rate, bytes);
+        }
+        *limited = connection;
+    }
+
+    return wait_ns > 0 ? (wait_ns + 999) / 1000 : 0;
+}
+
+/// <summary>
+/// Give back tokens taken by rate_take for a publish that was not sent after all
+/// </summary>
+/// <param name="connection">Connection limiter passed to rate_take</param>
+/// <param name="topic">Topic limiter passed to rate_take</param>
+/// <param name="bytes">Encoded packet size</param>
+static void rate_refund(MQTT_RATE_LIMITER *connection, MQTT_RATE_LIMITER *topic, size_t bytes)
+{
+    if (topic != NULL)
+    {
+        dx_mqttRateRefund(topic->rate, bytes);
+    }
+    if (connection != NULL)
+    {
+        dx_mqttRateRefund(connection->rate, bytes);
+    }
+}
+
+/// <summary>
+/// Take a publish from the limits currently set for its topic, for the outbox replay
+/// and conflated values, which wait rather than hold or drop
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="topic">Topic name, need not be NUL terminated</param>
+/// <param name="topic_length">Topic length</param>
+/// <param name="bytes">Encoded packet size</param>
+/// <param name="now_us">Current monotonic time</param>
+/// <returns>0 if taken, otherwise microseconds until the publish would be allowed</returns>
+static int64_t rate_acquire(DX_MQTT_CLIENT *client, const char *topic, size_t topic_length, size_t bytes, int64_t now_us)
+{
+    if (atomic_load(&client->rate_snapshot) == NULL)
+    {
+        return 0;
+    }
+
+    MQTT_RATE_SNAPSHOT *snapshot;
+    atomic_size_t *reader = rate_read_lock(client, &snapshot);
+    int64_t wait_us       = 0;
+
+    if (snapshot != NULL)
+    {
+        MQTT_RATE_LIMITER *limited;
+        wait_us = rate_take(snapshot->connection, topic_rate_limiter(snapshot, topic, topic_length), bytes, now_us, &limited);
+    }
+
+    rate_read_unlock(reader);
+
+    return wait_us;
+}
+
+/// <summary>
+/// Give back the tokens of a publish rate_admit or rate_acquire let through that could
+/// not be queued. Limits replaced in between get the tokens instead.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="topic">Topic name, need not be NUL terminated</param>
+/// <param name="topic_length">Topic length</param>
+/// <param name="bytes">Encoded packet size</param>
+static void rate_release(DX_MQTT_CLIENT *client, const char *topic, size_t topic_length, size_t bytes)
+{
+    if (atomic_load(&client->rate_snapshot) == NULL)
+    {
+        return;
+    }
+
+    MQTT_RATE_SNAPSHOT *snapshot;
+    atomic_size_t *reader = rate_read_lock(client, &snapshot);
+
+    if (snapshot != NULL)
+    {
+        rate_refund(snapshot->connection, topic_rate_limiter(snapshot, topic, topic_length), bytes);
+    }
+
+    rate_read_unlock(reader);
+}
+
+/// <summary>
+/// Copy a publish onto the end of a limiter's queue. Lock-free, only a publish too large
+/// for a ring slot allocates.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="limiter">Limiter whose queue holds the publish</param>
+/// <param name="message">Message to hold, its topic need not be NUL terminated</param>
+/// <param name="topic_length">Topic length</param>
+/// <param name="due_us">Earliest time the publish could be allowed</param>
+/// <returns>MQTT_RATE_QUEUED, or MQTT_RATE_REJECTED when the queue is full</returns>
+static MQTT_RATE_DECISION rate_hold(
+    DX_MQTT_CLIENT *client, MQTT_RATE_LIMITER *limiter, const DX_MQTT_MESSAGE *message, size_t topic_length, int64_t due_us)
+{
+    size_t length        = topic_length + 1 + message->payload_length;
+    char *spill          = NULL;
+    MQTT_RATE_HELD *held = NULL;
+
+    if (sizeof(MQTT_RATE_HELD) + length > dx_mqttRingSlotSize(limiter->held))
+    {
+        spill = malloc(length);
+    }
+
+    if (atomic_fetch_add(&limiter->held_count, 1) < limiter->queue_length &&
+        (spill != NULL || sizeof(MQTT_RATE_HELD) + length <= dx_mqttRingSlotSize(limiter->held)))
+    {
+        held = dx_mqttRingClaim(limiter->held);
+    }
+
+    if (held == NULL)
+    {
+        atomic_fetch_sub(&limiter->held_count, 1);
+        free(spill);
+        set_last_error(client, "MQTT rate limit queue full - message to '%.*s' rejected", (int)topic_length, message->topic);
+        stats_publish_failed(client, DX_MQTT_PUBLISH_FAILED_RATE_LIMITED, 1);
+        return MQTT_RATE_REJECTED;
+    }
+
+    char *topic = spill != NULL ? spill : (char *)(held + 1);
+    memcpy(topic, message->topic, topic_length);
+    topic[topic_length] = '\0';
+    if (message->payload_length > 0)
+    {
+        memcpy(topic + topic_length + 1, message->payload, message->payload_length);
+    }
+
+    held->topic_length   = topic_length;
+    held->payload_length = message->payload_length;
+    held->qos            = message->qos;
+    held->retain         = message->retain;
+    held->priority       = message->priority;
+    held->spill          = spill;
+
+    atomic_fetch_add(&client->rate_held_count, 1);
+    dx_mqttRingPublish(limiter->held, held, sizeof(MQTT_RATE_HELD) + (spill != NULL ? 0 : length));
+    stats_add(&client->stats.messages_rate_queued, 1);
+
+    // The driver may be sleeping on a later deadline, wake it when this one is sooner
+    int64_t next_us = atomic_load(&client->rate_next_us);
+    while ((next_us == 0 || due_us < next_us) && !atomic_compare_exchange_weak(&client->rate_next_us, &next_us, due_us))
+    {
+    }
+
+    if (next_us == 0 || due_us < next_us)
+    {
+        signal_publish_queue(client);
+    }
+
+    return MQTT_RATE_QUEUED;
+}
+
+/// <summary>
+/// Check a publish against the limits of a rate snapshot
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="snapshot">Current rate snapshot</param>
+/// <param name="message">Message to publish, its topic need not be NUL terminated</param>
+/// <param name="topic_length">Topic length</param>
+/// <returns>Whether to send the publish now, or what the limit did with it</returns>
+static MQTT_RATE_DECISION rate_check(DX_MQTT_CLIENT *client, MQTT_RATE_SNAPSHOT *snapshot, const DX_MQTT_MESSAGE *message, size_t topic_length)
+{
+    MQTT_RATE_LIMITER *connection = snapshot->connection;
+    MQTT_RATE_LIMITER *topic      = topic_rate_limiter(snapshot, message->topic, topic_length);
+
+    if (connection == NULL && topic == NULL)
+    {
+        return MQTT_RATE_ALLOW;
+    }
+
+    // Held publishes wait on their topic's queue, or the connection's when the topic
+    // limit does not queue
+    MQTT_RATE_LIMITER *home = topic != NULL && topic->held != NULL ? topic : connection;
+    int64_t now_us          = monotonic_us();
+
+    if (home != NULL && home->held != NULL && atomic_load(&home->held_count) > 0)
+    {
+        return rate_hold(client, home, message, topic_length, now_us);
+    }
+
+    MQTT_RATE_LIMITER *limited = NULL;
+    size_t bytes               = publish_packet_size(topic_length, message->payload_length, publish_flags_for(message));
+    int64_t wait_us            = rate_take(connection, topic, bytes, now_us, &limited);
+
+    if (wait_us == 0)
+    {
+        return MQTT_RATE_ALLOW;
+    }
+
+    if (limited->action == DX_MQTT_LIMIT_QUEUE)
+    {
+        return rate_hold(client, home != NULL && home->held != NULL ? home : limited, message, topic_length, now_us + wait_us);
+    }
+
+    if (limited->action == DX_MQTT_LIMIT_DROP)
+    {
+        stats_add(&client->stats.messages_rate_dropped, 1);
+        return MQTT_RATE_DROPPED;
+    }
+
+    set_last_error(client, "MQTT publish to '%.*s' over its rate limit", (int)topic_length, message->topic);
+    stats_publish_failed(client, DX_MQTT_PUBLISH_FAILED_RATE_LIMITED, 1);
+    return MQTT_RATE_REJECTED;
+}
+
+/// <summary>
+/// Check a publish against the connection and topic rate limits without taking a lock.
+/// Costs one atomic load when no limit is set. Otherwise the publisher enters a reader
+/// section on the current snapshot, two atomic increments on a counter its thread shares
+/// with few others, finds the topic's limiter in the snapshot's cache, matching the
+/// filters only for a topic not cached, and takes from each limit with a compare and
+/// swap. A publish on a topic with publishes already held is held behind them so the
+/// topic keeps its order.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="message">Message to publish, its topic need not be NUL terminated</param>
+/// <param name="topic_length">Topic length</param>
+/// <returns>Whether to send the publish now, or what the limit did with it</returns>
+static MQTT_RATE_DECISION rate_admit(DX_MQTT_CLIENT *client, const DX_MQTT_MESSAGE *message, size_t topic_length)
+{
+    if (atomic_load(&client->rate_snapshot) == NULL)
+    {
+        return MQTT_RATE_ALLOW;
+    }
+
+    MQTT_RATE_SNAPSHOT *snapshot;
+    atomic_size_t *reader       = rate_read_lock(client, &snapshot);
+    MQTT_RATE_DECISION decision = snapshot != NULL ? rate_check(client, snapshot, message, topic_length) : MQTT_RATE_ALLOW;
+    rate_read_unlock(reader);
+
+    return decision;
+}
+
+/// <summary>
+/// Give back the tokens of a publish rate_admit let through that could not be queued
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="message">Message passed to rate_admit</param>
+/// <param name="topic_length">Topic length</param>
+static void rate_unadmit(DX_MQTT_CLIENT *client, const DX_MQTT_MESSAGE *message, size_t topic_length)
+{
+    rate_release(client, message->topic, topic_length, publish_packet_size(topic_length, message->payload_length, publish_flags_for(message)));
+}
+
+/// <summary>
+/// Move held publishes that the rate limits now allow into MQTT-C, oldest first on
+/// each limiter. Runs on the thread that drives the connection, ahead of mqtt_sync,
+/// and is the only consumer of the limiter rings.
+/// </summary>
+/// <param name="client">MQTT client</param>
+static void release_rate_held(DX_MQTT_CLIENT *client)
+{
+    if (atomic_load(&client->rate_held_count) == 0)
+    {
+        return;
+    }
+
+    struct mqtt_client *mqtt = &client->client;
+
+    MQTT_PAL_MUTEX_LOCK(&mqtt->mutex);
+    pthread_mutex_lock(&client->rate_lock);
+
+    MQTT_RATE_LIMITER *connection = client->rate_connection;
+    int64_t now_us                = monotonic_us();
+    int64_t next_us               = 0;
+    bool blocked                  = false;
+
+    for (size_t i = 0; i < client->rate_limiter_count && !blocked;)
+    {
+        MQTT_RATE_LIMITER *limiter = client->rate_limiters[i];
+        MQTT_RATE_LIMITER *topic   = limiter->topic ? limiter : NULL;
+        const MQTT_RATE_HELD *held;
+        size_t length;
+
+        while (limiter->held != NULL && (held = dx_mqttRingPeek(limiter->held, &length)) != NULL)
+        {
+            const char *name = held->spill != NULL ? held->spill : (const char *)(held + 1);
+            uint8_t flags    = publish_flags_for(&(DX_MQTT_MESSAGE){.qos = held->qos, .retain = held->retain});
+            size_t bytes     = publish_packet_size(held->topic_length, held->payload_length, flags);
+
+            MQTT_RATE_LIMITER *limited;
+            int64_t wait_us = rate_take(connection, topic, bytes, now_us, &limited);
+            if (wait_us > 0)
+            {
+                if (next_us == 0 || now_us + wait_us < next_us)
+                {
+                    next_us = now_us + wait_us;
+                }
+                break;
+            }
+
+            if (enqueue_publish_locked(client, name, name + held->topic_length + 1, held->payload_length, flags, held->priority) != MQTT_OK)
+            {
+                // The rest wait for the send buffer or in-flight window to drain
+                rate_refund(connection, topic, bytes);
+                blocked = true;
+                break;
+            }
+
+            free(held->spill);
+            dx_mqttRingRelease(limiter->held);
+            atomic_fetch_sub(&limiter->held_count, 1);
+            atomic_fetch_sub(&client->rate_held_count, 1);
+        }
+
+        // No snapshot points at a retired limiter, so once empty nothing can refill it
+        if (limiter->retired && atomic_load(&limiter->held_count) == 0)
+        {
+            remove_rate_limiter_locked(client, i);
+        }
+        else
+        {
+            i++;
+        }
+    }
+
+    atomic_store(&client->rate_next_us, next_us);
+    client->rate_blocked = blocked;
+
+    pthread_mutex_unlock(&client->rate_lock);
+    MQTT_PAL_MUTEX_UNLOCK(&mqtt->mutex);
+}
+
+/// <summary>
+/// Shorten a poll timeout so the driver wakes when the next held publish is allowed.
+/// Publishes held back by a full buffer are left to the writable and ack wakeups.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="timeout_ms">Timeout from the other deadlines</param>
+/// <returns>Timeout in milliseconds</returns>
+static int rate_poll_timeout_ms(DX_MQTT_CLIENT *client, int timeout_ms)
+{
+    int64_t next_us = atomic_load(&client->rate_next_us);
+    if (atomic_load(&client->rate_held_count) == 0 || next_us == 0 || client->rate_blocked)
+    {
+        return timeout_ms;
+    }
+
+    int64_t remaining_us = next_us - monotonic_us();
+    int due_ms           = remaining_us <= 0 ? 0 : (int)((remaining_us + 999) / 1000);
+
+    return timeout_ms < 0 || due_ms < timeout_ms ? due_ms : timeout_ms;
+}
+
+/// <summary>
+/// Build a limiter from a DX_MQTT_RATE_LIMIT
+/// </summary>
+/// <param name="client">MQTT client, sizes the queue slots</param>
+/// <param name="limit">Limit settings</param>
+/// <param name="topic">True for a topic filter limit</param>
+/// <returns>New limiter, or NULL on failure</returns>
+static MQTT_RATE_LIMITER *create_rate_limiter(DX_MQTT_CLIENT *client, const DX_MQTT_RATE_LIMIT *limit, bool topic)
+{
+    MQTT_RATE_LIMITER *limiter = calloc(1, sizeof(MQTT_RATE_LIMITER));
+    if (limiter == NULL)
+    {
+        return NULL;
+    }
+
+    limiter->action       = limit->action;
+    limiter->topic        = topic;
+    limiter->queue_length = limit->queue_length > 0 ? limit->queue_length : DX_MQTT_DEFAULT_RATE_QUEUE_LENGTH;
+    limiter->rate         = dx_mqttRateCreate(limit->messages_per_second, limit->message_burst, limit->bytes_per_second, limit->byte_burst);
+
+    // Queue slots are sized like the publish queue's, larger publishes are copied aside
+    if (limiter->rate != NULL && limit->action == DX_MQTT_LIMIT_QUEUE)
+    {
+        size_t slot_size = client->config.publish_queue_slot_size > 0 ? client->config.publish_queue_slot_size : 512;
+        limiter->held    = dx_mqttRingCreate(limiter->queue_length, sizeof(MQTT_RATE_HELD) + slot_size);
+    }
+
+    if (limiter->rate == NULL || (limit->action == DX_MQTT_LIMIT_QUEUE && limiter->held == NULL))
+    {
+        dx_mqttRateDestroy(limiter->rate);
+        free(limiter);
+        return NULL;
+    }
+
+    return limiter;
+}
+
+/// <summary>
+/// Add a limiter to the list of those in use. Caller holds rate_lock.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="limiter">New limiter</param>
+/// <returns>False if the list could not grow</returns>
+static bool keep_rate_limiter_locked(DX_MQTT_CLIENT *client, MQTT_RATE_LIMITER *limiter)
+{
+    if (client->rate_limiter_count == client->rate_limiter_capacity)
+    {
+        size_t capacity              = client->rate_limiter_capacity > 0 ? client->rate_limiter_capacity * 2 : 4;
+        MQTT_RATE_LIMITER **limiters = realloc(client->rate_limiters, capacity * sizeof(MQTT_RATE_LIMITER *));
+        if (limiters == NULL)
+        {
+            return false;
+        }
+
+        client->rate_limiters         = limiters;
+        client->rate_limiter_capacity = capacity;
+    }
+
+    client->rate_limiters[client->rate_limiter_count++] = limiter;
+    return true;
+}
+
+/// <summary>
+/// Free a limiter and any publishes it still holds
+/// </summary>
+/// <param name="limiter">Limiter, can be NULL</param>
+static void free_rate_limiter(MQTT_RATE_LIMITER *limiter)
+{
+    if (limiter == NULL)
+    {
+        return;
+    }
+
+    const MQTT_RATE_HELD *held;
+    size_t length;
+
+    while (limiter->held != NULL && (held = dx_mqttRingPeek(limiter->held, &length)) != NULL)
+    {
+        free(held->spill);
+        dx_mqttRingRelease(limiter->held);
+    }
+
+    dx_mqttRingDestroy(limiter->held);
+    dx_mqttRateDestroy(limiter->rate);
+    free(limiter);
+}
+
+/// <summary>
+/// Take a limiter off the list and free it. Caller holds rate_lock.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="index">Position in rate_limiters</param>
+static void remove_rate_limiter_locked(DX_MQTT_CLIENT *client, size_t index)
+{
+    free_rate_limiter(client->rate_limiters[index]);
+
+    client->rate_limiter_count--;
+    memmove(&client->rate_limiters[index], &client->rate_limiters[index + 1], (client->rate_limiter_count - index) * sizeof(MQTT_RATE_LIMITER *));
+}
+
+/// <summary>
+/// Reclaim a limiter the current snapshot no longer points at. It is freed now when it
+/// holds nothing, otherwise release_rate_held frees it once it has sent what it holds.
+/// Caller holds rate_lock and has waited out the readers of the snapshots that used it.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="limiter">Replaced limiter, can be NULL</param>
+static void retire_rate_limiter_locked(DX_MQTT_CLIENT *client, MQTT_RATE_LIMITER *limiter)
+{
+    if (limiter == NULL)
+    {
+        return;
+    }
+
+    limiter->retired = true;
+    for (size_t i = 0; i < client->rate_limiter_count && atomic_load(&limiter->held_count) == 0; i++)
+    {
+        if (client->rate_limiters[i] == limiter)
+        {
+            remove_rate_limiter_locked(client, i);
+            return;
+        }
+    }
+}
+
+/// <summary>
+/// Free a rate snapshot and its cache. No reader may still be inside it.
+/// </summary>
+/// <param name="snapshot">Snapshot, can be NULL</param>
+static void free_rate_snapshot(MQTT_RATE_SNAPSHOT *snapshot)
+{
+    if (snapshot == NULL)
+    {
+        return;
+    }
+
+    // Limiters are owned by rate_limiters, the trie only points at them
+    dx_mqttTopicTrieDestroy(snapshot->filters, NULL);
+    for (size_t i = 0; i < DX_MQTT_RATE_CACHE_SLOTS; i++)
+    {
+        free(atomic_load(&snapshot->cache[i]));
+    }
+    free(snapshot);
+}
+
+/// <summary>
+/// Publish a snapshot of rate_connection and rate_filters to the publishers and free
+/// the one it replaces once no publisher can still be reading it. Caller holds rate_lock.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <returns>False if the snapshot could not be built, the old one stays in place</returns>
+static bool publish_rate_snapshot_locked(DX_MQTT_CLIENT *client)
+{
+    MQTT_RATE_SNAPSHOT *snapshot = NULL;
+    size_t filters               = 0;
+
+    for (size_t i = 0; i < client->rate_filter_count; i++)
+    {
+        filters += client->rate_filters[i].limiter != NULL;
+    }
+
+    if (client->rate_connection != NULL || filters > 0)
+    {
+        snapshot = calloc(1, sizeof(MQTT_RATE_SNAPSHOT));
+        if (snapshot == NULL)
+        {
+            return false;
+        }
+
+        snapshot->connection = client->rate_connection;
+        if (filters > 0 && (snapshot->filters = dx_mqttTopicTrieCreate()) == NULL)
+        {
+            free(snapshot);
+            return false;
+        }
+
+        for (size_t i = 0; i < client->rate_filter_count; i++)
+        {
+            MQTT_RATE_FILTER *filter = &client->rate_filters[i];
+            if (filter->limiter != NULL && !dx_mqttTopicTrieInsert(snapshot->filters, filter->filter, filter->limiter, NULL))
+            {
+                free_rate_snapshot(snapshot);
+                return false;
+            }
+        }
+    }
+
+    MQTT_RATE_SNAPSHOT *previous = atomic_exchange(&client->rate_snapshot, snapshot);
+    rate_synchronize(client);
+    free_rate_snapshot(previous);
+
+    return true;
+}
+
+/// <summary>
+/// Drop the filters left without a limiter. Caller holds rate_lock.
+/// </summary>
+/// <param name="client">MQTT client</param>
+static void prune_rate_filters_locked(DX_MQTT_CLIENT *client)
+{
+    size_t kept = 0;
+
+    for (size_t i = 0; i < client->rate_filter_count; i++)
+    {
+        if (client->rate_filters[i].limiter != NULL)
+        {
+            client->rate_filters[kept++] = client->rate_filters[i];
+        }
+        else
+        {
+            free(client->rate_filters[i].filter);
+        }
+    }
+    client->rate_filter_count = kept;
+}
+
+/// <summary>
+/// Check whether another QoS 1/2 publish fits in the in-flight window. Caller holds
+/// the MQTT-C mutex.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <returns>True if there is room</returns>
+static bool inflight_window_open_locked(DX_MQTT_CLIENT *client)
+{
+    return client->config.max_inflight == 0 || atomic_load(&client->inflight_count) < client->config.max_inflight;
+}
+
+/// <summary>
+/// Remember a QoS 1/2 publish that just entered the MQTT-C queue. Caller holds the
+/// MQTT-C mutex.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="packet_id">Packet id of the publish</param>
+static void inflight_track_locked(DX_MQTT_CLIENT *client, uint16_t packet_id)
+{
+    if (client->config.max_inflight == 0 && client->publish_complete == NULL)
+    {
+        return;
+    }
+
+    size_t count = atomic_load(&client->inflight_count);
+
+    if (count == client->inflight_capacity)
+    {
+        size_t capacity = client->inflight_capacity > 0 ? client->inflight_capacity * 2 : (client->config.max_inflight > 0 ? client->config.max_inflight : 16);
+
+        MQTT_INFLIGHT *inflight = realloc(client->inflight, capacity * sizeof(MQTT_INFLIGHT));
+        if (inflight == NULL)
+        {
+            dx_Log_Debug("DX MQTT: Failed to track in-flight publish %u\n", packet_id);
+            return;
+        }
+        client->inflight          = inflight;
+        client->inflight_capacity = capacity;
+    }
+
+    client->inflight[count].packet_id = packet_id;
+    client->inflight[count].queued_us = monotonic_us();
+    atomic_store(&client->inflight_count, count + 1);
+}
+
+/// <summary>
+/// Forget every in-flight publish, MQTT-C drops them with the old session
+/// </summary>
+/// <param name="client">MQTT client</param>
+static void inflight_reset(DX_MQTT_CLIENT *client)
+{
+    if (client->mqtt_initialized)
+    {
+        MQTT_PAL_MUTEX_LOCK(&client->client.mutex);
+        atomic_store(&client->inflight_count, 0);
+        MQTT_PAL_MUTEX_UNLOCK(&client->client.mutex);
+    }
+    else
+    {
+        atomic_store(&client->inflight_count, 0);
+    }
+
+    pthread_cond_broadcast(&client->inflight_cond);
+}
+
+/// <summary>
+/// Find the in-flight publishes MQTT-C has seen acknowledged since the last pass and
+/// report them. A publish is done once neither it nor its PUBREL is still pending in
+/// the MQTT-C queue. Runs on the thread that drives the connection, after mqtt_sync.
+/// </summary>
+/// <param name="client">MQTT client</param>
+static void inflight_collect(DX_MQTT_CLIENT *client)
+{
+    if (atomic_load(&client->inflight_count) == 0)
+    {
+        return;
+    }
+
+    struct mqtt_client *mqtt = &client->client;
+    size_t completed         = 0;
+
+    MQTT_PAL_MUTEX_LOCK(&mqtt->mutex);
+
+    size_t count   = atomic_load(&client->inflight_count);
+    int64_t now_us = monotonic_us();
+
+    // Scratch sized to the tracking table, only this thread reads the completions
+    if (client->inflight_outstanding == NULL)
+    {
+        client->inflight_outstanding = malloc((UINT16_MAX + 1) / 8);
+    }
+    if (client->inflight_completed_capacity < client->inflight_capacity)
+    {
+        MQTT_INFLIGHT *completions = realloc(client->inflight_completed, client->inflight_capacity * sizeof(MQTT_INFLIGHT));
+        if (completions != NULL)
+        {
+            client->inflight_completed          = completions;
+            client->inflight_completed_capacity = client->inflight_capacity;
+        }
+    }
+
+    MQTT_INFLIGHT *done = client->inflight_completed;
+
+    if (client->inflight_outstanding != NULL && client->inflight_completed_capacity >= count)
+    {
+        memset(client->inflight_outstanding, 0, (UINT16_MAX + 1) / 8);
+
+        ssize_t length = mqtt_mq_length(&mqtt->mq);
+        for (ssize_t i = 0; i < length; i++)
+        {
+            struct mqtt_queued_message *msg = mqtt_mq_get(&mqtt->mq, i);
+            if ((msg->control_type == MQTT_CONTROL_PUBLISH || msg->control_type == MQTT_CONTROL_PUBREL) && msg->state != MQTT_QUEUED_COMPLETE)
+            {
+                client->inflight_outstanding[msg->packet_id / 64] |= 1ULL << (msg->packet_id % 64);
+            }
+        }
+
+        size_t kept = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            uint16_t packet_id = client->inflight[i].packet_id;
+            if (client->inflight_outstanding[packet_id / 64] & (1ULL << (packet_id % 64)))
+            {
+                client->inflight[kept++] = client->inflight[i];
+            }
+            else
+            {
+                done[completed++] = client->inflight[i];
+            }
+        }
+        atomic_store(&client->inflight_count, kept);
+    }
+
+    MQTT_PAL_MUTEX_UNLOCK(&mqtt->mutex);
+
+    if (completed == 0)
+    {
+        return;
+    }
+
+    pthread_cond_broadcast(&client->inflight_cond);
+
+    DX_MQTT_PUBLISH_COMPLETE handler = client->publish_complete;
+    void *context                    = client->publish_complete_context;
+
+    for (size_t i = 0; handler != NULL && i < completed; i++)
+    {
+        handler(client, done[i].packet_id, (uint64_t)(now_us - done[i].queued_us), context);
+    }
+
+    // Publishes held back by a full window can move now
+    if (publish_queue_pending(client))
+    {
+        signal_publish_queue(client);
+    }
+}
+
+/// <summary>
+/// Add to a stats counter. Relaxed ordering is enough, readers only want the value.
+/// </summary>
+/// <param name="counter">Counter</param>
+/// <param name="value">Amount to add</param>
+static void stats_add(_Atomic uint64_t *counter, uint64_t value)
+{
+    atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
+}
+
+/// <summary>
+/// Raise a stats maximum if value is larger
+/// </summary>
+/// <param name="counter">Maximum so far</param>
+/// <param name="value">New sample</param>
+static void stats_max(_Atomic uint64_t *counter, uint64_t value)
+{
+    uint64_t current = atomic_load_explicit(counter, memory_order_relaxed);
+    while (value > current && !atomic_compare_exchange_weak_explicit(counter, &current, value, memory_order_relaxed, memory_order_relaxed))
+    {
+    }
+}
+
+/// <summary>
+/// Count refused publishes
+/// </summary>
+/// <param name="client">MQTT client, can be NULL</param>
+/// <param name="reason">Why they were refused</param>
+/// <param name="count">Number of messages</param>
+static void stats_publish_failed(DX_MQTT_CLIENT *client, DX_MQTT_PUBLISH_FAILURE reason, uint64_t count)
+{
+    if (client != NULL && count > 0)
+    {
+        stats_add(&client->stats.publish_failures[reason], count);
+    }
+}
+
+/// <summary>
+/// Failure reason for an error returned while queuing a publish into MQTT-C
+/// </summary>
+/// <param name="error">MQTT-C error</param>
+/// <returns>Failure reason</returns>
+static DX_MQTT_PUBLISH_FAILURE publish_failure_for(enum MQTTErrors error)
+{
+    return error == MQTT_ERROR_SEND_BUFFER_IS_FULL ? DX_MQTT_PUBLISH_FAILED_BACK_PRESSURE : DX_MQTT_PUBLISH_FAILED_CONNECTION;
+}
+
+/// <summary>
+/// Count a PUBLISH registered in the MQTT-C queue and track how full the send buffer
+/// has been. Caller holds the MQTT-C mutex.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="qos">QoS of the publish</param>
+/// <param name="packet_length">Encoded packet size</param>
+static void stats_publish_sent_locked(DX_MQTT_CLIENT *client, uint8_t qos, size_t packet_length)
+{
+    qos = qos > 2 ? 2 : qos;
+    stats_add(&client->stats.messages_out[qos], 1);
+    stats_add(&client->stats.bytes_out[qos], packet_length);
+
+    // Only writers under the mutex update the high water, so no compare and swap is needed
+    size_t used = client->send_buffer_size - client->client.mq.curr_sz;
+    if (used > atomic_load_explicit(&client->stats.send_buffer_high_water, memory_order_relaxed))
+    {
+        atomic_store_explicit(&client->stats.send_buffer_high_water, used, memory_order_relaxed);
+    }
+}
+
+/// <summary>
+/// Start the connected time clock for a new session
+/// </summary>
+/// <param name="client">MQTT client</param>
+static void stats_session_started(DX_MQTT_CLIENT *client)
+{
+    atomic_store(&client->stats.connected_since_ms, monotonic_us() / 1000);
+}
+
+/// <summary>
+/// Fold the session that just ended into the total connected time. Safe to call more
+/// than once per session, only the first call counts.
+/// </summary>
+/// <param name="client">MQTT client</param>
+static void stats_session_ended(DX_MQTT_CLIENT *client)
+{
+    int64_t since = atomic_exchange(&client->stats.connected_since_ms, 0);
+    if (since != 0)
+    {
+        stats_add(&client->stats.total_connected_ms, (uint64_t)(monotonic_us() / 1000 - since));
+    }
+}
+
+/// <summary>
+/// Time keep-alive round trips. MQTT-C only keeps ping times in whole seconds, so
+/// this watches the PINGREQ in its queue: the time it is first seen sent, and the
+/// time it is gone or completed because the PINGRESP arrived. The queue is only
+/// scanned when something was sent since the last check or a ping is under way.
+/// Runs on the thread that drives the connection, after mqtt_sync.
+/// </summary>
+/// <param name="client">MQTT client</param>
+static void stats_ping(DX_MQTT_CLIENT *client)
+{
+    static const int64_t bucket_limit_us[DX_MQTT_STATS_RTT_BUCKETS - 1] = {
+        1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000, 1000000, 2000000, 5000000};
+
+    struct mqtt_client *mqtt = &client->client;
+
+    MQTT_PAL_MUTEX_LOCK(&mqtt->mutex);
+
+    if (client->ping_sent_us == 0 && !client->ping_queued && mqtt->time_of_last_send == client->ping_last_send)
+    {
+        MQTT_PAL_MUTEX_UNLOCK(&mqtt->mutex);
+        return;
+    }
+
+    client->ping_last_send = mqtt->time_of_last_send;
+
+    bool queued    = false;
+    bool awaiting  = false;
+    ssize_t length = mqtt_mq_length(&mqtt->mq);
+    for (ssize_t i = 0; i < length; i++)
+    {
+        struct mqtt_queued_message *msg = mqtt_mq_get(&mqtt->mq, i);
+        if (msg->control_type == MQTT_CONTROL_PINGREQ)
+        {
+            queued   = queued || msg->state == MQTT_QUEUED_UNSENT;
+            awaiting = awaiting || msg->state == MQTT_QUEUED_AWAITING_ACK;
+        }
+    }
+    client->ping_queued = queued;
+
+    int64_t now_us = monotonic_us();
+    int64_t rtt_us = -1;
+
+    if (awaiting && client->ping_sent_us == 0)
+    {
+        client->ping_sent_us = now_us;
+    }
+    else if (!awaiting && client->ping_sent_us != 0)
+    {
+        rtt_us               = now_us - client->ping_sent_us;
+        client->ping_sent_us = 0;
+    }
+
+    MQTT_PAL_MUTEX_UNLOCK(&mqtt->mutex);
+
+    if (rtt_us < 0)
+    {
+        return;
+    }
+
+    size_t bucket = 0;
+    while (bucket < DX_MQTT_STATS_RTT_BUCKETS - 1 && rtt_us > bucket_limit_us[bucket])
+    {
+        bucket++;
+    }
+
+    stats_add(&client->stats.ping_rtt_histogram[bucket], 1);
+    atomic_store_explicit(&client->stats.ping_rtt_last_us, (uint64_t)rtt_us, memory_order_relaxed);
+}
+
+/// <summary>
+/// Encode a publish into the lock-free queue without touching the MQTT-C mutex.
+/// Safe to call from any thread.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="message">Message to publish</param>
+/// <returns>True if the message was queued</returns>
+static bool queue_publish(DX_MQTT_CLIENT *client, const DX_MQTT_MESSAGE *message)
+{
+    DX_MQTT_RING *ring  = message->priority == DX_MQTT_PRIORITY_HIGH ? client->priority_queue : client->publish_queue;
+    uint8_t flags       = publish_flags_for(message);
+    size_t topic_length = strlen(message->topic);
+    size_t packet_size  = publish_packet_size(topic_length, message->payload_length, flags);
+
+    if (topic_length > UINT16_MAX)
+    {
+        set_last_error(client, "Invalid topic - topic too long");
+        stats_publish_failed(client, DX_MQTT_PUBLISH_FAILED_INVALID, 1);
+        return false;
+    }
+
+    uint8_t *slot = dx_mqttRingClaim(ring);
+    if (slot == NULL)
+    {
+        set_last_error(client, "MQTT publish queue full");
+        stats_publish_failed(client, DX_MQTT_PUBLISH_FAILED_BACK_PRESSURE, 1);
+        return false;
+    }
+
+    MQTT_QUEUED_PUBLISH *record = (MQTT_QUEUED_PUBLISH *)slot;
+    uint8_t *packet             = slot + sizeof(MQTT_QUEUED_PUBLISH);
+
+    // The packet id is a placeholder until the consumer assigns one
+    ssize_t rv = mqtt_pack_publish_request(packet, dx_mqttRingSlotSize(ring) - sizeof(MQTT_QUEUED_PUBLISH), message->topic, 0,
+        message->payload, message->payload_length, flags);
+
+    record->packet_length    = rv > 0 ? (uint32_t)rv : 0;
+    record->packet_id_offset = (flags & MQTT_PUBLISH_QOS_MASK) ? (uint32_t)(packet_size - message->payload_length - 2) : 0;
+
+    // A claimed slot must always be published, an empty record is skipped by the consumer
+    dx_mqttRingPublish(ring, slot, sizeof(MQTT_QUEUED_PUBLISH) + record->packet_length);
+
+    if (rv <= 0)
+    {
+        set_last_error(client, "MQTT publish failed: %s", mqtt_error_str(rv < 0 ? (enum MQTTErrors)rv : MQTT_ERROR_SEND_BUFFER_IS_FULL));
+        stats_publish_failed(client, DX_MQTT_PUBLISH_FAILED_INVALID, 1);
+        return false;
+    }
+
+    signal_publish_queue(client);
+    return true;
+}
+
+/// <summary>
+/// Wake the consumer of the publish queue, at most once until it drains
+/// </summary>
+/// <param name="client">MQTT client</param>
+static void signal_publish_queue(DX_MQTT_CLIENT *client)
+{
+    if (atomic_exchange(&client->publish_queue_signalled, true))
+    {
+        return;
+    }
+
+    if (!loop_driver_signal(client))
+    {
+        wakeup_daemon(client);
+    }
+}
+
+/// <summary>
+/// Copy queued publish records into the MQTT-C send queue, assigning packet ids, high
+/// priority first. Runs on the thread that drives the connection.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <returns>True if at least one record was consumed</returns>
+static bool drain_publish_queue(DX_MQTT_CLIENT *client)
+{
+    // Clear before draining so a producer racing with us signals again. Outbox replay
+    // and conflation signal through the same flag, so clear it even without a queue.
+    atomic_store(&client->publish_queue_signalled, false);
+
+    if (client->publish_queue == NULL)
+    {
+        return false;
+    }
+
+    struct mqtt_client *mqtt = &client->client;
+
+    MQTT_PAL_MUTEX_LOCK(&mqtt->mutex);
+    bool progress = drain_ring_locked(client, client->priority_queue, false);
+    progress      = drain_ring_locked(client, client->publish_queue, true) || progress;
+    MQTT_PAL_MUTEX_UNLOCK(&mqtt->mutex);
+
+    return progress;
+}
+
+/// <summary>
+/// Copy the records of one publish queue into the MQTT-C send queue until it is empty
+/// or out of room. Caller holds the MQTT-C mutex.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="ring">Publish queue</param>
+/// <param name="bulk">Hold the records to the bulk budget</param>
+/// <returns>True if at least one record was consumed</returns>
+static bool drain_ring_locked(DX_MQTT_CLIENT *client, DX_MQTT_RING *ring, bool bulk)
+{
+    struct mqtt_client *mqtt = &client->client;
+    bool progress            = false;
+    const uint8_t *slot;
+    size_t length;
+
+    while ((slot = dx_mqttRingPeek(ring, &length)) != NULL)
+    {
+        const MQTT_QUEUED_PUBLISH *record = (const MQTT_QUEUED_PUBLISH *)slot;
+
+        if (record->packet_length > 0)
+        {
+            if ((mqtt->error < 0 && mqtt->error != MQTT_ERROR_SEND_BUFFER_IS_FULL) ||
+                (record->packet_id_offset != 0 && !inflight_window_open_locked(client)) ||
+                (bulk && !bulk_budget_open_locked(client, record->packet_length)) || !reserve_send_space_locked(client, record->packet_length))
+            {
+                // Leave the rest queued until acks or the send free up room
+                break;
+            }
+
+            uint8_t *packet    = mqtt->mq.curr;
+            uint16_t packet_id = __mqtt_next_pid(mqtt);
+
+            memcpy(packet, slot + sizeof(MQTT_QUEUED_PUBLISH), record->packet_length);
+            if (record->packet_id_offset != 0)
+            {
+                packet[record->packet_id_offset]     = (uint8_t)(packet_id >> 8);
+                packet[record->packet_id_offset + 1] = (uint8_t)(packet_id & 0xFF);
+            }
+
+            struct mqtt_queued_message *msg = mqtt_mq_register(&mqtt->mq, record->packet_length);
+            msg->control_type               = MQTT_CONTROL_PUBLISH;
+            msg->packet_id                  = packet_id;
+            stats_publish_sent_locked(client, (packet[0] & MQTT_PUBLISH_QOS_MASK) >> 1, record->packet_length);
+
+            if (record->packet_id_offset != 0)
+            {
+                inflight_track_locked(client, packet_id);
+            }
+
+            if (bulk)
+            {
+                bulk_budget_spend_locked(client, record->packet_length);
+            }
+        }
+
+        dx_mqttRingRelease(ring);
+        progress = true;
+    }
+
+    return progress;
+}
+
+/// <summary>
+/// Check whether either publish queue holds records
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <returns>True if a record is waiting</returns>
+static bool publish_queue_pending(DX_MQTT_CLIENT *client)
+{
+    return client->publish_queue != NULL && (!dx_mqttRingIsEmpty(client->priority_queue) || !dx_mqttRingIsEmpty(client->publish_queue));
+}
+
+/// <summary>
+/// Ask whichever driver owns the connection to run mqtt_sync as soon as possible. Safe
+/// from any thread: the loop driver is only woken, its handles are rearmed by the callback.
+/// </summary>
+/// <param name="client">MQTT client</param>
+static void request_service(DX_MQTT_CLIENT *client)
+{
+    if (!loop_driver_signal(client))
+    {
+        wakeup_daemon(client);
+    }
+}
+
+/// <summary>
+/// libuv socket readiness callback for event loop mode
+/// </summary>
+static void loop_driver_poll_handler(uv_poll_t *handle, int status, int events)
+{
+    MQTT_LOOP_DRIVER *driver = handle->data;
+    DX_MQTT_CLIENT *client   = driver->client;
+    (void)status;
+    (void)events;
+
+    // Errors surface through mqtt_sync, which reads the socket
+    service_connection(client);
+    loop_driver_rearm(client);
+}
+
+/// <summary>
+/// libuv wakeup from request_service or a thread that queued a publish, for event loop mode
+/// </summary>
+static void loop_driver_async_handler(uv_async_t *handle)
+{
+    MQTT_LOOP_DRIVER *driver = handle->data;
+    DX_MQTT_CLIENT *client   = driver->client;
+
+    service_connection(client);
+    loop_driver_rearm(client);
+}
+
+/// <summary>
+/// libuv keepalive/resend deadline callback for event loop mode
+/// </summary>
+static void loop_driver_timer_handler(uv_timer_t *handle)
+{
+    MQTT_LOOP_DRIVER *driver = handle->data;
+    DX_MQTT_CLIENT *client   = driver->client;
+
+    service_connection(client);
+    loop_driver_rearm(client);
+}
+
+/// <summary>
+/// Update the poll events and deadline timer to match the MQTT-C queue state. Loop thread only.
+/// </summary>
+/// <param name="client">MQTT client</param>
+static void loop_driver_rearm(DX_MQTT_CLIENT *client)
+{
+    MQTT_LOOP_DRIVER *driver = client->loop_driver;
+
+    // The handler may have disconnected the client during service_connection
+    if (driver == NULL)
+    {
+        return;
+    }
+
+    if (!client->is_connected)
+    {
+        // Stop watching a dead socket, otherwise a hangup would spin the loop
+        uv_poll_stop(&driver->poll);
+        uv_timer_stop(&driver->timer);
+
+        // A connection lost on another thread left the retry for the loop to time
+        if (client->reconnect_pending)
+        {
+            reconnect_timer_arm(client);
+        }
+        return;
+    }
+
+    // A pinned reservation keeps mqtt_sync off the queue, commit or abort wakes the loop
+    if (send_queue_pinned(client))
+    {
+        uv_poll_stop(&driver->poll);
+        uv_timer_stop(&driver->timer);
+        return;
+    }
+
+    int events = UV_READABLE;
+    if (has_pending_send(&client->client))
+    {
+        events |= UV_WRITABLE;
+    }
+
+    uv_poll_start(&driver->poll, events, loop_driver_poll_handler);
+    int timeout_ms = rate_poll_timeout_ms(client, conflation_poll_timeout_ms(client, outbox_poll_timeout_ms(client, next_poll_timeout_ms(&client->client))));
+    uv_timer_start(&driver->timer, loop_driver_timer_handler, (uint64_t)timeout_ms, 0);
+}
+
+/// <summary>
+/// Attach the connected socket to uv_default_loop()
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <returns>True on success</returns>
+static bool loop_driver_start(DX_MQTT_CLIENT *client)
+{
+    MQTT_LOOP_DRIVER *driver = calloc(1, sizeof(MQTT_LOOP_DRIVER));
+    if (driver == NULL)
+    {
+        return false;
+    }
+
+    if (uv_poll_init_socket(uv_default_loop(), &driver->poll, client->sockfd) != 0)
+    {
+        free(driver);
+        return false;
+    }
+
+    uv_timer_init(uv_default_loop(), &driver->timer);
+    uv_async_init(uv_default_loop(), &driver->async, loop_driver_async_handler);
+    driver->poll.data    = driver;
+    driver->timer.data   = driver;
+    driver->async.data   = driver;
+    driver->open_handles = 3;
+    driver->client       = client;
+
+    pthread_mutex_lock(&client->driver_lock);
+    client->loop_driver = driver;
+    pthread_mutex_unlock(&client->driver_lock);
+
+    return true;
+}
+
+/// <summary>
+/// Wake the loop driver from any thread
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <returns>False if there is no loop driver to wake</returns>
+static bool loop_driver_signal(DX_MQTT_CLIENT *client)
+{
+    pthread_mutex_lock(&client->driver_lock);
+
+    MQTT_LOOP_DRIVER *driver = client->loop_driver;
+    if (driver != NULL)
+    {
+        uv_async_send(&driver->async);
+    }
+
+    pthread_mutex_unlock(&client->driver_lock);
+
+    return driver != NULL;
+}
+
+/// <summary>
+/// Free the loop driver once libuv has released all of its handles
+/// </summary>
+static void loop_driver_close_handler(uv_handle_t *handle)
+{
+    MQTT_LOOP_DRIVER *driver = handle->data;
+    if (--driver->open_handles == 0)
+    {
+        free(driver);
+    }
+}
+
+/// <summary>
+/// Detach the socket from uv_default_loop(). Must run before the socket is closed.
+/// </summary>
+/// <param name="client">MQTT client</param>
+static void loop_driver_stop(DX_MQTT_CLIENT *client)
+{
+    MQTT_LOOP_DRIVER *driver = client->loop_driver;
+    if (driver == NULL)
+    {
+        return;
+    }
+
+    // Unpublish the driver first, a producer that still got hold of it has finished its
+    // uv_async_send by the time the lock is ours. The close handler frees the memory.
+    pthread_mutex_lock(&client->driver_lock);
+    client->loop_driver = NULL;
+    pthread_mutex_unlock(&client->driver_lock);
+
+    uv_poll_stop(&driver->poll);
+    uv_timer_stop(&driver->timer);
+    uv_close((uv_handle_t *)&driver->poll, loop_driver_close_handler);
+    uv_close((uv_handle_t *)&driver->timer, loop_driver_close_handler);
+    uv_close((uv_handle_t *)&driver->async, loop_driver_close_handler);
+}
+
+/// <summary>
+/// Stop and join the daemon thread if it is running
+/// </summary>
+/// <param name="client">MQTT client</param>
+static void stop_daemon(DX_MQTT_CLIENT *client)
+{
+    if (client->daemon_created && client->daemon_running)
+    {
+        client->daemon_running = false;
+        wakeup_daemon(client);
+        pthread_join(client->daemon, NULL);
+        client->daemon_created = false;
+        dx_Log_Debug("DX MQTT: Stopped background processing thread\n");
+        wakeup_close(client);
+    }
+}
+
+/// <summary>
+/// Round a buffer size up so MQTT-C's queue bookkeeping at the end of the send buffer stays aligned
+/// </summary>
+/// <param name="size">Requested size in bytes</param>
+/// <returns>Aligned size</returns>
+static size_t align_buffer_size(size_t size)
+{
+    const size_t alignment = sizeof(void *) * 2;
+    return (size + alignment - 1) & ~(alignment - 1);
+}
+
+/// <summary>
+/// Allocate the MQTT-C buffers at their configured initial sizes. Buffers that have
+/// already grown past the initial size are kept for the next connection.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <returns>True on success</returns>
+static bool allocate_buffers(DX_MQTT_CLIENT *client)
+{
+    size_t send_size = align_buffer_size(client->config.send_buffer_size > 0 ? client->config.send_buffer_size : DX_MQTT_DEFAULT_SEND_BUFFER_SIZE);
+    size_t recv_size = align_buffer_size(client->config.recv_buffer_size > 0 ? client->config.recv_buffer_size : DX_MQTT_DEFAULT_RECV_BUFFER_SIZE);
+
+    if (client->send_buffer == NULL || client->send_buffer_size < send_size)
+    {
+        uint8_t *buffer = realloc(client->send_buffer, send_size);
+        if (buffer == NULL)
+        {
+            return false;
+        }
+        client->send_buffer      = buffer;
+        client->send_buffer_size = send_size;
+    }
+
+    if (client->recv_buffer == NULL || client->recv_buffer_size < recv_size)
+    {
+        uint8_t *buffer = realloc(client->recv_buffer, recv_size);
+        if (buffer == NULL)
+        {
+            return false;
+        }
+        client->recv_buffer      = buffer;
+        client->recv_buffer_size = recv_size;
+    }
+
+    return true;
+}
+
+/// <summary>
+/// Release the MQTT-C buffers
+/// </summary>
+/// <param name="client">MQTT client</param>
+static void free_buffers(DX_MQTT_CLIENT *client)
+{
+    free(client->send_buffer);
+    free(client->recv_buffer);
+    client->send_buffer      = NULL;
+    client->send_buffer_size = 0;
+    client->recv_buffer      = NULL;
+    client->recv_buffer_size = 0;
+}
+
+/// <summary>
+/// Double the send buffer until a packet of the required size fits, relocating the
+/// MQTT-C message queue. Caller holds the MQTT-C mutex.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="required">Size of the packet that did not fit</param>
+/// <returns>True if the buffer grew enough for the packet</returns>
+static bool grow_send_buffer_locked(DX_MQTT_CLIENT *client, size_t required)
+{
+    struct mqtt_message_queue *mq = &client->client.mq;
+
+    size_t data_length  = (size_t)(mq->curr - (uint8_t *)mq->mem_start);
+    size_t queue_length = (size_t)((uint8_t *)mq->mem_end - (uint8_t *)mq->queue_tail);
+
+    // Packet data grows from the front and queue entries from the back, with room for one more entry
+    size_t needed   = data_length + queue_length + sizeof(struct mqtt_queued_message) + required;
+    size_t new_size = client->send_buffer_size;
+    while (new_size < needed)
+    {
+        new_size *= 2;
+    }
+
+    new_size = align_buffer_size(new_size);
+    if (new_size > align_buffer_size(client->config.max_send_buffer_size))
+    {
+        return false;
+    }
+
+    uint8_t *old_buffer = client->send_buffer;
+    uint8_t *buffer     = malloc(new_size);
+    if (buffer == NULL)
+    {
+        return false;
+    }
+
+    memcpy(buffer, mq->mem_start, data_length);
+    memcpy(buffer + new_size - queue_length, mq->queue_tail, queue_length);
+
+    mq->mem_start  = buffer;
+    mq->mem_end    = buffer + new_size;
+    mq->curr       = buffer + data_length;
+    mq->queue_tail = (struct mqtt_queued_message *)(buffer + new_size - queue_length);
+
+    ssize_t length = mqtt_mq_length(mq);
+    for (ssize_t i = 0; i < length; i++)
+    {
+        struct mqtt_queued_message *msg = mqtt_mq_get(mq, i);
+        msg->start                      = buffer + (msg->start - old_buffer);
+    }
+
+    mq->curr_sz = mqtt_mq_currsz(mq);
+
+    free(old_buffer);
+    client->send_buffer      = buffer;
+    client->send_buffer_size = new_size;
+
+    dx_Log_Debug("DX MQTT: Send buffer grown to %zu bytes\n", new_size);
+    return true;
+}
+
+/// <summary>
+/// Double the receive buffer, keeping any partially received packet.
+/// Caller holds the MQTT-C mutex.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <returns>True if the buffer grew</returns>
+static bool grow_recv_buffer_locked(DX_MQTT_CLIENT *client)
+{
+    size_t new_size = align_buffer_size(client->recv_buffer_size * 2);
+    if (new_size > align_buffer_size(client->config.max_recv_buffer_size))
+    {
+        return false;
+    }
+
+    size_t used     = (size_t)(client->client.recv_buffer.curr - client->client.recv_buffer.mem_start);
+    uint8_t *buffer = realloc(client->recv_buffer, new_size);
+    if (buffer == NULL)
+    {
+        return false;
+    }
+
+    client->client.recv_buffer.mem_start = buffer;
+    client->client.recv_buffer.mem_size  = new_size;
+    client->client.recv_buffer.curr      = buffer + used;
+    client->client.recv_buffer.curr_sz   = new_size - used;
+
+    client->recv_buffer      = buffer;
+    client->recv_buffer_size = new_size;
+    atomic_fetch_add(&client->receive_allocations, 1);
+
+    dx_Log_Debug("DX MQTT: Receive buffer grown to %zu bytes\n", new_size);
+    return true;
+}
+
+/// <summary>
+/// Number of bytes needed to encode an MQTT remaining length
+/// </summary>
+/// <param name="remaining_length">Remaining length value</param>
+/// <returns>Encoded size, 1 to 4 bytes</returns>
+static size_t remaining_length_size(size_t remaining_length)
+{
+    size_t size = 1;
+    for (; remaining_length >= 128; remaining_length /= 128)
+    {
+        size++;
+    }
+    return size;
+}
+
+/// <summary>
+/// Size on the wire of a PUBLISH packet
+/// </summary>
+/// <param name="topic_length">Topic length in bytes</param>
+/// <param name="payload_length">Payload length in bytes</param>
+/// <param name="publish_flags">MQTT-C publish flags</param>
+/// <returns>Packet size in bytes</returns>
+static size_t publish_packet_size(size_t topic_length, size_t payload_length, uint8_t publish_flags)
+{
+    size_t remaining = 2 + topic_length + payload_length + ((publish_flags & MQTT_PUBLISH_QOS_MASK) ? 2 : 0);
+
+    return 1 + remaining_length_size(remaining) + remaining;
+}
+
+/// <summary>
+/// Make sure the MQTT-C send queue has room for a packet and the acknowledgement
+/// headroom, reclaiming completed messages first and growing the buffer if allowed.
+/// Caller holds the MQTT-C mutex.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="required">Packet size in bytes</param>
+/// <returns>True if the packet fits</returns>
+static bool reserve_send_space_locked(DX_MQTT_CLIENT *client, size_t required)
+{
+    struct mqtt_message_queue *mq = &client->client.mq;
+
+    // An acknowledgement is four bytes plus its queue entry
+    size_t headroom = DX_MQTT_ACK_HEADROOM_PACKETS * (4 + sizeof(struct mqtt_queued_message));
+    if (headroom > client->send_buffer_size / 4)
+    {
+        headroom = client->send_buffer_size / 4;
+    }
+    required += headroom;
+
+    if (mq->curr_sz >= required)
+    {
+        return true;
+    }
+
+    // Compacting or moving the queue would pull a pinned reservation from under its writer
+    if (client->reservation.pinned)
+    {
+        return false;
+    }
+
+    mqtt_mq_clean(mq);
+    if (mq->curr_sz >= required)
+    {
+        return true;
+    }
+
+    return grow_send_buffer_locked(client, required);
+}
+
+/// <summary>
+/// Encode a PUBLISH into the MQTT-C send queue, growing the send buffer when
+/// allowed. Unlike mqtt_publish a full buffer does not latch an error on the client.
+/// Caller holds the MQTT-C mutex.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="topic">Topic name</param>
+/// <param name="payload">Payload bytes</param>
+/// <param name="payload_length">Payload length</param>
+/// <param name="publish_flags">MQTT-C publish flags</param>
+/// <param name="priority">Normal priority publishes are held to the bulk budget</param>
+/// <returns>MQTT_OK or the error that prevented queuing</returns>
+static enum MQTTErrors enqueue_publish_locked(
+    DX_MQTT_CLIENT *client, const char *topic, const void *payload, size_t payload_length, uint8_t publish_flags, DX_MQTT_PRIORITY priority)
+{
+    struct mqtt_client *mqtt = &client->client;
+
+    if (mqtt->error < 0 && mqtt->error != MQTT_ERROR_SEND_BUFFER_IS_FULL)
+    {
+        return mqtt->error;
+    }
+
+    // A full in-flight window is back pressure just like a full send buffer
+    if ((publish_flags & MQTT_PUBLISH_QOS_MASK) != 0 && !inflight_window_open_locked(client))
+    {
+        return MQTT_ERROR_SEND_BUFFER_IS_FULL;
+    }
+
+    size_t packet_length = publish_packet_size(strlen(topic), payload_length, publish_flags);
+    bool bulk            = priority != DX_MQTT_PRIORITY_HIGH;
+
+    // Bulk waits for the send queue to drain once its budget is spent, like a full buffer
+    if ((bulk && !bulk_budget_open_locked(client, packet_length)) || !reserve_send_space_locked(client, packet_length))
+    {
+        return MQTT_ERROR_SEND_BUFFER_IS_FULL;
+    }
+
+    uint16_t packet_id = __mqtt_next_pid(mqtt);
+    ssize_t rv         = mqtt_pack_publish_request(mqtt->mq.curr, mqtt->mq.curr_sz, topic, packet_id, payload, payload_length, publish_flags);
+
+    if (rv <= 0)
+    {
+        return rv == 0 ? MQTT_ERROR_SEND_BUFFER_IS_FULL : (enum MQTTErrors)rv;
+    }
+
+    struct mqtt_queued_message *msg = mqtt_mq_register(&mqtt->mq, (size_t)rv);
+    msg->control_type               = MQTT_CONTROL_PUBLISH;
+    msg->packet_id                  = packet_id;
+    stats_publish_sent_locked(client, (publish_flags & MQTT_PUBLISH_QOS_MASK) >> 1, (size_t)rv);
+
+    if (bulk)
+    {
+        bulk_budget_spend_locked(client, (size_t)rv);
+    }
+
+    if ((publish_flags & MQTT_PUBLISH_QOS_MASK) != 0)
+    {
+        inflight_track_locked(client, packet_id);
+    }
+
+    // A previous mqtt_publish may have latched the full buffer error, there is room again
+    if (mqtt->error == MQTT_ERROR_SEND_BUFFER_IS_FULL)
+    {
+        mqtt->error = MQTT_OK;
+    }
+
+    return MQTT_OK;
+}
+
+/// <summary>
+/// Lock the MQTT-C client and encode a PUBLISH into its send queue
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="topic">Topic name</param>
+/// <param name="payload">Payload bytes</param>
+/// <param name="payload_length">Payload length</param>
+/// <param name="publish_flags">MQTT-C publish flags</param>
+/// <param name="priority">Normal priority publishes are held to the bulk budget</param>
+/// <returns>MQTT_OK or the error that prevented queuing</returns>
+static enum MQTTErrors enqueue_publish(
+    DX_MQTT_CLIENT *client, const char *topic, const void *payload, size_t payload_length, uint8_t publish_flags, DX_MQTT_PRIORITY priority)
+{
+    MQTT_PAL_MUTEX_LOCK(&client->client.mutex);
+    enum MQTTErrors result = enqueue_publish_locked(client, topic, payload, payload_length, publish_flags, priority);
+    MQTT_PAL_MUTEX_UNLOCK(&client->client.mutex);
+
+    return result;
+}
+
+/// <summary>
+/// Check whether a normal priority packet fits what is left of the bulk budget, noting
+/// that bulk is waiting when it does not. A packet larger than the whole budget goes
+/// once the budget is untouched. Caller holds the MQTT-C mutex.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="packet_length">Encoded packet size</param>
+/// <returns>True if the packet may be queued</returns>
+static bool bulk_budget_open_locked(DX_MQTT_CLIENT *client, size_t packet_length)
+{
+    size_t budget = client->config.bulk_flush_budget;
+    if (budget == 0 || packet_length <= client->bulk_budget || client->bulk_budget == budget)
+    {
+        return true;
+    }
+
+    client->bulk_deferred = true;
+    return false;
+}
+
+/// <summary>
+/// Charge a queued normal priority packet to the bulk budget. Caller holds the MQTT-C mutex.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="packet_length">Encoded packet size</param>
+static void bulk_budget_spend_locked(DX_MQTT_CLIENT *client, size_t packet_length)
+{
+    client->bulk_budget = packet_length < client->bulk_budget ? client->bulk_budget - packet_length : 0;
+}
+
+/// <summary>
+/// Reopen the bulk budget once everything queued has been written to the socket, and
+/// come straight back for bulk that was waiting on it
+/// </summary>
+/// <param name="client">MQTT client</param>
+static void refill_bulk_budget(DX_MQTT_CLIENT *client)
+{
+    if (client->config.bulk_flush_budget == 0)
+    {
+        return;
+    }
+
+    MQTT_PAL_MUTEX_LOCK(&client->client.mutex);
+
+    bool drained = !has_pending_send_locked(&client->client);
+    bool wake    = drained && client->bulk_deferred;
+    if (drained)
+    {
+        client->bulk_budget   = client->config.bulk_flush_budget;
+        client->bulk_deferred = false;
+    }
+
+    MQTT_PAL_MUTEX_UNLOCK(&client->client.mutex);
+
+    if (wake)
+    {
+        signal_publish_queue(client);
+    }
+}
+
+/// <summary>
+/// Translate a DX_MQTT_MESSAGE QoS and retain setting to MQTT-C publish flags
+/// </summary>
+/// <param name="message">Message to publish</param>
+/// <returns>MQTT-C publish flags</returns>
+static uint8_t publish_flags_for(const DX_MQTT_MESSAGE *message)
+{
+    // Default QoS to 0 if not specified or invalid
+    uint8_t flags = MQTT_PUBLISH_QOS_0;
+    if (message->qos == 1)
+    {
+        flags = MQTT_PUBLISH_QOS_1;
+    }
+    else if (message->qos == 2)
+    {
+        flags = MQTT_PUBLISH_QOS_2;
+    }
+
+    if (message->retain)
+    {
+        flags |= MQTT_PUBLISH_RETAIN;
+    }
+
+    return flags;
+}
+
+/// <summary>
+/// Send the last count queued packets with one sendmsg and update their MQTT-C state
+/// the way __mqtt_send would. Packets are left to mqtt_sync when older data is still
+/// unsent, so ordering on the wire never changes. Caller holds the MQTT-C mutex.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="count">Number of packets at the tail of the queue</param>
+static void flush_tail_locked(DX_MQTT_CLIENT *client, size_t count)
+{
+    struct mqtt_client *mqtt = &client->client;
+    ssize_t length           = mqtt_mq_length(&mqtt->mq);
+    ssize_t first            = length - (ssize_t)count;
+
+    // Under TLS every byte has to go through the SSL BIO, leave the packets to mqtt_sync
+    if (count == 0 || client->config.use_tls || mqtt->error != MQTT_OK || mqtt->send_offset != 0)
+    {
+        return;
+    }
+
+    for (ssize_t i = 0; i < first; i++)
+    {
+        struct mqtt_queued_message *msg = mqtt_mq_get(&mqtt->mq, i);
+        if (msg->state == MQTT_QUEUED_UNSENT)
+        {
+            return;
+        }
+
+        // MQTT-C only allows one QoS 2 publish in flight, let it pace those
+        if (msg->control_type == MQTT_CONTROL_PUBLISH && msg->state == MQTT_QUEUED_AWAITING_ACK && ((msg->start[0] >> 1) & 0x03) == 2)
+        {
+            return;
+        }
+    }
+
+    struct iovec iov[DX_MQTT_BATCH_MAX_IOV];
+    size_t iov_count = 0;
+
+    for (ssize_t i = first; i < length && iov_count < DX_MQTT_BATCH_MAX_IOV; i++)
+    {
+        struct mqtt_queued_message *msg = mqtt_mq_get(&mqtt->mq, i);
+        if (((msg->start[0] >> 1) & 0x03) == 2 && iov_count > 0)
+        {
+            break;
+        }
+
+        iov[iov_count].iov_base = msg->start;
+        iov[iov_count].iov_len  = msg->size;
+        iov_count++;
+
+        if (((msg->start[0] >> 1) & 0x03) == 2)
+        {
+            break;
+        }
+    }
+
+    struct msghdr header = {.msg_iov = iov, .msg_iovlen = iov_count};
+    ssize_t sent         = sendmsg(client->sockfd, &header, MSG_NOSIGNAL);
+    if (sent <= 0)
+    {
+        // Would block or failed, mqtt_sync retries and reports socket errors
+        return;
+    }
+
+    mqtt_pal_time_t now     = MQTT_PAL_TIME();
+    mqtt->time_of_last_send = now;
+
+    for (ssize_t i = first; i < first + (ssize_t)iov_count && sent > 0; i++)
+    {
+        struct mqtt_queued_message *msg = mqtt_mq_get(&mqtt->mq, i);
+
+        if ((size_t)sent < msg->size)
+        {
+            // MQTT-C resumes a partially sent packet from send_offset
+            mqtt->send_offset = (size_t)sent;
+            break;
+        }
+
+        sent -= (ssize_t)msg->size;
+        msg->time_sent = now;
+
+        uint8_t qos = (msg->start[0] >> 1) & 0x03;
+        if (qos == 0)
+        {
+            msg->state = MQTT_QUEUED_COMPLETE;
+        }
+        else
+        {
+            msg->state = MQTT_QUEUED_AWAITING_ACK;
+            if (qos == 1)
+            {
+                // Set DUP for any resend, as MQTT-C does [MQTT-3.3.1-1]
+                msg->start[0] |= MQTT_PUBLISH_DUP;
+            }
+        }
+    }
+}
+
+/// <summary>
+/// Set the last error message
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="format">Format string</param>
+/// <param name="...">Format arguments</param>
+static void set_last_error(DX_MQTT_CLIENT *client, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vsnprintf(client->last_error, sizeof(client->last_error), format, args);
+    va_end(args);
+
+    dx_Log_Debug("DX MQTT Error: %s\n", client->last_error);
+}
+
+/// <summary>
+/// Clean up MQTT connection resources (but not the daemon thread)
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <returns>True on success</returns>
+static bool cleanup_connection(DX_MQTT_CLIENT *client)
+{
+    bool success = true;
+
+    close_socket(client);
+    stats_session_ended(client);
+
+    client->is_connected   = false;
+    client->is_initialized = false;
+    pthread_cond_broadcast(&client->inflight_cond);
+
+    return success;
+}
+
+/// <summary>
+/// Close the connection socket, detaching it from the event loop first. Taken under
+/// the MQTT-C mutex so a publish flushing on another thread never sees a stale fd.
+/// </summary>
+/// <param name="client">MQTT client</param>
+static void close_socket(DX_MQTT_CLIENT *client)
+{
+    // Release the event loop handles before the socket they watch goes away
+    loop_driver_stop(client);
+
+    if (client->mqtt_initialized)
+    {
+        MQTT_PAL_MUTEX_LOCK(&client->client.mutex);
+    }
+
+    transport_close(client);
+
+    if (client->sockfd != -1)
+    {
+        close(client->sockfd);
+        client->sockfd = -1;
+    }
+
+    if (client->mqtt_initialized)
+    {
+        MQTT_PAL_MUTEX_UNLOCK(&client->client.mutex);
+    }
+}
+
+/// <summary>
+/// Put the transport MQTT-C uses on top of the connected socket, starting TLS when configured
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <returns>True on success</returns>
+static bool transport_open(DX_MQTT_CLIENT *client)
+{
+#ifdef MQTT_USE_BIO
+    client->transport = dx_mqttTlsOpen(client->tls, client->sockfd, client->config.hostname);
+    if (client->transport == NULL)
+    {
+        set_last_error(client, "Failed to set up the MQTT transport for %s", client->config.hostname);
+        return false;
+    }
+#else
+    client->transport = client->sockfd;
+#endif
+
+    return true;
+}
+
+/// <summary>
+/// Release the transport ahead of closing its socket. Caller holds the MQTT-C mutex
+/// once it is initialized, so no sync can be using the transport.
+/// </summary>
+/// <param name="client">MQTT client</param>
+static void transport_close(DX_MQTT_CLIENT *client)
+{
+#ifdef MQTT_USE_BIO
+    dx_mqttTlsClose(client->transport);
+    client->transport = NULL;
+#else
+    client->transport = -1;
+#endif
+
+    // A sync racing the close then fails cleanly instead of touching a freed transport
+    if (client->mqtt_initialized)
+    {
+        client->client.socketfd = client->transport;
+    }
+}
+
+/// <summary>
+/// Broker port from the configuration, or the MQTT default for the transport
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <returns>Port string</returns>
+static const char *client_port(DX_MQTT_CLIENT *client)
+{
+    if (client->config.port != NULL)
+    {
+        return client->config.port;
+    }
+
+    return client->config.use_tls ? DX_MQTT_DEFAULT_TLS_PORT : DX_MQTT_DEFAULT_PORT;
+}
+
+/// <summary>
+/// Start an MQTT session on a connected socket: queue CONNECT followed by the
+/// remembered subscriptions and, in event loop mode, attach the socket to the loop.
+/// Closes the socket on failure.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="sockfd">Connected non-blocking socket</param>
+/// <returns>True on success</returns>
+static bool start_session(DX_MQTT_CLIENT *client, int sockfd)
+{
+    const DX_MQTT_CONFIG *config = &client->config;
+    const char *client_id        = config->client_id; // Can be NULL for anonymous client
+    uint16_t keep_alive          = config->keep_alive_seconds > 0 ? config->keep_alive_seconds : 400;
+
+    client->sockfd = sockfd;
+    dx_mqttSocketLogOptions(sockfd);
+
+#ifdef SO_NOSIGPIPE
+    // Where the platform has it, a broker hanging up can never raise SIGPIPE on this socket
+    int no_sigpipe = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_NOSIGPIPE, &no_sigpipe, sizeof(no_sigpipe));
+#endif
+
+    if (!transport_open(client))
+    {
+        close_socket(client);
+        return false;
+    }
+
+    if (!allocate_buffers(client))
+    {
+        set_last_error(client, "Failed to allocate MQTT buffers");
+        close_socket(client);
+        return false;
+    }
+
+    if (config->publish_queue_length > 0 && client->publish_queue == NULL)
+    {
+        size_t slot_size = config->publish_queue_slot_size > 0 ? config->publish_queue_slot_size : 512;
+
+        client->publish_queue  = dx_mqttRingCreate(config->publish_queue_length, sizeof(MQTT_QUEUED_PUBLISH) + slot_size);
+        client->priority_queue = dx_mqttRingCreate(config->publish_queue_length, sizeof(MQTT_QUEUED_PUBLISH) + slot_size);
+        if (client->publish_queue == NULL || client->priority_queue == NULL)
+        {
+            dx_mqttRingDestroy(client->publish_queue);
+            dx_mqttRingDestroy(client->priority_queue);
+            client->publish_queue  = NULL;
+            client->priority_queue = NULL;
+            set_last_error(client, "Failed to allocate MQTT publish queue");
+            close_socket(client);
+            return false;
+        }
+    }
+
+    // Publishes in flight on the old session are gone with its queue
+    inflight_reset(client);
+
+    // Initialize MQTT client, later sessions keep the mutex and drop what was queued for the old socket
+    if (!client->mqtt_initialized)
+    {
+        mqtt_init(&client->client, client->transport, client->send_buffer, client->send_buffer_size, client->recv_buffer,
+            client->recv_buffer_size, publish_callback);
+        client->client.publish_response_callback_state = client;
+        client->mqtt_initialized                        = true;
+    }
+    else
+    {
+        // A reservation pinned on the old session still points into the queue being reset
+        MQTT_PAL_MUTEX_LOCK(&client->client.mutex);
+        if (!send_queue_wait_locked(client))
+        {
+            MQTT_PAL_MUTEX_UNLOCK(&client->client.mutex);
+            set_last_error(client, "MQTT connect failed: a publish reservation is open on this thread");
+            close_socket(client);
+            return false;
+        }
+        mqtt_reinit(&client->client, client->transport, client->send_buffer, client->send_buffer_size, client->recv_buffer,
+            client->recv_buffer_size);
+        MQTT_PAL_MUTEX_UNLOCK(&client->client.mutex);
+    }
+
+    // Prepare connection flags
+    uint8_t connect_flags = 0;
+    if (config->clean_session)
+    {
+        connect_flags |= MQTT_CONNECT_CLEAN_SESSION;
+    }
+
+    // Connect to broker
+    if (mqtt_connect(&client->client, client_id, config->username, config->password, config->password ? strlen(config->password) : 0, NULL, NULL,
+            connect_flags, keep_alive) != MQTT_OK)
+    {
+        set_last_error(client, "MQTT connect failed: %s", mqtt_error_str(client->client.error));
+        close_socket(client);
+        return false;
+    }
+
+    // Check for connection errors
+    if (client->client.error != MQTT_OK)
+    {
+        set_last_error(client, "MQTT connection error: %s", mqtt_error_str(client->client.error));
+        close_socket(client);
+        return false;
+    }
+
+    if (!restore_subscriptions(client))
+    {
+        set_last_error(client, "Failed to queue subscriptions for restore");
+    }
+
+    if (config->use_event_loop)
+    {
+        if (!loop_driver_start(client))
+        {
+            set_last_error(client, "Failed to attach MQTT socket to the event loop");
+            close_socket(client);
+            return false;
+        }
+        dx_Log_Debug("DX MQTT: Attached to the event loop\n");
+    }
+
+    // Whatever ping was under way belonged to the previous connection
+    client->ping_sent_us   = 0;
+    client->ping_queued    = false;
+    client->ping_last_send = client->client.time_of_last_send;
+    stats_session_started(client);
+
+    // The old session's queue went with mqtt_reinit, so the bulk budget starts full
+    client->bulk_budget   = config->bulk_flush_budget;
+    client->bulk_deferred = false;
+
+    client->is_initialized = true;
+    client->is_connected   = true;
+
+    return true;
+}
+
+/// <summary>
+/// Remember a subscription so it can be restored after a reconnect
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="topic">Topic filter</param>
+/// <param name="qos">Requested QoS</param>
+/// <returns>False if the subscription could not be stored</returns>
+static bool subscription_add(DX_MQTT_CLIENT *client, const char *topic, uint8_t qos)
+{
+    bool stored = false;
+
+    pthread_mutex_lock(&client->subscriptions_lock);
+
+    for (size_t i = 0; i < client->subscription_count && !stored; i++)
+    {
+        if (strcmp(client->subscriptions[i].topic, topic) == 0)
+        {
+            client->subscriptions[i].qos = qos;
+            stored                       = true;
+        }
+    }
+
+    if (!stored && client->subscription_count == client->subscription_capacity)
+    {
+        size_t capacity                  = client->subscription_capacity == 0 ? 8 : client->subscription_capacity * 2;
+        MQTT_SUBSCRIPTION *subscriptions = realloc(client->subscriptions, capacity * sizeof(MQTT_SUBSCRIPTION));
+        if (subscriptions != NULL)
+        {
+            client->subscriptions         = subscriptions;
+            client->subscription_capacity = capacity;
+        }
+    }
+
+    if (!stored && client->subscription_count < client->subscription_capacity)
+    {
+        char *copy = strdup(topic);
+        if (copy != NULL)
+        {
+            client->subscriptions[client->subscription_count].topic = copy;
+            client->subscriptions[client->subscription_count].qos   = qos;
+            client->subscription_count++;
+            stored = true;
+        }
+    }
+
+    pthread_mutex_unlock(&client->subscriptions_lock);
+
+    return stored;
+}
+
+/// <summary>
+/// Forget a subscription after an unsubscribe
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="topic">Topic filter</param>
+static void subscription_remove(DX_MQTT_CLIENT *client, const char *topic)
+{
+    pthread_mutex_lock(&client->subscriptions_lock);
+
+    for (size_t i = 0; i < client->subscription_count; i++)
+    {
+        if (strcmp(client->subscriptions[i].topic, topic) == 0)
+        {
+            free(client->subscriptions[i].topic);
+            client->subscriptions[i] = client->subscriptions[--client->subscription_count];
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&client->subscriptions_lock);
+}
+
+/// <summary>
+/// Queue a single SUBSCRIBE carrying every remembered subscription. MQTT-C only
+/// encodes one topic per SUBSCRIBE, so the packet is built here and registered in
+/// its queue like mqtt_subscribe would. Runs straight after mqtt_connect.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <returns>True if there was nothing to restore or the packet was queued</returns>
+static bool restore_subscriptions(DX_MQTT_CLIENT *client)
+{
+    // Encode under the subscription lock, publish_callback takes it under the MQTT-C mutex
+    pthread_mutex_lock(&client->subscriptions_lock);
+
+    size_t count     = client->subscription_count;
+    size_t remaining = 2;
+    for (size_t i = 0; i < count; i++)
+    {
+        remaining += 2 + strlen(client->subscriptions[i].topic) + 1;
+    }
+
+    size_t packet_size = 1 + remaining_length_size(remaining) + remaining;
+    uint8_t *packet    = count > 0 ? malloc(packet_size) : NULL;
+    uint8_t *cursor    = packet;
+
+    if (packet != NULL)
+    {
+        *cursor++ = (uint8_t)((MQTT_CONTROL_SUBSCRIBE << 4) | 0x02);
+        for (size_t length = remaining;;)
+        {
+            uint8_t encoded = length % 128;
+            length /= 128;
+            *cursor++ = length > 0 ? (encoded | 0x80) : encoded;
+            if (length == 0)
+            {
+                break;
+            }
+        }
+
+        // Packet id is filled in once the MQTT-C mutex is held
+        cursor += 2;
+
+        for (size_t i = 0; i < count; i++)
+        {
+            size_t topic_length = strlen(client->subscriptions[i].topic);
+
+            *cursor++ = (uint8_t)(topic_length >> 8);
+            *cursor++ = (uint8_t)(topic_length & 0xFF);
+            memcpy(cursor, client->subscriptions[i].topic, topic_length);
+            cursor += topic_length;
+            *cursor++ = client->subscriptions[i].qos;
+        }
+    }
+
+    pthread_mutex_unlock(&client->subscriptions_lock);
+
+    if (count == 0)
+    {
+        return true;
+    }
+
+    if (packet == NULL)
+    {
+        return false;
+    }
+
+    struct mqtt_client *mqtt = &client->client;
+    bool queued              = false;
+
+    MQTT_PAL_MUTEX_LOCK(&mqtt->mutex);
+
+    if (reserve_send_space_locked(client, packet_size))
+    {
+        uint16_t packet_id = __mqtt_next_pid(mqtt);
+        size_t pid_offset  = 1 + remaining_length_size(remaining);
+
+        packet[pid_offset]     = (uint8_t)(packet_id >> 8);
+        packet[pid_offset + 1] = (uint8_t)(packet_id & 0xFF);
+        memcpy(mqtt->mq.curr, packet, packet_size);
+
+        struct mqtt_queued_message *msg = mqtt_mq_register(&mqtt->mq, packet_size);
+        msg->control_type               = MQTT_CONTROL_SUBSCRIBE;
+        msg->packet_id                  = packet_id;
+        queued                          = true;
+    }
+
+    MQTT_PAL_MUTEX_UNLOCK(&mqtt->mutex);
+
+    free(packet);
+
+    if (queued)
+    {
+        dx_Log_Debug("DX MQTT: Restoring %zu subscriptions\n", count);
+    }
+
+    return queued;
+}
+
+/// <summary>
+/// Raise the application's connection handler
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="connected">New connection state</param>
+static void notify_connection(DX_MQTT_CLIENT *client, bool connected)
+{
+    if (client->connection_handler != NULL)
+    {
+        client->connection_handler(client, connected, client->connection_context);
+    }
+}
+
+/// <summary>
+/// Mark the connection as lost, tell the application and start the reconnect
+/// backoff. Only the first caller after a drop does anything.
+/// </summary>
+/// <param name="client">MQTT client</param>
+static void connection_lost(DX_MQTT_CLIENT *client)
+{
+    if (!atomic_exchange(&client->is_connected, false))
+    {
+        return;
+    }
+
+    dx_Log_Debug("DX MQTT: Connection lost\n");
+    stats_session_ended(client);
+
+    // Wake producers waiting for window space, their publishes now go to the outbox or fail
+    pthread_cond_broadcast(&client->inflight_cond);
+
+    notify_connection(client, false);
+
+    schedule_reconnect(client);
+}
+
+/// <summary>
+/// Next reconnect delay. Doubles with each failed attempt up to the maximum, then
+/// keeps half of it and randomises the rest so devices that lost the same broker
+/// do not all come back in the same instant.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <returns>Delay in milliseconds</returns>
+static uint32_t reconnect_delay_ms(DX_MQTT_CLIENT *client)
+{
+    uint64_t min_delay = client->config.reconnect_min_delay_ms > 0 ? client->config.reconnect_min_delay_ms : DX_MQTT_DEFAULT_RECONNECT_MIN_DELAY_MS;
+    uint64_t max_delay = client->config.reconnect_max_delay_ms > 0 ? client->config.reconnect_max_delay_ms : DX_MQTT_DEFAULT_RECONNECT_MAX_DELAY_MS;
+
+    if (max_delay < min_delay)
+    {
+        max_delay = min_delay;
+    }
+
+    unsigned int attempt = atomic_fetch_add(&client->reconnect_attempt, 1);
+    uint64_t delay       = attempt >= 32 ? max_delay : min_delay << attempt;
+    if (delay > max_delay)
+    {
+        delay = max_delay;
+    }
+
+    return (uint32_t)(delay / 2 + (uint64_t)rand_r(&client->reconnect_seed) % (delay / 2 + 1));
+}
+
+/// <summary>
+/// libuv reconnect backoff timer callback for event loop mode
+/// </summary>
+static void reconnect_timer_handler(uv_timer_t *handle)
+{
+    reconnect_now(handle->data);
+}
+
+/// <summary>
+/// Free the reconnect timer once libuv has released it
+/// </summary>
+static void reconnect_timer_close_handler(uv_handle_t *handle)
+{
+    free(handle);
+}
+
+/// <summary>
+/// Start the reconnect backoff timer for reconnect_at_ms. Loop thread only.
+/// </summary>
+/// <param name="client">MQTT client</param>
+static void reconnect_timer_arm(DX_MQTT_CLIENT *client)
+{
+    if (client->reconnect_timer == NULL)
+    {
+        client->reconnect_timer = malloc(sizeof(uv_timer_t));
+        if (client->reconnect_timer == NULL)
+        {
+            client->reconnect_pending = false;
+            set_last_error(client, "Failed to allocate MQTT reconnect timer");
+            return;
+        }
+        uv_timer_init(uv_default_loop(), client->reconnect_timer);
+        client->reconnect_timer->data = client;
+    }
+
+    int64_t remaining_ms = client->reconnect_at_ms - dx_getNowMilliseconds();
+    uv_timer_start(client->reconnect_timer, reconnect_timer_handler, remaining_ms < 0 ? 0 : (uint64_t)remaining_ms, 0);
+}
+
+/// <summary>
+/// Arm the next reconnect attempt on whichever driver owns the connection. Safe from
+/// any thread: a loop driver is woken and arms the timer from its callback.
+/// </summary>
+/// <param name="client">MQTT client</param>
+static void schedule_reconnect(DX_MQTT_CLIENT *client)
+{
+    if (!client->reconnect_enabled)
+    {
+        return;
+    }
+
+    uint32_t delay_ms = reconnect_delay_ms(client);
+
+    dx_Log_Debug("DX MQTT: Reconnecting in %u ms\n", delay_ms);
+
+    client->reconnect_at_ms   = dx_getNowMilliseconds() + delay_ms;
+    client->reconnect_pending = true;
+
+    if (client->daemon_created)
+    {
+        wakeup_daemon(client);
+    }
+    else if (!loop_driver_signal(client))
+    {
+        // No driver means the socket is already gone (event loop mode, or a first async
+        // connect failed), which only happens in callbacks on the loop thread
+        reconnect_timer_arm(client);
+    }
+}
+
+/// <summary>
+/// Async connector result for an event loop reconnect
+/// </summary>
+static void reconnect_socket_connected(int sockfd, int status, void *context)
+{
+    DX_MQTT_CLIENT *client = context;
+
+    client->pending_connect = NULL;
+
+    if (sockfd == -1)
+    {
+        set_last_error(client, "Reconnect to %s failed: %s", client->config.hostname, uv_strerror(status));
+        schedule_reconnect(client);
+        return;
+    }
+
+    finish_reconnect(client, sockfd);
+}
+
+/// <summary>
+/// Drop the old socket and open a new one. The daemon thread connects inline,
+/// otherwise the async connector keeps the event loop from blocking.
+/// </summary>
+/// <param name="client">MQTT client</param>
+static void reconnect_now(DX_MQTT_CLIENT *client)
+{
+    const char *port = client_port(client);
+
+    if (!client->reconnect_pending || client->pending_connect != NULL)
+    {
+        return;
+    }
+
+    client->reconnect_pending = false;
+    close_socket(client);
+
+    dx_Log_Debug("DX MQTT: Reconnecting to %s:%s\n", client->config.hostname, port);
+
+    if (client->daemon_created)
+    {
+        char error[128];
+        int sockfd = open_nb_socket(client->config.hostname, port, &client->config.socket_options, error, sizeof(error));
+        if (sockfd == -1)
+        {
+            set_last_error(client, "Reconnect to %s:%s failed: %s", client->config.hostname, port, error);
+            schedule_reconnect(client);
+            return;
+        }
+
+        finish_reconnect(client, sockfd);
+        return;
+    }
+
+    client->pending_connect = dx_mqttSocketConnectAsync(uv_default_loop(), client->config.hostname, port, DX_MQTT_CONNECT_TIMEOUT_MS,
+        &client->config.socket_options, reconnect_socket_connected, client);
+    if (client->pending_connect == NULL)
+    {
+        set_last_error(client, "Failed to start MQTT reconnect");
+        schedule_reconnect(client);
+    }
+}
+
+/// <summary>
+/// Start a session on a freshly opened socket and report the reconnect
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="sockfd">Connected socket</param>
+static void finish_reconnect(DX_MQTT_CLIENT *client, int sockfd)
+{
+    if (!start_session(client, sockfd))
+    {
+        schedule_reconnect(client);
+        return;
+    }
+
+    client->reconnect_attempt = 0;
+    stats_add(&client->stats.reconnects, 1);
+
+    // A thread mode client whose first async connect failed has no daemon yet
+    if (!client->config.use_event_loop && !start_daemon(client))
+    {
+        connection_lost(client);
+        return;
+    }
+
+    dx_Log_Debug("DX MQTT: Reconnected to %s\n", client->config.hostname);
+
+    request_service(client);
+    notify_connection(client, true);
+}
+
+/// <summary>
+/// Cancel a pending reconnect. In event loop mode this must run on the loop thread.
+/// </summary>
+/// <param name="client">MQTT client</param>
+static void reconnect_stop(DX_MQTT_CLIENT *client)
+{
+    client->reconnect_pending = false;
+
+    if (client->reconnect_timer != NULL)
+    {
+        uv_close((uv_handle_t *)client->reconnect_timer, reconnect_timer_close_handler);
+        client->reconnect_timer = NULL;
+    }
+
+    // Closes any socket still opening, its callback will not run
+    if (client->pending_connect != NULL)
+    {
+        dx_mqttSocketConnectCancel(client->pending_connect);
+        client->pending_connect = NULL;
+    }
+}
+
+/// <summary>
+/// Reset a client to its disconnected state
+/// </summary>
+/// <param name="client">MQTT client</param>
+static void client_init(DX_MQTT_CLIENT *client)
+{
+    memset(client, 0, sizeof(*client));
+    client->sockfd       = -1;
+#ifndef MQTT_USE_BIO
+    client->transport = -1;
+#endif
+    client->wakeup_fd[0] = -1;
+    client->wakeup_fd[1] = -1;
+    pthread_mutex_init(&client->subscriptions_lock, NULL);
+
+    pthread_mutex_init(&client->codec_lock, NULL);
+    pthread_mutex_init(&client->conflation_lock, NULL);
+    pthread_mutex_init(&client->rate_lock, NULL);
+    pthread_mutex_init(&client->driver_lock, NULL);
+
+    pthread_cond_init(&client->inflight_cond, NULL);
+    pthread_cond_init(&client->reservation_cond, NULL);
+}
+
+/// <summary>
+/// Release the owned copies of the configuration strings
+/// </summary>
+/// <param name="config">Configuration owned by a client</param>
+static void config_free(DX_MQTT_CONFIG *config)
+{
+    free((char *)config->hostname);
+    free((char *)config->port);
+    free((char *)config->client_id);
+    free((char *)config->username);
+    free((char *)config->password);
+    free((char *)config->outbox_path);
+    free((char *)config->ca_file);
+    free((char *)config->cert_file);
+    free((char *)config->key_file);
+    memset(config, 0, sizeof(*config));
+}
+
+/// <summary>
+/// Compare two strings that may be NULL
+/// </summary>
+/// <param name="a">First string</param>
+/// <param name="b">Second string</param>
+/// <returns>True if both are NULL or equal</returns>
+static bool config_string_equal(const char *a, const char *b)
+{
+    return a == b || (a != NULL && b != NULL && strcmp(a, b) == 0);
+}
+
+/// <summary>
+/// Duplicate a string that may be NULL
+/// </summary>
+/// <param name="source">String to copy</param>
+/// <param name="copy">Receives the copy</param>
+/// <returns>False if the allocation failed</returns>
+static bool config_copy_string(const char *source, const char **copy)
+{
+    *copy = NULL;
+    if (source == NULL)
+    {
+        return true;
+    }
+
+    *copy = strdup(source);
+    return *copy != NULL;
+}
+
+/// <summary>
+/// Store a private copy of the configuration so the caller's strings may go out of scope
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="config">Configuration to copy</param>
+/// <returns>True on success</returns>
+static bool client_set_config(DX_MQTT_CLIENT *client, const DX_MQTT_CONFIG *config)
+{
+    DX_MQTT_CONFIG copy = *config;
+
+    if (!config_copy_string(config->hostname, &copy.hostname) || !config_copy_string(config->port, &copy.port) ||
+        !config_copy_string(config->client_id, &copy.client_id) || !config_copy_string(config->username, &copy.username) ||
+        !config_copy_string(config->password, &copy.password) || !config_copy_string(config->outbox_path, &copy.outbox_path) ||
+        !config_copy_string(config->ca_file, &copy.ca_file) || !config_copy_string(config->cert_file, &copy.cert_file) ||
+        !config_copy_string(config->key_file, &copy.key_file))
+    {
+        config_free(&copy);
+        set_last_error(client, "Failed to allocate memory for configuration");
+        return false;
+    }
+
+#ifdef MQTT_USE_BIO
+    // Keep the TLS context, and with it the cached session, unless its settings change
+    client->tls_stale = client->tls_stale || copy.tls_insecure != client->config.tls_insecure ||
+                        !config_string_equal(copy.ca_file, client->config.ca_file) ||
+                        !config_string_equal(copy.cert_file, client->config.cert_file) ||
+                        !config_string_equal(copy.key_file, client->config.key_file);
+#endif
+
+    config_free(&client->config);
+    client->config = copy;
+
+    return true;
+}
+
+/// <summary>
+/// Return the instance behind the single connection API, initializing it on first use
+/// </summary>
+/// <returns>Default client</returns>
+static DX_MQTT_CLIENT *default_client(void)
+{
+    if (!_default_client_initialized)
+    {
+        client_init(&_default_client);
+        _default_client_initialized = true;
+    }
+
+    return &_default_client;
+}
+
+/// <summary>
+/// Create an MQTT client instance for a broker connection
+/// </summary>
+/// <param name="config">MQTT connection configuration, copied into the client</param>
+/// <returns>New client, or NULL on failure</returns>
+DX_MQTT_CLIENT *dx_mqttClientCreate(const DX_MQTT_CONFIG *config)
+{
+    if (config == NULL || config->hostname == NULL)
+    {
+        return NULL;
+    }
+
+    DX_MQTT_CLIENT *client = malloc(sizeof(DX_MQTT_CLIENT));
+    if (client == NULL)
+    {
+        return NULL;
+    }
+
+    client_init(client);
+
+    if (!client_set_config(client, config))
+    {
+        free(client);
+        return NULL;
+    }
+
+    return client;
+}
+
+/// <summary>
+/// Build the TLS context for a connect, reusing the existing one while the TLS
+/// settings are unchanged. Runs after the old connection is gone.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <returns>False if TLS was requested but could not be set up</returns>
+static bool connect_prepare_tls(DX_MQTT_CLIENT *client)
+{
+    const DX_MQTT_CONFIG *config = &client->config;
+
+#ifdef MQTT_USE_BIO
+    if (client->tls != NULL && (client->tls_stale || !config->use_tls))
+    {
+        dx_mqttTlsDestroy(client->tls);
+        client->tls = NULL;
+    }
+    client->tls_stale = false;
+
+    if (config->use_tls && client->tls == NULL)
+    {
+        char error[192];
+        client->tls = dx_mqttTlsCreate(config->ca_file, config->cert_file, config->key_file, !config->tls_insecure, error, sizeof(error));
+        if (client->tls == NULL)
+        {
+            set_last_error(client, "TLS setup failed: %s", error);
+            return false;
+        }
+    }
+#else
+    if (config->use_tls)
+    {
+        set_last_error(client, "TLS requested but the library was built without DX_MQTT_TLS");
+        return false;
+    }
+#endif
+
+    return true;
+}
+
+/// <summary>
+/// Validate the configuration and reset the client ahead of a connect
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="message_handler">Callback function for received messages (can be NULL)</param>
+/// <param name="context">User context to pass to the message handler</param>
+/// <returns>True if the connect may go ahead</returns>
+static bool connect_prepare(DX_MQTT_CLIENT *client, DX_MQTT_MESSAGE_RECEIVED_HANDLER message_handler, void *context)
+{
+    const DX_MQTT_CONFIG *config = &client->config;
+
+    if (config->hostname == NULL)
+    {
+        set_last_error(client, "Invalid configuration parameters");
+        return false;
+    }
+
+    // Clean up any existing connection
+    reconnect_stop(client);
+    if (client->is_initialized)
+    {
+        cleanup_connection(client);
+    }
+
+    // Store message handler and context
+    client->message_handler = message_handler;
+    client->user_context    = context;
+
+    client->reconnect_enabled = config->auto_reconnect;
+    client->reconnect_attempt = 0;
+    client->reconnect_seed    = (unsigned int)dx_getNowMilliseconds() ^ (unsigned int)(uintptr_t)client;
+
+    if (!connect_prepare_tls(client))
+    {
+        return false;
+    }
+
+    if (config->dispatch_workers > 0 && config->dispatch_on_loop)
+    {
+        set_last_error(client, "dispatch_workers and dispatch_on_loop cannot be combined");
+        return false;
+    }
+
+    // Event loop mode promises handlers run on the loop thread
+    if (config->dispatch_workers > 0 && config->use_event_loop)
+    {
+        set_last_error(client, "dispatch_workers and use_event_loop cannot be combined");
+        return false;
+    }
+
+    size_t dispatch_queue_length = config->dispatch_queue_length > 0 ? config->dispatch_queue_length : DX_MQTT_DEFAULT_DISPATCH_QUEUE_LENGTH;
+
+    if (config->dispatch_workers > 0 && client->dispatch_pool == NULL)
+    {
+        client->dispatch_pool = dx_mqttDispatchCreate(config->dispatch_workers, dispatch_queue_length, dispatch_received, client);
+        if (client->dispatch_pool == NULL)
+        {
+            set_last_error(client, "Failed to start %zu MQTT dispatch workers", config->dispatch_workers);
+            return false;
+        }
+    }
+
+    // Messages that fit the initial receive buffer are handed over without allocating
+    if (config->dispatch_on_loop && !config->use_event_loop && client->loop_handoff == NULL)
+    {
+        client->loop_handoff = dx_mqttHandoffCreate(uv_default_loop(), dispatch_queue_length,
+            config->recv_buffer_size > 0 ? config->recv_buffer_size : DX_MQTT_DEFAULT_RECV_BUFFER_SIZE, dispatch_received, client);
+        if (client->loop_handoff == NULL)
+        {
+            set_last_error(client, "Failed to create the MQTT loop handoff");
+            return false;
+        }
+    }
+
+    // Open the outbox first so publishes are kept even if this connect fails
+    if (config->outbox_path != NULL && client->outbox == NULL)
+    {
+        client->outbox = dx_mqttOutboxOpen(config->outbox_path, config->outbox_size > 0 ? config->outbox_size : DX_MQTT_DEFAULT_OUTBOX_SIZE,
+            config->outbox_drop_newest ? DX_MQTT_OUTBOX_DROP_NEWEST : DX_MQTT_OUTBOX_DROP_OLDEST);
+        if (client->outbox == NULL)
+        {
+            set_last_error(client, "Failed to open MQTT outbox '%s': %s", config->outbox_path, strerror(errno));
+            return false;
+        }
+        dx_Log_Debug("DX MQTT: Outbox holds %zu messages\n", dx_mqttOutboxCount(client->outbox));
+    }
+
+    dx_Log_Debug("DX MQTT: Connecting to %s:%s\n", config->hostname, client_port(client));
+
+    return true;
+}
+
+/// <summary>
+/// Start the background processing thread unless it is already running
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <returns>True when the daemon is running</returns>
+static bool start_daemon(DX_MQTT_CLIENT *client)
+{
+    if (client->daemon_created)
+    {
+        return true;
+    }
+
+    if (!wakeup_open(client))
+    {
+        set_last_error(client, "Failed to create MQTT wakeup channel: %s", strerror(errno));
+        return false;
+    }
+
+    client->daemon_running = true; // Set this before creating the thread
+    if (pthread_create(&client->daemon, NULL, client_refresher, client) != 0)
+    {
+        set_last_error(client, "Failed to start MQTT background processing thread");
+        client->daemon_running = false;
+        wakeup_close(client);
+        return false;
+    }
+    client->daemon_created = true;
+    dx_Log_Debug("DX MQTT: Created background processing thread\n");
+
+    return true;
+}
+
+/// <summary>
+/// Start the MQTT session on a connected socket and the driver that services it
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="sockfd">Connected non-blocking socket</param>
+/// <returns>True on success</returns>
+static bool connect_finish(DX_MQTT_CLIENT *client, int sockfd)
+{
+    const DX_MQTT_CONFIG *config = &client->config;
+
+    // The loop thread drives the connection, so a daemon from an earlier connect must go
+    if (config->use_event_loop)
+    {
+        stop_daemon(client);
+    }
+
+    if (!start_session(client, sockfd))
+    {
+        cleanup_connection(client);
+        return false;
+    }
+
+    // Start client daemon thread for automatic background processing (only once)
+    if (!config->use_event_loop && !start_daemon(client))
+    {
+        cleanup_connection(client);
+        return false;
+    }
+
+    // Let the driver pick up the new socket and flush the CONNECT packet
+    request_service(client);
+
+    dx_Log_Debug("DX MQTT: Successfully connected to %s\n", config->hostname);
+
+    notify_connection(client, true);
+    return true;
+}
+
+/// <summary>
+/// Connect a client to its MQTT broker. Blocks while the host is resolved and connected.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="message_handler">Callback function for received messages (can be NULL)</param>
+/// <param name="context">User context to pass to the message handler</param>
+/// <returns>True on success, false on failure</returns>
+bool dx_mqttClientConnect(DX_MQTT_CLIENT *client, DX_MQTT_MESSAGE_RECEIVED_HANDLER message_handler, void *context)
+{
+    if (client == NULL || !connect_prepare(client, message_handler, context))
+    {
+        return false;
+    }
+
+    const char *port = client_port(client);
+
+    // Open socket connection
+    char error[128];
+    int sockfd = open_nb_socket(client->config.hostname, port, &client->config.socket_options, error, sizeof(error));
+    if (sockfd == -1)
+    {
+        set_last_error(client, "Failed to open socket to %s:%s: %s", client->config.hostname, port, error);
+        return false;
+    }
+
+    return connect_finish(client, sockfd);
+}
+
+/// <summary>
+/// Async connector result for dx_mqttClientConnectAsync
+/// </summary>
+static void connect_socket_connected(int sockfd, int status, void *context)
+{
+    DX_MQTT_CLIENT *client = context;
+    bool connected         = false;
+
+    client->pending_connect = NULL;
+
+    if (sockfd == -1)
+    {
+        set_last_error(client, "Failed to open socket to %s: %s", client->config.hostname, uv_strerror(status));
+    }
+    else
+    {
+        connected = connect_finish(client, sockfd);
+    }
+
+    if (client->connect_complete != NULL)
+    {
+        client->connect_complete(client, connected, client->connect_complete_context);
+    }
+
+    // With auto_reconnect a failed first connect keeps retrying in the background
+    if (!connected)
+    {
+        schedule_reconnect(client);
+    }
+}
+
+/// <summary>
+/// Connect a client to its MQTT broker without blocking
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="message_handler">Callback function for received messages (can be NULL)</param>
+/// <param name="context">User context to pass to the message handler</param>
+/// <param name="complete">Called on the event loop thread with the outcome (can be NULL)</param>
+/// <param name="complete_context">User context passed to the completion callback</param>
+/// <returns>True if the connect was started</returns>
+bool dx_mqttClientConnectAsync(DX_MQTT_CLIENT *client, DX_MQTT_MESSAGE_RECEIVED_HANDLER message_handler, void *context,
+    DX_MQTT_CONNECTION_HANDLER complete, void *complete_context)
+{
+    if (client == NULL || !connect_prepare(client, message_handler, context))
+    {
+        return false;
+    }
+
+    client->connect_complete         = complete;
+    client->connect_complete_context = complete_context;
+
+    client->pending_connect = dx_mqttSocketConnectAsync(uv_default_loop(), client->config.hostname, client_port(client),
+        DX_MQTT_CONNECT_TIMEOUT_MS, &client->config.socket_options, connect_socket_connected, client);
+    if (client->pending_connect == NULL)
+    {
+        set_last_error(client, "Failed to start connecting to %s", client->config.hostname);
+        return false;
+    }
+
+    return true;
+}
+
+/// <summary>
+/// Register a callback for connection state changes
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="handler">Callback, NULL to remove</param>
+/// <param name="context">User context passed to the handler</param>
+void dx_mqttClientSetConnectionHandler(DX_MQTT_CLIENT *client, DX_MQTT_CONNECTION_HANDLER handler, void *context)
+{
+    if (client == NULL)
+    {
+        return;
+    }
+
+    client->connection_context = context;
+    client->connection_handler = handler;
+}
+
+/// <summary>
+/// Register a callback for acknowledged QoS 1/2 publishes
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="handler">Callback, NULL to remove</param>
+/// <param name="context">User context passed to the handler</param>
+void dx_mqttClientSetPublishCompleteHandler(DX_MQTT_CLIENT *client, DX_MQTT_PUBLISH_COMPLETE handler, void *context)
+{
+    if (client == NULL)
+    {
+        return;
+    }
+
+    client->publish_complete_context = context;
+    client->publish_complete         = handler;
+}
+
+/// <summary>
+/// Number of QoS 1/2 publishes waiting for their acknowledgement
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <returns>In-flight count</returns>
+size_t dx_mqttClientGetInflight(DX_MQTT_CLIENT *client)
+{
+    return client == NULL ? 0 : atomic_load(&client->inflight_count);
+}
+
+/// <summary>
+/// Block until the in-flight window has room for another QoS 1/2 publish
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="timeout_ms">Longest wait in milliseconds</param>
+/// <returns>True if there is room, false on timeout</returns>
+bool dx_mqttClientWaitForWindow(DX_MQTT_CLIENT *client, uint32_t timeout_ms)
+{
+    if (client == NULL)
+    {
+        return false;
+    }
+
+    if (client->config.max_inflight == 0 || !client->mqtt_initialized)
+    {
+        return true;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    MQTT_PAL_MUTEX_LOCK(&client->client.mutex);
+
+    // While disconnected publishes go to the outbox or fail, neither needs the window
+    while (client->is_connected && !inflight_window_open_locked(client))
+    {
+        if (pthread_cond_timedwait(&client->inflight_cond, &client->client.mutex, &deadline) == ETIMEDOUT)
+        {
+            break;
+        }
+    }
+
+    bool open = !client->is_connected || inflight_window_open_locked(client);
+
+    MQTT_PAL_MUTEX_UNLOCK(&client->client.mutex);
+
+    return open;
+}
+
+/// <summary>
+/// Publish a message to an MQTT topic
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="message">Message to publish</param>
+/// <returns>True on success, false on failure</returns>
+bool dx_mqttClientPublish(DX_MQTT_CLIENT *client, const DX_MQTT_MESSAGE *message)
+{
+    // Conflated topics only keep their latest value, it goes out when the topic is due
+    uint32_t interval_ms;
+    if (client != NULL && message != NULL && message->topic != NULL && topic_conflation(client, message->topic, &interval_ms))
+    {
+        return conflate_message(client, message, interval_ms);
+    }
+
+    if (client == NULL || message == NULL || message->topic == NULL || atomic_load(&client->compression_filter_count) == 0)
+    {
+        return publish_message(client, message);
+    }
+
+    // The context holds the compressed payload until publish_message has copied it
+    DX_MQTT_CODEC_CONTEXT *codec = codec_acquire(client);
+    DX_MQTT_MESSAGE compressed;
+    bool published = false;
+
+    if (compress_message(client, codec, message, &compressed))
+    {
+        published = publish_message(client, &compressed);
+    }
+    codec_release(client, codec);
+
+    return published;
+}
+
+/// <summary>
+/// Publish a message whose payload is final, through the outbox, the publish queue
+/// or straight into MQTT-C
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="message">Message to publish</param>
+/// <returns>True on success, false on failure</returns>
+static bool publish_message(DX_MQTT_CLIENT *client, const DX_MQTT_MESSAGE *message)
+{
+    // Keep the message for later when the connection is down or a backlog is replaying
+    if (client != NULL && message != NULL && message->topic != NULL && outbox_should_store(client, message->priority))
+    {
+        return outbox_store(client, message);
+    }
+
+    // Check if dx_mqttClientConnect was called first
+    if (client == NULL || !client->is_initialized)
+    {
+        stats_publish_failed(client, DX_MQTT_PUBLISH_FAILED_NOT_CONNECTED, 1);
+        return false;
+    }
+
+    // Check if still connected
+    if (!client->is_connected)
+    {
+        stats_publish_failed(client, DX_MQTT_PUBLISH_FAILED_NOT_CONNECTED, 1);
+        return false;
+    }
+
+    // Validate message parameters
+    if (message == NULL || message->topic == NULL)
+    {
+        set_last_error(client, "Invalid message parameters - message and topic cannot be NULL");
+        stats_publish_failed(client, DX_MQTT_PUBLISH_FAILED_INVALID, 1);
+        return false;
+    }
+
+    size_t topic_length = strlen(message->topic);
+
+    switch (rate_admit(client, message, topic_length))
+    {
+        case MQTT_RATE_ALLOW:
+            break;
+        case MQTT_RATE_REJECTED:
+            return false;
+        default:
+            return true;
+    }
+
+    // Hand off to the connection's thread without taking the MQTT-C mutex when the
+    // record fits a queue slot, larger messages take the locked path
+    if (client->publish_queue != NULL &&
+        sizeof(MQTT_QUEUED_PUBLISH) + publish_packet_size(topic_length, message->payload_length, publish_flags_for(message)) <=
+            dx_mqttRingSlotSize(client->publish_queue))
+    {
+        if (!queue_publish(client, message))
+        {
+            rate_unadmit(client, message, topic_length);
+            return false;
+        }
+        return true;
+    }
+
+    // Publish the message
+    enum MQTTErrors result =
+        enqueue_publish(client, message->topic, message->payload, message->payload_length, publish_flags_for(message), message->priority);
+    if (result != MQTT_OK)
+    {
+        rate_unadmit(client, message, topic_length);
+        bool window_full = result == MQTT_ERROR_SEND_BUFFER_IS_FULL && message->qos > 0 && client->config.max_inflight > 0 &&
+                           atomic_load(&client->inflight_count) >= client->config.max_inflight;
+        set_last_error(client, "MQTT publish failed: %s", window_full ? "in-flight window is full" : mqtt_error_str(result));
+        stats_publish_failed(client, publish_failure_for(result), 1);
+
+        // A full send buffer is back pressure, not a broken connection
+        if (result != MQTT_ERROR_SEND_BUFFER_IS_FULL && client->client.error != MQTT_OK)
+        {
+            connection_lost(client);
+        }
+        return false;
+    }
+
+    request_service(client);
+    return true;
+}
+
+/// <summary>
+/// Publish several messages under one lock of the MQTT-C client and write the
+/// resulting packets to the socket with a single sendmsg
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="messages">Messages to publish</param>
+/// <param name="count">Number of messages</param>
+/// <param name="results">Optional array of count entries receiving each message's status</param>
+/// <returns>Number of messages queued</returns>
+size_t dx_mqttClientPublishBatch(DX_MQTT_CLIENT *client, const DX_MQTT_MESSAGE *messages, size_t count, bool *results)
+{
+    if (client == NULL || messages == NULL || atomic_load(&client->conflation_filter_count) == 0)
+    {
+        return publish_batch_run(client, messages, count, results);
+    }
+
+    // Conflated messages are kept as their topic's latest value, the runs between them
+    // are published as batches so the order on the wire is unchanged
+    size_t queued = 0;
+    size_t start  = 0;
+
+    for (size_t i = 0; i <= count; i++)
+    {
+        uint32_t interval_ms;
+        bool conflated = i < count && messages[i].topic != NULL && topic_conflation(client, messages[i].topic, &interval_ms);
+        if (i < count && !conflated)
+        {
+            continue;
+        }
+
+        if (i > start)
+        {
+            queued += publish_batch_run(client, messages + start, i - start, results != NULL ? results + start : NULL);
+        }
+        start = i + 1;
+
+        if (conflated)
+        {
+            bool stored = conflate_message(client, &messages[i], interval_ms);
+            if (results != NULL)
+            {
+                results[i] = stored;
+            }
+            queued += stored ? 1 : 0;
+        }
+    }
+
+    return queued;
+}
+
+/// <summary>
+/// Publish a run of messages with none on a conflated topic, with a codec context of
+/// its own when compression filters are configured
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="messages">Messages to publish</param>
+/// <param name="count">Number of messages</param>
+/// <param name="results">Optional array of count entries receiving each message's status</param>
+/// <returns>Number of messages queued</returns>
+static size_t publish_batch_run(DX_MQTT_CLIENT *client, const DX_MQTT_MESSAGE *messages, size_t count, bool *results)
+{
+    if (client == NULL || atomic_load(&client->compression_filter_count) == 0)
+    {
+        return publish_batch(client, messages, count, results, NULL);
+    }
+
+    DX_MQTT_CODEC_CONTEXT *codec = codec_acquire(client);
+    if (codec == NULL)
+    {
+        if (results != NULL)
+        {
+            memset(results, 0, count * sizeof(bool));
+        }
+        set_last_error(client, "Failed to allocate memory for compression");
+        stats_publish_failed(client, DX_MQTT_PUBLISH_FAILED_COMPRESSION, count);
+        return 0;
+    }
+
+    size_t queued = publish_batch(client, messages, count, results, codec);
+    codec_release(client, codec);
+
+    return queued;
+}
+
+/// <summary>
+/// Publish several messages under one lock of the MQTT-C client, compressing each
+/// payload just before it is copied when asked to
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="messages">Messages to publish</param>
+/// <param name="count">Number of messages</param>
+/// <param name="results">Optional array of count entries receiving each message's status</param>
+/// <param name="codec">Context to apply the compression filters with, NULL for none</param>
+/// <returns>Number of messages queued</returns>
+static size_t publish_batch(
+    DX_MQTT_CLIENT *client, const DX_MQTT_MESSAGE *messages, size_t count, bool *results, DX_MQTT_CODEC_CONTEXT *codec)
+{
+    bool compress = codec != NULL;
+
+    if (results != NULL)
+    {
+        memset(results, 0, count * sizeof(bool));
+    }
+
+    if (client == NULL || messages == NULL)
+    {
+        return 0;
+    }
+
+    // With a backlog, high priority messages still skip the outbox one at a time
+    if (outbox_should_store(client, DX_MQTT_PRIORITY_NORMAL))
+    {
+        size_t stored = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            if (messages[i].topic == NULL)
+            {
+                stats_publish_failed(client, DX_MQTT_PUBLISH_FAILED_INVALID, 1);
+                continue;
+            }
+
+            DX_MQTT_MESSAGE message;
+            if (compress && !compress_message(client, codec, &messages[i], &message))
+            {
+                continue;
+            }
+
+            const DX_MQTT_MESSAGE *final = compress ? &message : &messages[i];
+            if (outbox_should_store(client, final->priority) ? outbox_store(client, final) : publish_message(client, final))
+            {
+                if (results != NULL)
+                {
+                    results[i] = true;
+                }
+                stored++;
+            }
+        }
+        return stored;
+    }
+
+    if (!client->is_initialized || !client->is_connected)
+    {
+        stats_publish_failed(client, DX_MQTT_PUBLISH_FAILED_NOT_CONNECTED, count);
+        return 0;
+    }
+
+    struct mqtt_client *mqtt = &client->client;
+    enum MQTTErrors error    = MQTT_OK;
+    size_t queued            = 0;
+    size_t enqueued          = 0;
+
+    MQTT_PAL_MUTEX_LOCK(&mqtt->mutex);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (messages[i].topic == NULL)
+        {
+            set_last_error(client, "Invalid message parameters - message and topic cannot be NULL");
+            stats_publish_failed(client, DX_MQTT_PUBLISH_FAILED_INVALID, 1);
+            continue;
+        }
+
+        DX_MQTT_MESSAGE message = messages[i];
+        if (compress && !compress_message(client, codec, &messages[i], &message))
+        {
+            continue;
+        }
+
+        size_t topic_length         = strlen(message.topic);
+        MQTT_RATE_DECISION decision = rate_admit(client, &message, topic_length);
+        if (decision == MQTT_RATE_REJECTED)
+        {
+            continue;
+        }
+
+        if (decision == MQTT_RATE_ALLOW)
+        {
+            enum MQTTErrors result =
+                enqueue_publish_locked(client, message.topic, message.payload, message.payload_length, publish_flags_for(&message), message.priority);
+            if (result != MQTT_OK)
+            {
+                rate_unadmit(client, &message, topic_length);
+                stats_publish_failed(client, publish_failure_for(result), 1);
+                error = result;
+                continue;
+            }
+            enqueued++;
+        }
+
+        if (results != NULL)
+        {
+            results[i] = true;
+        }
+        queued++;
+    }
+
+    // The batch occupies the tail of the queue since the lock was held throughout
+    flush_tail_locked(client, enqueued);
+
+    MQTT_PAL_MUTEX_UNLOCK(&mqtt->mutex);
+
+    if (error != MQTT_OK)
+    {
+        set_last_error(client, "MQTT publish failed: %s", mqtt_error_str(error));
+        if (error != MQTT_ERROR_SEND_BUFFER_IS_FULL && mqtt->error != MQTT_OK)
+        {
+            connection_lost(client);
+        }
+    }
+
+    request_service(client);
+    return queued;
+}
+
+/// <summary>
+/// End the open reservation and wake threads waiting for it. Caller holds the MQTT-C mutex.
+/// </summary>
+/// <param name="client">MQTT client</param>
+static void reservation_end_locked(DX_MQTT_CLIENT *client)
+{
+    client->reservation.active = false;
+    client->reservation.pinned = false;
+    client->reservation.entry  = NULL;
+    pthread_cond_broadcast(&client->reservation_cond);
+}
+
+/// <summary>
+/// Make sure the staging buffer holds a topic, its terminator and a payload. Caller
+/// holds the MQTT-C mutex.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="size">Bytes needed</param>
+/// <returns>True if the buffer is large enough</returns>
+static bool reservation_stage_locked(DX_MQTT_CLIENT *client, size_t size)
+{
+    if (client->reservation.staging_size >= size)
+    {
+        return true;
+    }
+
+    uint8_t *staging = realloc(client->reservation.staging, size);
+    if (staging == NULL)
+    {
+        set_last_error(client, "Failed to allocate memory for publish reservation");
+        return false;
+    }
+
+    client->reservation.staging      = staging;
+    client->reservation.staging_size = size;
+    return true;
+}
+
+/// <summary>
+/// Publish the staged topic and payload through dx_mqttClientPublish and end the
+/// reservation. Called with the MQTT-C mutex held, returns with it released.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="length">Number of payload bytes written</param>
+/// <param name="qos">Quality of Service level</param>
+/// <returns>True if the message was published</returns>
+static bool reservation_publish_staged(DX_MQTT_CLIENT *client, size_t length, uint8_t qos)
+{
+    uint8_t *staging        = client->reservation.staging;
+    DX_MQTT_MESSAGE message = {
+        .topic = (const char *)staging, .payload = staging + client->reservation.topic_length + 1, .payload_length = length, .qos = qos};
+    MQTT_PAL_MUTEX_UNLOCK(&client->client.mutex);
+
+    // The reservation stays active so no other thread reuses the staging buffer meanwhile
+    bool published = dx_mqttClientPublish(client, &message);
+
+    MQTT_PAL_MUTEX_LOCK(&client->client.mutex);
+    reservation_end_locked(client);
+    MQTT_PAL_MUTEX_UNLOCK(&client->client.mutex);
+
+    return published;
+}
+
+/// <summary>
+/// Reserve space for a PUBLISH in the send buffer so the payload can be written in place.
+/// The packet header is laid out right aligned against the payload and written by
+/// dx_mqttClientPublishCommit once the final length and QoS are known. The region is
+/// pinned by a placeholder queue entry, so the MQTT-C mutex is not held while the
+/// caller writes. Messages dx_mqttClientPublish would not queue straight away are
+/// staged in a client buffer instead.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="topic">Topic to publish to, copied into the reservation</param>
+/// <param name="max_length">Largest payload the caller may write</param>
+/// <returns>Writable payload area of max_length bytes, or NULL on failure</returns>
+void *dx_mqttClientPublishBegin(DX_MQTT_CLIENT *client, const char *topic, size_t max_length)
+{
+    // Without an outbox there is nothing to do with the payload while disconnected
+    if (client == NULL || !client->is_initialized || (!client->is_connected && client->outbox == NULL))
+    {
+        stats_publish_failed(client, DX_MQTT_PUBLISH_FAILED_NOT_CONNECTED, 1);
+        return NULL;
+    }
+
+    if (topic == NULL)
+    {
+        set_last_error(client, "Invalid topic - topic cannot be NULL");
+        stats_publish_failed(client, DX_MQTT_PUBLISH_FAILED_INVALID, 1);
+        return NULL;
+    }
+
+    struct mqtt_client *mqtt = &client->client;
+    size_t topic_length      = strlen(topic);
+
+    // Worst case layout: fixed header, topic, packet id, payload
+    size_t remaining = 2 + topic_length + 2 + max_length;
+    size_t reserved  = 1 + remaining_length_size(remaining) + remaining;
+
+    if (topic_length > UINT16_MAX || remaining > 268435455)
+    {
+        set_last_error(client, "MQTT publish reservation too large");
+        stats_publish_failed(client, DX_MQTT_PUBLISH_FAILED_INVALID, 1);
+        return NULL;
+    }
+
+    // Outbox backlog, queued publishes, conflation and compression are left to
+    // dx_mqttClientPublish at commit, which keeps their ordering and framing
+    uint32_t interval_ms;
+    int level;
+    bool staged = outbox_should_store(client, DX_MQTT_PRIORITY_NORMAL) || publish_queue_pending(client) ||
+                  topic_conflation(client, topic, &interval_ms) ||
+                  (atomic_load(&client->compression_filter_count) > 0 && topic_codec(client, topic, topic_length, &level) != DX_MQTT_CODEC_NONE);
+
+    MQTT_PAL_MUTEX_LOCK(&mqtt->mutex);
+
+    // One reservation at a time, another thread's is waited for
+    while (client->reservation.active && !pthread_equal(client->reservation.owner, pthread_self()))
+    {
+        pthread_cond_wait(&client->reservation_cond, &mqtt->mutex);
+    }
+
+    if (client->reservation.active)
+    {
+        MQTT_PAL_MUTEX_UNLOCK(&mqtt->mutex);
+        set_last_error(client, "A publish reservation is already open on this thread");
+        stats_publish_failed(client, DX_MQTT_PUBLISH_FAILED_INVALID, 1);
+        return NULL;
+    }
+
+    // An MQTT-C call under way may compact the queue, and waiting for it could mean
+    // waiting on a message handler that is publishing itself
+    staged = staged || !client->is_connected || client->send_queue_users > 0;
+
+    uint8_t *payload;
+    if (staged)
+    {
+        if (!reservation_stage_locked(client, topic_length + 1 + max_length))
+        {
+            MQTT_PAL_MUTEX_UNLOCK(&mqtt->mutex);
+            return NULL;
+        }
+
+        memcpy(client->reservation.staging, topic, topic_length);
+        client->reservation.staging[topic_length] = '\0';
+        payload                                   = client->reservation.staging + topic_length + 1;
+    }
+    else
+    {
+        if (mqtt->error < 0 && mqtt->error != MQTT_ERROR_SEND_BUFFER_IS_FULL)
+        {
+            set_last_error(client, "MQTT publish failed: %s", mqtt_error_str(mqtt->error));
+            stats_publish_failed(client, DX_MQTT_PUBLISH_FAILED_CONNECTION, 1);
+            MQTT_PAL_MUTEX_UNLOCK(&mqtt->mutex);
+            return NULL;
+        }
+
+        if (!reserve_send_space_locked(client, reserved))
+        {
+            set_last_error(client, "MQTT publish failed: %s", mqtt_error_str(MQTT_ERROR_SEND_BUFFER_IS_FULL));
+            stats_publish_failed(client, DX_MQTT_PUBLISH_FAILED_BACK_PRESSURE, 1);
+            MQTT_PAL_MUTEX_UNLOCK(&mqtt->mutex);
+            return NULL;
+        }
+
+        // The placeholder is skipped by the sender until commit makes it UNSENT
+        struct mqtt_queued_message *entry = mqtt_mq_register(&mqtt->mq, reserved);
+        entry->control_type               = MQTT_CONTROL_PUBLISH;
+        entry->packet_id                  = 0;
+        entry->state                      = MQTT_QUEUED_COMPLETE;
+
+        payload       = entry->start + reserved - max_length;
+        uint8_t *name = payload - 2 - topic_length;
+
+        // Topic is written assuming a packet id follows, commit shifts it for QoS 0
+        name[-2] = (uint8_t)(topic_length >> 8);
+        name[-1] = (uint8_t)(topic_length & 0xFF);
+        memcpy(name, topic, topic_length);
+
+        client->reservation.entry = entry;
+    }
+
+    client->reservation.active       = true;
+    client->reservation.pinned       = !staged;
+    client->reservation.owner        = pthread_self();
+    client->reservation.payload      = payload;
+    client->reservation.max_length   = max_length;
+    client->reservation.topic_length = topic_length;
+
+    MQTT_PAL_MUTEX_UNLOCK(&mqtt->mutex);
+    return payload;
+}
+
+/// <summary>
+/// Finish a PUBLISH started with dx_mqttClientPublishBegin on the same thread
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="length">Number of payload bytes written</param>
+/// <param name="qos">Quality of Service level (0, 1, or 2)</param>
+/// <returns>True if the message was queued</returns>
+bool dx_mqttClientPublishCommit(DX_MQTT_CLIENT *client, size_t length, uint8_t qos)
+{
+    if (client == NULL)
+    {
+        return false;
+    }
+
+    struct mqtt_client *mqtt = &client->client;
+    MQTT_PAL_MUTEX_LOCK(&mqtt->mutex);
+
+    if (!client->reservation.active || !pthread_equal(client->reservation.owner, pthread_self()))
+    {
+        MQTT_PAL_MUTEX_UNLOCK(&mqtt->mutex);
+        set_last_error(client, "No publish reservation is open on this thread");
+        return false;
+    }
+
+    bool pinned = client->reservation.pinned;
+
+    if (length > client->reservation.max_length)
+    {
+        reservation_end_locked(client);
+        MQTT_PAL_MUTEX_UNLOCK(&mqtt->mutex);
+        set_last_error(client, "MQTT publish commit exceeds the reserved length");
+        stats_publish_failed(client, DX_MQTT_PUBLISH_FAILED_INVALID, 1);
+        if (pinned)
+        {
+            request_service(client);
+        }
+        return false;
+    }
+
+    uint8_t *payload    = client->reservation.payload;
+    size_t topic_length = client->reservation.topic_length;
+
+    if (qos > 2)
+    {
+        qos = 0;
+    }
+
+    // The connection went while the payload was written: hand a copy to the outbox path
+    // and let the next session reset the queue
+    if (pinned && (!client->is_connected || (mqtt->error < 0 && mqtt->error != MQTT_ERROR_SEND_BUFFER_IS_FULL)))
+    {
+        if (!reservation_stage_locked(client, topic_length + 1 + length))
+        {
+            reservation_end_locked(client);
+            MQTT_PAL_MUTEX_UNLOCK(&mqtt->mutex);
+            request_service(client);
+            return false;
+        }
+
+        memcpy(client->reservation.staging, payload - 2 - topic_length, topic_length);
+        client->reservation.staging[topic_length] = '\0';
+        memcpy(client->reservation.staging + topic_length + 1, payload, length);
+
+        client->reservation.pinned = false;
+        client->reservation.entry  = NULL;
+        pthread_cond_broadcast(&client->reservation_cond);
+    }
+
+    if (!client->reservation.pinned)
+    {
+        bool published = reservation_publish_staged(client, length, qos);
+        if (pinned)
+        {
+            request_service(client);
+        }
+        return published;
+    }
+
+    // Rate limits apply once the size is known. A held publish is a copy, so the
+    // reservation is given up whatever the limit decided.
+    DX_MQTT_MESSAGE message = {.topic = (const char *)payload - 2 - topic_length, .payload = payload, .payload_length = length, .qos = qos};
+    switch (rate_admit(client, &message, topic_length))
+    {
+        case MQTT_RATE_ALLOW:
+            break;
+        case MQTT_RATE_REJECTED:
+            reservation_end_locked(client);
+            MQTT_PAL_MUTEX_UNLOCK(&mqtt->mutex);
+            request_service(client);
+            return false;
+        default:
+            reservation_end_locked(client);
+            MQTT_PAL_MUTEX_UNLOCK(&mqtt->mutex);
+            request_service(client);
+            return true;
+    }
+
+    // The same back pressure as enqueue_publish_locked: in-flight window, then bulk budget
+    size_t packet_length = publish_packet_size(topic_length, length, (uint8_t)(qos << 1));
+    bool window_full     = qos > 0 && !inflight_window_open_locked(client);
+    if (window_full || !bulk_budget_open_locked(client, packet_length))
+    {
+        rate_unadmit(client, &message, topic_length);
+        reservation_end_locked(client);
+        MQTT_PAL_MUTEX_UNLOCK(&mqtt->mutex);
+        set_last_error(client, "MQTT publish failed: %s", window_full ? "in-flight window is full" : mqtt_error_str(MQTT_ERROR_SEND_BUFFER_IS_FULL));
+        stats_publish_failed(client, DX_MQTT_PUBLISH_FAILED_BACK_PRESSURE, 1);
+        request_service(client);
+        return false;
+    }
+
+    uint16_t packet_id = __mqtt_next_pid(mqtt);
+
+    uint8_t *variable_header = payload - 2 - topic_length - 2;
+    if (qos > 0)
+    {
+        payload[-2] = (uint8_t)(packet_id >> 8);
+        payload[-1] = (uint8_t)(packet_id & 0xFF);
+    }
+    else
+    {
+        memmove(variable_header + 2, variable_header, 2 + topic_length);
+        variable_header += 2;
+    }
+
+    size_t remaining = (size_t)(payload + length - variable_header);
+    uint8_t *start   = variable_header - 1 - remaining_length_size(remaining);
+    uint8_t *cursor  = start;
+
+    *cursor++ = (uint8_t)((MQTT_CONTROL_PUBLISH << 4) | (qos << 1));
+    do
+    {
+        uint8_t encoded = remaining % 128;
+        remaining /= 128;
+        *cursor++ = remaining > 0 ? (encoded | 0x80) : encoded;
+    } while (remaining > 0);
+
+    // Bytes of the placeholder around a shorter header or payload stay in the queue as padding
+    struct mqtt_queued_message *msg = client->reservation.entry;
+    msg->start                      = start;
+    msg->size                       = (size_t)(payload + length - start);
+    msg->packet_id                  = packet_id;
+    msg->state                      = MQTT_QUEUED_UNSENT;
+    stats_publish_sent_locked(client, qos, msg->size);
+    bulk_budget_spend_locked(client, msg->size);
+
+    if (qos > 0)
+    {
+        inflight_track_locked(client, packet_id);
+    }
+
+    if (mqtt->error == MQTT_ERROR_SEND_BUFFER_IS_FULL)
+    {
+        mqtt->error = MQTT_OK;
+    }
+
+    reservation_end_locked(client);
+    MQTT_PAL_MUTEX_UNLOCK(&mqtt->mutex);
+
+    request_service(client);
+    return true;
+}
+
+/// <summary>
+/// Drop a reservation made with dx_mqttClientPublishBegin on the same thread without
+/// sending anything
+/// </summary>
+/// <param name="client">MQTT client</param>
+void dx_mqttClientPublishAbort(DX_MQTT_CLIENT *client)
+{
+    if (client == NULL)
+    {
+        return;
+    }
+
+    MQTT_PAL_MUTEX_LOCK(&client->client.mutex);
+
+    if (!client->reservation.active || !pthread_equal(client->reservation.owner, pthread_self()))
+    {
+        MQTT_PAL_MUTEX_UNLOCK(&client->client.mutex);
+        set_last_error(client, "No publish reservation is open on this thread");
+        return;
+    }
+
+    // A pinned placeholder stays COMPLETE and goes with the next compaction
+    bool pinned = client->reservation.pinned;
+    reservation_end_locked(client);
+    MQTT_PAL_MUTEX_UNLOCK(&client->client.mutex);
+
+    if (pinned)
+    {
+        request_service(client);
+    }
+}
+
+/// <summary>
+/// Subscribe to an MQTT topic
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="topic">Topic to subscribe to</param>
+/// <param name="qos">Quality of Service level (0, 1, or 2)</param>
+/// <returns>True on success, false on failure</returns>
+bool dx_mqttClientSubscribe(DX_MQTT_CLIENT *client, const char *topic, uint8_t qos)
+{
+    if (client == NULL)
+    {
+        return false;
+    }
+
+    // Check if dx_mqttClientConnect was called first
+    if (!client->is_initialized)
+    {
+        set_last_error(client, "MQTT client not initialized - dx_mqttConnect must be called first");
+        return false;
+    }
+
+    // Check if still connected
+    if (!client->is_connected)
+    {
+        set_last_error(client, "MQTT client not connected - connection may have been lost");
+        return false;
+    }
+
+    // Validate topic parameter
+    if (topic == NULL)
+    {
+        set_last_error(client, "Invalid topic - topic cannot be NULL");
+        return false;
+    }
+
+    // Validate QoS
+    if (qos > 2)
+    {
+        qos = 0;
+    }
+
+    // MQTT-C compacts the send queue when it is short of room
+    if (!send_queue_enter(client, true))
+    {
+        set_last_error(client, "MQTT subscribe failed: a publish reservation is open on this thread");
+        return false;
+    }
+
+    enum MQTTErrors subscribed = mqtt_subscribe(&client->client, topic, qos);
+    send_queue_leave(client);
+
+    if (subscribed != MQTT_OK)
+    {
+        set_last_error(client, "MQTT subscribe failed: %s", mqtt_error_str(client->client.error));
+        if (client->client.error != MQTT_OK)
+        {
+            connection_lost(client);
+        }
+        return false;
+    }
+
+    if (!subscription_add(client, topic, qos))
+    {
+        dx_Log_Debug("DX MQTT: Subscription to '%s' will not be restored after a reconnect\n", topic);
+    }
+
+    request_service(client);
+
+    dx_Log_Debug("DX MQTT: Subscribed to topic '%s' with QoS %d\n", topic, qos);
+    return true;
+}
+
+/// <summary>
+/// Subscribe to a topic filter and route matching messages to their own handler
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="topic_filter">Topic filter to subscribe to, may use + and #</param>
+/// <param name="qos">Quality of Service level (0, 1, or 2)</param>
+/// <param name="handler">Callback for messages matching the filter</param>
+/// <param name="context">User context passed to the handler</param>
+/// <returns>True on success, false on failure</returns>
+bool dx_mqttClientSubscribeWithHandler(
+    DX_MQTT_CLIENT *client, const char *topic_filter, uint8_t qos, DX_MQTT_MESSAGE_RECEIVED_HANDLER handler, void *context)
+{
+    if (client == NULL)
+    {
+        return false;
+    }
+
+    if (handler == NULL)
+    {
+        set_last_error(client, "Invalid handler - handler cannot be NULL");
+        return false;
+    }
+
+    if (!dx_mqttTopicFilterIsValid(topic_filter))
+    {
+        set_last_error(client, "Invalid topic filter '%s'", topic_filter == NULL ? "(null)" : topic_filter);
+        return false;
+    }
+
+    MQTT_TOPIC_HANDLER *entry = malloc(sizeof(MQTT_TOPIC_HANDLER));
+    if (entry == NULL)
+    {
+        set_last_error(client, "Failed to allocate memory for topic handler");
+        return false;
+    }
+
+    entry->handler = handler;
+    entry->context = context;
+
+    // Register before subscribing so retained messages sent straight after SUBACK are routed
+    void *previous = NULL;
+    bool inserted  = false;
+
+    pthread_mutex_lock(&client->subscriptions_lock);
+
+    if (client->topic_handlers == NULL)
+    {
+        client->topic_handlers = dx_mqttTopicTrieCreate();
+    }
+    inserted = dx_mqttTopicTrieInsert(client->topic_handlers, topic_filter, entry, &previous);
+
+    pthread_mutex_unlock(&client->subscriptions_lock);
+
+    if (!inserted)
+    {
+        free(entry);
+        set_last_error(client, "Failed to allocate memory for topic handler");
+        return false;
+    }
+
+    free(previous);
+
+    if (!dx_mqttClientSubscribe(client, topic_filter, qos))
+    {
+        pthread_mutex_lock(&client->subscriptions_lock);
+        free(dx_mqttTopicTrieRemove(client->topic_handlers, topic_filter));
+        pthread_mutex_unlock(&client->subscriptions_lock);
+        return false;
+    }
+
+    return true;
+}
+
+/// <summary>
+/// Compress payloads published to topics matching a filter, and decompress messages
+/// received on them before any handler sees them
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="topic_filter">Topic filter, may use + and #</param>
+/// <param name="codec">Codec to use, DX_MQTT_CODEC_NONE removes the filter</param>
+/// <param name="level">Codec specific level, 0 selects the default</param>
+/// <returns>False if the filter is invalid or the codec was not built in</returns>
+bool dx_mqttClientSetCompression(DX_MQTT_CLIENT *client, const char *topic_filter, DX_MQTT_CODEC codec, int level)
+{
+    if (client == NULL)
+    {
+        return false;
+    }
+
+    if (!dx_mqttTopicFilterIsValid(topic_filter))
+    {
+        set_last_error(client, "Invalid topic filter '%s'", topic_filter == NULL ? "(null)" : topic_filter);
+        return false;
+    }
+
+    if (codec != DX_MQTT_CODEC_NONE && !dx_mqttCodecIsAvailable(codec))
+    {
+        set_last_error(client, "Compression codec %d is not built in", (int)codec);
+        return false;
+    }
+
+    MQTT_COMPRESSION *entry = NULL;
+    if (codec != DX_MQTT_CODEC_NONE)
+    {
+        entry = malloc(sizeof(MQTT_COMPRESSION));
+        if (entry == NULL)
+        {
+            set_last_error(client, "Failed to allocate memory for compression filter");
+            return false;
+        }
+        entry->codec = codec;
+        entry->level = level;
+    }
+
+    void *previous = NULL;
+    bool updated   = true;
+
+    pthread_mutex_lock(&client->subscriptions_lock);
+
+    if (entry == NULL)
+    {
+        previous = client->compression_filters != NULL ? dx_mqttTopicTrieRemove(client->compression_filters, topic_filter) : NULL;
+    }
+    else
+    {
+        if (client->compression_filters == NULL)
+        {
+            client->compression_filters = dx_mqttTopicTrieCreate();
+        }
+        entry->sequence = ++client->compression_sequence;
+        updated         = client->compression_filters != NULL && dx_mqttTopicTrieInsert(client->compression_filters, topic_filter, entry, &previous);
+    }
+
+    atomic_store(&client->compression_filter_count, dx_mqttTopicTrieCount(client->compression_filters));
+
+    pthread_mutex_unlock(&client->subscriptions_lock);
+
+    free(previous);
+
+    if (!updated)
+    {
+        free(entry);
+        set_last_error(client, "Failed to allocate memory for compression filter");
+        return false;
+    }
+
+    return true;
+}
+
+/// <summary>
+/// Keep only the latest unsent value on topics matching a filter. A publish to such a
+/// topic replaces any value still waiting, and at most one value per topic is sent
+/// each interval. A value that does not fit the send buffer stays pending and goes
+/// out once the link drains. Conflated topics bypass the outbox and the zero-copy API.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="topic_filter">Topic filter, may use + and #</param>
+/// <param name="conflate">True to conflate matching topics, false to remove the filter</param>
+/// <param name="interval_ms">Minimum time between sends on each topic, 0 sends whenever the link has room</param>
+/// <returns>False if the filter is invalid or could not be stored</returns>
+bool dx_mqttClientSetConflation(DX_MQTT_CLIENT *client, const char *topic_filter, bool conflate, uint32_t interval_ms)
+{
+    if (client == NULL)
+    {
+        return false;
+    }
+
+    if (!dx_mqttTopicFilterIsValid(topic_filter))
+    {
+        set_last_error(client, "Invalid topic filter '%s'", topic_filter == NULL ? "(null)" : topic_filter);
+        return false;
+    }
+
+    MQTT_CONFLATION *entry = NULL;
+    if (conflate)
+    {
+        entry = malloc(sizeof(MQTT_CONFLATION));
+        if (entry == NULL)
+        {
+            set_last_error(client, "Failed to allocate memory for conflation filter");
+            return false;
+        }
+        entry->interval_ms = interval_ms;
+    }
+
+    void *previous = NULL;
+    bool updated   = true;
+
+    pthread_mutex_lock(&client->subscriptions_lock);
+
+    if (entry == NULL)
+    {
+        previous = client->conflation_filters != NULL ? dx_mqttTopicTrieRemove(client->conflation_filters, topic_filter) : NULL;
+    }
+    else
+    {
+        if (client->conflation_filters == NULL)
+        {
+            client->conflation_filters = dx_mqttTopicTrieCreate();
+        }
+        entry->sequence = ++client->conflation_sequence;
+        updated         = client->conflation_filters != NULL && dx_mqttTopicTrieInsert(client->conflation_filters, topic_filter, entry, &previous);
+    }
+
+    atomic_store(&client->conflation_filter_count, dx_mqttTopicTrieCount(client->conflation_filters));
+
+    pthread_mutex_unlock(&client->subscriptions_lock);
+
+    free(previous);
+
+    if (!updated)
+    {
+        free(entry);
+        set_last_error(client, "Failed to allocate memory for conflation filter");
+        return false;
+    }
+
+    // Topics that are no longer conflated give their slots back once sent
+    if (entry == NULL)
+    {
+        prune_conflated(client);
+    }
+
+    return true;
+}
+
+/// <summary>
+/// Limit the rate of publishes on the whole connection. Every publish path checks
+/// the limit, including the outbox replay and conflated values, which simply wait
+/// for it. Messages held by DX_MQTT_LIMIT_QUEUE are released in order.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="limit">Limit to apply, NULL removes it</param>
+/// <returns>False if the limit could not be stored</returns>
+bool dx_mqttClientSetRateLimit(DX_MQTT_CLIENT *client, const DX_MQTT_RATE_LIMIT *limit)
+{
+    if (client == NULL)
+    {
+        return false;
+    }
+
+    MQTT_RATE_LIMITER *limiter = NULL;
+    if (limit != NULL && (limiter = create_rate_limiter(client, limit, false)) == NULL)
+    {
+        set_last_error(client, "Failed to allocate memory for rate limit");
+        return false;
+    }
+
+    pthread_mutex_lock(&client->rate_lock);
+
+    // The limiter left unused, once no publisher can still be reading it, is reclaimed
+    MQTT_RATE_LIMITER *previous = client->rate_connection;
+    bool updated                = limiter == NULL || keep_rate_limiter_locked(client, limiter);
+    if (updated)
+    {
+        client->rate_connection = limiter;
+        updated                 = publish_rate_snapshot_locked(client);
+        if (!updated)
+        {
+            client->rate_connection = previous;
+        }
+        retire_rate_limiter_locked(client, updated ? previous : limiter);
+    }
+    else
+    {
+        free_rate_limiter(limiter);
+    }
+
+    pthread_mutex_unlock(&client->rate_lock);
+
+    if (!updated)
+    {
+        set_last_error(client, "Failed to allocate memory for rate limit");
+        return false;
+    }
+
+    return true;
+}
+
+/// <summary>
+/// Limit the rate of publishes on topics matching a filter. All matching topics share
+/// one budget, and when several filters match the one set last applies. A message
+/// must also pass the connection limit.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="topic_filter">Topic filter, may use + and #</param>
+/// <param name="limit">Limit to apply, NULL removes the filter</param>
+/// <returns>False if the filter is invalid or could not be stored</returns>
+bool dx_mqttClientSetTopicRateLimit(DX_MQTT_CLIENT *client, const char *topic_filter, const DX_MQTT_RATE_LIMIT *limit)
+{
+    if (client == NULL)
+    {
+        return false;
+    }
+
+    if (!dx_mqttTopicFilterIsValid(topic_filter))
+    {
+        set_last_error(client, "Invalid topic filter '%s'", topic_filter == NULL ? "(null)" : topic_filter);
+        return false;
+    }
+
+    MQTT_RATE_LIMITER *limiter = NULL;
+    if (limit != NULL && (limiter = create_rate_limiter(client, limit, true)) == NULL)
+    {
+        set_last_error(client, "Failed to allocate memory for rate limit");
+        return false;
+    }
+
+    pthread_mutex_lock(&client->rate_lock);
+
+    MQTT_RATE_FILTER *filter = NULL;
+    for (size_t i = 0; i < client->rate_filter_count && filter == NULL; i++)
+    {
+        if (strcmp(client->rate_filters[i].filter, topic_filter) == 0)
+        {
+            filter = &client->rate_filters[i];
+        }
+    }
+
+    // A new filter starts without a limiter, so a failure below leaves it to be pruned
+    bool updated = filter != NULL || limiter == NULL;
+    if (!updated && client->rate_filter_count == client->rate_filter_capacity)
+    {
+        size_t capacity           = client->rate_filter_capacity > 0 ? client->rate_filter_capacity * 2 : 4;
+        MQTT_RATE_FILTER *filters = realloc(client->rate_filters, capacity * sizeof(MQTT_RATE_FILTER));
+        if (filters != NULL)
+        {
+            client->rate_filters         = filters;
+            client->rate_filter_capacity = capacity;
+        }
+    }
+    if (!updated && client->rate_filter_count < client->rate_filter_capacity)
+    {
+        filter = &client->rate_filters[client->rate_filter_count];
+        if ((filter->filter = strdup(topic_filter)) != NULL)
+        {
+            filter->limiter = NULL;
+            client->rate_filter_count++;
+            updated = true;
+        }
+    }
+
+    // The limiter left unused, once no publisher can still be reading it, is reclaimed
+    updated = updated && (limiter == NULL || keep_rate_limiter_locked(client, limiter));
+    if (updated && filter != NULL)
+    {
+        MQTT_RATE_LIMITER *previous = filter->limiter;
+        filter->limiter             = limiter;
+        if (limiter != NULL)
+        {
+            limiter->sequence = ++client->rate_sequence;
+        }
+
+        updated = publish_rate_snapshot_locked(client);
+        if (!updated)
+        {
+            filter->limiter = previous;
+        }
+        retire_rate_limiter_locked(client, updated ? previous : limiter);
+    }
+    else if (!updated)
+    {
+        free_rate_limiter(limiter);
+    }
+    prune_rate_filters_locked(client);
+
+    pthread_mutex_unlock(&client->rate_lock);
+
+    if (!updated)
+    {
+        set_last_error(client, "Failed to allocate memory for rate limit");
+        return false;
+    }
+
+    return true;
+}
+
+/// <summary>
+/// Unsubscribe from an MQTT topic, dropping any handler registered for it
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="topic">Topic to unsubscribe from</param>
+/// <returns>True on success, false on failure</returns>
+bool dx_mqttClientUnsubscribe(DX_MQTT_CLIENT *client, const char *topic)
+{
+    if (client == NULL)
+    {
+        return false;
+    }
+
+    // Check if dx_mqttClientConnect was called first
+    if (!client->is_initialized)
+    {
+        set_last_error(client, "MQTT client not initialized - dx_mqttConnect must be called first");
+        return false;
+    }
+
+    // Check if still connected
+    if (!client->is_connected)
+    {
+        set_last_error(client, "MQTT client not connected - connection may have been lost");
+        return false;
+    }
+
+    // Validate topic parameter
+    if (topic == NULL)
+    {
+        set_last_error(client, "Invalid topic - topic cannot be NULL");
+        return false;
+    }
+
+    // MQTT-C compacts the send queue when it is short of room
+    if (!send_queue_enter(client, true))
+    {
+        set_last_error(client, "MQTT unsubscribe failed: a publish reservation is open on this thread");
+        return false;
+    }
+
+    enum MQTTErrors unsubscribed = mqtt_unsubscribe(&client->client, topic);
+    send_queue_leave(client);
+
+    if (unsubscribed != MQTT_OK)
+    {
+        set_last_error(client, "MQTT unsubscribe failed: %s", mqtt_error_str(client->client.error));
+        if (client->client.error != MQTT_OK)
+        {
+            connection_lost(client);
+        }
+        return false;
+    }
+
+    pthread_mutex_lock(&client->subscriptions_lock);
+    free(dx_mqttTopicTrieRemove(client->topic_handlers, topic));
+    pthread_mutex_unlock(&client->subscriptions_lock);
+
+    subscription_remove(client, topic);
+
+    request_service(client);
+
+    dx_Log_Debug("DX MQTT: Unsubscribed from topic '%s'\n", topic);
+    return true;
+}
+
+/// <summary>
+/// Check if a client is connected to its broker
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <returns>True if connected, false otherwise</returns>
+bool dx_mqttClientIsConnected(DX_MQTT_CLIENT *client)
+{
+    return client != NULL && client->is_connected && client->is_initialized && (client->client.error == MQTT_OK);
+}
+
+/// <summary>
+/// Get the last error message recorded for a client
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <returns>String description of the last error, or NULL if no error</returns>
+const char *dx_mqttClientGetLastError(DX_MQTT_CLIENT *client)
+{
+    if (client == NULL)
+    {
+        return NULL;
+    }
+
+    return strlen(client->last_error) > 0 ? client->last_error : NULL;
+}
+
+/// <summary>
+/// Number of heap allocations made on the receive path since the client was created
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <returns>Allocation count</returns>
+size_t dx_mqttClientGetReceiveAllocations(DX_MQTT_CLIENT *client)
+{
+    return client == NULL ? 0 : receive_allocations(client);
+}
+
+/// <summary>
+/// Copy the client's counters. Counting is lock-free, so this can be called from
+/// any thread at any rate without slowing the connection.
+/// </summary>
+/// <param name="client">MQTT client</param>
+/// <param name="stats">Receives the counters</param>
+/// <returns>False if client or stats is NULL</returns>
+bool dx_mqttClientGetStats(DX_MQTT_CLIENT *client, DX_MQTT_STATS *stats)
+{
+    if (client == NULL || stats == NULL)
+    {
+        return false;
+    }
+
+    const MQTT_STATS *source = &client->stats;
+    memset(stats, 0, sizeof(*stats));
+
+    for (size_t qos = 0; qos < 3; qos++)
     {
-        return;
+        stats->messages_out[qos] = atomic_load_explicit(&source->messages_out[qos], memory_order_relaxed);
+        stats->bytes_out[qos]    = atomic_load_explicit(&source->bytes_out[qos], memory_order_relaxed);
+        stats->messages_in[qos]  = atomic_load_explicit(&source->messages_in[qos], memory_order_relaxed);
+        stats->bytes_in[qos]     = atomic_load_explicit(&source->bytes_in[qos], memory_order_relaxed);
     }
 
-    // Create null-terminated topic string
-    char *topic = malloc(published->topic_name_size + 1);
-    if (topic == NULL)
+    for (size_t reason = 0; reason < DX_MQTT_PUBLISH_FAILURE_REASONS; reason++)
     {
-        set_last_error("Failed to allocate memory for topic");
-        return;
+        stats->publish_failures[reason] = atomic_load_explicit(&source->publish_failures[reason], memory_order_relaxed);
     }
 
-    memcpy(topic, published->topic_name, published->topic_name_size);
-    topic[published->topic_name_size] = '\0';
+    for (size_t bucket = 0; bucket < DX_MQTT_STATS_RTT_BUCKETS; bucket++)
+    {
+        stats->ping_rtt_histogram[bucket] = atomic_load_explicit(&source->ping_rtt_histogram[bucket], memory_order_relaxed);
+    }
 
-    // Call user's message handler
-    _message_handler(topic, published->application_message, published->application_message_size, _user_context);
+    int64_t since = atomic_load(&source->connected_since_ms);
+    uint64_t now  = since != 0 ? (uint64_t)(monotonic_us() / 1000 - since) : 0;
 
-    free(topic);
+    stats->messages_conflated        = atomic_load_explicit(&source->messages_conflated, memory_order_relaxed);
+    stats->messages_rate_dropped     = atomic_load_explicit(&source->messages_rate_dropped, memory_order_relaxed);
+    stats->messages_rate_queued      = atomic_load_explicit(&source->messages_rate_queued, memory_order_relaxed);
+    stats->messages_dispatch_dropped = atomic_load_explicit(&source->messages_dispatch_dropped, memory_order_relaxed);
+    stats->outbox_read_failures      = atomic_load_explicit(&source->outbox_read_failures, memory_order_relaxed);
+    stats->send_buffer_high_water    = atomic_load_explicit(&source->send_buffer_high_water, memory_order_relaxed);
+    stats->reconnects                = atomic_load_explicit(&source->reconnects, memory_order_relaxed);
+    stats->connected_ms              = now;
+    stats->total_connected_ms        = atomic_load(&source->total_connected_ms) + now;
+    stats->handler_time_us           = atomic_load_explicit(&source->handler_time_us, memory_order_relaxed);
+    stats->handler_time_max_us       = atomic_load_explicit(&source->handler_time_max_us, memory_order_relaxed);
+    stats->ping_rtt_last_us          = atomic_load_explicit(&source->ping_rtt_last_us, memory_order_relaxed);
+    stats->receive_allocations       = receive_allocations(client);
+    stats->inflight                  = atomic_load(&client->inflight_count);
+
+    return true;
 }
 
 /// <summary>
-/// MQTT client refresher thread - handles message processing and connection monitoring
+/// Disconnect a client from its broker and cleanup connection resources
 /// </summary>
-/// <param name="client">MQTT client pointer</param>
-/// <returns>NULL</returns>
-static void *client_refresher(void *client)
+/// <param name="client">MQTT client</param>
+void dx_mqttClientDisconnect(DX_MQTT_CLIENT *client)
 {
-    dx_Log_Debug("DX MQTT: Background processing thread started\n");
-
-    while (_daemon_running)
+    if (client == NULL)
     {
-        if (_is_connected)
-        {
-            // Process MQTT operations (send/receive messages, handle keepalive, etc.)
-            int result = mqtt_sync((struct mqtt_client *)client);
+        return;
+    }
 
-            if (result != MQTT_OK)
-            {
-                set_last_error("MQTT sync failed: %s", mqtt_error_str(_client.error));
-                _is_connected = false;
-                dx_Log_Debug("DX MQTT: Connection lost in background thread\n");
-            }
+    // An application disconnect ends any reconnect backoff in progress
+    client->reconnect_enabled = false;
+    reconnect_stop(client);
 
-            // Check for any client errors that might have occurred
-            if (_client.error != MQTT_OK)
-            {
-                set_last_error("MQTT client error: %s", mqtt_error_str(_client.error));
-                _is_connected = false;
-                dx_Log_Debug("DX MQTT: Client error detected in background thread\n");
-            }
-        }
+    if (!client->is_initialized)
+    {
+        return;
+    }
+
+    dx_Log_Debug("DX MQTT: Disconnecting from broker\n");
 
-        // Sleep for 100ms between processing cycles
-        // This provides responsive message handling while not consuming too much CPU
-        usleep(100000U);
+    // Send disconnect message if still connected
+    // Skipped when this thread still holds a reservation pinning the send queue
+    if (client->is_connected && client->client.error == MQTT_OK && send_queue_enter(client, true))
+    {
+        mqtt_disconnect(&client->client);
+        send_queue_leave(client);
     }
 
-    dx_Log_Debug("DX MQTT: Background processing thread stopped\n");
-    return NULL;
-}
+    // Stop the daemon thread
+    stop_daemon(client);
 
-/// <summary>
-/// Set the last error message
-/// </summary>
-/// <param name="format">Format string</param>
-/// <param name="...">Format arguments</param>
-static void set_last_error(const char *format, ...)
-{
-    va_list args;
-    va_start(args, format);
-    vsnprintf(_last_error, sizeof(_last_error), format, args);
-    va_end(args);
+    // Cleanup connection resources
+    cleanup_connection(client);
+
+    // Clear error state
+    client->last_error[0] = '\0';
 
-    dx_Log_Debug("DX MQTT Error: %s\n", _last_error);
+    dx_Log_Debug("DX MQTT: Disconnected and cleaned up\n");
 }
 
 /// <summary>
-/// Clean up MQTT connection resources (but not the daemon thread)
+/// Disconnect if needed and free a client created with dx_mqttClientCreate
 /// </summary>
-/// <returns>True on success</returns>
-static bool cleanup_connection(void)
+/// <param name="client">MQTT client</param>
+void dx_mqttClientDestroy(DX_MQTT_CLIENT *client)
 {
-    bool success = true;
-
-    // Close socket
-    if (_sockfd != -1)
+    if (client == NULL || client == &_default_client)
     {
-        close(_sockfd);
-        _sockfd = -1;
+        return;
     }
 
-    _is_connected   = false;
-    _is_initialized = false;
+    dx_mqttClientDisconnect(client);
 
-    return success;
+    // A daemon can outlive a failed connection, make sure it is gone
+    stop_daemon(client);
+
+    // Nothing posts once the daemon is gone, let the workers and loop finish what is queued
+    dx_mqttDispatchDestroy(client->dispatch_pool);
+    dx_mqttHandoffDestroy(client->loop_handoff);
+
+    config_free(&client->config);
+    free_buffers(client);
+    dx_mqttRingDestroy(client->publish_queue);
+    dx_mqttRingDestroy(client->priority_queue);
+    dx_mqttOutboxClose(client->outbox);
+#ifdef MQTT_USE_BIO
+    dx_mqttTlsDestroy(client->tls);
+#endif
+    dx_mqttTopicTrieDestroy(client->topic_handlers, free);
+    free(client->topic_scratch);
+    for (size_t i = 0; i < client->subscription_count; i++)
+    {
+        free(client->subscriptions[i].topic);
+    }
+    free(client->subscriptions);
+    dx_mqttTopicTrieDestroy(client->compression_filters, free);
+    dx_mqttTopicTrieDestroy(client->conflation_filters, free);
+    dx_mqttTopicTrieDestroy(client->conflated_topics, free_conflated);
+    free(client->conflated);
+    free_rate_snapshot(atomic_load(&client->rate_snapshot));
+    for (size_t i = 0; i < client->rate_filter_count; i++)
+    {
+        free(client->rate_filters[i].filter);
+    }
+    free(client->rate_filters);
+    for (size_t i = 0; i < client->rate_limiter_count; i++)
+    {
+        free_rate_limiter(client->rate_limiters[i]);
+    }
+    free(client->rate_limiters);
+    for (size_t i = 0; i < client->publish_codec_count; i++)
+    {
+        dx_mqttCodecDestroy(client->publish_codecs[i]);
+    }
+    free(client->publish_codecs);
+    dx_mqttCodecDestroy(client->receive_codec);
+    pthread_mutex_destroy(&client->subscriptions_lock);
+    pthread_mutex_destroy(&client->codec_lock);
+    pthread_mutex_destroy(&client->conflation_lock);
+    pthread_mutex_destroy(&client->rate_lock);
+    pthread_mutex_destroy(&client->driver_lock);
+    free(client->inflight);
+    free(client->inflight_outstanding);
+    free(client->inflight_completed);
+    pthread_cond_destroy(&client->inflight_cond);
+    free(client->reservation.staging);
+    pthread_cond_destroy(&client->reservation_cond);
+    free(client);
 }
 
 /// <summary>
@@ -170,84 +6437,87 @@ static bool cleanup_connection(void)
 /// <returns>True on success, false on failure</returns>
 bool dx_mqttConnect(const DX_MQTT_CONFIG *config, DX_MQTT_MESSAGE_RECEIVED_HANDLER message_handler, void *context)
 {
+    DX_MQTT_CLIENT *client = default_client();
+
     if (config == NULL || config->hostname == NULL)
     {
-        set_last_error("Invalid configuration parameters");
+        set_last_error(client, "Invalid configuration parameters");
         return false;
     }
 
-    // Clean up any existing connection
-    if (_is_initialized)
-    {
-        cleanup_connection();
-    }
-
-    // Store message handler and context
-    _message_handler = message_handler;
-    _user_context    = context;
-
-    // Set defaults
-    const char *port      = config->port ? config->port : "1883";
-    const char *client_id = config->client_id; // Can be NULL for anonymous client
-    uint16_t keep_alive   = config->keep_alive_seconds > 0 ? config->keep_alive_seconds : 400;
-
-    dx_Log_Debug("DX MQTT: Connecting to %s:%s\n", config->hostname, port);
-
-    // Open socket connection
-    _sockfd = open_nb_socket(config->hostname, port);
-    if (_sockfd == -1)
+    if (!client_set_config(client, config))
     {
-        set_last_error("Failed to open socket to %s:%s", config->hostname, port);
         return false;
     }
 
-    // Initialize MQTT client
-    mqtt_init(&_client, _sockfd, _send_buffer, sizeof(_send_buffer), _recv_buffer, sizeof(_recv_buffer), publish_callback);
+    return dx_mqttClientConnect(client, message_handler, context);
+}
 
-    // Prepare connection flags
-    uint8_t connect_flags = 0;
-    if (config->clean_session)
-    {
-        connect_flags |= MQTT_CONNECT_CLEAN_SESSION;
-    }
+/// <summary>
+/// Initialize and connect to an MQTT broker without blocking
+/// </summary>
+/// <param name="config">MQTT connection configuration</param>
+/// <param name="message_handler">Callback function for received messages (can be NULL)</param>
+/// <param name="context">User context to pass to the message handler</param>
+/// <param name="complete">Called on the event loop thread with the outcome (can be NULL)</param>
+/// <param name="complete_context">User context passed to the completion callback</param>
+/// <returns>True if the connect was started</returns>
+bool dx_mqttConnectAsync(const DX_MQTT_CONFIG *config, DX_MQTT_MESSAGE_RECEIVED_HANDLER message_handler, void *context,
+    DX_MQTT_CONNECTION_HANDLER complete, void *complete_context)
+{
+    DX_MQTT_CLIENT *client = default_client();
 
-    // Connect to broker
-    if (mqtt_connect(&_client, client_id, config->username, config->password, config->password ? strlen(config->password) : 0, NULL, NULL, connect_flags,
-            keep_alive) != MQTT_OK)
+    if (config == NULL || config->hostname == NULL)
     {
-        set_last_error("MQTT connect failed: %s", mqtt_error_str(_client.error));
-        cleanup_connection();
+        set_last_error(client, "Invalid configuration parameters");
         return false;
     }
 
-    // Check for connection errors
-    if (_client.error != MQTT_OK)
+    if (!client_set_config(client, config))
     {
-        set_last_error("MQTT connection error: %s", mqtt_error_str(_client.error));
-        cleanup_connection();
         return false;
     }
 
-    // Start client daemon thread for automatic background processing (only once)
-    if (!_daemon_created)
-    {
-        _daemon_running = true; // Set this before creating the thread
-        if (pthread_create(&_client_daemon, NULL, client_refresher, &_client) != 0)
-        {
-            set_last_error("Failed to start MQTT background processing thread");
-            _daemon_running = false;
-            cleanup_connection();
-            return false;
-        }
-        _daemon_created = true;
-        dx_Log_Debug("DX MQTT: Created background processing thread\n");
-    }
+    return dx_mqttClientConnectAsync(client, message_handler, context, complete, complete_context);
+}
+
+/// <summary>
+/// Register a callback for connection state changes of the default client
+/// </summary>
+/// <param name="handler">Callback, NULL to remove</param>
+/// <param name="context">User context passed to the handler</param>
+void dx_mqttSetConnectionHandler(DX_MQTT_CONNECTION_HANDLER handler, void *context)
+{
+    dx_mqttClientSetConnectionHandler(default_client(), handler, context);
+}
 
-    _is_initialized = true;
-    _is_connected   = true;
+/// <summary>
+/// Register a callback for acknowledged QoS 1/2 publishes on the default client
+/// </summary>
+/// <param name="handler">Callback, NULL to remove</param>
+/// <param name="context">User context passed to the handler</param>
+void dx_mqttSetPublishCompleteHandler(DX_MQTT_PUBLISH_COMPLETE handler, void *context)
+{
+    dx_mqttClientSetPublishCompleteHandler(default_client(), handler, context);
+}
 
-    dx_Log_Debug("DX MQTT: Successfully connected to %s:%s\n", config->hostname, port);
-    return true;
+/// <summary>
+/// Number of QoS 1/2 publishes of the default client waiting for their acknowledgement
+/// </summary>
+/// <returns>In-flight count</returns>
+size_t dx_mqttGetInflight(void)
+{
+    return dx_mqttClientGetInflight(default_client());
+}
+
+/// <summary>
+/// Block until the default client's in-flight window has room
+/// </summary>
+/// <param name="timeout_ms">Longest wait in milliseconds</param>
+/// <returns>True if there is room, false on timeout</returns>
+bool dx_mqttWaitForWindow(uint32_t timeout_ms)
+{
+    return dx_mqttClientWaitForWindow(default_client(), timeout_ms);
 }
 
 /// <summary>
@@ -257,47 +6527,49 @@ bool dx_mqttConnect(const DX_MQTT_CONFIG *config, DX_MQTT_MESSAGE_RECEIVED_HANDL
 /// <returns>True on success, false on failure</returns>
 bool dx_mqttPublish(const DX_MQTT_MESSAGE *message)
 {
-    // Check if dx_mqttConnect was called first
-    if (!_is_initialized)
-    {
-        return false;
-    }
+    return dx_mqttClientPublish(default_client(), message);
+}
 
-    // Check if still connected
-    if (!_is_connected)
-    {
-        return false;
-    }
+/// <summary>
+/// Publish several messages with one lock acquisition and one socket write
+/// </summary>
+/// <param name="messages">Messages to publish</param>
+/// <param name="count">Number of messages</param>
+/// <param name="results">Optional array of count entries receiving each message's status</param>
+/// <returns>Number of messages queued</returns>
+size_t dx_mqttPublishBatch(const DX_MQTT_MESSAGE *messages, size_t count, bool *results)
+{
+    return dx_mqttClientPublishBatch(default_client(), messages, count, results);
+}
 
-    // Validate message parameters
-    if (message == NULL || message->topic == NULL)
-    {
-        set_last_error("Invalid message parameters - message and topic cannot be NULL");
-        return false;
-    }
+/// <summary>
+/// Reserve space for a PUBLISH in the send buffer so the payload can be written in place
+/// </summary>
+/// <param name="topic">Topic to publish to</param>
+/// <param name="max_length">Largest payload the caller may write</param>
+/// <returns>Writable payload area of max_length bytes, or NULL on failure</returns>
+void *dx_mqttPublishBegin(const char *topic, size_t max_length)
+{
+    return dx_mqttClientPublishBegin(default_client(), topic, max_length);
+}
 
-    // Default QoS to 0 if not specified or invalid
-    uint8_t qos = MQTT_PUBLISH_QOS_0;
-    if (message->qos == 1)
-    {
-        qos = MQTT_PUBLISH_QOS_1;
-    }
-    else if (message->qos == 2)
-    {
-        qos = MQTT_PUBLISH_QOS_2;
-    }
+/// <summary>
+/// Finish a PUBLISH started with dx_mqttPublishBegin
+/// </summary>
+/// <param name="length">Number of payload bytes written</param>
+/// <param name="qos">Quality of Service level (0, 1, or 2)</param>
+/// <returns>True if the message was queued</returns>
+bool dx_mqttPublishCommit(size_t length, uint8_t qos)
+{
+    return dx_mqttClientPublishCommit(default_client(), length, qos);
+}
 
-    // Publish the message
-    if (mqtt_publish(&_client, message->topic, message->payload, message->payload_length, qos) != MQTT_OK)
-    {
-        set_last_error("MQTT publish failed: %s", mqtt_error_str(_client.error));
-        if (_client.error != MQTT_OK)
-        {
-            _is_connected = false;
-        }
-        return false;
-    }
-    return true;
+/// <summary>
+/// Drop a reservation made with dx_mqttPublishBegin without sending anything
+/// </summary>
+void dx_mqttPublishAbort(void)
+{
+    dx_mqttClientPublishAbort(default_client());
 }
 
 /// <summary>
@@ -308,87 +6580,75 @@ bool dx_mqttPublish(const DX_MQTT_MESSAGE *message)
 /// <returns>True on success, false on failure</returns>
 bool dx_mqttSubscribe(const char *topic, uint8_t qos)
 {
-    // Check if dx_mqttConnect was called first
-    if (!_is_initialized)
-    {
-        set_last_error("MQTT client not initialized - dx_mqttConnect must be called first");
-        return false;
-    }
+    return dx_mqttClientSubscribe(default_client(), topic, qos);
+}
 
-    // Check if still connected
-    if (!_is_connected)
-    {
-        set_last_error("MQTT client not connected - connection may have been lost");
-        return false;
-    }
+/// <summary>
+/// Subscribe to a topic filter and route matching messages to their own handler
+/// </summary>
+/// <param name="topic_filter">Topic filter to subscribe to, may use + and #</param>
+/// <param name="qos">Quality of Service level (0, 1, or 2)</param>
+/// <param name="handler">Callback for messages matching the filter</param>
+/// <param name="context">User context passed to the handler</param>
+/// <returns>True on success, false on failure</returns>
+bool dx_mqttSubscribeWithHandler(const char *topic_filter, uint8_t qos, DX_MQTT_MESSAGE_RECEIVED_HANDLER handler, void *context)
+{
+    return dx_mqttClientSubscribeWithHandler(default_client(), topic_filter, qos, handler, context);
+}
 
-    // Validate topic parameter
-    if (topic == NULL)
-    {
-        set_last_error("Invalid topic - topic cannot be NULL");
-        return false;
-    }
+/// <summary>
+/// Compress payloads on topics matching a filter for the default client
+/// </summary>
+/// <param name="topic_filter">Topic filter, may use + and #</param>
+/// <param name="codec">Codec to use, DX_MQTT_CODEC_NONE removes the filter</param>
+/// <param name="level">Codec specific level, 0 selects the default</param>
+/// <returns>False if the filter is invalid or the codec was not built in</returns>
+bool dx_mqttSetCompression(const char *topic_filter, DX_MQTT_CODEC codec, int level)
+{
+    return dx_mqttClientSetCompression(default_client(), topic_filter, codec, level);
+}
 
-    // Validate QoS
-    if (qos > 2)
-    {
-        qos = 0;
-    }
+/// <summary>
+/// Keep only the latest unsent value on topics matching a filter, for the default client
+/// </summary>
+/// <param name="topic_filter">Topic filter, may use + and #</param>
+/// <param name="conflate">True to conflate matching topics, false to remove the filter</param>
+/// <param name="interval_ms">Minimum time between sends on each topic, 0 sends whenever the link has room</param>
+/// <returns>False if the filter is invalid or could not be stored</returns>
+bool dx_mqttSetConflation(const char *topic_filter, bool conflate, uint32_t interval_ms)
+{
+    return dx_mqttClientSetConflation(default_client(), topic_filter, conflate, interval_ms);
+}
 
-    if (mqtt_subscribe(&_client, topic, qos) != MQTT_OK)
-    {
-        set_last_error("MQTT subscribe failed: %s", mqtt_error_str(_client.error));
-        if (_client.error != MQTT_OK)
-        {
-            _is_connected = false;
-        }
-        return false;
-    }
+/// <summary>
+/// Limit the rate of publishes on the default client's connection
+/// </summary>
+/// <param name="limit">Limit to apply, NULL removes it</param>
+/// <returns>False if the limit could not be stored</returns>
+bool dx_mqttSetRateLimit(const DX_MQTT_RATE_LIMIT *limit)
+{
+    return dx_mqttClientSetRateLimit(default_client(), limit);
+}
 
-    dx_Log_Debug("DX MQTT: Subscribed to topic '%s' with QoS %d\n", topic, qos);
-    return true;
+/// <summary>
+/// Limit the rate of publishes on topics matching a filter, for the default client
+/// </summary>
+/// <param name="topic_filter">Topic filter, may use + and #</param>
+/// <param name="limit">Limit to apply, NULL removes the filter</param>
+/// <returns>False if the filter is invalid or could not be stored</returns>
+bool dx_mqttSetTopicRateLimit(const char *topic_filter, const DX_MQTT_RATE_LIMIT *limit)
+{
+    return dx_mqttClientSetTopicRateLimit(default_client(), topic_filter, limit);
 }
 
 /// <summary>
-/// Unsubscribe from an MQTT topic
+/// Unsubscribe from an MQTT topic, dropping any handler registered for it
 /// </summary>
 /// <param name="topic">Topic to unsubscribe from</param>
 /// <returns>True on success, false on failure</returns>
 bool dx_mqttUnsubscribe(const char *topic)
 {
-    // Check if dx_mqttConnect was called first
-    if (!_is_initialized)
-    {
-        set_last_error("MQTT client not initialized - dx_mqttConnect must be called first");
-        return false;
-    }
-
-    // Check if still connected
-    if (!_is_connected)
-    {
-        set_last_error("MQTT client not connected - connection may have been lost");
-        return false;
-    }
-
-    // Validate topic parameter
-    if (topic == NULL)
-    {
-        set_last_error("Invalid topic - topic cannot be NULL");
-        return false;
-    }
-
-    if (mqtt_unsubscribe(&_client, topic) != MQTT_OK)
-    {
-        set_last_error("MQTT unsubscribe failed: %s", mqtt_error_str(_client.error));
-        if (_client.error != MQTT_OK)
-        {
-            _is_connected = false;
-        }
-        return false;
-    }
-
-    dx_Log_Debug("DX MQTT: Unsubscribed from topic '%s'\n", topic);
-    return true;
+    return dx_mqttClientUnsubscribe(default_client(), topic);
 }
 
 /// <summary>
@@ -397,7 +6657,7 @@ bool dx_mqttUnsubscribe(const char *topic)
 /// <returns>True if connected, false otherwise</returns>
 bool dx_isMqttConnected(void)
 {
-    return _is_connected && _is_initialized && (_client.error == MQTT_OK);
+    return dx_mqttClientIsConnected(default_client());
 }
 
 /// <summary>
@@ -406,47 +6666,34 @@ bool dx_isMqttConnected(void)
 /// <returns>String description of the last error, or NULL if no error</returns>
 const char *dx_mqttGetLastError(void)
 {
-    return strlen(_last_error) > 0 ? _last_error : NULL;
+    return dx_mqttClientGetLastError(default_client());
 }
 
 /// <summary>
-/// Disconnect from MQTT broker and cleanup resources
+/// Number of heap allocations made on the receive path of the default client
 /// </summary>
-void dx_mqttDisconnect(void)
+/// <returns>Allocation count</returns>
+size_t dx_mqttGetReceiveAllocations(void)
 {
-    if (!_is_initialized)
-    {
-        return;
-    }
-
-    dx_Log_Debug("DX MQTT: Disconnecting from broker\n");
-
-    // Send disconnect message if still connected
-    if (_is_connected && _client.error == MQTT_OK)
-    {
-        mqtt_disconnect(&_client);
-    }
-
-    // Stop the daemon thread
-    if (_daemon_created && _daemon_running)
-    {
-        _daemon_running = false;
-        if (_client_daemon != 0)
-        {
-            pthread_join(_client_daemon, NULL);
-            _client_daemon  = 0;
-            _daemon_created = false;
-            dx_Log_Debug("DX MQTT: Stopped background processing thread\n");
-        }
-    }
-
-    // Cleanup connection resources
-    cleanup_connection();
+    return dx_mqttClientGetReceiveAllocations(default_client());
+}
 
-    // Clear error state
-    _last_error[0] = '\0';
+/// <summary>
+/// Copy the counters of the default client
+/// </summary>
+/// <param name="stats">Receives the counters</param>
+/// <returns>False if stats is NULL</returns>
+bool dx_mqttGetStats(DX_MQTT_STATS *stats)
+{
+    return dx_mqttClientGetStats(default_client(), stats);
+}
 
-    dx_Log_Debug("DX MQTT: Disconnected and cleaned up\n");
+/// <summary>
+/// Disconnect from MQTT broker and cleanup resources
+/// </summary>
+void dx_mqttDisconnect(void)
+{
+    dx_mqttClientDisconnect(default_client());
 }
 
 /// <summary>
@@ -454,8 +6701,11 @@ void dx_mqttDisconnect(void)
 /// </summary>
 /// <param name="addr">Host address</param>
 /// <param name="port">Port number</param>
+/// <param name="options">TCP options applied before connecting</param>
+/// <param name="error">Receives the reason on failure</param>
+/// <param name="error_size">Size of the error buffer</param>
 /// <returns>Socket file descriptor on success, -1 on failure</returns>
-static int open_nb_socket(const char *addr, const char *port)
+static int open_nb_socket(const char *addr, const char *port, const DX_MQTT_SOCKET_OPTIONS *options, char *error, size_t error_size)
 {
     struct addrinfo hints = {0};
     hints.ai_family       = AF_UNSPEC;   /* IPv4 or IPv6 */
@@ -469,7 +6719,7 @@ static int open_nb_socket(const char *addr, const char *port)
     rv = getaddrinfo(addr, port, &hints, &servinfo);
     if (rv != 0)
     {
-        set_last_error("getaddrinfo failed: %s", gai_strerror(rv));
+        snprintf(error, error_size, "getaddrinfo failed: %s", gai_strerror(rv));
         return -1;
     }
 
@@ -495,6 +6745,9 @@ static int open_nb_socket(const char *addr, const char *port)
             continue;
         }
 
+        /* tune before connecting, buffer sizes only shape the window from the handshake */
+        dx_mqttSocketApplyOptions(sockfd, p->ai_family, options);
+
         /* connect to server */
         rv = connect(sockfd, p->ai_addr, p->ai_addrlen);
         if (rv == -1)
@@ -527,9 +6780,9 @@ static int open_nb_socket(const char *addr, const char *port)
             }
 
             /* Check if connection actually succeeded */
-            int error     = 0;
-            socklen_t len = sizeof(error);
-            if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &len) == -1 || error != 0)
+            int so_error  = 0;
+            socklen_t len = sizeof(so_error);
+            if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &so_error, &len) == -1 || so_error != 0)
             {
                 close(sockfd);
                 sockfd = -1;
@@ -543,9 +6796,9 @@ static int open_nb_socket(const char *addr, const char *port)
 
     if (sockfd == -1)
     {
-        set_last_error("Failed to open socket to %s:%s", addr, port);
+        snprintf(error, error_size, "no address accepted the connection");
         return -1;
     }
 
     return sockfd;
-}
\ No newline at end of file
+}
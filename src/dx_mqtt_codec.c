@@ -0,0 +1,387 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+#include "dx_mqtt_codec.h"
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef DX_MQTT_USE_LZ4
+#include <lz4.h>
+#endif
+
+#ifdef DX_MQTT_USE_ZSTD
+#include <zstd.h>
+#endif
+
+// Payload header on topics with a codec: two magic bytes, the codec, a reserved zero
+// byte and the original length as little endian uint32. Every payload on such a topic
+// carries it, with DX_MQTT_CODEC_NONE for one stored as is, so a binary payload that
+// happens to start with the magic bytes is never mistaken for a compressed one.
+#define DX_MQTT_CODEC_HEADER_SIZE 8
+#define DX_MQTT_CODEC_MAGIC_0 0xDC
+#define DX_MQTT_CODEC_MAGIC_1 0x5A
+
+// Payloads shorter than this are stored, the header would eat any saving
+#define DX_MQTT_CODEC_MIN_LENGTH 64
+
+// Largest payload a received message may claim to expand to
+#define DX_MQTT_CODEC_MAX_LENGTH (16 * 1024 * 1024)
+
+struct DX_MQTT_CODEC_CONTEXT
+{
+    uint8_t *buffer;
+    size_t buffer_size;
+    size_t allocations;
+
+#ifdef DX_MQTT_USE_LZ4
+    void *lz4_state;
+#endif
+
+#ifdef DX_MQTT_USE_ZSTD
+    ZSTD_CCtx *zstd_compress;
+    ZSTD_DCtx *zstd_decompress;
+#endif
+};
+
+/// <summary>
+/// Grow the output buffer to hold at least size bytes
+/// </summary>
+/// <param name="context">Codec context</param>
+/// <param name="size">Bytes needed</param>
+/// <returns>False if the allocation failed</returns>
+static bool reserve_buffer(DX_MQTT_CODEC_CONTEXT *context, size_t size)
+{
+    if (size <= context->buffer_size)
+    {
+        return true;
+    }
+
+    size_t new_size = context->buffer_size > 0 ? context->buffer_size : 1024;
+    while (new_size < size)
+    {
+        new_size *= 2;
+    }
+
+    uint8_t *buffer = realloc(context->buffer, new_size);
+    if (buffer == NULL)
+    {
+        return false;
+    }
+
+    context->buffer      = buffer;
+    context->buffer_size = new_size;
+    context->allocations++;
+
+    return true;
+}
+
+/// <summary>
+/// Create a codec context
+/// </summary>
+/// <returns>New context, or NULL on failure</returns>
+DX_MQTT_CODEC_CONTEXT *dx_mqttCodecCreate(void)
+{
+    return calloc(1, sizeof(DX_MQTT_CODEC_CONTEXT));
+}
+
+/// <summary>
+/// Free a codec context
+/// </summary>
+/// <param name="context">Codec context, can be NULL</param>
+void dx_mqttCodecDestroy(DX_MQTT_CODEC_CONTEXT *context)
+{
+    if (context == NULL)
+    {
+        return;
+    }
+
+#ifdef DX_MQTT_USE_LZ4
+    free(context->lz4_state);
+#endif
+
+#ifdef DX_MQTT_USE_ZSTD
+    ZSTD_freeCCtx(context->zstd_compress);
+    ZSTD_freeDCtx(context->zstd_decompress);
+#endif
+
+    free(context->buffer);
+    free(context);
+}
+
+/// <summary>
+/// Check whether a codec was compiled in
+/// </summary>
+/// <param name="codec">Codec</param>
+/// <returns>True if payloads can be compressed and decompressed with it</returns>
+bool dx_mqttCodecIsAvailable(DX_MQTT_CODEC codec)
+{
+    switch (codec)
+    {
+#ifdef DX_MQTT_USE_LZ4
+        case DX_MQTT_CODEC_LZ4:
+            return true;
+#endif
+#ifdef DX_MQTT_USE_ZSTD
+        case DX_MQTT_CODEC_ZSTD:
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+/// <summary>
+/// Compress into the buffer after the header room
+/// </summary>
+/// <param name="context">Codec context</param>
+/// <param name="codec">Available codec</param>
+/// <param name="level">Codec specific level, 0 selects the default</param>
+/// <param name="payload">Payload to compress</param>
+/// <param name="length">Payload length</param>
+/// <returns>Compressed length, 0 if compression failed or the payload is too large</returns>
+static size_t compress_into_buffer(DX_MQTT_CODEC_CONTEXT *context, DX_MQTT_CODEC codec, int level, const void *payload, size_t length)
+{
+    switch (codec)
+    {
+#ifdef DX_MQTT_USE_LZ4
+        case DX_MQTT_CODEC_LZ4:
+        {
+            int bound = length <= INT_MAX ? LZ4_compressBound((int)length) : 0;
+            if (bound <= 0 || !reserve_buffer(context, DX_MQTT_CODEC_HEADER_SIZE + (size_t)bound))
+            {
+                return 0;
+            }
+
+            if (context->lz4_state == NULL)
+            {
+                context->lz4_state = malloc((size_t)LZ4_sizeofState());
+                if (context->lz4_state == NULL)
+                {
+                    return 0;
+                }
+                context->allocations++;
+            }
+
+            int compressed = LZ4_compress_fast_extState(context->lz4_state, payload, (char *)context->buffer + DX_MQTT_CODEC_HEADER_SIZE,
+                (int)length, bound, level > 0 ? level : 1);
+            return compressed > 0 ? (size_t)compressed : 0;
+        }
+#endif
+#ifdef DX_MQTT_USE_ZSTD
+        case DX_MQTT_CODEC_ZSTD:
+        {
+            size_t bound = ZSTD_compressBound(length);
+            if (ZSTD_isError(bound) || !reserve_buffer(context, DX_MQTT_CODEC_HEADER_SIZE + bound))
+            {
+                return 0;
+            }
+
+            if (context->zstd_compress == NULL)
+            {
+                context->zstd_compress = ZSTD_createCCtx();
+                if (context->zstd_compress == NULL)
+                {
+                    return 0;
+                }
+                context->allocations++;
+            }
+
+            size_t compressed =
+                ZSTD_compressCCtx(context->zstd_compress, context->buffer + DX_MQTT_CODEC_HEADER_SIZE, bound, payload, length, level);
+            return ZSTD_isError(compressed) ? 0 : compressed;
+        }
+#endif
+        default:
+            (void)context;
+            (void)level;
+            (void)payload;
+            (void)length;
+            return 0;
+    }
+}
+
+/// <summary>
+/// Write the codec header at the start of the buffer
+/// </summary>
+/// <param name="context">Codec context, its buffer holds the header and what follows</param>
+/// <param name="codec">Codec the rest of the payload is in, DX_MQTT_CODEC_NONE when stored</param>
+/// <param name="length">Original payload length</param>
+static void write_header(DX_MQTT_CODEC_CONTEXT *context, DX_MQTT_CODEC codec, size_t length)
+{
+    uint8_t *header = context->buffer;
+
+    header[0] = DX_MQTT_CODEC_MAGIC_0;
+    header[1] = DX_MQTT_CODEC_MAGIC_1;
+    header[2] = (uint8_t)codec;
+    header[3] = 0;
+    header[4] = (uint8_t)length;
+    header[5] = (uint8_t)(length >> 8);
+    header[6] = (uint8_t)(length >> 16);
+    header[7] = (uint8_t)(length >> 24);
+}
+
+/// <summary>
+/// Compress a payload behind the codec header. Small payloads, and payloads that
+/// would not shrink, are stored behind a header with DX_MQTT_CODEC_NONE.
+/// </summary>
+/// <param name="context">Codec context</param>
+/// <param name="codec">Codec to use</param>
+/// <param name="level">Codec specific level, 0 selects the default</param>
+/// <param name="payload">Payload to compress</param>
+/// <param name="length">Payload length</param>
+/// <param name="output">Receives the payload to send, valid until the next call</param>
+/// <param name="output_length">Receives its length</param>
+/// <returns>False if the codec failed or is not available</returns>
+bool dx_mqttCodecCompress(DX_MQTT_CODEC_CONTEXT *context, DX_MQTT_CODEC codec, int level, const void *payload, size_t length,
+    const void **output, size_t *output_length)
+{
+    *output        = payload;
+    *output_length = length;
+
+    if (codec == DX_MQTT_CODEC_NONE)
+    {
+        return true;
+    }
+
+    if (context == NULL || !dx_mqttCodecIsAvailable(codec) || length > UINT32_MAX)
+    {
+        return false;
+    }
+
+    if (length >= DX_MQTT_CODEC_MIN_LENGTH && length <= DX_MQTT_CODEC_MAX_LENGTH)
+    {
+        size_t compressed = compress_into_buffer(context, codec, level, payload, length);
+        if (compressed == 0)
+        {
+            return false;
+        }
+
+        if (DX_MQTT_CODEC_HEADER_SIZE + compressed < length)
+        {
+            write_header(context, codec, length);
+            *output        = context->buffer;
+            *output_length = DX_MQTT_CODEC_HEADER_SIZE + compressed;
+            return true;
+        }
+    }
+
+    if (!reserve_buffer(context, DX_MQTT_CODEC_HEADER_SIZE + length))
+    {
+        return false;
+    }
+
+    write_header(context, DX_MQTT_CODEC_NONE, length);
+    memcpy(context->buffer + DX_MQTT_CODEC_HEADER_SIZE, payload, length);
+
+    *output        = context->buffer;
+    *output_length = DX_MQTT_CODEC_HEADER_SIZE + length;
+
+    return true;
+}
+
+/// <summary>
+/// Decompress a payload that starts with the codec header. A stored payload is
+/// returned in place after its header, payloads without the header unchanged.
+/// </summary>
+/// <param name="context">Codec context</param>
+/// <param name="payload">Received payload</param>
+/// <param name="length">Payload length</param>
+/// <param name="output">Receives the original payload, valid until the next call</param>
+/// <param name="output_length">Receives its length</param>
+/// <returns>False if the payload is corrupt or uses a codec that is not available</returns>
+bool dx_mqttCodecDecompress(DX_MQTT_CODEC_CONTEXT *context, const void *payload, size_t length, const void **output, size_t *output_length)
+{
+    const uint8_t *header = payload;
+
+    *output        = payload;
+    *output_length = length;
+
+    if (length < DX_MQTT_CODEC_HEADER_SIZE || header[0] != DX_MQTT_CODEC_MAGIC_0 || header[1] != DX_MQTT_CODEC_MAGIC_1 || header[3] != 0)
+    {
+        return true;
+    }
+
+    DX_MQTT_CODEC codec = (DX_MQTT_CODEC)header[2];
+    size_t original     = (size_t)header[4] | (size_t)header[5] << 8 | (size_t)header[6] << 16 | (size_t)header[7] << 24;
+
+    if (codec == DX_MQTT_CODEC_NONE)
+    {
+        if (original != length - DX_MQTT_CODEC_HEADER_SIZE)
+        {
+            return false;
+        }
+
+        *output        = header + DX_MQTT_CODEC_HEADER_SIZE;
+        *output_length = original;
+        return true;
+    }
+
+    if (context == NULL || !dx_mqttCodecIsAvailable(codec) || original > DX_MQTT_CODEC_MAX_LENGTH ||
+        !reserve_buffer(context, original > 0 ? original : 1))
+    {
+        return false;
+    }
+
+    const uint8_t *compressed = header + DX_MQTT_CODEC_HEADER_SIZE;
+    size_t compressed_length  = length - DX_MQTT_CODEC_HEADER_SIZE;
+    bool decoded              = false;
+
+    switch (codec)
+    {
+#ifdef DX_MQTT_USE_LZ4
+        case DX_MQTT_CODEC_LZ4:
+        {
+            int result = compressed_length <= INT_MAX
+                             ? LZ4_decompress_safe((const char *)compressed, (char *)context->buffer, (int)compressed_length, (int)original)
+                             : -1;
+            decoded    = result >= 0 && (size_t)result == original;
+            break;
+        }
+#endif
+#ifdef DX_MQTT_USE_ZSTD
+        case DX_MQTT_CODEC_ZSTD:
+        {
+            if (context->zstd_decompress == NULL)
+            {
+                context->zstd_decompress = ZSTD_createDCtx();
+                if (context->zstd_decompress == NULL)
+                {
+                    return false;
+                }
+                context->allocations++;
+            }
+
+            size_t result = ZSTD_decompressDCtx(context->zstd_decompress, context->buffer, original, compressed, compressed_length);
+            decoded       = !ZSTD_isError(result) && result == original;
+            break;
+        }
+#endif
+        default:
+            (void)compressed;
+            (void)compressed_length;
+            break;
+    }
+
+    if (!decoded)
+    {
+        return false;
+    }
+
+    *output        = context->buffer;
+    *output_length = original;
+
+    return true;
+}
+
+/// <summary>
+/// Number of heap allocations the context has made, for the allocation counters
+/// </summary>
+/// <param name="context">Codec context, can be NULL</param>
+/// <returns>Allocation count</returns>
+size_t dx_mqttCodecAllocations(const DX_MQTT_CODEC_CONTEXT *context)
+{
+    return context != NULL ? context->allocations : 0;
+}
@@ -0,0 +1,311 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+#include "dx_mqtt_dispatch.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// One queued message: the NUL terminated topic, the header and the payload. The buffer
+// stays with the slot and only grows, so a warmed up queue never allocates.
+typedef struct
+{
+    char *data;
+    size_t capacity;
+    size_t topic_length;
+    size_t header_length;
+    size_t payload_length;
+} MQTT_DISPATCH_SLOT;
+
+// A worker and its queue. The slot at head stays counted until its handler returns,
+// so a producer never writes into the message being handled.
+typedef struct
+{
+    pthread_t thread;
+    bool started;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    MQTT_DISPATCH_SLOT *slots;
+    size_t head;
+    size_t count;
+    bool stopping;
+    DX_MQTT_DISPATCH *dispatch;
+} MQTT_DISPATCH_WORKER;
+
+struct DX_MQTT_DISPATCH
+{
+    MQTT_DISPATCH_WORKER *workers;
+    size_t worker_count;
+    size_t queue_length;
+    DX_MQTT_DISPATCH_HANDLER handler;
+    void *context;
+    atomic_size_t allocations;
+};
+
+/// <summary>
+/// Pick the worker for a topic with FNV-1a, so a topic always lands on the same one
+/// </summary>
+/// <param name="dispatch">Worker pool</param>
+/// <param name="topic">Topic, not NUL terminated</param>
+/// <param name="topic_length">Topic length</param>
+/// <returns>Worker</returns>
+static MQTT_DISPATCH_WORKER *topic_worker(DX_MQTT_DISPATCH *dispatch, const char *topic, size_t topic_length)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < topic_length; i++)
+    {
+        hash = (hash ^ (uint8_t)topic[i]) * 16777619u;
+    }
+
+    return &dispatch->workers[hash % dispatch->worker_count];
+}
+
+/// <summary>
+/// Worker thread. Runs queued messages in order until stopped with an empty queue.
+/// </summary>
+/// <param name="arg">MQTT_DISPATCH_WORKER</param>
+/// <returns>NULL</returns>
+static void *worker_main(void *arg)
+{
+    MQTT_DISPATCH_WORKER *worker = arg;
+    DX_MQTT_DISPATCH *dispatch   = worker->dispatch;
+
+    pthread_mutex_lock(&worker->lock);
+
+    for (;;)
+    {
+        while (worker->count == 0 && !worker->stopping)
+        {
+            pthread_cond_wait(&worker->not_empty, &worker->lock);
+        }
+
+        if (worker->count == 0)
+        {
+            break;
+        }
+
+        MQTT_DISPATCH_SLOT *slot = &worker->slots[worker->head];
+        const char *header       = slot->data + slot->topic_length + 1;
+        pthread_mutex_unlock(&worker->lock);
+
+        dispatch->handler(slot->data, header, slot->header_length, header + slot->header_length, slot->payload_length, dispatch->context);
+
+        pthread_mutex_lock(&worker->lock);
+        worker->head = (worker->head + 1) % dispatch->queue_length;
+        worker->count--;
+        pthread_cond_signal(&worker->not_full);
+    }
+
+    pthread_mutex_unlock(&worker->lock);
+
+    return NULL;
+}
+
+/// <summary>
+/// Create a worker pool and start its threads
+/// </summary>
+/// <param name="workers">Number of worker threads</param>
+/// <param name="queue_length">Messages each worker can hold</param>
+/// <param name="handler">Called for each message</param>
+/// <param name="context">Passed to the handler</param>
+/// <returns>New pool, or NULL on failure</returns>
+DX_MQTT_DISPATCH *dx_mqttDispatchCreate(size_t workers, size_t queue_length, DX_MQTT_DISPATCH_HANDLER handler, void *context)
+{
+    if (workers == 0 || queue_length == 0 || handler == NULL)
+    {
+        return NULL;
+    }
+
+    DX_MQTT_DISPATCH *dispatch = calloc(1, sizeof(DX_MQTT_DISPATCH));
+    if (dispatch == NULL)
+    {
+        return NULL;
+    }
+
+    dispatch->queue_length = queue_length;
+    dispatch->handler      = handler;
+    dispatch->context      = context;
+    atomic_init(&dispatch->allocations, 0);
+
+    dispatch->workers = calloc(workers, sizeof(MQTT_DISPATCH_WORKER));
+    if (dispatch->workers == NULL)
+    {
+        free(dispatch);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < workers; i++)
+    {
+        MQTT_DISPATCH_WORKER *worker = &dispatch->workers[i];
+
+        worker->slots = calloc(queue_length, sizeof(MQTT_DISPATCH_SLOT));
+        if (worker->slots == NULL)
+        {
+            dx_mqttDispatchDestroy(dispatch);
+            return NULL;
+        }
+
+        worker->dispatch = dispatch;
+        pthread_mutex_init(&worker->lock, NULL);
+        pthread_cond_init(&worker->not_empty, NULL);
+        pthread_cond_init(&worker->not_full, NULL);
+        dispatch->worker_count++;
+
+        worker->started = pthread_create(&worker->thread, NULL, worker_main, worker) == 0;
+        if (!worker->started)
+        {
+            dx_mqttDispatchDestroy(dispatch);
+            return NULL;
+        }
+    }
+
+    return dispatch;
+}
+
+/// <summary>
+/// Run every message still queued, then stop and free the pool. Must not be called
+/// from a worker thread.
+/// </summary>
+/// <param name="dispatch">Worker pool, can be NULL</param>
+void dx_mqttDispatchDestroy(DX_MQTT_DISPATCH *dispatch)
+{
+    if (dispatch == NULL)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < dispatch->worker_count; i++)
+    {
+        MQTT_DISPATCH_WORKER *worker = &dispatch->workers[i];
+
+        pthread_mutex_lock(&worker->lock);
+        worker->stopping = true;
+        pthread_cond_signal(&worker->not_empty);
+        pthread_mutex_unlock(&worker->lock);
+    }
+
+    for (size_t i = 0; i < dispatch->worker_count; i++)
+    {
+        MQTT_DISPATCH_WORKER *worker = &dispatch->workers[i];
+
+        if (worker->started)
+        {
+            pthread_join(worker->thread, NULL);
+        }
+
+        for (size_t s = 0; s < dispatch->queue_length; s++)
+        {
+            free(worker->slots[s].data);
+        }
+        free(worker->slots);
+        pthread_mutex_destroy(&worker->lock);
+        pthread_cond_destroy(&worker->not_empty);
+        pthread_cond_destroy(&worker->not_full);
+    }
+
+    free(dispatch->workers);
+    free(dispatch);
+}
+
+/// <summary>
+/// Copy a message into the queue of its topic's worker
+/// </summary>
+/// <param name="dispatch">Worker pool</param>
+/// <param name="topic">Topic, not NUL terminated</param>
+/// <param name="topic_length">Topic length</param>
+/// <param name="header">Bytes the poster wants back with the message, such as what it already looked up</param>
+/// <param name="header_length">Header length, can be 0</param>
+/// <param name="payload">Payload</param>
+/// <param name="payload_length">Payload length</param>
+/// <returns>DX_MQTT_DISPATCH_QUEUED, or why the message was not queued</returns>
+DX_MQTT_DISPATCH_RESULT dx_mqttDispatchPost(DX_MQTT_DISPATCH *dispatch, const char *topic, size_t topic_length, const void *header,
+    size_t header_length, const void *payload, size_t payload_length)
+{
+    MQTT_DISPATCH_WORKER *worker = topic_worker(dispatch, topic, topic_length);
+    size_t size                  = topic_length + 1 + header_length + payload_length;
+
+    pthread_mutex_lock(&worker->lock);
+
+    if (worker->count == dispatch->queue_length)
+    {
+        pthread_mutex_unlock(&worker->lock);
+        return DX_MQTT_DISPATCH_FULL;
+    }
+
+    MQTT_DISPATCH_SLOT *slot = &worker->slots[(worker->head + worker->count) % dispatch->queue_length];
+
+    if (size > slot->capacity)
+    {
+        size_t capacity = slot->capacity > 0 ? slot->capacity : 256;
+        while (capacity < size)
+        {
+            capacity *= 2;
+        }
+
+        char *data = realloc(slot->data, capacity);
+        if (data == NULL)
+        {
+            pthread_mutex_unlock(&worker->lock);
+            return DX_MQTT_DISPATCH_NO_MEMORY;
+        }
+
+        slot->data     = data;
+        slot->capacity = capacity;
+        atomic_fetch_add(&dispatch->allocations, 1);
+    }
+
+    memcpy(slot->data, topic, topic_length);
+    slot->data[topic_length] = '\0';
+    if (header_length > 0)
+    {
+        memcpy(slot->data + topic_length + 1, header, header_length);
+    }
+    if (payload_length > 0)
+    {
+        memcpy(slot->data + topic_length + 1 + header_length, payload, payload_length);
+    }
+    slot->topic_length   = topic_length;
+    slot->header_length  = header_length;
+    slot->payload_length = payload_length;
+
+    worker->count++;
+    pthread_cond_signal(&worker->not_empty);
+
+    pthread_mutex_unlock(&worker->lock);
+
+    return DX_MQTT_DISPATCH_QUEUED;
+}
+
+/// <summary>
+/// Block until the worker a topic hashes to has a free slot
+/// </summary>
+/// <param name="dispatch">Worker pool</param>
+/// <param name="topic">Topic, not NUL terminated</param>
+/// <param name="topic_length">Topic length</param>
+void dx_mqttDispatchWaitForRoom(DX_MQTT_DISPATCH *dispatch, const char *topic, size_t topic_length)
+{
+    MQTT_DISPATCH_WORKER *worker = topic_worker(dispatch, topic, topic_length);
+
+    pthread_mutex_lock(&worker->lock);
+
+    while (worker->count == dispatch->queue_length)
+    {
+        pthread_cond_wait(&worker->not_full, &worker->lock);
+    }
+
+    pthread_mutex_unlock(&worker->lock);
+}
+
+/// <summary>
+/// Number of heap allocations the pool has made for slot buffers, for the allocation counters
+/// </summary>
+/// <param name="dispatch">Worker pool, can be NULL</param>
+/// <returns>Allocation count</returns>
+size_t dx_mqttDispatchAllocations(const DX_MQTT_DISPATCH *dispatch)
+{
+    return dispatch != NULL ? atomic_load(&dispatch->allocations) : 0;
+}
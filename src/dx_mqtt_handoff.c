@@ -0,0 +1,282 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+#include "dx_mqtt_handoff.h"
+#include "dx_mqtt_ring.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Ring record header. The NUL terminated topic, the poster's header and the payload
+// follow it in the slot, or live in spill when they are too large for one.
+typedef struct
+{
+    uint32_t topic_length;
+    uint32_t header_length;
+    uint32_t payload_length;
+    char *spill;
+} MQTT_HANDOFF_RECORD;
+
+struct DX_MQTT_HANDOFF
+{
+    uv_async_t async;
+    DX_MQTT_RING *ring;
+    size_t slot_count;
+    size_t inline_size;
+    DX_MQTT_DISPATCH_HANDLER handler;
+    void *context;
+    atomic_size_t allocations;
+
+    // Producers blocked on a full ring. queued counts posted records the loop has not
+    // finished with, waiters lets the loop skip the lock when nobody is blocked.
+    atomic_size_t queued;
+    atomic_uint waiters;
+    pthread_mutex_t wait_lock;
+    pthread_cond_t room;
+};
+
+/// <summary>
+/// Run up to limit waiting messages on the loop thread and wake blocked producers
+/// </summary>
+/// <param name="handoff">Handoff</param>
+/// <param name="limit">Most messages to run</param>
+/// <returns>Number of messages run</returns>
+static size_t run_pending(DX_MQTT_HANDOFF *handoff, size_t limit)
+{
+    const void *slot;
+    size_t length;
+    size_t count = 0;
+
+    while (count < limit && (slot = dx_mqttRingPeek(handoff->ring, &length)) != NULL)
+    {
+        const MQTT_HANDOFF_RECORD *record = slot;
+        const char *data                  = record->spill != NULL ? record->spill : (const char *)(record + 1);
+        const char *header                = data + record->topic_length + 1;
+        char *spill                       = record->spill;
+
+        handoff->handler(data, header, record->header_length, header + record->header_length, record->payload_length, handoff->context);
+
+        dx_mqttRingRelease(handoff->ring);
+        free(spill);
+        count++;
+    }
+
+    if (count > 0)
+    {
+        atomic_fetch_sub(&handoff->queued, count);
+
+        if (atomic_load(&handoff->waiters) > 0)
+        {
+            pthread_mutex_lock(&handoff->wait_lock);
+            pthread_cond_broadcast(&handoff->room);
+            pthread_mutex_unlock(&handoff->wait_lock);
+        }
+    }
+
+    return count;
+}
+
+/// <summary>
+/// Async handler. Runs one batch, at most a ring's worth so a steady stream cannot
+/// hold the loop, and comes back on the next iteration if that left messages behind.
+/// </summary>
+/// <param name="handle">Handoff async handle</param>
+static void handoff_async_handler(uv_async_t *handle)
+{
+    DX_MQTT_HANDOFF *handoff = handle->data;
+
+    if (run_pending(handoff, handoff->slot_count) == handoff->slot_count)
+    {
+        uv_async_send(&handoff->async);
+    }
+}
+
+/// <summary>
+/// Free the handoff once libuv has released its handle
+/// </summary>
+/// <param name="handle">Handoff async handle</param>
+static void handoff_close_handler(uv_handle_t *handle)
+{
+    DX_MQTT_HANDOFF *handoff = handle->data;
+
+    dx_mqttRingDestroy(handoff->ring);
+    pthread_mutex_destroy(&handoff->wait_lock);
+    pthread_cond_destroy(&handoff->room);
+    free(handoff);
+}
+
+/// <summary>
+/// Create a handoff onto a loop. Must be called on the loop's thread.
+/// </summary>
+/// <param name="loop">Loop whose thread runs the handler</param>
+/// <param name="slot_count">Messages that can be waiting for the loop</param>
+/// <param name="inline_size">Topic and payload bytes a slot holds without allocating</param>
+/// <param name="handler">Called on the loop thread for each message</param>
+/// <param name="context">Passed to the handler</param>
+/// <returns>New handoff, or NULL on failure</returns>
+DX_MQTT_HANDOFF *dx_mqttHandoffCreate(uv_loop_t *loop, size_t slot_count, size_t inline_size, DX_MQTT_DISPATCH_HANDLER handler, void *context)
+{
+    if (loop == NULL || slot_count == 0 || handler == NULL)
+    {
+        return NULL;
+    }
+
+    DX_MQTT_HANDOFF *handoff = calloc(1, sizeof(DX_MQTT_HANDOFF));
+    if (handoff == NULL)
+    {
+        return NULL;
+    }
+
+    handoff->ring = dx_mqttRingCreate(slot_count, sizeof(MQTT_HANDOFF_RECORD) + inline_size);
+    if (handoff->ring == NULL || uv_async_init(loop, &handoff->async, handoff_async_handler) != 0)
+    {
+        dx_mqttRingDestroy(handoff->ring);
+        free(handoff);
+        return NULL;
+    }
+
+    handoff->async.data  = handoff;
+    handoff->slot_count  = slot_count;
+    handoff->inline_size = dx_mqttRingSlotSize(handoff->ring) - sizeof(MQTT_HANDOFF_RECORD);
+    handoff->handler     = handler;
+    handoff->context     = context;
+    atomic_init(&handoff->allocations, 0);
+    atomic_init(&handoff->queued, 0);
+    atomic_init(&handoff->waiters, 0);
+    pthread_mutex_init(&handoff->wait_lock, NULL);
+    pthread_cond_init(&handoff->room, NULL);
+
+    return handoff;
+}
+
+/// <summary>
+/// Run the messages still waiting and close the handoff. Must be called on the
+/// loop's thread with no producer left, the memory is freed on a later loop iteration.
+/// </summary>
+/// <param name="handoff">Handoff, can be NULL</param>
+void dx_mqttHandoffDestroy(DX_MQTT_HANDOFF *handoff)
+{
+    if (handoff == NULL)
+    {
+        return;
+    }
+
+    run_pending(handoff, SIZE_MAX);
+    uv_close((uv_handle_t *)&handoff->async, handoff_close_handler);
+}
+
+/// <summary>
+/// Copy a message into the ring and wake the loop
+/// </summary>
+/// <param name="handoff">Handoff</param>
+/// <param name="topic">Topic, not NUL terminated</param>
+/// <param name="topic_length">Topic length</param>
+/// <param name="header">Bytes handed back to the handler with the message</param>
+/// <param name="header_length">Header length, can be 0</param>
+/// <param name="payload">Payload</param>
+/// <param name="payload_length">Payload length</param>
+/// <returns>DX_MQTT_DISPATCH_QUEUED, or why the message was not queued</returns>
+DX_MQTT_DISPATCH_RESULT dx_mqttHandoffPost(DX_MQTT_HANDOFF *handoff, const char *topic, size_t topic_length, const void *header,
+    size_t header_length, const void *payload, size_t payload_length)
+{
+    size_t size = topic_length + 1 + header_length + payload_length;
+    char *spill = NULL;
+
+    // MQTT caps topics at 64 KiB and packets at 256 MiB, so the lengths fit the record
+    if (size > handoff->inline_size)
+    {
+        spill = malloc(size);
+        if (spill == NULL)
+        {
+            return DX_MQTT_DISPATCH_NO_MEMORY;
+        }
+        atomic_fetch_add(&handoff->allocations, 1);
+    }
+
+    MQTT_HANDOFF_RECORD *record = dx_mqttRingClaim(handoff->ring);
+    if (record == NULL)
+    {
+        free(spill);
+        return DX_MQTT_DISPATCH_FULL;
+    }
+
+    char *data = spill != NULL ? spill : (char *)(record + 1);
+
+    memcpy(data, topic, topic_length);
+    data[topic_length] = '\0';
+    if (header_length > 0)
+    {
+        memcpy(data + topic_length + 1, header, header_length);
+    }
+    if (payload_length > 0)
+    {
+        memcpy(data + topic_length + 1 + header_length, payload, payload_length);
+    }
+
+    record->topic_length   = (uint32_t)topic_length;
+    record->header_length  = (uint32_t)header_length;
+    record->payload_length = (uint32_t)payload_length;
+    record->spill          = spill;
+
+    atomic_fetch_add(&handoff->queued, 1);
+    dx_mqttRingPublish(handoff->ring, record, sizeof(MQTT_HANDOFF_RECORD) + (spill != NULL ? 0 : size));
+
+    // libuv folds sends that arrive before the loop gets to them into one callback
+    uv_async_send(&handoff->async);
+
+    return DX_MQTT_DISPATCH_QUEUED;
+}
+
+/// <summary>
+/// Block until the loop has taken messages off a full ring, or the timeout passes
+/// </summary>
+/// <param name="handoff">Handoff</param>
+/// <param name="timeout_ms">Longest wait</param>
+/// <returns>True if there is room</returns>
+bool dx_mqttHandoffWaitForRoom(DX_MQTT_HANDOFF *handoff, uint32_t timeout_ms)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&handoff->wait_lock);
+
+    // Announce the wait before checking, so the loop either sees the waiter or this
+    // check sees the room the loop made
+    atomic_fetch_add(&handoff->waiters, 1);
+
+    while (atomic_load(&handoff->queued) >= handoff->slot_count)
+    {
+        if (pthread_cond_timedwait(&handoff->room, &handoff->wait_lock, &deadline) == ETIMEDOUT)
+        {
+            break;
+        }
+    }
+
+    atomic_fetch_sub(&handoff->waiters, 1);
+    bool room = atomic_load(&handoff->queued) < handoff->slot_count;
+
+    pthread_mutex_unlock(&handoff->wait_lock);
+
+    return room;
+}
+
+/// <summary>
+/// Number of heap allocations made for messages too large for a slot, for the allocation counters
+/// </summary>
+/// <param name="handoff">Handoff, can be NULL</param>
+/// <returns>Allocation count</returns>
+size_t dx_mqttHandoffAllocations(const DX_MQTT_HANDOFF *handoff)
+{
+    return handoff != NULL ? atomic_load(&handoff->allocations) : 0;
+}
@@ -0,0 +1,609 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+#include "dx_mqtt_outbox.h"
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define DX_MQTT_OUTBOX_MAGIC   0x584F4244 // "DBOX"
+#define DX_MQTT_OUTBOX_VERSION 3
+
+// Record storage starts after the header, on its own cache line
+#define DX_MQTT_OUTBOX_DATA_OFFSET 64
+
+// File header. head and tail are monotonic byte offsets, the ring position is the
+// offset modulo capacity, so tail - head is the number of bytes in use. tail is only
+// synced after the record it covers, and head before the space it frees is reused,
+// so the disk never describes bytes that are not there. Open still checks every
+// record up to tail against damage on the medium.
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t dropped;
+} MQTT_OUTBOX_HEADER;
+
+// Precedes every record, followed by the topic and then the payload. crc is the CRC-32
+// of the fields after header_crc, the topic and the payload. header_crc covers those
+// fields alone, so recovery can look for the next record past a damaged one cheaply.
+typedef struct
+{
+    uint32_t crc;
+    uint32_t header_crc;
+    uint32_t payload_length;
+    uint16_t topic_length;
+    uint8_t qos;
+    uint8_t retain;
+} MQTT_OUTBOX_RECORD;
+
+struct DX_MQTT_OUTBOX
+{
+    pthread_mutex_t lock;
+    int fd;
+    size_t map_size;
+    MQTT_OUTBOX_HEADER *header;
+    uint8_t *data;
+    uint64_t capacity;
+    DX_MQTT_OUTBOX_EVICTION eviction;
+    size_t page_size;
+
+    // head as last synced to the file, appends sync the header before reusing freed space
+    uint64_t synced_head;
+
+    // Records between head and tail, counted by the walk on open
+    uint64_t count;
+
+    // Linear copy of the peeked record, records may wrap around the end of the ring
+    char *scratch;
+    size_t scratch_size;
+    uint64_t peek_head;
+    bool peek_valid;
+};
+
+/// <summary>
+/// Copy bytes into the ring at a monotonic offset, wrapping at the end
+/// </summary>
+static void ring_write(DX_MQTT_OUTBOX *outbox, uint64_t offset, const void *source, size_t length)
+{
+    if (length == 0)
+    {
+        return;
+    }
+
+    size_t position = (size_t)(offset % outbox->capacity);
+    size_t first    = length < outbox->capacity - position ? length : (size_t)(outbox->capacity - position);
+
+    memcpy(outbox->data + position, source, first);
+    memcpy(outbox->data, (const uint8_t *)source + first, length - first);
+}
+
+/// <summary>
+/// Copy bytes out of the ring at a monotonic offset, wrapping at the end
+/// </summary>
+static void ring_read(const DX_MQTT_OUTBOX *outbox, uint64_t offset, void *destination, size_t length)
+{
+    size_t position = (size_t)(offset % outbox->capacity);
+    size_t first    = length < outbox->capacity - position ? length : (size_t)(outbox->capacity - position);
+
+    memcpy(destination, outbox->data + position, first);
+    memcpy((uint8_t *)destination + first, outbox->data, length - first);
+}
+
+/// <summary>
+/// Move bytes toward the front of the ring, to a lower monotonic offset. Copying in
+/// ascending chunks never overwrites source bytes that have not been read yet.
+/// </summary>
+static void ring_move(DX_MQTT_OUTBOX *outbox, uint64_t to, uint64_t from, uint64_t length)
+{
+    uint8_t chunk[4096];
+
+    for (uint64_t done = 0; done < length;)
+    {
+        size_t size = length - done < sizeof(chunk) ? (size_t)(length - done) : sizeof(chunk);
+
+        ring_read(outbox, from + done, chunk, size);
+        ring_write(outbox, to + done, chunk, size);
+        done += size;
+    }
+}
+
+/// <summary>
+/// Write the pages holding a range of the mapping back to the file and wait for them
+/// </summary>
+static void sync_bytes(DX_MQTT_OUTBOX *outbox, const void *start, size_t length)
+{
+    uintptr_t page = (uintptr_t)start & ~(uintptr_t)(outbox->page_size - 1);
+
+    msync((void *)page, (uintptr_t)start + length - page, MS_SYNC);
+}
+
+/// <summary>
+/// Sync bytes of the ring at a monotonic offset, wrapping at the end
+/// </summary>
+static void sync_ring(DX_MQTT_OUTBOX *outbox, uint64_t offset, uint64_t length)
+{
+    size_t position = (size_t)(offset % outbox->capacity);
+    size_t first    = length < outbox->capacity - position ? (size_t)length : (size_t)(outbox->capacity - position);
+
+    sync_bytes(outbox, outbox->data + position, first);
+    if (length > first)
+    {
+        sync_bytes(outbox, outbox->data, (size_t)(length - first));
+    }
+}
+
+/// <summary>
+/// Sync the file header and remember which head the disk now has
+/// </summary>
+static void sync_header(DX_MQTT_OUTBOX *outbox)
+{
+    sync_bytes(outbox, outbox->header, sizeof(MQTT_OUTBOX_HEADER));
+    outbox->synced_head = outbox->header->head;
+}
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+/// <summary>
+/// Fill the table for the reflected CRC-32 polynomial used by zlib and Ethernet
+/// </summary>
+static void crc_table_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+        }
+        crc_table[i] = crc;
+    }
+}
+
+/// <summary>
+/// Continue a CRC-32 over more bytes. Start from 0.
+/// </summary>
+static uint32_t crc_update(uint32_t crc, const void *data, size_t length)
+{
+    const uint8_t *p = data;
+
+    crc = ~crc;
+    while (length-- > 0)
+    {
+        crc = crc_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+/// <summary>
+/// Continue a CRC-32 over bytes in the ring at a monotonic offset, wrapping at the end
+/// </summary>
+static uint32_t crc_update_ring(const DX_MQTT_OUTBOX *outbox, uint32_t crc, uint64_t offset, size_t length)
+{
+    size_t position = (size_t)(offset % outbox->capacity);
+    size_t first    = length < outbox->capacity - position ? length : (size_t)(outbox->capacity - position);
+
+    crc = crc_update(crc, outbox->data + position, first);
+    return crc_update(crc, outbox->data, length - first);
+}
+
+/// <summary>
+/// CRC-32 of a record's fields other than the checksums
+/// </summary>
+static uint32_t record_crc_fields(const MQTT_OUTBOX_RECORD *record)
+{
+    size_t fields = offsetof(MQTT_OUTBOX_RECORD, payload_length);
+
+    return crc_update(0, (const uint8_t *)record + fields, sizeof(MQTT_OUTBOX_RECORD) - fields);
+}
+
+/// <summary>
+/// Size of a record in the ring
+/// </summary>
+static uint64_t record_size(const MQTT_OUTBOX_RECORD *record)
+{
+    return sizeof(MQTT_OUTBOX_RECORD) + record->topic_length + (uint64_t)record->payload_length;
+}
+
+/// <summary>
+/// Check a header read from disk describes a usable ring of the expected size
+/// </summary>
+static bool header_is_valid(const MQTT_OUTBOX_HEADER *header, uint64_t capacity)
+{
+    return header->magic == DX_MQTT_OUTBOX_MAGIC && header->version == DX_MQTT_OUTBOX_VERSION && header->capacity == capacity &&
+           header->head <= header->tail && header->tail - header->head <= capacity;
+}
+
+/// <summary>
+/// Check the record at a monotonic offset is whole and ends by tail
+/// </summary>
+static bool record_is_valid(const DX_MQTT_OUTBOX *outbox, uint64_t offset, MQTT_OUTBOX_RECORD *record)
+{
+    ring_read(outbox, offset, record, sizeof(*record));
+
+    uint64_t size = record_size(record);
+    return record->header_crc == record_crc_fields(record) && size <= outbox->header->tail - offset &&
+           crc_update_ring(outbox, record->header_crc, offset + sizeof(*record), (size_t)(size - sizeof(*record))) == record->crc;
+}
+
+/// <summary>
+/// Count the records from head to tail. A damaged stretch is skipped up to the next
+/// record that checks out, and the records after it are moved down so the ring stays
+/// contiguous. Each stretch counts as one dropped message.
+/// </summary>
+static void recover_records(DX_MQTT_OUTBOX *outbox)
+{
+    MQTT_OUTBOX_HEADER *header = outbox->header;
+    uint64_t offset            = header->head;
+    uint64_t end               = header->head;
+    bool damaged               = false;
+
+    outbox->count = 0;
+
+    while (header->tail - offset >= sizeof(MQTT_OUTBOX_RECORD))
+    {
+        MQTT_OUTBOX_RECORD record;
+        if (!record_is_valid(outbox, offset, &record))
+        {
+            if (!damaged)
+            {
+                header->dropped++;
+                damaged = true;
+            }
+            offset++;
+            continue;
+        }
+        damaged = false;
+
+        uint64_t size = record_size(&record);
+        if (end != offset)
+        {
+            ring_move(outbox, end, offset, size);
+        }
+
+        offset += size;
+        end += size;
+        outbox->count++;
+    }
+
+    if (offset != header->tail && !damaged)
+    {
+        header->dropped++;
+    }
+
+    // The moved records reach the disk before the tail that now covers them
+    if (end != header->tail)
+    {
+        header->tail = end;
+        sync_bytes(outbox, outbox->data, (size_t)outbox->capacity);
+    }
+    sync_header(outbox);
+}
+
+/// <summary>
+/// Drop the oldest record. Caller holds the lock and the outbox is not empty.
+/// </summary>
+static void evict_oldest(DX_MQTT_OUTBOX *outbox)
+{
+    MQTT_OUTBOX_RECORD record;
+
+    ring_read(outbox, outbox->header->head, &record, sizeof(record));
+
+    outbox->header->head += record_size(&record);
+    outbox->header->dropped++;
+    outbox->count--;
+}
+
+/// <summary>
+/// Open or create an outbox file. An existing file with the same capacity keeps its
+/// backlog less any damaged records, a missing, damaged or differently sized file
+/// starts empty.
+/// </summary>
+/// <param name="path">File path</param>
+/// <param name="capacity">Bytes of record storage</param>
+/// <param name="eviction">Policy when the outbox is full</param>
+/// <returns>Outbox, or NULL on failure</returns>
+DX_MQTT_OUTBOX *dx_mqttOutboxOpen(const char *path, size_t capacity, DX_MQTT_OUTBOX_EVICTION eviction)
+{
+    if (path == NULL || capacity <= sizeof(MQTT_OUTBOX_RECORD))
+    {
+        return NULL;
+    }
+
+    pthread_once(&crc_table_once, crc_table_init);
+
+    DX_MQTT_OUTBOX *outbox = calloc(1, sizeof(DX_MQTT_OUTBOX));
+    if (outbox == NULL)
+    {
+        return NULL;
+    }
+
+    outbox->fd       = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    outbox->map_size = DX_MQTT_OUTBOX_DATA_OFFSET + capacity;
+    outbox->capacity = capacity;
+    outbox->eviction = eviction;
+
+    long page_size    = sysconf(_SC_PAGESIZE);
+    outbox->page_size = page_size > 0 ? (size_t)page_size : 4096;
+
+    struct stat info;
+    if (outbox->fd == -1 || fstat(outbox->fd, &info) == -1)
+    {
+        goto fail;
+    }
+
+    if ((size_t)info.st_size != outbox->map_size && ftruncate(outbox->fd, (off_t)outbox->map_size) == -1)
+    {
+        goto fail;
+    }
+
+    void *map = mmap(NULL, outbox->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, outbox->fd, 0);
+    if (map == MAP_FAILED)
+    {
+        goto fail;
+    }
+
+    outbox->header = map;
+    outbox->data   = (uint8_t *)map + DX_MQTT_OUTBOX_DATA_OFFSET;
+
+    if (!header_is_valid(outbox->header, capacity))
+    {
+        memset(outbox->header, 0, sizeof(MQTT_OUTBOX_HEADER));
+        outbox->header->magic    = DX_MQTT_OUTBOX_MAGIC;
+        outbox->header->version  = DX_MQTT_OUTBOX_VERSION;
+        outbox->header->capacity = capacity;
+    }
+
+    recover_records(outbox);
+
+    pthread_mutex_init(&outbox->lock, NULL);
+
+    return outbox;
+
+fail:
+    if (outbox->fd != -1)
+    {
+        close(outbox->fd);
+    }
+    free(outbox);
+    return NULL;
+}
+
+/// <summary>
+/// Flush and unmap an outbox
+/// </summary>
+/// <param name="outbox">Outbox to close</param>
+void dx_mqttOutboxClose(DX_MQTT_OUTBOX *outbox)
+{
+    if (outbox == NULL)
+    {
+        return;
+    }
+
+    msync(outbox->header, outbox->map_size, MS_SYNC);
+    munmap(outbox->header, outbox->map_size);
+    close(outbox->fd);
+    pthread_mutex_destroy(&outbox->lock);
+    free(outbox->scratch);
+    free(outbox);
+}
+
+/// <summary>
+/// Append a message to the end of the outbox
+/// </summary>
+/// <param name="outbox">Outbox</param>
+/// <param name="message">Message to store</param>
+/// <returns>True if stored, false if it was larger than the outbox or rejected by the eviction policy</returns>
+bool dx_mqttOutboxAppend(DX_MQTT_OUTBOX *outbox, const DX_MQTT_MESSAGE *message)
+{
+    if (outbox == NULL || message == NULL || message->topic == NULL)
+    {
+        return false;
+    }
+
+    size_t topic_length = strlen(message->topic);
+    if (topic_length > UINT16_MAX || message->payload_length > UINT32_MAX)
+    {
+        return false;
+    }
+
+    MQTT_OUTBOX_RECORD record = {
+        .payload_length = (uint32_t)message->payload_length,
+        .topic_length   = (uint16_t)topic_length,
+        .qos            = message->qos > 2 ? 0 : message->qos,
+        .retain         = message->retain ? 1 : 0,
+    };
+    uint64_t size = record_size(&record);
+
+    // Checksummed outside the lock, the lock only covers the copy into the ring
+    record.header_crc = record_crc_fields(&record);
+    record.crc        = crc_update(crc_update(record.header_crc, message->topic, topic_length), message->payload, message->payload_length);
+
+    pthread_mutex_lock(&outbox->lock);
+
+    MQTT_OUTBOX_HEADER *header = outbox->header;
+    bool stored                = false;
+
+    if (size > outbox->capacity)
+    {
+        header->dropped++;
+    }
+    else
+    {
+        while (outbox->capacity - (header->tail - header->head) < size && outbox->eviction == DX_MQTT_OUTBOX_DROP_OLDEST)
+        {
+            evict_oldest(outbox);
+        }
+
+        if (outbox->capacity - (header->tail - header->head) < size)
+        {
+            header->dropped++;
+        }
+        else
+        {
+            // The record may reuse space freed by pops and evictions, which the disk
+            // must no longer count as part of the backlog
+            if (header->head != outbox->synced_head)
+            {
+                sync_header(outbox);
+            }
+
+            ring_write(outbox, header->tail, &record, sizeof(record));
+            ring_write(outbox, header->tail + sizeof(record), message->topic, topic_length);
+            ring_write(outbox, header->tail + sizeof(record) + topic_length, message->payload, message->payload_length);
+
+            // The record reaches the disk before the tail that covers it
+            sync_ring(outbox, header->tail, size);
+            header->tail += size;
+            sync_header(outbox);
+
+            outbox->count++;
+            stored = true;
+        }
+    }
+
+    pthread_mutex_unlock(&outbox->lock);
+
+    return stored;
+}
+
+/// <summary>
+/// Read the oldest message without removing it
+/// </summary>
+/// <param name="outbox">Outbox</param>
+/// <param name="message">Receives the message, valid until the next peek</param>
+/// <returns>DX_MQTT_OUTBOX_PEEKED, or why there is no message</returns>
+DX_MQTT_OUTBOX_PEEK_RESULT dx_mqttOutboxPeek(DX_MQTT_OUTBOX *outbox, DX_MQTT_MESSAGE *message)
+{
+    if (outbox == NULL || message == NULL)
+    {
+        return DX_MQTT_OUTBOX_EMPTY;
+    }
+
+    pthread_mutex_lock(&outbox->lock);
+
+    MQTT_OUTBOX_HEADER *header        = outbox->header;
+    DX_MQTT_OUTBOX_PEEK_RESULT result = DX_MQTT_OUTBOX_EMPTY;
+
+    if (outbox->count > 0)
+    {
+        MQTT_OUTBOX_RECORD record;
+        ring_read(outbox, header->head, &record, sizeof(record));
+
+        // Topic, its terminator and the payload, laid out for the caller
+        size_t needed = (size_t)record.topic_length + 1 + record.payload_length;
+        if (needed > outbox->scratch_size)
+        {
+            char *scratch = realloc(outbox->scratch, needed);
+            if (scratch != NULL)
+            {
+                outbox->scratch      = scratch;
+                outbox->scratch_size = needed;
+            }
+        }
+
+        if (needed > outbox->scratch_size)
+        {
+            result = DX_MQTT_OUTBOX_NO_MEMORY;
+        }
+        else
+        {
+            ring_read(outbox, header->head + sizeof(record), outbox->scratch, record.topic_length);
+            outbox->scratch[record.topic_length] = '\0';
+            ring_read(outbox, header->head + sizeof(record) + record.topic_length, outbox->scratch + record.topic_length + 1, record.payload_length);
+
+            message->topic          = outbox->scratch;
+            message->payload        = outbox->scratch + record.topic_length + 1;
+            message->payload_length = record.payload_length;
+            message->qos            = record.qos;
+            message->retain         = record.retain != 0;
+
+            outbox->peek_head  = header->head;
+            outbox->peek_valid = true;
+            result             = DX_MQTT_OUTBOX_PEEKED;
+        }
+    }
+
+    pthread_mutex_unlock(&outbox->lock);
+
+    return result;
+}
+
+/// <summary>
+/// Remove the message returned by the last peek. Does nothing if it has already
+/// been evicted to make room. The new head is synced by the next append, a crash
+/// before then replays the message again.
+/// </summary>
+/// <param name="outbox">Outbox</param>
+void dx_mqttOutboxPop(DX_MQTT_OUTBOX *outbox)
+{
+    if (outbox == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&outbox->lock);
+
+    MQTT_OUTBOX_HEADER *header = outbox->header;
+
+    if (outbox->peek_valid && outbox->count > 0 && header->head == outbox->peek_head)
+    {
+        MQTT_OUTBOX_RECORD record;
+        ring_read(outbox, header->head, &record, sizeof(record));
+
+        header->head += record_size(&record);
+        outbox->count--;
+    }
+    outbox->peek_valid = false;
+
+    pthread_mutex_unlock(&outbox->lock);
+}
+
+/// <summary>
+/// Number of messages waiting in the outbox
+/// </summary>
+/// <param name="outbox">Outbox</param>
+/// <returns>Message count</returns>
+size_t dx_mqttOutboxCount(DX_MQTT_OUTBOX *outbox)
+{
+    if (outbox == NULL)
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&outbox->lock);
+    size_t count = (size_t)outbox->count;
+    pthread_mutex_unlock(&outbox->lock);
+
+    return count;
+}
+
+/// <summary>
+/// Number of messages lost to the eviction policy since the file was created
+/// </summary>
+/// <param name="outbox">Outbox</param>
+/// <returns>Dropped message count</returns>
+size_t dx_mqttOutboxDropped(DX_MQTT_OUTBOX *outbox)
+{
+    if (outbox == NULL)
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&outbox->lock);
+    size_t dropped = (size_t)outbox->header->dropped;
+    pthread_mutex_unlock(&outbox->lock);
+
+    return dropped;
+}
@@ -0,0 +1,178 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+#include "dx_mqtt_rate.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#define DX_MQTT_NS_PER_SECOND 1000000000LL
+
+// One bucket. tat_ns is the theoretical arrival time: the moment the bucket would be
+// full again if nothing else were taken. Taking cost pushes it forward by cost * interval,
+// and a take is allowed while it stays within tolerance_ns of now.
+typedef struct
+{
+    _Atomic int64_t tat_ns;
+    uint32_t rate;        // Units per second, 0 disables the bucket
+    int64_t tolerance_ns; // Burst expressed as time
+} MQTT_RATE_BUCKET;
+
+struct DX_MQTT_RATE
+{
+    MQTT_RATE_BUCKET messages;
+    MQTT_RATE_BUCKET bytes;
+};
+
+/// <summary>
+/// Set up a bucket
+/// </summary>
+/// <param name="bucket">Bucket</param>
+/// <param name="rate">Units per second, 0 disables the bucket</param>
+/// <param name="burst">Units that may go back to back, 0 selects one second's worth</param>
+static void bucket_init(MQTT_RATE_BUCKET *bucket, uint32_t rate, uint32_t burst)
+{
+    atomic_init(&bucket->tat_ns, 0);
+    bucket->rate         = rate;
+    bucket->tolerance_ns = rate > 0 ? (int64_t)(burst > 0 ? burst : rate) * DX_MQTT_NS_PER_SECOND / rate : 0;
+}
+
+/// <summary>
+/// Time a cost occupies in a bucket
+/// </summary>
+/// <param name="bucket">Enabled bucket</param>
+/// <param name="cost">Units</param>
+/// <returns>Nanoseconds</returns>
+static int64_t bucket_increment(const MQTT_RATE_BUCKET *bucket, size_t cost)
+{
+    // MQTT packets are under 256 MiB, so cost in nanoseconds fits in 64 bits
+    return (int64_t)((uint64_t)cost * DX_MQTT_NS_PER_SECOND / bucket->rate);
+}
+
+/// <summary>
+/// Take cost from a bucket if it conforms
+/// </summary>
+/// <param name="bucket">Bucket</param>
+/// <param name="cost">Units</param>
+/// <param name="now_ns">Current time</param>
+/// <returns>0 if taken, otherwise nanoseconds until it would conform</returns>
+static int64_t bucket_take(MQTT_RATE_BUCKET *bucket, size_t cost, int64_t now_ns)
+{
+    if (bucket->rate == 0)
+    {
+        return 0;
+    }
+
+    int64_t increment = bucket_increment(bucket, cost);
+    int64_t current   = atomic_load_explicit(&bucket->tat_ns, memory_order_relaxed);
+
+    for (;;)
+    {
+        int64_t base = current > now_ns ? current : now_ns;
+        int64_t next = base + increment;
+
+        // Over the burst, unless the bucket is full and the cost is simply larger than it
+        if (next - now_ns > bucket->tolerance_ns && current > now_ns)
+        {
+            int64_t wait_ns = next - now_ns - bucket->tolerance_ns;
+            int64_t full_ns = current - now_ns;
+            return wait_ns < full_ns ? wait_ns : full_ns;
+        }
+
+        if (atomic_compare_exchange_weak_explicit(&bucket->tat_ns, &current, next, memory_order_relaxed, memory_order_relaxed))
+        {
+            return 0;
+        }
+    }
+}
+
+/// <summary>
+/// Give back cost taken from a bucket
+/// </summary>
+/// <param name="bucket">Bucket</param>
+/// <param name="cost">Units</param>
+static void bucket_refund(MQTT_RATE_BUCKET *bucket, size_t cost)
+{
+    if (bucket->rate > 0)
+    {
+        atomic_fetch_sub_explicit(&bucket->tat_ns, bucket_increment(bucket, cost), memory_order_relaxed);
+    }
+}
+
+/// <summary>
+/// Create a rate limit
+/// </summary>
+/// <param name="messages_per_second">Sustained message rate, 0 for no message limit</param>
+/// <param name="message_burst">Messages that may go back to back, 0 selects one second's worth</param>
+/// <param name="bytes_per_second">Sustained byte rate, 0 for no byte limit</param>
+/// <param name="byte_burst">Bytes that may go back to back, 0 selects one second's worth</param>
+/// <returns>New rate limit, or NULL on failure</returns>
+DX_MQTT_RATE *dx_mqttRateCreate(uint32_t messages_per_second, uint32_t message_burst, uint32_t bytes_per_second, uint32_t byte_burst)
+{
+    DX_MQTT_RATE *rate = malloc(sizeof(DX_MQTT_RATE));
+    if (rate == NULL)
+    {
+        return NULL;
+    }
+
+    bucket_init(&rate->messages, messages_per_second, message_burst);
+    bucket_init(&rate->bytes, bytes_per_second, byte_burst);
+
+    return rate;
+}
+
+/// <summary>
+/// Free a rate limit
+/// </summary>
+/// <param name="rate">Rate limit, can be NULL</param>
+void dx_mqttRateDestroy(DX_MQTT_RATE *rate)
+{
+    free(rate);
+}
+
+/// <summary>
+/// Take one message of the given size from the buckets if both allow it. A message
+/// larger than the byte burst goes through once the byte bucket is full, so it is
+/// delayed rather than refused forever.
+/// </summary>
+/// <param name="rate">Rate limit, NULL always allows</param>
+/// <param name="bytes">Message size</param>
+/// <param name="now_ns">Current monotonic time in nanoseconds</param>
+/// <returns>0 if the message was taken, otherwise nanoseconds until it would be allowed</returns>
+int64_t dx_mqttRateTake(DX_MQTT_RATE *rate, size_t bytes, int64_t now_ns)
+{
+    if (rate == NULL)
+    {
+        return 0;
+    }
+
+    int64_t wait_ns = bucket_take(&rate->messages, 1, now_ns);
+    if (wait_ns > 0)
+    {
+        return wait_ns;
+    }
+
+    // The two buckets are not updated together, so undo the message if the bytes do not fit
+    wait_ns = bucket_take(&rate->bytes, bytes, now_ns);
+    if (wait_ns > 0)
+    {
+        bucket_refund(&rate->messages, 1);
+    }
+
+    return wait_ns;
+}
+
+/// <summary>
+/// Give back a message taken with dx_mqttRateTake that was not sent after all
+/// </summary>
+/// <param name="rate">Rate limit, can be NULL</param>
+/// <param name="bytes">Size passed to dx_mqttRateTake</param>
+void dx_mqttRateRefund(DX_MQTT_RATE *rate, size_t bytes)
+{
+    if (rate != NULL)
+    {
+        bucket_refund(&rate->messages, 1);
+        bucket_refund(&rate->bytes, bytes);
+    }
+}
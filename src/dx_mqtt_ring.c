@@ -0,0 +1,205 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+#include "dx_mqtt_ring.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Bounded MPSC queue after Dmitry Vyukov's sequence numbered ring.
+// Each slot carries a sequence that tells producers and the consumer whose turn it is.
+
+typedef struct
+{
+    atomic_size_t sequence;
+    size_t length;
+    unsigned char *data;
+} DX_MQTT_RING_SLOT;
+
+struct DX_MQTT_RING
+{
+    DX_MQTT_RING_SLOT *slots;
+    unsigned char *storage;
+    size_t mask;
+    size_t slot_size;
+
+    // Kept on separate cache lines so producers and the consumer do not false share
+    _Alignas(64) atomic_size_t enqueue_position;
+    _Alignas(64) atomic_size_t dequeue_position;
+};
+
+/// <summary>
+/// Create a ring
+/// </summary>
+/// <param name="slot_count">Number of slots, rounded up to a power of two</param>
+/// <param name="slot_size">Bytes of storage in each slot</param>
+/// <returns>New ring, or NULL on failure</returns>
+DX_MQTT_RING *dx_mqttRingCreate(size_t slot_count, size_t slot_size)
+{
+    if (slot_count == 0 || slot_size == 0)
+    {
+        return NULL;
+    }
+
+    size_t count = 2;
+    while (count < slot_count)
+    {
+        count *= 2;
+    }
+
+    // Keep each slot's storage aligned for the record headers written into it
+    slot_size = (slot_size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+
+    DX_MQTT_RING *ring = aligned_alloc(64, (sizeof(DX_MQTT_RING) + 63) & ~(size_t)63);
+    if (ring == NULL)
+    {
+        return NULL;
+    }
+
+    ring->slots   = calloc(count, sizeof(DX_MQTT_RING_SLOT));
+    ring->storage = malloc(count * slot_size);
+    if (ring->slots == NULL || ring->storage == NULL)
+    {
+        free(ring->slots);
+        free(ring->storage);
+        free(ring);
+        return NULL;
+    }
+
+    ring->mask      = count - 1;
+    ring->slot_size = slot_size;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        atomic_init(&ring->slots[i].sequence, i);
+        ring->slots[i].data = ring->storage + i * slot_size;
+    }
+
+    atomic_init(&ring->enqueue_position, 0);
+    atomic_init(&ring->dequeue_position, 0);
+
+    return ring;
+}
+
+/// <summary>
+/// Free a ring. No producer or consumer may be using it.
+/// </summary>
+/// <param name="ring">Ring to free</param>
+void dx_mqttRingDestroy(DX_MQTT_RING *ring)
+{
+    if (ring == NULL)
+    {
+        return;
+    }
+
+    free(ring->slots);
+    free(ring->storage);
+    free(ring);
+}
+
+/// <summary>
+/// Size of the storage in each slot
+/// </summary>
+/// <param name="ring">Ring</param>
+/// <returns>Slot size in bytes</returns>
+size_t dx_mqttRingSlotSize(const DX_MQTT_RING *ring)
+{
+    return ring->slot_size;
+}
+
+/// <summary>
+/// Producer: claim the next free slot for writing
+/// </summary>
+/// <param name="ring">Ring</param>
+/// <returns>Slot storage of dx_mqttRingSlotSize bytes, or NULL if the ring is full</returns>
+void *dx_mqttRingClaim(DX_MQTT_RING *ring)
+{
+    size_t position = atomic_load_explicit(&ring->enqueue_position, memory_order_relaxed);
+
+    for (;;)
+    {
+        DX_MQTT_RING_SLOT *slot = &ring->slots[position & ring->mask];
+        size_t sequence         = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t difference     = (intptr_t)sequence - (intptr_t)position;
+
+        if (difference == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&ring->enqueue_position, &position, position + 1, memory_order_relaxed, memory_order_relaxed))
+            {
+                return slot->data;
+            }
+            // position was reloaded by the failed exchange
+        }
+        else if (difference < 0)
+        {
+            // The consumer has not released this slot yet
+            return NULL;
+        }
+        else
+        {
+            position = atomic_load_explicit(&ring->enqueue_position, memory_order_relaxed);
+        }
+    }
+}
+
+/// <summary>
+/// Producer: make a claimed slot visible to the consumer
+/// </summary>
+/// <param name="ring">Ring</param>
+/// <param name="slot">Slot returned by dx_mqttRingClaim</param>
+/// <param name="length">Number of bytes written to the slot</param>
+void dx_mqttRingPublish(DX_MQTT_RING *ring, void *slot, size_t length)
+{
+    size_t index            = (size_t)((unsigned char *)slot - ring->storage) / ring->slot_size;
+    DX_MQTT_RING_SLOT *cell = &ring->slots[index];
+
+    // The slot sequence equals the claimed position until it is published
+    size_t position = atomic_load_explicit(&cell->sequence, memory_order_relaxed);
+
+    cell->length = length;
+    atomic_store_explicit(&cell->sequence, position + 1, memory_order_release);
+}
+
+/// <summary>
+/// Consumer: look at the oldest published slot without removing it
+/// </summary>
+/// <param name="ring">Ring</param>
+/// <param name="length">Receives the number of bytes in the slot</param>
+/// <returns>Slot storage, or NULL if nothing is ready</returns>
+const void *dx_mqttRingPeek(DX_MQTT_RING *ring, size_t *length)
+{
+    size_t position         = atomic_load_explicit(&ring->dequeue_position, memory_order_relaxed);
+    DX_MQTT_RING_SLOT *slot = &ring->slots[position & ring->mask];
+
+    if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != position + 1)
+    {
+        return NULL;
+    }
+
+    *length = slot->length;
+    return slot->data;
+}
+
+/// <summary>
+/// Consumer: release the slot returned by dx_mqttRingPeek back to producers
+/// </summary>
+/// <param name="ring">Ring</param>
+void dx_mqttRingRelease(DX_MQTT_RING *ring)
+{
+    size_t position         = atomic_load_explicit(&ring->dequeue_position, memory_order_relaxed);
+    DX_MQTT_RING_SLOT *slot = &ring->slots[position & ring->mask];
+
+    atomic_store_explicit(&slot->sequence, position + ring->mask + 1, memory_order_release);
+    atomic_store_explicit(&ring->dequeue_position, position + 1, memory_order_relaxed);
+}
+
+/// <summary>
+/// Check if no slot is claimed or published
+/// </summary>
+/// <param name="ring">Ring</param>
+/// <returns>True if the ring is empty</returns>
+bool dx_mqttRingIsEmpty(DX_MQTT_RING *ring)
+{
+    return atomic_load_explicit(&ring->enqueue_position, memory_order_acquire) == atomic_load_explicit(&ring->dequeue_position, memory_order_relaxed);
+}
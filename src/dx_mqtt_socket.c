@@ -0,0 +1,576 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+#include "dx_mqtt_socket.h"
+#include "dx_utilities.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Head start each attempt gets before the next address is tried, RFC 8305 section 5
+#define DX_MQTT_CONNECTION_ATTEMPT_DELAY_MS 250
+
+typedef struct
+{
+    uv_poll_t poll;
+    int sockfd;
+    bool active;
+    DX_MQTT_SOCKET_CONNECT *owner;
+} MQTT_CONNECT_ATTEMPT;
+
+struct DX_MQTT_SOCKET_CONNECT
+{
+    uv_loop_t *loop;
+    uv_getaddrinfo_t resolver;
+    uv_timer_t stagger_timer;
+    uv_timer_t timeout_timer;
+
+    // Resolved addresses in the order they are tried, one attempt slot each
+    struct addrinfo *addresses;
+    struct addrinfo **order;
+    MQTT_CONNECT_ATTEMPT *attempts;
+    size_t address_count;
+    size_t next_address;
+    size_t attempts_in_flight;
+
+    int open_handles;
+    bool resolving;
+    bool finished;
+    int last_error;
+
+    DX_MQTT_SOCKET_OPTIONS options; // All zero keeps the OS defaults
+
+    DX_MQTT_SOCKET_CONNECTED callback;
+    void *context;
+};
+
+static void start_next_attempt(DX_MQTT_SOCKET_CONNECT *pending);
+
+/// <summary>
+/// Free the connect once the resolver has returned and libuv has released every handle
+/// </summary>
+static void maybe_free(DX_MQTT_SOCKET_CONNECT *pending)
+{
+    if (!pending->finished || pending->resolving || pending->open_handles > 0)
+    {
+        return;
+    }
+
+    if (pending->addresses != NULL)
+    {
+        uv_freeaddrinfo(pending->addresses);
+    }
+    free(pending->order);
+    free(pending->attempts);
+    free(pending);
+}
+
+/// <summary>
+/// libuv close callback for the timers
+/// </summary>
+static void timer_closed(uv_handle_t *handle)
+{
+    DX_MQTT_SOCKET_CONNECT *pending = handle->data;
+
+    pending->open_handles--;
+    maybe_free(pending);
+}
+
+/// <summary>
+/// libuv close callback for an attempt's poll handle
+/// </summary>
+static void attempt_closed(uv_handle_t *handle)
+{
+    MQTT_CONNECT_ATTEMPT *attempt = handle->data;
+
+    attempt->owner->open_handles--;
+    maybe_free(attempt->owner);
+}
+
+/// <summary>
+/// Stop watching an attempt, closing its socket unless it is being handed to the caller
+/// </summary>
+static void attempt_close(MQTT_CONNECT_ATTEMPT *attempt, bool close_socket)
+{
+    if (!attempt->active)
+    {
+        return;
+    }
+
+    attempt->active = false;
+    attempt->owner->attempts_in_flight--;
+
+    uv_poll_stop(&attempt->poll);
+    if (close_socket)
+    {
+        close(attempt->sockfd);
+    }
+    uv_close((uv_handle_t *)&attempt->poll, attempt_closed);
+}
+
+/// <summary>
+/// Complete the connect: tear down the losing attempts and timers and report the result
+/// </summary>
+static void finish(DX_MQTT_SOCKET_CONNECT *pending, int sockfd, int status)
+{
+    if (pending->finished)
+    {
+        return;
+    }
+
+    pending->finished = true;
+
+    for (size_t i = 0; i < pending->address_count; i++)
+    {
+        attempt_close(&pending->attempts[i], true);
+    }
+
+    uv_timer_stop(&pending->stagger_timer);
+    uv_timer_stop(&pending->timeout_timer);
+    uv_close((uv_handle_t *)&pending->stagger_timer, timer_closed);
+    uv_close((uv_handle_t *)&pending->timeout_timer, timer_closed);
+
+    // Nobody wants the socket after a cancel
+    if (pending->callback != NULL)
+    {
+        pending->callback(sockfd, status, pending->context);
+    }
+    else if (sockfd != -1)
+    {
+        close(sockfd);
+    }
+}
+
+/// <summary>
+/// An attempt's socket became writable, which means connected or failed
+/// </summary>
+static void attempt_writable(uv_poll_t *handle, int status, int events)
+{
+    MQTT_CONNECT_ATTEMPT *attempt   = handle->data;
+    DX_MQTT_SOCKET_CONNECT *pending = attempt->owner;
+    int so_error                    = 0;
+    socklen_t length                = sizeof(so_error);
+    (void)events;
+
+    if (status == 0 && getsockopt(attempt->sockfd, SOL_SOCKET, SO_ERROR, &so_error, &length) == -1)
+    {
+        so_error = errno;
+    }
+
+    if (status == 0 && so_error == 0)
+    {
+        int sockfd = attempt->sockfd;
+        attempt_close(attempt, false);
+        finish(pending, sockfd, 0);
+        return;
+    }
+
+    pending->last_error = status < 0 ? status : -so_error;
+    attempt_close(attempt, true);
+
+    // A failed attempt does not need to wait out the stagger delay
+    uv_timer_stop(&pending->stagger_timer);
+    start_next_attempt(pending);
+}
+
+/// <summary>
+/// The current attempt has had its head start, race the next address alongside it
+/// </summary>
+static void stagger_elapsed(uv_timer_t *handle)
+{
+    start_next_attempt(handle->data);
+}
+
+/// <summary>
+/// The overall deadline passed
+/// </summary>
+static void timeout_elapsed(uv_timer_t *handle)
+{
+    finish(handle->data, -1, UV_ETIMEDOUT);
+}
+
+/// <summary>
+/// Open a non-blocking socket and start connecting it to the next address. Fails the
+/// whole connect when there is nothing left to try and no attempt is in flight.
+/// </summary>
+static void start_next_attempt(DX_MQTT_SOCKET_CONNECT *pending)
+{
+    while (pending->next_address < pending->address_count)
+    {
+        struct addrinfo *address      = pending->order[pending->next_address];
+        MQTT_CONNECT_ATTEMPT *attempt = &pending->attempts[pending->next_address];
+
+        pending->next_address++;
+
+        int sockfd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (sockfd == -1)
+        {
+            pending->last_error = -errno;
+            continue;
+        }
+
+        int flags = fcntl(sockfd, F_GETFL, 0);
+        if (flags == -1 || fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) == -1)
+        {
+            pending->last_error = -errno;
+            close(sockfd);
+            continue;
+        }
+
+        // Rejected options are logged but do not stop the attempt
+        dx_mqttSocketApplyOptions(sockfd, address->ai_family, &pending->options);
+
+        if (connect(sockfd, address->ai_addr, address->ai_addrlen) == 0)
+        {
+            finish(pending, sockfd, 0);
+            return;
+        }
+
+        if (errno != EINPROGRESS)
+        {
+            pending->last_error = -errno;
+            close(sockfd);
+            continue;
+        }
+
+        int result = uv_poll_init_socket(pending->loop, &attempt->poll, sockfd);
+        if (result != 0)
+        {
+            pending->last_error = result;
+            close(sockfd);
+            continue;
+        }
+
+        attempt->poll.data = attempt;
+        attempt->sockfd    = sockfd;
+        attempt->owner     = pending;
+        attempt->active    = true;
+        pending->attempts_in_flight++;
+        pending->open_handles++;
+
+        uv_poll_start(&attempt->poll, UV_WRITABLE, attempt_writable);
+
+        if (pending->next_address < pending->address_count)
+        {
+            uv_timer_start(&pending->stagger_timer, stagger_elapsed, DX_MQTT_CONNECTION_ATTEMPT_DELAY_MS, 0);
+        }
+        return;
+    }
+
+    if (pending->attempts_in_flight == 0)
+    {
+        finish(pending, -1, pending->last_error != 0 ? pending->last_error : UV_ECONNREFUSED);
+    }
+}
+
+/// <summary>
+/// Order the resolved addresses so families alternate, starting with the family the
+/// resolver preferred, as RFC 8305 section 4 describes
+/// </summary>
+static bool order_addresses(DX_MQTT_SOCKET_CONNECT *pending)
+{
+    size_t count = 0;
+    for (struct addrinfo *address = pending->addresses; address != NULL; address = address->ai_next)
+    {
+        count++;
+    }
+
+    pending->order    = calloc(count, sizeof(struct addrinfo *));
+    pending->attempts = calloc(count, sizeof(MQTT_CONNECT_ATTEMPT));
+    if (count == 0 || pending->order == NULL || pending->attempts == NULL)
+    {
+        return false;
+    }
+
+    int first_family           = pending->addresses->ai_family;
+    struct addrinfo *preferred = pending->addresses;
+    struct addrinfo *other     = pending->addresses;
+
+    while (pending->address_count < count)
+    {
+        bool want_preferred = pending->address_count % 2 == 0;
+
+        // Find the next address of the wanted family, falling back to the other one
+        while (preferred != NULL && preferred->ai_family != first_family)
+        {
+            preferred = preferred->ai_next;
+        }
+        while (other != NULL && other->ai_family == first_family)
+        {
+            other = other->ai_next;
+        }
+
+        struct addrinfo **source = (want_preferred && preferred != NULL) || other == NULL ? &preferred : &other;
+        pending->order[pending->address_count++] = *source;
+        *source                                  = (*source)->ai_next;
+    }
+
+    return true;
+}
+
+/// <summary>
+/// uv_getaddrinfo completion
+/// </summary>
+static void resolved(uv_getaddrinfo_t *request, int status, struct addrinfo *addresses)
+{
+    DX_MQTT_SOCKET_CONNECT *pending = request->data;
+
+    pending->resolving = false;
+    pending->addresses = addresses;
+
+    if (pending->finished)
+    {
+        maybe_free(pending);
+        return;
+    }
+
+    if (status != 0)
+    {
+        finish(pending, -1, status);
+        return;
+    }
+
+    if (!order_addresses(pending))
+    {
+        finish(pending, -1, UV_ENOMEM);
+        return;
+    }
+
+    start_next_attempt(pending);
+}
+
+/// <summary>
+/// Start connecting to a host
+/// </summary>
+/// <param name="loop">Loop that runs the resolver, attempts and callback</param>
+/// <param name="host">Host name or address</param>
+/// <param name="port">Port number or service name</param>
+/// <param name="timeout_ms">Deadline for the whole connect including name resolution</param>
+/// <param name="options">TCP options applied to each attempt's socket, NULL for OS defaults</param>
+/// <param name="callback">Completion callback</param>
+/// <param name="context">Passed to the callback</param>
+/// <returns>Handle for cancelling, or NULL if the connect could not be started</returns>
+DX_MQTT_SOCKET_CONNECT *dx_mqttSocketConnectAsync(uv_loop_t *loop, const char *host, const char *port, uint32_t timeout_ms,
+    const DX_MQTT_SOCKET_OPTIONS *options, DX_MQTT_SOCKET_CONNECTED callback, void *context)
+{
+    if (loop == NULL || host == NULL || port == NULL || callback == NULL)
+    {
+        return NULL;
+    }
+
+    DX_MQTT_SOCKET_CONNECT *pending = calloc(1, sizeof(DX_MQTT_SOCKET_CONNECT));
+    if (pending == NULL)
+    {
+        return NULL;
+    }
+
+    pending->loop     = loop;
+    pending->callback = callback;
+    pending->context  = context;
+
+    if (options != NULL)
+    {
+        pending->options = *options;
+    }
+
+    uv_timer_init(loop, &pending->stagger_timer);
+    uv_timer_init(loop, &pending->timeout_timer);
+    pending->stagger_timer.data = pending;
+    pending->timeout_timer.data = pending;
+    pending->resolver.data      = pending;
+    pending->open_handles       = 2;
+
+    struct addrinfo hints = {0};
+    hints.ai_family       = AF_UNSPEC;
+    hints.ai_socktype     = SOCK_STREAM;
+
+    pending->resolving = true;
+    if (uv_getaddrinfo(loop, &pending->resolver, resolved, host, port, &hints) != 0)
+    {
+        // Tear down without reporting, the caller learns of the failure from the NULL return
+        pending->resolving = false;
+        pending->callback  = NULL;
+        finish(pending, -1, UV_ECANCELED);
+        return NULL;
+    }
+
+    uv_timer_start(&pending->timeout_timer, timeout_elapsed, timeout_ms, 0);
+
+    return pending;
+}
+
+/// <summary>
+/// Abandon a connect that has not completed. The callback is not called and any
+/// socket still opening is closed. Must run on the loop thread.
+/// </summary>
+/// <param name="pending">Connect in progress</param>
+void dx_mqttSocketConnectCancel(DX_MQTT_SOCKET_CONNECT *pending)
+{
+    if (pending == NULL || pending->finished)
+    {
+        return;
+    }
+
+    pending->callback = NULL;
+
+    // The resolver callback still runs, with UV_ECANCELED, and frees what is left
+    if (pending->resolving)
+    {
+        uv_cancel((uv_req_t *)&pending->resolver);
+    }
+
+    finish(pending, -1, UV_ECANCELED);
+}
+
+/// <summary>
+/// Set one integer socket option, logging a rejection
+/// </summary>
+static bool set_option(int sockfd, int level, int name, int value, const char *label)
+{
+    if (setsockopt(sockfd, level, name, &value, sizeof(value)) == 0)
+    {
+        return true;
+    }
+
+    dx_Log_Debug("DX MQTT: Could not set %s to %d: %s\n", label, value, strerror(errno));
+    return false;
+}
+
+/// <summary>
+/// Read one integer socket option, -1 when the platform does not report it
+/// </summary>
+static int get_option(int sockfd, int level, int name)
+{
+    int value        = 0;
+    socklen_t length = sizeof(value);
+
+    return getsockopt(sockfd, level, name, &value, &length) == 0 ? value : -1;
+}
+
+/// <summary>
+/// Apply TCP options to a socket that has not connected yet. Buffer sizes must be set
+/// before the handshake to affect window scaling. Every option is attempted, one the
+/// platform rejects is logged and skipped.
+/// </summary>
+/// <param name="sockfd">Socket</param>
+/// <param name="family">Address family the socket was created with</param>
+/// <param name="options">Options, NULL leaves the socket unchanged</param>
+/// <returns>False if any option could not be applied</returns>
+bool dx_mqttSocketApplyOptions(int sockfd, int family, const DX_MQTT_SOCKET_OPTIONS *options)
+{
+    if (options == NULL)
+    {
+        return true;
+    }
+
+    bool applied = true;
+
+    if (options->tcp_nodelay)
+    {
+        applied &= set_option(sockfd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    }
+
+    if (options->send_buffer_size > 0)
+    {
+        applied &= set_option(sockfd, SOL_SOCKET, SO_SNDBUF, options->send_buffer_size, "SO_SNDBUF");
+    }
+
+    if (options->recv_buffer_size > 0)
+    {
+        applied &= set_option(sockfd, SOL_SOCKET, SO_RCVBUF, options->recv_buffer_size, "SO_RCVBUF");
+    }
+
+    if (options->keepalive_idle_s > 0 || options->keepalive_interval_s > 0 || options->keepalive_count > 0)
+    {
+        applied &= set_option(sockfd, SOL_SOCKET, SO_KEEPALIVE, 1, "SO_KEEPALIVE");
+    }
+
+    if (options->keepalive_idle_s > 0)
+    {
+#if defined(TCP_KEEPIDLE)
+        applied &= set_option(sockfd, IPPROTO_TCP, TCP_KEEPIDLE, (int)options->keepalive_idle_s, "TCP_KEEPIDLE");
+#elif defined(TCP_KEEPALIVE)
+        applied &= set_option(sockfd, IPPROTO_TCP, TCP_KEEPALIVE, (int)options->keepalive_idle_s, "TCP_KEEPALIVE");
+#else
+        applied = false;
+#endif
+    }
+
+#ifdef TCP_KEEPINTVL
+    if (options->keepalive_interval_s > 0)
+    {
+        applied &= set_option(sockfd, IPPROTO_TCP, TCP_KEEPINTVL, (int)options->keepalive_interval_s, "TCP_KEEPINTVL");
+    }
+#endif
+
+#ifdef TCP_KEEPCNT
+    if (options->keepalive_count > 0)
+    {
+        applied &= set_option(sockfd, IPPROTO_TCP, TCP_KEEPCNT, (int)options->keepalive_count, "TCP_KEEPCNT");
+    }
+#endif
+
+    if (options->user_timeout_ms > 0)
+    {
+#ifdef TCP_USER_TIMEOUT
+        applied &= set_option(sockfd, IPPROTO_TCP, TCP_USER_TIMEOUT, (int)options->user_timeout_ms, "TCP_USER_TIMEOUT");
+#else
+        dx_Log_Debug("DX MQTT: TCP_USER_TIMEOUT is not supported on this platform\n");
+        applied = false;
+#endif
+    }
+
+    if (options->tos > 0)
+    {
+        if (family == AF_INET6)
+        {
+            applied &= set_option(sockfd, IPPROTO_IPV6, IPV6_TCLASS, options->tos, "IPV6_TCLASS");
+        }
+        else
+        {
+            applied &= set_option(sockfd, IPPROTO_IP, IP_TOS, options->tos, "IP_TOS");
+        }
+    }
+
+    return applied;
+}
+
+/// <summary>
+/// Log the TCP options in effect on a connected socket, as the kernel reports them
+/// </summary>
+/// <param name="sockfd">Connected socket</param>
+void dx_mqttSocketLogOptions(int sockfd)
+{
+    struct sockaddr_storage local;
+    socklen_t local_length = sizeof(local);
+    int family             = getsockname(sockfd, (struct sockaddr *)&local, &local_length) == 0 ? local.ss_family : AF_INET;
+
+    int keepidle = -1, keepintvl = -1, keepcnt = -1, user_timeout = -1;
+#if defined(TCP_KEEPIDLE)
+    keepidle = get_option(sockfd, IPPROTO_TCP, TCP_KEEPIDLE);
+#elif defined(TCP_KEEPALIVE)
+    keepidle = get_option(sockfd, IPPROTO_TCP, TCP_KEEPALIVE);
+#endif
+#ifdef TCP_KEEPINTVL
+    keepintvl = get_option(sockfd, IPPROTO_TCP, TCP_KEEPINTVL);
+#endif
+#ifdef TCP_KEEPCNT
+    keepcnt = get_option(sockfd, IPPROTO_TCP, TCP_KEEPCNT);
+#endif
+#ifdef TCP_USER_TIMEOUT
+    user_timeout = get_option(sockfd, IPPROTO_TCP, TCP_USER_TIMEOUT);
+#endif
+
+    dx_Log_Debug("DX MQTT: Socket nodelay=%d sndbuf=%d rcvbuf=%d keepalive=%d idle=%d interval=%d count=%d user_timeout=%d tos=%d\n",
+        get_option(sockfd, IPPROTO_TCP, TCP_NODELAY), get_option(sockfd, SOL_SOCKET, SO_SNDBUF), get_option(sockfd, SOL_SOCKET, SO_RCVBUF),
+        get_option(sockfd, SOL_SOCKET, SO_KEEPALIVE), keepidle, keepintvl, keepcnt, user_timeout,
+        family == AF_INET6 ? get_option(sockfd, IPPROTO_IPV6, IPV6_TCLASS) : get_option(sockfd, IPPROTO_IP, IP_TOS));
+}
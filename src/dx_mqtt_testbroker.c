@@ -0,0 +1,1263 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+#include "dx_mqtt_testbroker.h"
+#include "dx_mqtt_topic_trie.h"
+
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+
+// Largest packet a client may send, anything bigger closes the connection
+#define DX_MQTT_TESTBROKER_MAX_PACKET (16 * 1024 * 1024)
+
+// MQTT control packet types, the high nibble of the first byte
+#define MQTT_BROKER_CONNECT 1
+#define MQTT_BROKER_CONNACK 2
+#define MQTT_BROKER_PUBLISH 3
+#define MQTT_BROKER_PUBACK 4
+#define MQTT_BROKER_PUBREC 5
+#define MQTT_BROKER_PUBREL 6
+#define MQTT_BROKER_PUBCOMP 7
+#define MQTT_BROKER_SUBSCRIBE 8
+#define MQTT_BROKER_SUBACK 9
+#define MQTT_BROKER_UNSUBSCRIBE 10
+#define MQTT_BROKER_UNSUBACK 11
+#define MQTT_BROKER_PINGREQ 12
+#define MQTT_BROKER_PINGRESP 13
+#define MQTT_BROKER_DISCONNECT 14
+
+// Outbound packet. The write request comes first so write_done can recover the packet,
+// and delayed packets wait in a per session list until they are due.
+typedef struct MQTT_BROKER_PACKET
+{
+    uv_write_t request;
+    struct MQTT_BROKER_PACKET *next;
+    uint64_t due_ms;
+    size_t length;
+    uint8_t data[];
+} MQTT_BROKER_PACKET;
+
+// Retained message, one per topic
+typedef struct
+{
+    char *topic;
+    uint8_t *payload;
+    size_t payload_length;
+    uint8_t qos;
+} MQTT_BROKER_RETAINED;
+
+// One client connection
+typedef struct MQTT_BROKER_SESSION
+{
+    uv_tcp_t tcp;
+    uv_timer_t send_timer; // Writes delayed packets once they are due
+    uv_timer_t read_timer; // Resumes reading after a slow read window
+    int open_handles;
+    bool closing;
+    bool connected; // CONNECT seen
+    struct MQTT_BROKER_SESSION *next;
+    DX_MQTT_TESTBROKER *broker;
+
+    // Bytes read but not yet parsed
+    uint8_t *buffer;
+    size_t length;
+    size_t capacity;
+
+    // Filters the client subscribed to, values are the granted QoS
+    DX_MQTT_TOPIC_TRIE *subscriptions;
+    uint16_t next_packet_id;
+    uint64_t packets_in;
+
+    // Bit per packet id of inbound QoS 2 publishes routed but not yet released by PUBREL
+    uint8_t qos2_received[65536 / 8];
+
+    MQTT_BROKER_PACKET *delayed_head;
+    MQTT_BROKER_PACKET *delayed_tail;
+
+    // Slow read accounting for the current one second window
+    uint64_t read_window_ms;
+    size_t read_window_bytes;
+} MQTT_BROKER_SESSION;
+
+struct DX_MQTT_TESTBROKER
+{
+    uv_loop_t loop;
+    uv_tcp_t listener;
+    uv_async_t wakeup; // Stop and disconnect requests from other threads
+    pthread_t thread;
+    uint16_t port;
+
+    pthread_mutex_t faults_lock;
+    DX_MQTT_TESTBROKER_FAULTS faults;
+    uint64_t drop_counter;
+
+    atomic_bool stop_requested;
+    atomic_bool disconnect_requested;
+
+    // Loop thread only
+    MQTT_BROKER_SESSION *sessions;
+    MQTT_BROKER_RETAINED *retained;
+    size_t retained_count;
+    size_t retained_capacity;
+
+    _Atomic uint64_t connections;
+    _Atomic uint64_t packets_in;
+    _Atomic uint64_t packets_out;
+    _Atomic uint64_t packets_dropped;
+    _Atomic uint64_t publishes_in;
+    _Atomic uint64_t publishes_out;
+    _Atomic uint64_t forced_disconnects;
+};
+
+static void session_close(MQTT_BROKER_SESSION *session);
+
+/// <summary>
+/// Take a copy of the current faults
+/// </summary>
+/// <param name="broker">Broker</param>
+/// <param name="faults">Receives the faults</param>
+static void current_faults(DX_MQTT_TESTBROKER *broker, DX_MQTT_TESTBROKER_FAULTS *faults)
+{
+    pthread_mutex_lock(&broker->faults_lock);
+    *faults = broker->faults;
+    pthread_mutex_unlock(&broker->faults_lock);
+}
+
+/// <summary>
+/// Bytes the MQTT remaining length takes on the wire
+/// </summary>
+/// <param name="remaining_length">Remaining length</param>
+/// <returns>1 to 4</returns>
+static size_t remaining_length_size(size_t remaining_length)
+{
+    size_t size = 1;
+    while (remaining_length >= 128)
+    {
+        remaining_length /= 128;
+        size++;
+    }
+    return size;
+}
+
+/// <summary>
+/// Allocate a packet and write its fixed header
+/// </summary>
+/// <param name="header">First byte, type and flags</param>
+/// <param name="remaining_length">Bytes after the fixed header</param>
+/// <param name="cursor">Receives where the variable header starts</param>
+/// <returns>New packet, or NULL when out of memory</returns>
+static MQTT_BROKER_PACKET *packet_new(uint8_t header, size_t remaining_length, uint8_t **cursor)
+{
+    size_t length              = 1 + remaining_length_size(remaining_length) + remaining_length;
+    MQTT_BROKER_PACKET *packet = malloc(sizeof(MQTT_BROKER_PACKET) + length);
+    if (packet == NULL)
+    {
+        return NULL;
+    }
+
+    packet->next   = NULL;
+    packet->length = length;
+
+    uint8_t *p = packet->data;
+    *p++       = header;
+    do
+    {
+        uint8_t digit = remaining_length % 128;
+        remaining_length /= 128;
+        *p++ = remaining_length > 0 ? digit | 0x80 : digit;
+    } while (remaining_length > 0);
+
+    *cursor = p;
+    return packet;
+}
+
+/// <summary>
+/// Write a big endian 16 bit value
+/// </summary>
+/// <param name="p">Destination</param>
+/// <param name="value">Value</param>
+/// <returns>Position after the value</returns>
+static uint8_t *put_u16(uint8_t *p, uint16_t value)
+{
+    p[0] = (uint8_t)(value >> 8);
+    p[1] = (uint8_t)value;
+    return p + 2;
+}
+
+/// <summary>
+/// libuv write completion, frees the packet
+/// </summary>
+/// <param name="request">Write request inside the packet</param>
+/// <param name="status">Write status</param>
+static void write_done(uv_write_t *request, int status)
+{
+    (void)status;
+    free(request);
+}
+
+/// <summary>
+/// Hand a packet to libuv
+/// </summary>
+/// <param name="session">Session</param>
+/// <param name="packet">Packet, owned by libuv from here</param>
+static void write_packet(MQTT_BROKER_SESSION *session, MQTT_BROKER_PACKET *packet)
+{
+    uv_buf_t buffer = uv_buf_init((char *)packet->data, (unsigned int)packet->length);
+
+    if (uv_write(&packet->request, (uv_stream_t *)&session->tcp, &buffer, 1, write_done) != 0)
+    {
+        free(packet);
+        return;
+    }
+
+    atomic_fetch_add(&session->broker->packets_out, 1);
+}
+
+/// <summary>
+/// Write the delayed packets that are due and rearm for the next one
+/// </summary>
+/// <param name="handle">Send timer</param>
+static void send_timer_handler(uv_timer_t *handle)
+{
+    MQTT_BROKER_SESSION *session = handle->data;
+    uint64_t now                 = uv_now(handle->loop);
+
+    while (session->delayed_head != NULL && session->delayed_head->due_ms <= now)
+    {
+        MQTT_BROKER_PACKET *packet = session->delayed_head;
+        session->delayed_head      = packet->next;
+        if (session->delayed_head == NULL)
+        {
+            session->delayed_tail = NULL;
+        }
+        write_packet(session, packet);
+    }
+
+    if (session->delayed_head != NULL)
+    {
+        uv_timer_start(&session->send_timer, send_timer_handler, session->delayed_head->due_ms - now, 0);
+    }
+}
+
+/// <summary>
+/// Send a packet, applying the drop and delay faults
+/// </summary>
+/// <param name="session">Session</param>
+/// <param name="packet">Packet, always taken</param>
+/// <param name="droppable">False for packets the drop fault must not touch</param>
+static void send_packet(MQTT_BROKER_SESSION *session, MQTT_BROKER_PACKET *packet, bool droppable)
+{
+    DX_MQTT_TESTBROKER *broker = session->broker;
+
+    if (packet == NULL)
+    {
+        return;
+    }
+
+    if (session->closing)
+    {
+        free(packet);
+        return;
+    }
+
+    DX_MQTT_TESTBROKER_FAULTS faults;
+    current_faults(broker, &faults);
+
+    if (droppable && faults.drop_one_in > 0 && ++broker->drop_counter % faults.drop_one_in == 0)
+    {
+        atomic_fetch_add(&broker->packets_dropped, 1);
+        free(packet);
+        return;
+    }
+
+    // Packets queued under an earlier delay still go first
+    if (faults.delay_ms == 0 && session->delayed_head == NULL)
+    {
+        write_packet(session, packet);
+        return;
+    }
+
+    packet->due_ms = uv_now(&broker->loop) + faults.delay_ms;
+
+    if (session->delayed_tail != NULL)
+    {
+        session->delayed_tail->next = packet;
+    }
+    else
+    {
+        session->delayed_head = packet;
+        uv_timer_start(&session->send_timer, send_timer_handler, faults.delay_ms, 0);
+    }
+    session->delayed_tail = packet;
+}
+
+/// <summary>
+/// Send a two byte acknowledgement carrying a packet id
+/// </summary>
+/// <param name="session">Session</param>
+/// <param name="header">First byte, type and flags</param>
+/// <param name="packet_id">Packet id</param>
+static void send_ack(MQTT_BROKER_SESSION *session, uint8_t header, uint16_t packet_id)
+{
+    uint8_t *p;
+    MQTT_BROKER_PACKET *packet = packet_new(header, 2, &p);
+    if (packet != NULL)
+    {
+        put_u16(p, packet_id);
+    }
+    send_packet(session, packet, true);
+}
+
+/// <summary>
+/// Send a PUBLISH to a subscriber
+/// </summary>
+/// <param name="session">Subscriber</param>
+/// <param name="topic">Topic</param>
+/// <param name="topic_length">Topic length</param>
+/// <param name="payload">Payload</param>
+/// <param name="payload_length">Payload length</param>
+/// <param name="qos">QoS to deliver at</param>
+/// <param name="retain">Set the retain flag, only for retained messages sent on subscribe</param>
+static void send_publish(
+    MQTT_BROKER_SESSION *session, const char *topic, size_t topic_length, const void *payload, size_t payload_length, uint8_t qos, bool retain)
+{
+    uint8_t *p;
+    uint8_t header             = (uint8_t)(MQTT_BROKER_PUBLISH << 4 | qos << 1 | (retain ? 1 : 0));
+    MQTT_BROKER_PACKET *packet = packet_new(header, 2 + topic_length + (qos > 0 ? 2 : 0) + payload_length, &p);
+    if (packet == NULL)
+    {
+        return;
+    }
+
+    p = put_u16(p, (uint16_t)topic_length);
+    memcpy(p, topic, topic_length);
+    p += topic_length;
+
+    if (qos > 0)
+    {
+        if (++session->next_packet_id == 0)
+        {
+            session->next_packet_id = 1;
+        }
+        p = put_u16(p, session->next_packet_id);
+    }
+
+    if (payload_length > 0)
+    {
+        memcpy(p, payload, payload_length);
+    }
+
+    atomic_fetch_add(&session->broker->publishes_out, 1);
+    send_packet(session, packet, true);
+}
+
+/// <summary>
+/// Trie visitor that keeps the highest granted QoS of the matching filters
+/// </summary>
+/// <param name="value">Granted QoS stored for the filter</param>
+/// <param name="context">Highest QoS so far</param>
+static void pick_granted_qos(void *value, void *context)
+{
+    uint8_t granted = *(uint8_t *)value;
+    uint8_t *best   = context;
+
+    if (granted > *best)
+    {
+        *best = granted;
+    }
+}
+
+/// <summary>
+/// Trie visitor that ignores the value, for match counts
+/// </summary>
+/// <param name="value">Stored value</param>
+/// <param name="context">Unused</param>
+static void count_match(void *value, void *context)
+{
+    (void)value;
+    (void)context;
+}
+
+/// <summary>
+/// Keep, replace or clear the retained message of a topic
+/// </summary>
+/// <param name="broker">Broker</param>
+/// <param name="topic">Topic</param>
+/// <param name="topic_length">Topic length</param>
+/// <param name="payload">Payload, an empty one clears the topic</param>
+/// <param name="payload_length">Payload length</param>
+/// <param name="qos">QoS it was published at</param>
+static void retain_message(DX_MQTT_TESTBROKER *broker, const char *topic, size_t topic_length, const void *payload, size_t payload_length, uint8_t qos)
+{
+    size_t index = 0;
+    while (index < broker->retained_count &&
+           (strlen(broker->retained[index].topic) != topic_length || memcmp(broker->retained[index].topic, topic, topic_length) != 0))
+    {
+        index++;
+    }
+
+    if (index < broker->retained_count)
+    {
+        free(broker->retained[index].topic);
+        free(broker->retained[index].payload);
+        broker->retained[index] = broker->retained[--broker->retained_count];
+    }
+
+    if (payload_length == 0)
+    {
+        return;
+    }
+
+    if (broker->retained_count == broker->retained_capacity)
+    {
+        size_t capacity                = broker->retained_capacity > 0 ? broker->retained_capacity * 2 : 16;
+        MQTT_BROKER_RETAINED *retained = realloc(broker->retained, capacity * sizeof(MQTT_BROKER_RETAINED));
+        if (retained == NULL)
+        {
+            return;
+        }
+        broker->retained          = retained;
+        broker->retained_capacity = capacity;
+    }
+
+    MQTT_BROKER_RETAINED *entry = &broker->retained[broker->retained_count];
+    entry->topic                = malloc(topic_length + 1);
+    entry->payload              = malloc(payload_length);
+    if (entry->topic == NULL || entry->payload == NULL)
+    {
+        free(entry->topic);
+        free(entry->payload);
+        return;
+    }
+
+    memcpy(entry->topic, topic, topic_length);
+    entry->topic[topic_length] = '\0';
+    memcpy(entry->payload, payload, payload_length);
+    entry->payload_length = payload_length;
+    entry->qos            = qos;
+    broker->retained_count++;
+}
+
+/// <summary>
+/// Read a length prefixed string from a packet body
+/// </summary>
+/// <param name="p">Cursor, advanced past the string</param>
+/// <param name="end">End of the body</param>
+/// <param name="length">Receives the string length</param>
+/// <returns>String start, or NULL if the body is too short</returns>
+static const uint8_t *get_string(const uint8_t **p, const uint8_t *end, size_t *length)
+{
+    if (end - *p < 2)
+    {
+        return NULL;
+    }
+
+    *length = (size_t)(*p)[0] << 8 | (*p)[1];
+    if ((size_t)(end - *p - 2) < *length)
+    {
+        return NULL;
+    }
+
+    const uint8_t *start = *p + 2;
+    *p                   = start + *length;
+    return start;
+}
+
+/// <summary>
+/// Handle CONNECT. Will, username and password are accepted but not acted on.
+/// </summary>
+/// <param name="session">Session</param>
+/// <param name="p">Body</param>
+/// <param name="end">End of the body</param>
+/// <returns>False on a protocol error</returns>
+static bool handle_connect(MQTT_BROKER_SESSION *session, const uint8_t *p, const uint8_t *end)
+{
+    size_t length;
+    const uint8_t *name = get_string(&p, end, &length);
+    if (name == NULL || session->connected || end - p < 4)
+    {
+        return false;
+    }
+
+    uint8_t level = p[0];
+    uint8_t *body;
+    MQTT_BROKER_PACKET *packet = packet_new(MQTT_BROKER_CONNACK << 4, 2, &body);
+    if (packet == NULL)
+    {
+        return false;
+    }
+
+    // 3.1.1 is level 4, level 3 is the MQIsdp name of 3.1 which MQTT-C can also speak
+    bool supported = (level == 4 && length == 4 && memcmp(name, "MQTT", 4) == 0) || (level == 3 && length == 6 && memcmp(name, "MQIsdp", 6) == 0);
+    body[0]        = 0;
+    body[1]        = supported ? 0 : 1;
+
+    session->connected = supported;
+    send_packet(session, packet, false);
+
+    return supported;
+}
+
+/// <summary>
+/// Handle PUBLISH: acknowledge it, keep it when retained and route it to subscribers
+/// </summary>
+/// <param name="session">Publishing session</param>
+/// <param name="flags">Low nibble of the fixed header</param>
+/// <param name="p">Body</param>
+/// <param name="end">End of the body</param>
+/// <returns>False on a protocol error</returns>
+static bool handle_publish(MQTT_BROKER_SESSION *session, uint8_t flags, const uint8_t *p, const uint8_t *end)
+{
+    DX_MQTT_TESTBROKER *broker = session->broker;
+    uint8_t qos                = (flags >> 1) & 3;
+    bool retain                = (flags & 1) != 0;
+    uint16_t packet_id         = 0;
+    size_t topic_length;
+
+    const char *topic = (const char *)get_string(&p, end, &topic_length);
+    if (topic == NULL || qos > 2 || topic_length == 0 || memchr(topic, '+', topic_length) != NULL || memchr(topic, '#', topic_length) != NULL)
+    {
+        return false;
+    }
+
+    if (qos > 0)
+    {
+        if (end - p < 2)
+        {
+            return false;
+        }
+        packet_id = (uint16_t)(p[0] << 8 | p[1]);
+        p += 2;
+    }
+
+    size_t payload_length = (size_t)(end - p);
+    atomic_fetch_add(&broker->publishes_in, 1);
+
+    if (qos == 1)
+    {
+        send_ack(session, MQTT_BROKER_PUBACK << 4, packet_id);
+    }
+    else if (qos == 2)
+    {
+        send_ack(session, MQTT_BROKER_PUBREC << 4, packet_id);
+
+        // A resend before PUBREL was routed the first time round, only the PUBREC goes again
+        uint8_t bit = (uint8_t)(1u << (packet_id & 7));
+        if ((session->qos2_received[packet_id >> 3] & bit) != 0)
+        {
+            return true;
+        }
+        session->qos2_received[packet_id >> 3] |= bit;
+    }
+
+    if (retain)
+    {
+        retain_message(broker, topic, topic_length, p, payload_length, qos);
+    }
+
+    for (MQTT_BROKER_SESSION *subscriber = broker->sessions; subscriber != NULL; subscriber = subscriber->next)
+    {
+        uint8_t granted = 0;
+        if (subscriber->closing || !subscriber->connected ||
+            dx_mqttTopicTrieMatch(subscriber->subscriptions, topic, topic_length, pick_granted_qos, &granted) == 0)
+        {
+            continue;
+        }
+
+        send_publish(subscriber, topic, topic_length, p, payload_length, qos < granted ? qos : granted, false);
+    }
+
+    return true;
+}
+
+/// <summary>
+/// Send the retained messages matching a new subscription
+/// </summary>
+/// <param name="session">Subscriber</param>
+/// <param name="filter">NUL terminated topic filter</param>
+/// <param name="granted">Granted QoS</param>
+static void send_retained(MQTT_BROKER_SESSION *session, const char *filter, uint8_t granted)
+{
+    DX_MQTT_TESTBROKER *broker = session->broker;
+
+    if (broker->retained_count == 0)
+    {
+        return;
+    }
+
+    // A one filter trie gives the same wildcard rules as routing
+    DX_MQTT_TOPIC_TRIE *trie = dx_mqttTopicTrieCreate();
+    uint8_t unused           = 0;
+    if (trie == NULL || !dx_mqttTopicTrieInsert(trie, filter, &unused, NULL))
+    {
+        dx_mqttTopicTrieDestroy(trie, NULL);
+        return;
+    }
+
+    for (size_t i = 0; i < broker->retained_count; i++)
+    {
+        const MQTT_BROKER_RETAINED *entry = &broker->retained[i];
+        size_t topic_length               = strlen(entry->topic);
+
+        if (dx_mqttTopicTrieMatch(trie, entry->topic, topic_length, count_match, NULL) > 0)
+        {
+            send_publish(session, entry->topic, topic_length, entry->payload, entry->payload_length, entry->qos < granted ? entry->qos : granted, true);
+        }
+    }
+
+    dx_mqttTopicTrieDestroy(trie, NULL);
+}
+
+/// <summary>
+/// Handle SUBSCRIBE, then send the retained messages of each granted filter
+/// </summary>
+/// <param name="session">Session</param>
+/// <param name="p">Body</param>
+/// <param name="end">End of the body</param>
+/// <returns>False on a protocol error</returns>
+static bool handle_subscribe(MQTT_BROKER_SESSION *session, const uint8_t *p, const uint8_t *end)
+{
+    if (end - p < 2)
+    {
+        return false;
+    }
+
+    uint16_t packet_id = (uint16_t)(p[0] << 8 | p[1]);
+    p += 2;
+
+    // Every filter takes at least three bytes, so this bounds the return codes
+    size_t most = (size_t)(end - p) / 3;
+    if (most == 0)
+    {
+        return false;
+    }
+
+    char **filters = calloc(most, sizeof(char *));
+    uint8_t *codes = malloc(most);
+    size_t count   = 0;
+    bool valid     = filters != NULL && codes != NULL;
+
+    while (valid && p < end)
+    {
+        size_t length;
+        const char *filter = (const char *)get_string(&p, end, &length);
+        if (filter == NULL || p == end || (p[0] & 0xFC) != 0)
+        {
+            valid = false;
+            break;
+        }
+
+        uint8_t requested = *p++ & 3;
+        char *copy        = malloc(length + 1);
+        uint8_t *qos      = malloc(1);
+        codes[count]      = 0x80;
+
+        if (copy != NULL && qos != NULL)
+        {
+            memcpy(copy, filter, length);
+            copy[length] = '\0';
+            *qos         = requested > 2 ? 2 : requested;
+
+            void *previous = NULL;
+            if (dx_mqttTopicFilterIsValid(copy) && dx_mqttTopicTrieInsert(session->subscriptions, copy, qos, &previous))
+            {
+                free(previous);
+                codes[count] = *qos;
+                qos          = NULL;
+            }
+        }
+
+        free(qos);
+        filters[count++] = copy;
+    }
+
+    if (valid)
+    {
+        uint8_t *body;
+        MQTT_BROKER_PACKET *packet = packet_new(MQTT_BROKER_SUBACK << 4, 2 + count, &body);
+        if (packet != NULL)
+        {
+            memcpy(put_u16(body, packet_id), codes, count);
+        }
+        send_packet(session, packet, true);
+
+        for (size_t i = 0; i < count; i++)
+        {
+            if (codes[i] != 0x80)
+            {
+                send_retained(session, filters[i], codes[i]);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        free(filters[i]);
+    }
+    free(filters);
+    free(codes);
+
+    return valid;
+}
+
+/// <summary>
+/// Handle UNSUBSCRIBE
+/// </summary>
+/// <param name="session">Session</param>
+/// <param name="p">Body</param>
+/// <param name="end">End of the body</param>
+/// <returns>False on a protocol error</returns>
+static bool handle_unsubscribe(MQTT_BROKER_SESSION *session, const uint8_t *p, const uint8_t *end)
+{
+    if (end - p < 4)
+    {
+        return false;
+    }
+
+    uint16_t packet_id = (uint16_t)(p[0] << 8 | p[1]);
+    p += 2;
+
+    while (p < end)
+    {
+        size_t length;
+        const char *filter = (const char *)get_string(&p, end, &length);
+        if (filter == NULL)
+        {
+            return false;
+        }
+
+        char *copy = malloc(length + 1);
+        if (copy != NULL)
+        {
+            memcpy(copy, filter, length);
+            copy[length] = '\0';
+            free(dx_mqttTopicTrieRemove(session->subscriptions, copy));
+            free(copy);
+        }
+    }
+
+    send_ack(session, MQTT_BROKER_UNSUBACK << 4, packet_id);
+    return true;
+}
+
+/// <summary>
+/// Handle one complete packet
+/// </summary>
+/// <param name="session">Session</param>
+/// <param name="header">First byte, type and flags</param>
+/// <param name="body">Variable header and payload</param>
+/// <param name="length">Body length</param>
+/// <returns>False if the connection must be closed</returns>
+static bool handle_packet(MQTT_BROKER_SESSION *session, uint8_t header, const uint8_t *body, size_t length)
+{
+    uint8_t type       = header >> 4;
+    const uint8_t *p   = body;
+    const uint8_t *end = body + length;
+
+    atomic_fetch_add(&session->broker->packets_in, 1);
+
+    if (type != MQTT_BROKER_CONNECT && !session->connected)
+    {
+        return false;
+    }
+
+    switch (type)
+    {
+        case MQTT_BROKER_CONNECT:
+            return handle_connect(session, p, end);
+        case MQTT_BROKER_PUBLISH:
+            return handle_publish(session, header & 0x0F, p, end);
+        case MQTT_BROKER_PUBACK:
+        case MQTT_BROKER_PUBCOMP:
+            return length == 2;
+        case MQTT_BROKER_PUBREC:
+            if (length != 2)
+            {
+                return false;
+            }
+            send_ack(session, MQTT_BROKER_PUBREL << 4 | 2, (uint16_t)(p[0] << 8 | p[1]));
+            return true;
+        case MQTT_BROKER_PUBREL:
+        {
+            if (length != 2)
+            {
+                return false;
+            }
+            uint16_t packet_id = (uint16_t)(p[0] << 8 | p[1]);
+            session->qos2_received[packet_id >> 3] &= (uint8_t)~(1u << (packet_id & 7));
+            send_ack(session, MQTT_BROKER_PUBCOMP << 4, packet_id);
+            return true;
+        }
+        case MQTT_BROKER_SUBSCRIBE:
+            return handle_subscribe(session, p, end);
+        case MQTT_BROKER_UNSUBSCRIBE:
+            return handle_unsubscribe(session, p, end);
+        case MQTT_BROKER_PINGREQ:
+        {
+            uint8_t *unused;
+            send_packet(session, packet_new(MQTT_BROKER_PINGRESP << 4, 0, &unused), true);
+            return true;
+        }
+        default:
+            // DISCONNECT, or a packet only a broker sends
+            return false;
+    }
+}
+
+/// <summary>
+/// Handle every complete packet in the read buffer
+/// </summary>
+/// <param name="session">Session</param>
+static void parse_packets(MQTT_BROKER_SESSION *session)
+{
+    DX_MQTT_TESTBROKER_FAULTS faults;
+    current_faults(session->broker, &faults);
+
+    size_t offset = 0;
+
+    while (!session->closing && session->length - offset >= 2)
+    {
+        const uint8_t *start    = session->buffer + offset;
+        size_t available        = session->length - offset;
+        size_t remaining_length = 0;
+        size_t header_size      = 1;
+        bool complete           = false;
+
+        for (size_t multiplier = 1; header_size < available; multiplier *= 128)
+        {
+            uint8_t digit = start[header_size++];
+            remaining_length += (digit & 0x7F) * multiplier;
+            if ((digit & 0x80) == 0)
+            {
+                complete = true;
+                break;
+            }
+            if (header_size == 5)
+            {
+                session_close(session);
+                return;
+            }
+        }
+
+        if (!complete)
+        {
+            break;
+        }
+
+        if (remaining_length > DX_MQTT_TESTBROKER_MAX_PACKET)
+        {
+            session_close(session);
+            return;
+        }
+
+        if (available - header_size < remaining_length)
+        {
+            break;
+        }
+
+        if (!handle_packet(session, start[0], start + header_size, remaining_length))
+        {
+            session_close(session);
+            return;
+        }
+
+        offset += header_size + remaining_length;
+
+        if (faults.disconnect_after_packets > 0 && ++session->packets_in >= faults.disconnect_after_packets)
+        {
+            atomic_fetch_add(&session->broker->forced_disconnects, 1);
+            session_close(session);
+            return;
+        }
+    }
+
+    memmove(session->buffer, session->buffer + offset, session->length - offset);
+    session->length -= offset;
+}
+
+/// <summary>
+/// libuv allocation callback. Reads go straight into the session buffer, sized to what
+/// is left of the slow read window so a read never overshoots it.
+/// </summary>
+/// <param name="handle">Session TCP handle</param>
+/// <param name="suggested_size">libuv's suggestion</param>
+/// <param name="buffer">Receives the buffer</param>
+static void session_alloc(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buffer)
+{
+    MQTT_BROKER_SESSION *session = handle->data;
+    size_t chunk                 = suggested_size;
+
+    DX_MQTT_TESTBROKER_FAULTS faults;
+    current_faults(session->broker, &faults);
+
+    if (faults.read_bytes_per_second > 0)
+    {
+        uint64_t now = uv_now(handle->loop);
+        if (now - session->read_window_ms >= 1000)
+        {
+            session->read_window_ms    = now;
+            session->read_window_bytes = 0;
+        }
+
+        size_t left = session->read_window_bytes < faults.read_bytes_per_second ? faults.read_bytes_per_second - session->read_window_bytes : 1;
+        chunk       = left < chunk ? left : chunk;
+    }
+
+    if (session->length + chunk > session->capacity)
+    {
+        size_t capacity = session->capacity > 0 ? session->capacity : 4096;
+        while (capacity < session->length + chunk)
+        {
+            capacity *= 2;
+        }
+
+        uint8_t *grown = realloc(session->buffer, capacity);
+        if (grown == NULL)
+        {
+            *buffer = uv_buf_init(NULL, 0);
+            return;
+        }
+        session->buffer   = grown;
+        session->capacity = capacity;
+    }
+
+    *buffer = uv_buf_init((char *)session->buffer + session->length, (unsigned int)chunk);
+}
+
+/// <summary>
+/// Resume reading once the slow read window has passed
+/// </summary>
+/// <param name="handle">Read timer</param>
+static void read_timer_handler(uv_timer_t *handle);
+
+/// <summary>
+/// libuv read callback
+/// </summary>
+/// <param name="stream">Session TCP handle</param>
+/// <param name="nread">Bytes read, negative on error or end of stream</param>
+/// <param name="buffer">Buffer from session_alloc</param>
+static void session_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buffer)
+{
+    MQTT_BROKER_SESSION *session = stream->data;
+    (void)buffer;
+
+    if (nread < 0)
+    {
+        session_close(session);
+        return;
+    }
+
+    session->length += (size_t)nread;
+    session->read_window_bytes += (size_t)nread;
+
+    parse_packets(session);
+
+    DX_MQTT_TESTBROKER_FAULTS faults;
+    current_faults(session->broker, &faults);
+
+    if (!session->closing && faults.read_bytes_per_second > 0 && session->read_window_bytes >= faults.read_bytes_per_second)
+    {
+        uint64_t elapsed = uv_now(stream->loop) - session->read_window_ms;
+        uv_read_stop(stream);
+        uv_timer_start(&session->read_timer, read_timer_handler, elapsed < 1000 ? 1000 - elapsed : 0, 0);
+    }
+}
+
+static void read_timer_handler(uv_timer_t *handle)
+{
+    MQTT_BROKER_SESSION *session = handle->data;
+    uv_read_start((uv_stream_t *)&session->tcp, session_alloc, session_read);
+}
+
+/// <summary>
+/// Free a session once libuv has released all of its handles
+/// </summary>
+/// <param name="handle">One of the session's handles</param>
+static void session_close_handler(uv_handle_t *handle)
+{
+    MQTT_BROKER_SESSION *session = handle->data;
+
+    if (--session->open_handles > 0)
+    {
+        return;
+    }
+
+    while (session->delayed_head != NULL)
+    {
+        MQTT_BROKER_PACKET *packet = session->delayed_head;
+        session->delayed_head      = packet->next;
+        free(packet);
+    }
+
+    dx_mqttTopicTrieDestroy(session->subscriptions, free);
+    free(session->buffer);
+    free(session);
+}
+
+/// <summary>
+/// Unlink a session and close its handles, pending writes are cancelled
+/// </summary>
+/// <param name="session">Session</param>
+static void session_close(MQTT_BROKER_SESSION *session)
+{
+    if (session->closing)
+    {
+        return;
+    }
+    session->closing = true;
+
+    for (MQTT_BROKER_SESSION **link = &session->broker->sessions; *link != NULL; link = &(*link)->next)
+    {
+        if (*link == session)
+        {
+            *link = session->next;
+            break;
+        }
+    }
+
+    uv_close((uv_handle_t *)&session->tcp, session_close_handler);
+    uv_close((uv_handle_t *)&session->send_timer, session_close_handler);
+    uv_close((uv_handle_t *)&session->read_timer, session_close_handler);
+}
+
+/// <summary>
+/// Accept a client connection
+/// </summary>
+/// <param name="server">Listener</param>
+/// <param name="status">Listen status</param>
+static void on_connection(uv_stream_t *server, int status)
+{
+    DX_MQTT_TESTBROKER *broker = server->data;
+
+    if (status < 0)
+    {
+        return;
+    }
+
+    MQTT_BROKER_SESSION *session = calloc(1, sizeof(MQTT_BROKER_SESSION));
+    if (session == NULL)
+    {
+        return;
+    }
+
+    session->broker        = broker;
+    session->subscriptions = dx_mqttTopicTrieCreate();
+
+    uv_tcp_init(&broker->loop, &session->tcp);
+    uv_timer_init(&broker->loop, &session->send_timer);
+    uv_timer_init(&broker->loop, &session->read_timer);
+    session->tcp.data        = session;
+    session->send_timer.data = session;
+    session->read_timer.data = session;
+    session->open_handles    = 3;
+    session->read_window_ms  = uv_now(&broker->loop);
+
+    session->next    = broker->sessions;
+    broker->sessions = session;
+
+    if (session->subscriptions == NULL || uv_accept(server, (uv_stream_t *)&session->tcp) != 0)
+    {
+        session_close(session);
+        return;
+    }
+
+    atomic_fetch_add(&broker->connections, 1);
+
+    // Small packets are the common case, do not let Nagle add latency to measurements
+    uv_tcp_nodelay(&session->tcp, 1);
+    uv_read_start((uv_stream_t *)&session->tcp, session_alloc, session_read);
+}
+
+/// <summary>
+/// Close every session
+/// </summary>
+/// <param name="broker">Broker</param>
+/// <param name="forced">Count them as forced disconnects</param>
+static void close_sessions(DX_MQTT_TESTBROKER *broker, bool forced)
+{
+    while (broker->sessions != NULL)
+    {
+        if (forced)
+        {
+            atomic_fetch_add(&broker->forced_disconnects, 1);
+        }
+        session_close(broker->sessions);
+    }
+}
+
+/// <summary>
+/// Requests from other threads
+/// </summary>
+/// <param name="handle">Wakeup handle</param>
+static void wakeup_handler(uv_async_t *handle)
+{
+    DX_MQTT_TESTBROKER *broker = handle->data;
+
+    if (atomic_exchange(&broker->disconnect_requested, false))
+    {
+        close_sessions(broker, true);
+    }
+
+    // With every handle closed uv_run returns and the thread ends
+    if (atomic_load(&broker->stop_requested))
+    {
+        close_sessions(broker, false);
+        uv_close((uv_handle_t *)&broker->listener, NULL);
+        uv_close((uv_handle_t *)&broker->wakeup, NULL);
+    }
+}
+
+/// <summary>
+/// Broker thread
+/// </summary>
+/// <param name="arg">Broker</param>
+/// <returns>NULL</returns>
+static void *broker_main(void *arg)
+{
+    DX_MQTT_TESTBROKER *broker = arg;
+    uv_run(&broker->loop, UV_RUN_DEFAULT);
+    return NULL;
+}
+
+/// <summary>
+/// Start a broker on 127.0.0.1
+/// </summary>
+/// <param name="port">TCP port, 0 picks a free one</param>
+/// <param name="faults">Faults to inject from the start, can be NULL</param>
+/// <returns>Running broker, or NULL on failure</returns>
+DX_MQTT_TESTBROKER *dx_mqttTestBrokerStart(uint16_t port, const DX_MQTT_TESTBROKER_FAULTS *faults)
+{
+    DX_MQTT_TESTBROKER *broker = calloc(1, sizeof(DX_MQTT_TESTBROKER));
+    if (broker == NULL)
+    {
+        return NULL;
+    }
+
+    if (uv_loop_init(&broker->loop) != 0)
+    {
+        free(broker);
+        return NULL;
+    }
+
+    pthread_mutex_init(&broker->faults_lock, NULL);
+    if (faults != NULL)
+    {
+        broker->faults = *faults;
+    }
+
+    uv_tcp_init(&broker->loop, &broker->listener);
+    uv_async_init(&broker->loop, &broker->wakeup, wakeup_handler);
+    broker->listener.data = broker;
+    broker->wakeup.data   = broker;
+
+    struct sockaddr_in address;
+    struct sockaddr_storage bound;
+    int bound_length = sizeof(bound);
+
+    bool listening = uv_ip4_addr("127.0.0.1", port, &address) == 0 && uv_tcp_bind(&broker->listener, (const struct sockaddr *)&address, 0) == 0 &&
+                     uv_listen((uv_stream_t *)&broker->listener, 128, on_connection) == 0 &&
+                     uv_tcp_getsockname(&broker->listener, (struct sockaddr *)&bound, &bound_length) == 0;
+
+    if (listening)
+    {
+        broker->port = ntohs(((struct sockaddr_in *)&bound)->sin_port);
+    }
+
+    if (!listening || pthread_create(&broker->thread, NULL, broker_main, broker) != 0)
+    {
+        uv_close((uv_handle_t *)&broker->listener, NULL);
+        uv_close((uv_handle_t *)&broker->wakeup, NULL);
+        uv_run(&broker->loop, UV_RUN_DEFAULT);
+        uv_loop_close(&broker->loop);
+        pthread_mutex_destroy(&broker->faults_lock);
+        free(broker);
+        return NULL;
+    }
+
+    return broker;
+}
+
+/// <summary>
+/// Close every connection, stop the loop thread and free the broker
+/// </summary>
+/// <param name="broker">Broker, can be NULL</param>
+void dx_mqttTestBrokerStop(DX_MQTT_TESTBROKER *broker)
+{
+    if (broker == NULL)
+    {
+        return;
+    }
+
+    atomic_store(&broker->stop_requested, true);
+    uv_async_send(&broker->wakeup);
+    pthread_join(broker->thread, NULL);
+    uv_loop_close(&broker->loop);
+
+    for (size_t i = 0; i < broker->retained_count; i++)
+    {
+        free(broker->retained[i].topic);
+        free(broker->retained[i].payload);
+    }
+    free(broker->retained);
+    pthread_mutex_destroy(&broker->faults_lock);
+    free(broker);
+}
+
+/// <summary>
+/// Port the broker listens on
+/// </summary>
+/// <param name="broker">Broker</param>
+/// <returns>TCP port</returns>
+uint16_t dx_mqttTestBrokerPort(const DX_MQTT_TESTBROKER *broker)
+{
+    return broker->port;
+}
+
+/// <summary>
+/// Replace the injected faults, applies to packets handled from now on
+/// </summary>
+/// <param name="broker">Broker</param>
+/// <param name="faults">New faults, NULL turns them all off</param>
+void dx_mqttTestBrokerSetFaults(DX_MQTT_TESTBROKER *broker, const DX_MQTT_TESTBROKER_FAULTS *faults)
+{
+    pthread_mutex_lock(&broker->faults_lock);
+    if (faults != NULL)
+    {
+        broker->faults = *faults;
+    }
+    else
+    {
+        memset(&broker->faults, 0, sizeof(broker->faults));
+    }
+    pthread_mutex_unlock(&broker->faults_lock);
+}
+
+/// <summary>
+/// Drop every open connection without a DISCONNECT, as if the network failed
+/// </summary>
+/// <param name="broker">Broker</param>
+void dx_mqttTestBrokerDisconnectAll(DX_MQTT_TESTBROKER *broker)
+{
+    atomic_store(&broker->disconnect_requested, true);
+    uv_async_send(&broker->wakeup);
+}
+
+/// <summary>
+/// Copy the broker's counters
+/// </summary>
+/// <param name="broker">Broker</param>
+/// <param name="stats">Receives the counters</param>
+void dx_mqttTestBrokerGetStats(const DX_MQTT_TESTBROKER *broker, DX_MQTT_TESTBROKER_STATS *stats)
+{
+    stats->connections        = atomic_load(&broker->connections);
+    stats->packets_in         = atomic_load(&broker->packets_in);
+    stats->packets_out        = atomic_load(&broker->packets_out);
+    stats->packets_dropped    = atomic_load(&broker->packets_dropped);
+    stats->publishes_in       = atomic_load(&broker->publishes_in);
+    stats->publishes_out      = atomic_load(&broker->publishes_out);
+    stats->forced_disconnects = atomic_load(&broker->forced_disconnects);
+}
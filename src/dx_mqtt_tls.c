@@ -0,0 +1,425 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+#include "dx_mqtt_tls.h"
+
+#include <arpa/inet.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+struct DX_MQTT_TLS
+{
+    SSL_CTX *ctx;
+    bool verify_peer;
+
+    // Latest session handed out by the broker, offered again on the next handshake
+    pthread_mutex_t session_lock;
+    SSL_SESSION *session;
+};
+
+// Socket BIO that writes with MSG_NOSIGNAL, created once for the process
+static BIO_METHOD *socket_method;
+static pthread_once_t socket_method_once = PTHREAD_ONCE_INIT;
+
+/// <summary>
+/// Describe the most recent OpenSSL error
+/// </summary>
+/// <param name="what">Operation that failed</param>
+/// <param name="error">Receives the description</param>
+/// <param name="error_size">Size of the error buffer</param>
+static void set_error(const char *what, char *error, size_t error_size)
+{
+    char detail[160];
+    ERR_error_string_n(ERR_get_error(), detail, sizeof(detail));
+    snprintf(error, error_size, "%s: %s", what, detail);
+    ERR_clear_error();
+}
+
+/// <summary>
+/// OpenSSL new session callback. Fires after a full handshake and for every TLS 1.3
+/// ticket, so the cache always holds the newest resumable session.
+/// </summary>
+/// <param name="ssl">Connection the session belongs to</param>
+/// <param name="session">New session</param>
+/// <returns>1 when the session was kept, which transfers its reference</returns>
+static int session_new(SSL *ssl, SSL_SESSION *session)
+{
+    DX_MQTT_TLS *tls = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+    if (tls == NULL || !SSL_SESSION_is_resumable(session))
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&tls->session_lock);
+    SSL_SESSION *previous = tls->session;
+    tls->session          = session;
+    pthread_mutex_unlock(&tls->session_lock);
+
+    if (previous != NULL)
+    {
+        SSL_SESSION_free(previous);
+    }
+
+    return 1;
+}
+
+/// <summary>
+/// Write to the socket. MSG_NOSIGNAL turns a broker hanging up into EPIPE for this
+/// connection instead of a SIGPIPE that would end the process.
+/// </summary>
+/// <param name="bio">Socket BIO</param>
+/// <param name="data">Bytes to write</param>
+/// <param name="length">Number of bytes</param>
+/// <returns>Bytes written, or -1 with the retry flags set when the socket is full</returns>
+static int socket_write(BIO *bio, const char *data, int length)
+{
+    ssize_t written = send((int)(intptr_t)BIO_get_data(bio), data, (size_t)length, MSG_NOSIGNAL);
+
+    BIO_clear_retry_flags(bio);
+    if (written <= 0 && BIO_sock_should_retry((int)written))
+    {
+        BIO_set_retry_write(bio);
+    }
+
+    return (int)written;
+}
+
+/// <summary>
+/// Read from the socket
+/// </summary>
+/// <param name="bio">Socket BIO</param>
+/// <param name="data">Receives the bytes</param>
+/// <param name="length">Room in data</param>
+/// <returns>Bytes read, 0 at end of stream, or -1 with the retry flags set when nothing is waiting</returns>
+static int socket_read(BIO *bio, char *data, int length)
+{
+    ssize_t received = recv((int)(intptr_t)BIO_get_data(bio), data, (size_t)length, 0);
+
+    BIO_clear_retry_flags(bio);
+    if (received < 0 && BIO_sock_should_retry((int)received))
+    {
+        BIO_set_retry_read(bio);
+    }
+
+    return (int)received;
+}
+
+/// <summary>
+/// Write a string to the socket
+/// </summary>
+static int socket_puts(BIO *bio, const char *text)
+{
+    return socket_write(bio, text, (int)strlen(text));
+}
+
+/// <summary>
+/// The controls OpenSSL and BIO_set_fd/BIO_get_fd use on a socket BIO
+/// </summary>
+static long socket_ctrl(BIO *bio, int command, long number, void *pointer)
+{
+    switch (command)
+    {
+        case BIO_C_SET_FD:
+            BIO_set_data(bio, (void *)(intptr_t)*(int *)pointer);
+            BIO_set_shutdown(bio, (int)number);
+            BIO_set_init(bio, 1);
+            return 1;
+        case BIO_C_GET_FD:
+            if (!BIO_get_init(bio))
+            {
+                return -1;
+            }
+            if (pointer != NULL)
+            {
+                *(int *)pointer = (int)(intptr_t)BIO_get_data(bio);
+            }
+            return (long)(intptr_t)BIO_get_data(bio);
+        case BIO_CTRL_GET_CLOSE:
+            return BIO_get_shutdown(bio);
+        case BIO_CTRL_SET_CLOSE:
+            BIO_set_shutdown(bio, (int)number);
+            return 1;
+        case BIO_CTRL_DUP:
+        case BIO_CTRL_FLUSH:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/// <summary>
+/// Close the socket when the BIO owns it
+/// </summary>
+static int socket_destroy(BIO *bio)
+{
+    if (BIO_get_init(bio) && BIO_get_shutdown(bio))
+    {
+        close((int)(intptr_t)BIO_get_data(bio));
+    }
+    BIO_set_init(bio, 0);
+
+    return 1;
+}
+
+/// <summary>
+/// Build the socket BIO method
+/// </summary>
+static void socket_method_init(void)
+{
+    BIO_METHOD *method = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK | BIO_TYPE_DESCRIPTOR, "dx_mqtt socket");
+
+    if (method != NULL &&
+        (BIO_meth_set_write(method, socket_write) != 1 || BIO_meth_set_read(method, socket_read) != 1 ||
+            BIO_meth_set_puts(method, socket_puts) != 1 || BIO_meth_set_ctrl(method, socket_ctrl) != 1 ||
+            BIO_meth_set_destroy(method, socket_destroy) != 1))
+    {
+        BIO_meth_free(method);
+        method = NULL;
+    }
+
+    socket_method = method;
+}
+
+/// <summary>
+/// Check whether a host is a literal IPv4 or IPv6 address
+/// </summary>
+/// <param name="host">Host name or address</param>
+/// <returns>True for an address literal</returns>
+static bool is_address_literal(const char *host)
+{
+    unsigned char address[sizeof(struct in6_addr)];
+    return inet_pton(AF_INET, host, address) == 1 || inet_pton(AF_INET6, host, address) == 1;
+}
+
+/// <summary>
+/// Create a TLS client context
+/// </summary>
+/// <param name="ca_file">PEM file of trusted CAs, NULL uses the system store</param>
+/// <param name="cert_file">PEM client certificate for mutual TLS, can be NULL</param>
+/// <param name="key_file">PEM private key for cert_file, can be NULL</param>
+/// <param name="verify_peer">Check the broker certificate and host name</param>
+/// <param name="error">Receives a description on failure</param>
+/// <param name="error_size">Size of the error buffer</param>
+/// <returns>New context, or NULL on failure</returns>
+DX_MQTT_TLS *dx_mqttTlsCreate(
+    const char *ca_file, const char *cert_file, const char *key_file, bool verify_peer, char *error, size_t error_size)
+{
+    DX_MQTT_TLS *tls = calloc(1, sizeof(DX_MQTT_TLS));
+    if (tls == NULL)
+    {
+        snprintf(error, error_size, "Out of memory");
+        return NULL;
+    }
+
+    tls->verify_peer = verify_peer;
+    pthread_mutex_init(&tls->session_lock, NULL);
+
+    tls->ctx = SSL_CTX_new(TLS_client_method());
+    if (tls->ctx == NULL)
+    {
+        set_error("SSL_CTX_new failed", error, error_size);
+        goto cleanup;
+    }
+
+    SSL_CTX_set_min_proto_version(tls->ctx, TLS1_2_VERSION);
+    SSL_CTX_set_app_data(tls->ctx, tls);
+
+    // Keep sessions out of OpenSSL's internal cache, the callback holds the one we reuse
+    SSL_CTX_set_session_cache_mode(tls->ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(tls->ctx, session_new);
+
+    if (verify_peer)
+    {
+        SSL_CTX_set_verify(tls->ctx, SSL_VERIFY_PEER, NULL);
+
+        int loaded = ca_file != NULL ? SSL_CTX_load_verify_locations(tls->ctx, ca_file, NULL) : SSL_CTX_set_default_verify_paths(tls->ctx);
+        if (loaded != 1)
+        {
+            set_error("Failed to load CA certificates", error, error_size);
+            goto cleanup;
+        }
+    }
+
+    if (cert_file != NULL && SSL_CTX_use_certificate_chain_file(tls->ctx, cert_file) != 1)
+    {
+        set_error("Failed to load client certificate", error, error_size);
+        goto cleanup;
+    }
+
+    if (key_file != NULL && (SSL_CTX_use_PrivateKey_file(tls->ctx, key_file, SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(tls->ctx) != 1))
+    {
+        set_error("Failed to load client key", error, error_size);
+        goto cleanup;
+    }
+
+    return tls;
+
+cleanup:
+    dx_mqttTlsDestroy(tls);
+    return NULL;
+}
+
+/// <summary>
+/// Destroy a TLS context. Transports opened from it stay usable until closed.
+/// </summary>
+/// <param name="tls">TLS context, can be NULL</param>
+void dx_mqttTlsDestroy(DX_MQTT_TLS *tls)
+{
+    if (tls == NULL)
+    {
+        return;
+    }
+
+    if (tls->ctx != NULL)
+    {
+        // Open connections hold a reference to the SSL_CTX, stop them reaching this context
+        SSL_CTX_set_app_data(tls->ctx, NULL);
+        SSL_CTX_free(tls->ctx);
+    }
+
+    if (tls->session != NULL)
+    {
+        SSL_SESSION_free(tls->session);
+    }
+
+    pthread_mutex_destroy(&tls->session_lock);
+    free(tls);
+}
+
+/// <summary>
+/// Wrap a connected non-blocking socket in a BIO for MQTT-C. The handshake runs on
+/// the first read or write, resuming the cached session when there is one.
+/// </summary>
+/// <param name="tls">TLS context, NULL for a plain socket BIO</param>
+/// <param name="sockfd">Connected socket, stays owned by the caller</param>
+/// <param name="hostname">Broker host name for SNI and certificate checks</param>
+/// <returns>BIO chain, or NULL on failure</returns>
+BIO *dx_mqttTlsOpen(DX_MQTT_TLS *tls, int sockfd, const char *hostname)
+{
+    pthread_once(&socket_method_once, socket_method_init);
+
+    BIO *socket_bio = socket_method != NULL ? BIO_new(socket_method) : NULL;
+    if (socket_bio == NULL)
+    {
+        return NULL;
+    }
+    BIO_set_fd(socket_bio, sockfd, BIO_NOCLOSE);
+
+    if (tls == NULL)
+    {
+        return socket_bio;
+    }
+
+    SSL *ssl = SSL_new(tls->ctx);
+    if (ssl == NULL)
+    {
+        BIO_free(socket_bio);
+        return NULL;
+    }
+
+    // From here the SSL owns the socket BIO
+    SSL_set_bio(ssl, socket_bio, socket_bio);
+    SSL_set_connect_state(ssl);
+
+    // SNI carries names only, addresses are matched against the certificate's IP entries
+    bool configured = true;
+    if (is_address_literal(hostname))
+    {
+        configured = !tls->verify_peer || X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), hostname) == 1;
+    }
+    else
+    {
+        configured = SSL_set_tlsext_host_name(ssl, hostname) == 1 && (!tls->verify_peer || SSL_set1_host(ssl, hostname) == 1);
+    }
+
+    if (!configured)
+    {
+        SSL_free(ssl);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&tls->session_lock);
+    if (tls->session != NULL)
+    {
+        SSL_set_session(ssl, tls->session);
+    }
+    pthread_mutex_unlock(&tls->session_lock);
+
+    BIO *ssl_bio = BIO_new(BIO_f_ssl());
+    if (ssl_bio == NULL)
+    {
+        SSL_free(ssl);
+        return NULL;
+    }
+    BIO_set_ssl(ssl_bio, ssl, BIO_CLOSE);
+
+    return ssl_bio;
+}
+
+/// <summary>
+/// Send close_notify if the handshake completed and free the BIO chain
+/// </summary>
+/// <param name="bio">BIO from dx_mqttTlsOpen, can be NULL</param>
+void dx_mqttTlsClose(BIO *bio)
+{
+    if (bio == NULL)
+    {
+        return;
+    }
+
+    SSL *ssl = NULL;
+    if (BIO_get_ssl(bio, &ssl) > 0 && ssl != NULL && SSL_is_init_finished(ssl))
+    {
+        // Best effort on a non-blocking socket, the broker may already be gone
+        SSL_shutdown(ssl);
+    }
+
+    BIO_free_all(bio);
+    ERR_clear_error();
+}
+
+/// <summary>
+/// Decrypted bytes buffered inside OpenSSL. The socket does not poll readable for
+/// these, so the caller must service the connection again while this is non-zero.
+/// </summary>
+/// <param name="bio">BIO from dx_mqttTlsOpen</param>
+/// <returns>Number of bytes ready to read</returns>
+size_t dx_mqttTlsPending(BIO *bio)
+{
+    SSL *ssl = NULL;
+    if (bio == NULL || BIO_get_ssl(bio, &ssl) <= 0 || ssl == NULL)
+    {
+        return 0;
+    }
+
+    int pending = SSL_pending(ssl);
+    return pending > 0 ? (size_t)pending : 0;
+}
+
+/// <summary>
+/// Check whether the handshake resumed a cached session
+/// </summary>
+/// <param name="bio">BIO from dx_mqttTlsOpen</param>
+/// <returns>True if the session was resumed</returns>
+bool dx_mqttTlsSessionReused(BIO *bio)
+{
+    SSL *ssl = NULL;
+    if (bio == NULL || BIO_get_ssl(bio, &ssl) <= 0 || ssl == NULL)
+    {
+        return false;
+    }
+
+    return SSL_session_reused(ssl) == 1;
+}
@@ -0,0 +1,517 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+#include "dx_mqtt_topic_trie.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct DX_MQTT_TOPIC_NODE DX_MQTT_TOPIC_NODE;
+
+/// <summary>
+/// One topic level. Literal children are kept sorted for binary search, the
+/// single level (+) and multi level (#) wildcards have their own slots.
+/// </summary>
+struct DX_MQTT_TOPIC_NODE
+{
+    char *level;
+    size_t level_length;
+    DX_MQTT_TOPIC_NODE **children;
+    size_t child_count;
+    size_t child_capacity;
+    DX_MQTT_TOPIC_NODE *plus;
+    DX_MQTT_TOPIC_NODE *hash;
+    void *value;
+    bool has_value;
+};
+
+struct DX_MQTT_TOPIC_TRIE
+{
+    DX_MQTT_TOPIC_NODE root;
+    size_t count;
+};
+
+/// <summary>
+/// Length of the topic level starting at start
+/// </summary>
+static size_t level_length(const char *topic, size_t topic_length, size_t start)
+{
+    const char *end = memchr(topic + start, '/', topic_length - start);
+    return end == NULL ? topic_length - start : (size_t)(end - (topic + start));
+}
+
+/// <summary>
+/// Order literal levels by length then bytes
+/// </summary>
+static int compare_level(const DX_MQTT_TOPIC_NODE *node, const char *level, size_t length)
+{
+    if (node->level_length != length)
+    {
+        return node->level_length < length ? -1 : 1;
+    }
+    return memcmp(node->level, level, length);
+}
+
+/// <summary>
+/// Binary search the literal children of a node
+/// </summary>
+/// <param name="node">Parent node</param>
+/// <param name="level">Level text</param>
+/// <param name="length">Level length</param>
+/// <param name="index">Receives the match or insertion position</param>
+/// <returns>Matching child, or NULL</returns>
+static DX_MQTT_TOPIC_NODE *find_child(const DX_MQTT_TOPIC_NODE *node, const char *level, size_t length, size_t *index)
+{
+    size_t low  = 0;
+    size_t high = node->child_count;
+
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        int order     = compare_level(node->children[middle], level, length);
+
+        if (order == 0)
+        {
+            *index = middle;
+            return node->children[middle];
+        }
+        if (order < 0)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    *index = low;
+    return NULL;
+}
+
+/// <summary>
+/// Allocate a node for a level
+/// </summary>
+static DX_MQTT_TOPIC_NODE *node_create(const char *level, size_t length)
+{
+    DX_MQTT_TOPIC_NODE *node = calloc(1, sizeof(DX_MQTT_TOPIC_NODE));
+    if (node == NULL)
+    {
+        return NULL;
+    }
+
+    node->level = malloc(length + 1);
+    if (node->level == NULL)
+    {
+        free(node);
+        return NULL;
+    }
+
+    memcpy(node->level, level, length);
+    node->level[length] = '\0';
+    node->level_length  = length;
+
+    return node;
+}
+
+/// <summary>
+/// Free a node's children and, unless it is the embedded root, the node itself
+/// </summary>
+static void node_free(DX_MQTT_TOPIC_NODE *node, void (*free_value)(void *value), bool is_root)
+{
+    if (node == NULL)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < node->child_count; i++)
+    {
+        node_free(node->children[i], free_value, false);
+    }
+    node_free(node->plus, free_value, false);
+    node_free(node->hash, free_value, false);
+
+    if (node->has_value && free_value != NULL)
+    {
+        free_value(node->value);
+    }
+
+    free(node->children);
+    free(node->level);
+
+    if (!is_root)
+    {
+        free(node);
+    }
+}
+
+/// <summary>
+/// True if a node no longer carries a value or any children
+/// </summary>
+static bool node_is_empty(const DX_MQTT_TOPIC_NODE *node)
+{
+    return !node->has_value && node->child_count == 0 && node->plus == NULL && node->hash == NULL;
+}
+
+/// <summary>
+/// Find or create the child for a filter level
+/// </summary>
+static DX_MQTT_TOPIC_NODE *child_for_level(DX_MQTT_TOPIC_NODE *node, const char *level, size_t length, bool create)
+{
+    DX_MQTT_TOPIC_NODE **wildcard = NULL;
+
+    if (length == 1 && level[0] == '+')
+    {
+        wildcard = &node->plus;
+    }
+    else if (length == 1 && level[0] == '#')
+    {
+        wildcard = &node->hash;
+    }
+
+    if (wildcard != NULL)
+    {
+        if (*wildcard == NULL && create)
+        {
+            *wildcard = node_create(level, length);
+        }
+        return *wildcard;
+    }
+
+    size_t index;
+    DX_MQTT_TOPIC_NODE *child = find_child(node, level, length, &index);
+    if (child != NULL || !create)
+    {
+        return child;
+    }
+
+    if (node->child_count == node->child_capacity)
+    {
+        size_t capacity               = node->child_capacity == 0 ? 4 : node->child_capacity * 2;
+        DX_MQTT_TOPIC_NODE **children = realloc(node->children, capacity * sizeof(DX_MQTT_TOPIC_NODE *));
+        if (children == NULL)
+        {
+            return NULL;
+        }
+        node->children       = children;
+        node->child_capacity = capacity;
+    }
+
+    child = node_create(level, length);
+    if (child == NULL)
+    {
+        return NULL;
+    }
+
+    memmove(&node->children[index + 1], &node->children[index], (node->child_count - index) * sizeof(DX_MQTT_TOPIC_NODE *));
+    node->children[index] = child;
+    node->child_count++;
+
+    return child;
+}
+
+/// <summary>
+/// Detach and free an empty child from its parent
+/// </summary>
+static void prune_child(DX_MQTT_TOPIC_NODE *parent, DX_MQTT_TOPIC_NODE *child)
+{
+    if (parent->plus == child)
+    {
+        parent->plus = NULL;
+    }
+    else if (parent->hash == child)
+    {
+        parent->hash = NULL;
+    }
+    else
+    {
+        size_t index;
+        if (find_child(parent, child->level, child->level_length, &index) != child)
+        {
+            return;
+        }
+        memmove(&parent->children[index], &parent->children[index + 1], (parent->child_count - index - 1) * sizeof(DX_MQTT_TOPIC_NODE *));
+        parent->child_count--;
+    }
+
+    node_free(child, NULL, false);
+}
+
+/// <summary>
+/// Recursive removal that prunes nodes left empty on the way back up
+/// </summary>
+static bool remove_filter(DX_MQTT_TOPIC_NODE *node, const char *filter, size_t filter_length, size_t start, void **value)
+{
+    if (start > filter_length)
+    {
+        if (!node->has_value)
+        {
+            return false;
+        }
+        *value          = node->value;
+        node->value     = NULL;
+        node->has_value = false;
+        return true;
+    }
+
+    size_t length             = level_length(filter, filter_length, start);
+    DX_MQTT_TOPIC_NODE *child = child_for_level(node, filter + start, length, false);
+
+    if (child == NULL || !remove_filter(child, filter, filter_length, start + length + 1, value))
+    {
+        return false;
+    }
+
+    if (node_is_empty(child))
+    {
+        prune_child(node, child);
+    }
+
+    return true;
+}
+
+/// <summary>
+/// Recursive match. start indexes the next topic level, start > topic_length
+/// means every level has been consumed.
+/// </summary>
+static size_t match_node(const DX_MQTT_TOPIC_NODE *node, const char *topic, size_t topic_length, size_t start, bool is_root,
+    DX_MQTT_TOPIC_TRIE_VISITOR visitor, void *context)
+{
+    size_t matches = 0;
+
+    // Wildcards at the first level never match topics such as $SYS [MQTT-4.7.2-1]
+    bool allow_wildcards = !(is_root && topic_length > 0 && topic[0] == '$');
+
+    // A trailing # also matches the parent level itself, so sport/# matches sport
+    if (allow_wildcards && node->hash != NULL && node->hash->has_value)
+    {
+        visitor(node->hash->value, context);
+        matches++;
+    }
+
+    if (start > topic_length)
+    {
+        if (node->has_value)
+        {
+            visitor(node->value, context);
+            matches++;
+        }
+        return matches;
+    }
+
+    size_t length = level_length(topic, topic_length, start);
+    size_t index;
+
+    const DX_MQTT_TOPIC_NODE *child = find_child(node, topic + start, length, &index);
+    if (child != NULL)
+    {
+        matches += match_node(child, topic, topic_length, start + length + 1, false, visitor, context);
+    }
+
+    if (allow_wildcards && node->plus != NULL)
+    {
+        matches += match_node(node->plus, topic, topic_length, start + length + 1, false, visitor, context);
+    }
+
+    return matches;
+}
+
+/// <summary>
+/// Create an empty trie
+/// </summary>
+/// <returns>New trie, or NULL on failure</returns>
+DX_MQTT_TOPIC_TRIE *dx_mqttTopicTrieCreate(void)
+{
+    return calloc(1, sizeof(DX_MQTT_TOPIC_TRIE));
+}
+
+/// <summary>
+/// Free a trie
+/// </summary>
+/// <param name="trie">Trie to free</param>
+/// <param name="free_value">Called for each stored value (can be NULL)</param>
+void dx_mqttTopicTrieDestroy(DX_MQTT_TOPIC_TRIE *trie, void (*free_value)(void *value))
+{
+    if (trie == NULL)
+    {
+        return;
+    }
+
+    node_free(&trie->root, free_value, true);
+    free(trie);
+}
+
+/// <summary>
+/// Check a topic filter is well formed: + and # occupy a whole level and # is last
+/// </summary>
+/// <param name="filter">Topic filter</param>
+/// <returns>True if valid</returns>
+bool dx_mqttTopicFilterIsValid(const char *filter)
+{
+    if (filter == NULL || filter[0] == '\0')
+    {
+        return false;
+    }
+
+    size_t filter_length = strlen(filter);
+    if (filter_length > 65535)
+    {
+        return false;
+    }
+
+    for (size_t start = 0; start <= filter_length;)
+    {
+        size_t length     = level_length(filter, filter_length, start);
+        const char *level = filter + start;
+
+        for (size_t i = 0; i < length; i++)
+        {
+            if ((level[i] == '+' || level[i] == '#') && length != 1)
+            {
+                return false;
+            }
+        }
+
+        if (length == 1 && level[0] == '#' && start + length != filter_length)
+        {
+            return false;
+        }
+
+        start += length + 1;
+    }
+
+    return true;
+}
+
+/// <summary>
+/// Store a value for a topic filter, replacing any existing value
+/// </summary>
+/// <param name="trie">Trie</param>
+/// <param name="filter">Topic filter</param>
+/// <param name="value">Value to store</param>
+/// <param name="previous">Receives the replaced value, or NULL (can be NULL)</param>
+/// <returns>True on success, false on an invalid filter or allocation failure</returns>
+bool dx_mqttTopicTrieInsert(DX_MQTT_TOPIC_TRIE *trie, const char *filter, void *value, void **previous)
+{
+    if (previous != NULL)
+    {
+        *previous = NULL;
+    }
+
+    if (trie == NULL || !dx_mqttTopicFilterIsValid(filter))
+    {
+        return false;
+    }
+
+    size_t filter_length     = strlen(filter);
+    DX_MQTT_TOPIC_NODE *node = &trie->root;
+
+    for (size_t start = 0; start <= filter_length;)
+    {
+        size_t length = level_length(filter, filter_length, start);
+
+        node = child_for_level(node, filter + start, length, true);
+        if (node == NULL)
+        {
+            // Nodes created on the way stay until the next removal prunes them
+            return false;
+        }
+
+        start += length + 1;
+    }
+
+    if (node->has_value)
+    {
+        if (previous != NULL)
+        {
+            *previous = node->value;
+        }
+    }
+    else
+    {
+        trie->count++;
+    }
+
+    node->value     = value;
+    node->has_value = true;
+
+    return true;
+}
+
+/// <summary>
+/// Remove the value stored for a topic filter
+/// </summary>
+/// <param name="trie">Trie</param>
+/// <param name="filter">Topic filter</param>
+/// <returns>The removed value, or NULL if the filter was not present</returns>
+void *dx_mqttTopicTrieRemove(DX_MQTT_TOPIC_TRIE *trie, const char *filter)
+{
+    void *value = NULL;
+
+    if (trie == NULL || filter == NULL)
+    {
+        return NULL;
+    }
+
+    if (remove_filter(&trie->root, filter, strlen(filter), 0, &value))
+    {
+        trie->count--;
+    }
+
+    return value;
+}
+
+/// <summary>
+/// Look up the value stored for exactly this filter, wildcards are not expanded
+/// </summary>
+/// <param name="trie">Trie</param>
+/// <param name="filter">Topic filter</param>
+/// <returns>The stored value, or NULL if not present</returns>
+void *dx_mqttTopicTrieFind(DX_MQTT_TOPIC_TRIE *trie, const char *filter)
+{
+    if (trie == NULL || filter == NULL)
+    {
+        return NULL;
+    }
+
+    size_t filter_length     = strlen(filter);
+    DX_MQTT_TOPIC_NODE *node = &trie->root;
+
+    for (size_t start = 0; start <= filter_length && node != NULL;)
+    {
+        size_t length = level_length(filter, filter_length, start);
+        node          = child_for_level(node, filter + start, length, false);
+        start += length + 1;
+    }
+
+    return node != NULL && node->has_value ? node->value : NULL;
+}
+
+/// <summary>
+/// Visit the value of every filter matching a topic name
+/// </summary>
+/// <param name="trie">Trie</param>
+/// <param name="topic">Topic name, need not be NUL terminated</param>
+/// <param name="topic_length">Topic length in bytes</param>
+/// <param name="visitor">Called for each match</param>
+/// <param name="context">Passed to the visitor</param>
+/// <returns>Number of matching filters</returns>
+size_t dx_mqttTopicTrieMatch(DX_MQTT_TOPIC_TRIE *trie, const char *topic, size_t topic_length, DX_MQTT_TOPIC_TRIE_VISITOR visitor, void *context)
+{
+    if (trie == NULL || topic == NULL || visitor == NULL || trie->count == 0)
+    {
+        return 0;
+    }
+
+    return match_node(&trie->root, topic, topic_length, 0, true, visitor, context);
+}
+
+/// <summary>
+/// Number of filters stored in the trie
+/// </summary>
+/// <param name="trie">Trie</param>
+/// <returns>Filter count</returns>
+size_t dx_mqttTopicTrieCount(const DX_MQTT_TOPIC_TRIE *trie)
+{
+    return trie == NULL ? 0 : trie->count;
+}
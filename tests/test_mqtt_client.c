@@ -0,0 +1,785 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+// test_mqtt_client: end to end tests of the MQTT client against edge_mqtt_testbroker.
+//
+// Each test starts its own broker on a free port, drives one or more DX_MQTT_CLIENT
+// handles against it and exits non-zero on the first failed check. Run one test by
+// name, "test_mqtt_client connect", or all of them with no argument. CTest runs each
+// one as its own test.
+
+#include "dx_mqtt.h"
+#include "dx_mqtt_testbroker.h"
+#include "dx_utilities.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TEST_TIMEOUT_MS 10000
+#define TEST_MESSAGES 200
+
+#define CHECK(condition)                                                                                                   \
+    do                                                                                                                     \
+    {                                                                                                                      \
+        if (!(condition))                                                                                                  \
+        {                                                                                                                  \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition);                                  \
+            return false;                                                                                                  \
+        }                                                                                                                  \
+    } while (0)
+
+// What a message handler has seen, payloads carry a sequence number below TEST_MESSAGES
+typedef struct
+{
+    atomic_size_t received;
+    atomic_size_t duplicates;
+    atomic_uchar seen[TEST_MESSAGES];
+    char last_payload[64];
+    atomic_size_t last_length;
+} TEST_SINK;
+
+// One test case
+typedef struct
+{
+    const char *name;
+    bool (*run)(DX_MQTT_TESTBROKER *broker);
+} TEST_CASE;
+
+/// <summary>
+/// Monotonic clock in milliseconds
+/// </summary>
+/// <returns>Milliseconds</returns>
+static uint64_t now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000ull + (uint64_t)now.tv_nsec / 1000000ull;
+}
+
+/// <summary>
+/// Sleep for a number of milliseconds
+/// </summary>
+/// <param name="ms">Milliseconds</param>
+static void sleep_ms(uint32_t ms)
+{
+    struct timespec delay = {.tv_sec = ms / 1000, .tv_nsec = (long)(ms % 1000) * 1000000l};
+    nanosleep(&delay, NULL);
+}
+
+/// <summary>
+/// Wait until a sink has received at least a number of messages
+/// </summary>
+/// <param name="sink">Sink</param>
+/// <param name="count">Messages to wait for</param>
+/// <returns>False on timeout</returns>
+static bool wait_for_messages(TEST_SINK *sink, size_t count)
+{
+    uint64_t deadline = now_ms() + TEST_TIMEOUT_MS;
+
+    while (atomic_load(&sink->received) < count)
+    {
+        if (now_ms() > deadline)
+        {
+            fprintf(stderr, "timed out with %zu of %zu messages\n", atomic_load(&sink->received), count);
+            return false;
+        }
+        sleep_ms(5);
+    }
+
+    return true;
+}
+
+/// <summary>
+/// Message handler. Counts each sequence number once and keeps the last payload.
+/// </summary>
+/// <param name="topic">Topic</param>
+/// <param name="payload">Decimal sequence number, or any text for a probe</param>
+/// <param name="payload_length">Payload length</param>
+/// <param name="context">TEST_SINK</param>
+static void sink_received(const char *topic, const void *payload, size_t payload_length, void *context)
+{
+    (void)topic;
+    TEST_SINK *sink = context;
+    char text[64];
+    size_t length = payload_length < sizeof(text) - 1 ? payload_length : sizeof(text) - 1;
+
+    memcpy(text, payload, length);
+    text[length] = '\0';
+
+    char *end;
+    unsigned long sequence = strtoul(text, &end, 10);
+    if (end != text && *end == '\0' && sequence < TEST_MESSAGES && atomic_exchange(&sink->seen[sequence], 1) != 0)
+    {
+        atomic_fetch_add(&sink->duplicates, 1);
+        return;
+    }
+
+    memcpy(sink->last_payload, text, length + 1);
+    atomic_store(&sink->last_length, length);
+    atomic_fetch_add(&sink->received, 1);
+}
+
+/// <summary>
+/// Create a client for the broker
+/// </summary>
+/// <param name="broker">Broker</param>
+/// <param name="client_id">MQTT client id</param>
+/// <param name="port">Receives the port as text, must outlive the client</param>
+/// <param name="config">Receives the config, filled in further by the caller</param>
+static void client_config(DX_MQTT_TESTBROKER *broker, const char *client_id, char port[8], DX_MQTT_CONFIG *config)
+{
+    snprintf(port, 8, "%u", (unsigned)dx_mqttTestBrokerPort(broker));
+
+    memset(config, 0, sizeof(*config));
+    config->hostname           = "127.0.0.1";
+    config->port               = port;
+    config->client_id          = client_id;
+    config->keep_alive_seconds = 30;
+    config->clean_session      = true;
+
+    // Acks would otherwise wait out delayed ACK behind Nagle's algorithm
+    config->socket_options.tcp_nodelay = true;
+}
+
+/// <summary>
+/// Create and connect a client subscribed to a topic, delivering into a sink
+/// </summary>
+/// <param name="broker">Broker</param>
+/// <param name="client_id">MQTT client id</param>
+/// <param name="topic">Topic to subscribe to, NULL for none</param>
+/// <param name="qos">Subscription QoS</param>
+/// <param name="sink">Sink for received messages</param>
+/// <returns>Connected client, NULL on failure</returns>
+static DX_MQTT_CLIENT *connect_client(DX_MQTT_TESTBROKER *broker, const char *client_id, const char *topic, uint8_t qos, TEST_SINK *sink)
+{
+    static char ports[8][8];
+    static unsigned next_port;
+    DX_MQTT_CONFIG config;
+
+    client_config(broker, client_id, ports[next_port++ % 8], &config);
+
+    // MQTT-C sends one QoS 2 publish at a time and cannot reclaim the acks queued behind
+    // the rest, so a window keeps a fast QoS 2 publisher within the default send buffer
+    config.max_inflight = 4;
+
+    DX_MQTT_CLIENT *client = dx_mqttClientCreate(&config);
+    if (client == NULL)
+    {
+        return NULL;
+    }
+
+    if (!dx_mqttClientConnect(client, sink_received, sink) || (topic != NULL && !dx_mqttClientSubscribe(client, topic, qos)))
+    {
+        fprintf(stderr, "connect %s: %s\n", client_id, dx_mqttClientGetLastError(client));
+        dx_mqttClientDestroy(client);
+        return NULL;
+    }
+
+    return client;
+}
+
+/// <summary>
+/// Publish a probe on a topic until it comes back, which shows the connection and the
+/// subscriptions made before it are in place
+/// </summary>
+/// <param name="client">Client subscribed to the topic</param>
+/// <param name="topic">Topic</param>
+/// <param name="sink">Sink the client delivers into</param>
+/// <returns>False on timeout</returns>
+static bool wait_for_probe(DX_MQTT_CLIENT *client, const char *topic, TEST_SINK *sink)
+{
+    uint64_t deadline       = now_ms() + TEST_TIMEOUT_MS;
+    size_t received         = atomic_load(&sink->received);
+    DX_MQTT_MESSAGE message = {.topic = topic, .payload = "probe", .payload_length = 5, .qos = 0};
+
+    while (atomic_load(&sink->received) == received)
+    {
+        if (now_ms() > deadline)
+        {
+            return false;
+        }
+        dx_mqttClientPublish(client, &message);
+        sleep_ms(20);
+    }
+
+    return true;
+}
+
+/// <summary>
+/// Publish sequence numbers 0 to count - 1 on a topic, retrying while the client pushes back
+/// </summary>
+/// <param name="client">Client</param>
+/// <param name="topic">Topic</param>
+/// <param name="qos">QoS</param>
+/// <param name="count">Messages</param>
+/// <returns>False if a publish never went through</returns>
+static bool publish_sequence(DX_MQTT_CLIENT *client, const char *topic, uint8_t qos, size_t count)
+{
+    for (size_t sequence = 0; sequence < count; sequence++)
+    {
+        char payload[16];
+        int length              = snprintf(payload, sizeof(payload), "%zu", sequence);
+        DX_MQTT_MESSAGE message = {.topic = topic, .payload = payload, .payload_length = (size_t)length, .qos = qos};
+        uint64_t deadline       = now_ms() + TEST_TIMEOUT_MS;
+
+        while (!dx_mqttClientPublish(client, &message))
+        {
+            if (now_ms() > deadline)
+            {
+                fprintf(stderr, "publish %zu: %s\n", sequence, dx_mqttClientGetLastError(client));
+                return false;
+            }
+            sleep_ms(1);
+        }
+    }
+
+    return true;
+}
+
+/// <summary>
+/// Subscribe at a QoS, publish a run of messages at the same QoS to the client's own
+/// topic and check every one comes back exactly once
+/// </summary>
+/// <param name="broker">Broker</param>
+/// <param name="qos">QoS</param>
+/// <returns>True on success</returns>
+static bool round_trip(DX_MQTT_TESTBROKER *broker, uint8_t qos)
+{
+    static TEST_SINK sink;
+    char topic[32];
+
+    memset(&sink, 0, sizeof(sink));
+    snprintf(topic, sizeof(topic), "test/qos%u", qos);
+
+    DX_MQTT_CLIENT *client = connect_client(broker, "round-trip", topic, qos, &sink);
+    CHECK(client != NULL);
+    CHECK(wait_for_probe(client, topic, &sink));
+
+    memset(&sink, 0, sizeof(sink));
+    CHECK(publish_sequence(client, topic, qos, TEST_MESSAGES));
+    CHECK(wait_for_messages(&sink, TEST_MESSAGES));
+    CHECK(atomic_load(&sink.duplicates) == 0);
+
+    DX_MQTT_STATS stats;
+    CHECK(dx_mqttClientGetStats(client, &stats));
+    CHECK(stats.messages_in[qos] >= TEST_MESSAGES);
+
+    dx_mqttClientDestroy(client);
+    return true;
+}
+
+static bool test_connect(DX_MQTT_TESTBROKER *broker)
+{
+    static TEST_SINK sink;
+
+    DX_MQTT_CLIENT *client = connect_client(broker, "connect", "test/connect", 0, &sink);
+    CHECK(client != NULL);
+    CHECK(dx_mqttClientIsConnected(client));
+    CHECK(wait_for_probe(client, "test/connect", &sink));
+
+    DX_MQTT_TESTBROKER_STATS stats;
+    dx_mqttTestBrokerGetStats(broker, &stats);
+    CHECK(stats.connections == 1);
+
+    dx_mqttClientDisconnect(client);
+    CHECK(!dx_mqttClientIsConnected(client));
+
+    dx_mqttClientDestroy(client);
+    return true;
+}
+
+static bool test_qos0(DX_MQTT_TESTBROKER *broker)
+{
+    return round_trip(broker, 0);
+}
+
+static bool test_qos1(DX_MQTT_TESTBROKER *broker)
+{
+    return round_trip(broker, 1);
+}
+
+static bool test_qos2(DX_MQTT_TESTBROKER *broker)
+{
+    return round_trip(broker, 2);
+}
+
+/// <summary>
+/// Write a whole buffer to a raw socket
+/// </summary>
+static bool raw_send(int fd, const void *data, size_t length)
+{
+    return send(fd, data, length, 0) == (ssize_t)length;
+}
+
+/// <summary>
+/// Read one packet of an expected type from a raw socket, all packets here are 4 bytes or less
+/// </summary>
+static bool raw_expect(int fd, uint8_t type)
+{
+    uint8_t packet[4];
+    size_t length = 0;
+
+    while (length < 2 || length < 2u + packet[1])
+    {
+        ssize_t n = recv(fd, packet + length, (length < 2 ? 2 : 2u + packet[1]) - length, 0);
+        if (n <= 0 || (length >= 2 && packet[1] > 2))
+        {
+            return false;
+        }
+        length += (size_t)n;
+    }
+
+    return (packet[0] >> 4) == type;
+}
+
+/// <summary>
+/// A QoS 2 PUBLISH resent with DUP before its PUBREL must reach subscribers only once
+/// </summary>
+static bool test_qos2_duplicate(DX_MQTT_TESTBROKER *broker)
+{
+    static TEST_SINK sink;
+
+    DX_MQTT_CLIENT *client = connect_client(broker, "dup-subscriber", "test/dup", 2, &sink);
+    CHECK(client != NULL);
+    CHECK(wait_for_probe(client, "test/dup", &sink));
+    memset(&sink, 0, sizeof(sink));
+
+    // A publisher that speaks raw MQTT so it can resend the same packet id
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    CHECK(fd != -1);
+
+    struct sockaddr_in address = {.sin_family = AF_INET, .sin_port = htons(dx_mqttTestBrokerPort(broker))};
+    address.sin_addr.s_addr    = htonl(INADDR_LOOPBACK);
+    CHECK(connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0);
+
+    static const uint8_t connect_packet[] = {0x10, 15, 0, 4, 'M', 'Q', 'T', 'T', 4, 0x02, 0, 30, 0, 3, 'd', 'u', 'p'};
+    static const uint8_t publish[]        = {0x34, 13, 0, 8, 't', 'e', 's', 't', '/', 'd', 'u', 'p', 0, 7, '7'};
+    static const uint8_t publish_dup[]    = {0x3C, 13, 0, 8, 't', 'e', 's', 't', '/', 'd', 'u', 'p', 0, 7, '7'};
+    static const uint8_t pubrel[]         = {0x62, 2, 0, 7};
+
+    CHECK(raw_send(fd, connect_packet, sizeof(connect_packet)));
+    CHECK(raw_expect(fd, 2)); // CONNACK
+    CHECK(raw_send(fd, publish, sizeof(publish)));
+    CHECK(raw_expect(fd, 5)); // PUBREC
+    CHECK(raw_send(fd, publish_dup, sizeof(publish_dup)));
+    CHECK(raw_expect(fd, 5)); // PUBREC again
+    CHECK(raw_send(fd, pubrel, sizeof(pubrel)));
+    CHECK(raw_expect(fd, 7)); // PUBCOMP
+    close(fd);
+
+    CHECK(wait_for_messages(&sink, 1));
+
+    // Leave time for a second copy to arrive if the broker routed one
+    sleep_ms(200);
+    CHECK(atomic_load(&sink.received) == 1);
+    CHECK(atomic_load(&sink.duplicates) == 0);
+
+    DX_MQTT_TESTBROKER_STATS stats;
+    dx_mqttTestBrokerGetStats(broker, &stats);
+    CHECK(stats.publishes_out >= 1);
+
+    dx_mqttClientDestroy(client);
+    return true;
+}
+
+/// <summary>
+/// A retained message published before a client subscribes is delivered on subscribe
+/// </summary>
+static bool test_retained(DX_MQTT_TESTBROKER *broker)
+{
+    static TEST_SINK publisher_sink;
+    static TEST_SINK subscriber_sink;
+
+    DX_MQTT_CLIENT *publisher = connect_client(broker, "retain-publisher", "test/retain-probe", 0, &publisher_sink);
+    CHECK(publisher != NULL);
+    CHECK(wait_for_probe(publisher, "test/retain-probe", &publisher_sink));
+
+    DX_MQTT_MESSAGE message = {.topic = "test/retained", .payload = "kept", .payload_length = 4, .qos = 1, .retain = true};
+    CHECK(dx_mqttClientPublish(publisher, &message));
+
+    // The probe is published after the retained message, so once it is back the broker holds both
+    CHECK(wait_for_probe(publisher, "test/retain-probe", &publisher_sink));
+
+    DX_MQTT_CLIENT *subscriber = connect_client(broker, "retain-subscriber", "test/retained", 1, &subscriber_sink);
+    CHECK(subscriber != NULL);
+    CHECK(wait_for_messages(&subscriber_sink, 1));
+    CHECK(atomic_load(&subscriber_sink.last_length) == 4);
+    CHECK(memcmp(subscriber_sink.last_payload, "kept", 4) == 0);
+
+    dx_mqttClientDestroy(subscriber);
+    dx_mqttClientDestroy(publisher);
+    return true;
+}
+
+/// <summary>
+/// With auto_reconnect a client the broker keeps dropping reconnects, restores its
+/// subscription and carries on once the broker behaves again
+/// </summary>
+static bool test_reconnect(DX_MQTT_TESTBROKER *broker)
+{
+    static TEST_SINK sink;
+    char port[8];
+    DX_MQTT_CONFIG config;
+
+    client_config(broker, "reconnect", port, &config);
+    config.auto_reconnect         = true;
+    config.reconnect_min_delay_ms = 10;
+    config.reconnect_max_delay_ms = 100;
+
+    DX_MQTT_CLIENT *client = dx_mqttClientCreate(&config);
+    CHECK(client != NULL);
+    CHECK(dx_mqttClientConnect(client, sink_received, &sink));
+    CHECK(dx_mqttClientSubscribe(client, "test/reconnect", 1));
+    CHECK(wait_for_probe(client, "test/reconnect", &sink));
+
+    DX_MQTT_TESTBROKER_FAULTS faults = {.disconnect_after_packets = 20};
+    dx_mqttTestBrokerSetFaults(broker, &faults);
+
+    // Keep publishing through several forced disconnects
+    uint64_t deadline = now_ms() + TEST_TIMEOUT_MS;
+    DX_MQTT_STATS stats;
+    do
+    {
+        DX_MQTT_MESSAGE message = {.topic = "test/reconnect", .payload = "x", .payload_length = 1, .qos = 1};
+        dx_mqttClientPublish(client, &message);
+        sleep_ms(2);
+        CHECK(dx_mqttClientGetStats(client, &stats));
+        CHECK(now_ms() < deadline);
+    } while (stats.reconnects < 3);
+
+    dx_mqttTestBrokerSetFaults(broker, NULL);
+
+    DX_MQTT_TESTBROKER_STATS broker_stats;
+    dx_mqttTestBrokerGetStats(broker, &broker_stats);
+    CHECK(broker_stats.forced_disconnects >= 3);
+
+    // Only a restored subscription brings the probe back
+    deadline = now_ms() + TEST_TIMEOUT_MS;
+    while (!dx_mqttClientIsConnected(client))
+    {
+        CHECK(now_ms() < deadline);
+        sleep_ms(5);
+    }
+    CHECK(wait_for_probe(client, "test/reconnect", &sink));
+
+    dx_mqttClientDestroy(client);
+    return true;
+}
+
+/// <summary>
+/// Receive a run of messages on topics up to a given length and wait for all of them
+/// </summary>
+/// <param name="client">Client subscribed to test/alloc/#</param>
+/// <param name="sink">Sink the client delivers into</param>
+/// <param name="count">Messages</param>
+/// <returns>False on a failed publish or timeout</returns>
+static bool receive_run(DX_MQTT_CLIENT *client, TEST_SINK *sink, size_t count)
+{
+    static const char *topics[] = {"test/alloc/a", "test/alloc/a/much/longer/topic/name", "test/alloc/bb"};
+
+    for (size_t sent = 0; sent < count; sent++)
+    {
+        size_t received         = atomic_load(&sink->received);
+        DX_MQTT_MESSAGE message = {.topic = topics[sent % 3], .payload = "payload", .payload_length = 7, .qos = 1};
+        uint64_t deadline       = now_ms() + TEST_TIMEOUT_MS;
+
+        while (!dx_mqttClientPublish(client, &message))
+        {
+            CHECK(now_ms() < deadline);
+            sleep_ms(1);
+        }
+
+        // One at a time, so nothing depends on how deep the queues get
+        while (atomic_load(&sink->received) == received)
+        {
+            CHECK(now_ms() < deadline);
+            sleep_ms(1);
+        }
+    }
+
+    return true;
+}
+
+/// <summary>
+/// Once warmed up the receive path makes no heap allocations, inline and with dispatch workers
+/// </summary>
+static bool test_receive_allocations(DX_MQTT_TESTBROKER *broker)
+{
+    static TEST_SINK sink;
+
+    for (size_t workers = 0; workers <= 2; workers += 2)
+    {
+        char port[8];
+        DX_MQTT_CONFIG config;
+
+        client_config(broker, "allocations", port, &config);
+        config.dispatch_workers      = workers;
+        config.dispatch_queue_length = 16;
+
+        memset(&sink, 0, sizeof(sink));
+        DX_MQTT_CLIENT *client = dx_mqttClientCreate(&config);
+        CHECK(client != NULL);
+        CHECK(dx_mqttClientConnect(client, sink_received, &sink));
+        CHECK(dx_mqttClientSubscribe(client, "test/alloc/#", 1));
+        CHECK(wait_for_probe(client, "test/alloc/probe", &sink));
+
+        // Grows the topic scratch buffer to the longest topic and every dispatch slot's buffer
+        CHECK(receive_run(client, &sink, 100));
+
+        size_t before = dx_mqttClientGetReceiveAllocations(client);
+        CHECK(receive_run(client, &sink, TEST_MESSAGES));
+        size_t after = dx_mqttClientGetReceiveAllocations(client);
+
+        if (after != before)
+        {
+            fprintf(stderr, "%zu receive allocations with %zu workers\n", after - before, workers);
+        }
+        CHECK(after == before);
+
+        dx_mqttClientDestroy(client);
+    }
+
+    return true;
+}
+
+// Limits replaced under a publisher until stop is set
+typedef struct
+{
+    DX_MQTT_CLIENT *client;
+    atomic_bool stop;
+    size_t changes;
+} RATE_CHANGER;
+
+/// <summary>
+/// Keep replacing the connection and topic rate limits
+/// </summary>
+/// <param name="arg">RATE_CHANGER</param>
+/// <returns>NULL</returns>
+static void *change_rate_limits(void *arg)
+{
+    RATE_CHANGER *changer    = arg;
+    DX_MQTT_RATE_LIMIT topic = {.messages_per_second = 200, .message_burst = 10, .action = DX_MQTT_LIMIT_QUEUE};
+    DX_MQTT_RATE_LIMIT total = {.messages_per_second = 1000, .action = DX_MQTT_LIMIT_QUEUE};
+
+    while (!atomic_load(&changer->stop))
+    {
+        dx_mqttClientSetTopicRateLimit(changer->client, "test/rate/#", &topic);
+        dx_mqttClientSetRateLimit(changer->client, changer->changes % 2 == 0 ? &total : NULL);
+        changer->changes++;
+        sleep_ms(5);
+    }
+
+    return NULL;
+}
+
+/// <summary>
+/// Publishes over a queueing rate limit are held and all delivered once, while the
+/// limits are replaced under the publisher
+/// </summary>
+static bool test_rate_limit(DX_MQTT_TESTBROKER *broker)
+{
+    static TEST_SINK sink;
+    static RATE_CHANGER changer;
+    pthread_t thread;
+
+    DX_MQTT_CLIENT *client = connect_client(broker, "rate-limit", "test/rate/#", 1, &sink);
+    CHECK(client != NULL);
+    CHECK(wait_for_probe(client, "test/rate/probe", &sink));
+
+    DX_MQTT_RATE_LIMIT limit = {.messages_per_second = 200, .message_burst = 10, .action = DX_MQTT_LIMIT_QUEUE};
+    CHECK(dx_mqttClientSetTopicRateLimit(client, "test/rate/#", &limit));
+
+    memset(&sink, 0, sizeof(sink));
+    changer.client = client;
+    CHECK(pthread_create(&thread, NULL, change_rate_limits, &changer) == 0);
+
+    bool published = publish_sequence(client, "test/rate/a", 1, TEST_MESSAGES);
+    atomic_store(&changer.stop, true);
+    pthread_join(thread, NULL);
+
+    CHECK(published);
+    CHECK(wait_for_messages(&sink, TEST_MESSAGES));
+    CHECK(atomic_load(&sink.duplicates) == 0);
+    CHECK(changer.changes > 0);
+
+    DX_MQTT_STATS stats;
+    CHECK(dx_mqttClientGetStats(client, &stats));
+    CHECK(stats.messages_rate_queued > 0);
+
+    dx_mqttClientDestroy(client);
+    return true;
+}
+
+#define RESERVATION_THREADS 4
+
+// One publisher building payloads in place, every RESERVATION_THREADS-th sequence number from first
+typedef struct
+{
+    DX_MQTT_CLIENT *client;
+    size_t first;
+    bool ok;
+} RESERVATION_PUBLISHER;
+
+/// <summary>
+/// Publish a share of the sequence numbers through dx_mqttClientPublishBegin/Commit,
+/// retrying while the client pushes back
+/// </summary>
+/// <param name="arg">RESERVATION_PUBLISHER</param>
+/// <returns>NULL</returns>
+static void *publish_reserved(void *arg)
+{
+    RESERVATION_PUBLISHER *publisher = arg;
+
+    for (size_t sequence = publisher->first; sequence < TEST_MESSAGES; sequence += RESERVATION_THREADS)
+    {
+        uint64_t deadline = now_ms() + TEST_TIMEOUT_MS;
+
+        for (;;)
+        {
+            char *payload = dx_mqttClientPublishBegin(publisher->client, "test/reserve", 16);
+            if (payload != NULL)
+            {
+                int length = snprintf(payload, 16, "%zu", sequence);
+                if (dx_mqttClientPublishCommit(publisher->client, (size_t)length, 1))
+                {
+                    break;
+                }
+            }
+
+            if (now_ms() > deadline)
+            {
+                fprintf(stderr, "reserve %zu: %s\n", sequence, dx_mqttClientGetLastError(publisher->client));
+                return NULL;
+            }
+            sleep_ms(1);
+        }
+    }
+
+    publisher->ok = true;
+    return NULL;
+}
+
+/// <summary>
+/// Try to commit another thread's reservation
+/// </summary>
+/// <param name="arg">DX_MQTT_CLIENT</param>
+/// <returns>Non-NULL if the commit was accepted</returns>
+static void *commit_foreign(void *arg)
+{
+    return dx_mqttClientPublishCommit(arg, 0, 0) ? arg : NULL;
+}
+
+/// <summary>
+/// Reservations from several threads at once all arrive exactly once, and only the
+/// thread that opened a reservation may finish it
+/// </summary>
+static bool test_publish_reservation(DX_MQTT_TESTBROKER *broker)
+{
+    static TEST_SINK sink;
+    static RESERVATION_PUBLISHER publishers[RESERVATION_THREADS];
+    pthread_t threads[RESERVATION_THREADS];
+    void *foreign;
+
+    DX_MQTT_CLIENT *client = connect_client(broker, "reservation", "test/reserve", 1, &sink);
+    CHECK(client != NULL);
+    CHECK(wait_for_probe(client, "test/reserve", &sink));
+
+    char *payload = dx_mqttClientPublishBegin(client, "test/reserve", 16);
+    CHECK(payload != NULL);
+    CHECK(dx_mqttClientPublishBegin(client, "test/reserve", 16) == NULL);
+    CHECK(pthread_create(&threads[0], NULL, commit_foreign, client) == 0);
+    pthread_join(threads[0], &foreign);
+    CHECK(foreign == NULL);
+    memcpy(payload, "probe", 5);
+    size_t received = atomic_load(&sink.received);
+    CHECK(dx_mqttClientPublishCommit(client, 5, 0));
+    CHECK(!dx_mqttClientPublishCommit(client, 5, 0));
+    CHECK(wait_for_messages(&sink, received + 1));
+
+    memset(&sink, 0, sizeof(sink));
+    for (size_t i = 0; i < RESERVATION_THREADS; i++)
+    {
+        publishers[i] = (RESERVATION_PUBLISHER){.client = client, .first = i};
+        CHECK(pthread_create(&threads[i], NULL, publish_reserved, &publishers[i]) == 0);
+    }
+
+    bool published = true;
+    for (size_t i = 0; i < RESERVATION_THREADS; i++)
+    {
+        pthread_join(threads[i], NULL);
+        published = published && publishers[i].ok;
+    }
+
+    CHECK(published);
+    CHECK(wait_for_messages(&sink, TEST_MESSAGES));
+    CHECK(atomic_load(&sink.duplicates) == 0);
+
+    dx_mqttClientDestroy(client);
+    return true;
+}
+
+static const TEST_CASE tests[] = {
+    {"connect", test_connect},
+    {"qos0", test_qos0},
+    {"qos1", test_qos1},
+    {"qos2", test_qos2},
+    {"qos2_duplicate", test_qos2_duplicate},
+    {"retained", test_retained},
+    {"reconnect", test_reconnect},
+    {"receive_allocations", test_receive_allocations},
+    {"rate_limit", test_rate_limit},
+    {"publish_reservation", test_publish_reservation},
+};
+
+int main(int argc, char *argv[])
+{
+    static char log_buffer[512];
+    const char *only = argc > 1 ? argv[1] : NULL;
+    int failed       = 0;
+    bool found       = false;
+
+    dx_Log_Debug_Init(log_buffer, sizeof(log_buffer));
+
+    // MQTT-C writes plain TCP sockets without MSG_NOSIGNAL, and the broker closes
+    // connections under the client on purpose
+    signal(SIGPIPE, SIG_IGN);
+
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+    {
+        if (only != NULL && strcmp(only, tests[i].name) != 0)
+        {
+            continue;
+        }
+        found = true;
+
+        DX_MQTT_TESTBROKER *broker = dx_mqttTestBrokerStart(0, NULL);
+        if (broker == NULL)
+        {
+            fprintf(stderr, "%s: failed to start the test broker\n", tests[i].name);
+            return EXIT_FAILURE;
+        }
+
+        bool passed = tests[i].run(broker);
+        printf("%s: %s\n", tests[i].name, passed ? "passed" : "FAILED");
+        failed += passed ? 0 : 1;
+
+        dx_mqttTestBrokerStop(broker);
+    }
+
+    if (!found)
+    {
+        fprintf(stderr, "unknown test %s\n", only);
+        return EXIT_FAILURE;
+    }
+
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}